@@ -0,0 +1,402 @@
+/**
+ * Asynchronous access log
+ *
+ * Serving threads format one JSON line per request into a buffer of their
+ * own and never block on the log: if the buffer is full the line is
+ * dropped and counted. A flusher thread gathers every buffer into one
+ * writev() every ACCESSLOG_FLUSH_MS, or sooner once a buffer is half full,
+ * and rotates the file when it grows past rotate_bytes. SIGHUP reopens the
+ * file for external rotation.
+ *
+ * Successful requests can be sampled; 4xx and 5xx responses are always
+ * logged.
+ */
+
+#include "accesslog.h"
+#include "applog.h"
+#include "net.h"
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+struct accesslog *access_log = NULL;
+
+__thread struct accesslog_buffer *accesslog_local = NULL;
+
+/**
+ * This thread's buffer, registered on first use
+ */
+struct accesslog_buffer *accesslog_buffer(struct accesslog *log) {
+  if (accesslog_local != NULL)
+    return accesslog_local;
+
+  struct accesslog_buffer *b = calloc(1, sizeof *b);
+  if (b == NULL)
+    return NULL;
+
+  b->rng = (uintptr_t)b | 1;
+  b->second = -1;
+
+  pthread_mutex_lock(&log->lock);
+  b->next = log->buffers;
+  log->buffers = b;
+  pthread_mutex_unlock(&log->lock);
+
+  return accesslog_local = b;
+}
+
+/**
+ * Copy s into a JSON string body at p, escaping as needed
+ *
+ * Stops at the first space, CR, LF or NUL, or after max input bytes.
+ * Returns the end of the output.
+ */
+char *accesslog_escape(char *p, char *end, const char *s, int max) {
+  for (int i = 0; i < max && s[i] != '\0' && s[i] != ' ' && s[i] != '\r' &&
+                  s[i] != '\n';
+       i++) {
+    unsigned char ch = s[i];
+
+    if (end - p < 7)
+      break;
+    if (ch == '"' || ch == '\\') {
+      *p++ = '\\';
+      *p++ = ch;
+    } else if (ch < 0x20 || ch == 0x7f) {
+      p += sprintf(p, "\\u%04x", ch);
+    } else {
+      *p++ = ch;
+    }
+  }
+
+  return p;
+}
+
+/**
+ * Format one line into line[]; returns its length
+ */
+int accesslog_format(struct accesslog_buffer *b, char *line,
+                     struct sockaddr_storage *peer, char *request,
+                     int status, off_t bytes, uint64_t ns) {
+  char client[INET6_ADDRSTRLEN] = "-";
+  char *p = line, *end = line + ACCESSLOG_LINE_MAX;
+  char *path = request;
+  struct timespec now;
+
+  // The date only changes once a second
+  clock_gettime(CLOCK_REALTIME, &now);
+  if (now.tv_sec != b->second) {
+    struct tm tm;
+
+    gmtime_r(&now.tv_sec, &tm);
+    strftime(b->stamp, sizeof b->stamp, "%Y-%m-%dT%H:%M:%S", &tm);
+    b->second = now.tv_sec;
+  }
+
+  if (peer->ss_family == AF_INET || peer->ss_family == AF_INET6)
+    inet_ntop(peer->ss_family, get_in_addr((struct sockaddr *)peer), client,
+              sizeof client);
+
+  while (*path != '\0' && *path != ' ' && *path != '\n')
+    path++;
+  if (*path == ' ')
+    path++;
+
+  p += sprintf(p, "{\"time\":\"%s.%03ldZ\",\"client\":\"%s\",\"method\":\"",
+               b->stamp, now.tv_nsec / 1000000, client);
+  p = accesslog_escape(p, end - 128, request, 16);
+  p += sprintf(p, "\",\"path\":\"");
+  p = accesslog_escape(p, end - 96, path, 512);
+  p += snprintf(p, end - p,
+                "\",\"status\":%d,\"bytes\":%lld,\"duration_us\":%llu}\n",
+                status, (long long)bytes, (unsigned long long)(ns / 1000));
+
+  return p - line;
+}
+
+/**
+ * Log a finished request
+ *
+ * request is the raw request, for its method and path; ns is how long the
+ * connection took from accept to release. Called on serving threads.
+ */
+void accesslog_request(struct accesslog *log, struct sockaddr_storage *peer,
+                       char *request, int status, off_t bytes, uint64_t ns) {
+  struct accesslog_buffer *b = accesslog_buffer(log);
+  char line[ACCESSLOG_LINE_MAX];
+  uint64_t head, tail, used;
+  size_t at;
+  int length;
+
+  if (b == NULL)
+    return;
+
+  // xorshift64: keep a sample of the successes
+  if (status < 400 && log->sample < 1.0) {
+    b->rng ^= b->rng << 13;
+    b->rng ^= b->rng >> 7;
+    b->rng ^= b->rng << 17;
+    if ((b->rng >> 11) * 0x1.0p-53 >= log->sample)
+      return;
+  }
+
+  length = accesslog_format(b, line, peer, request, status, bytes, ns);
+
+  head = b->head;
+  tail = __atomic_load_n(&b->tail, __ATOMIC_ACQUIRE);
+  used = head - tail;
+  if (ACCESSLOG_BUFFER_SIZE - used < (uint64_t)length) {
+    __atomic_store_n(&b->dropped, b->dropped + 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  at = head % ACCESSLOG_BUFFER_SIZE;
+  if (at + length <= ACCESSLOG_BUFFER_SIZE) {
+    memcpy(b->data + at, line, length);
+  } else {
+    size_t first = ACCESSLOG_BUFFER_SIZE - at;
+
+    memcpy(b->data + at, line, first);
+    memcpy(b->data, line + first, length - first);
+  }
+  __atomic_store_n(&b->head, head + length, __ATOMIC_RELEASE);
+
+  // Wake the flusher early rather than let a busy thread fill up. Without
+  // waiters this is just a check.
+  if (used < ACCESSLOG_BUFFER_SIZE / 2 &&
+      used + length >= ACCESSLOG_BUFFER_SIZE / 2)
+    pthread_cond_signal(&log->cond);
+}
+
+/**
+ * Open (or reopen) the log file
+ *
+ * Returns 0, or -1 with the old descriptor, if any, kept.
+ */
+int accesslog_open(struct accesslog *log) {
+  struct stat st;
+  int fd = open(log->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+
+  if (fd == -1) {
+    perror(log->path);
+    return -1;
+  }
+
+  if (log->fd != -1)
+    close(log->fd);
+  log->fd = fd;
+  log->size = fstat(fd, &st) == 0 ? st.st_size : 0;
+
+  return 0;
+}
+
+/**
+ * Flusher: shift path.N up by one and start a new file
+ */
+void accesslog_rotate(struct accesslog *log) {
+  char from[PATH_MAX], to[PATH_MAX];
+
+  for (int i = ACCESSLOG_KEEP - 1; i >= 1; i--) {
+    snprintf(from, sizeof from, "%s.%d", log->path, i);
+    snprintf(to, sizeof to, "%s.%d", log->path, i + 1);
+    rename(from, to);
+  }
+
+  snprintf(to, sizeof to, "%s.1", log->path);
+  if (rename(log->path, to) == -1) {
+    perror("accesslog: rename");
+    return;
+  }
+
+  accesslog_open(log);
+  log->rotations++;
+}
+
+/**
+ * Flusher: write out everything buffered
+ *
+ * Each buffer contributes at most two pieces (its ring may wrap), all
+ * written with one writev() per IOV_MAX pieces.
+ */
+void accesslog_flush(struct accesslog *log) {
+  struct iovec iov[IOV_MAX];
+  struct accesslog_buffer *taken[IOV_MAX / 2];
+  uint64_t heads[IOV_MAX / 2];
+  struct accesslog_buffer *b;
+
+  pthread_mutex_lock(&log->lock);
+  b = log->buffers;
+  pthread_mutex_unlock(&log->lock);
+
+  // Buffers are only ever added at the front, so this walk is safe
+  while (b != NULL) {
+    int nbuf = 0, niov = 0;
+    size_t total = 0;
+
+    for (; b != NULL && nbuf < IOV_MAX / 2; b = b->next) {
+      uint64_t head = __atomic_load_n(&b->head, __ATOMIC_ACQUIRE);
+      uint64_t tail = b->tail;
+      size_t at = tail % ACCESSLOG_BUFFER_SIZE;
+      size_t length = head - tail;
+
+      if (length == 0)
+        continue;
+
+      if (at + length <= ACCESSLOG_BUFFER_SIZE) {
+        iov[niov++] = (struct iovec){b->data + at, length};
+      } else {
+        iov[niov++] = (struct iovec){b->data + at, ACCESSLOG_BUFFER_SIZE - at};
+        iov[niov++] =
+            (struct iovec){b->data, length - (ACCESSLOG_BUFFER_SIZE - at)};
+      }
+      taken[nbuf] = b;
+      heads[nbuf++] = head;
+      total += length;
+    }
+
+    if (niov == 0)
+      continue;
+
+    // On a failed write the lines are lost rather than kept, so the
+    // serving threads never back up behind the disk
+    if (log->fd == -1 || applog_writev_all(log->fd, iov, niov) != 0)
+      log->write_errors++;
+    else
+      log->size += total;
+    log->flushes++;
+
+    for (int i = 0; i < nbuf; i++)
+      __atomic_store_n(&taken[i]->tail, heads[i], __ATOMIC_RELEASE);
+  }
+
+  if (log->rotate_bytes > 0 && log->size >= log->rotate_bytes)
+    accesslog_rotate(log);
+}
+
+void *accesslog_flusher(void *arg) {
+  struct accesslog *log = arg;
+  struct timespec next;
+
+  pthread_mutex_lock(&log->lock);
+
+  while (!log->stopping) {
+    clock_gettime(CLOCK_REALTIME, &next);
+    next.tv_nsec += ACCESSLOG_FLUSH_MS * 1000000L;
+    if (next.tv_nsec >= 1000000000) {
+      next.tv_sec++;
+      next.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&log->cond, &log->lock, &next);
+
+    int reopen = log->reopen;
+    log->reopen = 0;
+    pthread_mutex_unlock(&log->lock);
+
+    accesslog_flush(log);
+    if (reopen)
+      accesslog_open(log);
+
+    pthread_mutex_lock(&log->lock);
+  }
+
+  pthread_mutex_unlock(&log->lock);
+
+  // Whatever the serving threads logged before they stopped
+  accesslog_flush(log);
+
+  return NULL;
+}
+
+/**
+ * Start logging to path
+ *
+ * sample is the fraction of requests below 400 to log; rotate_bytes the
+ * size at which to rotate, or 0. Returns NULL if the file can't be opened.
+ */
+struct accesslog *accesslog_create(char *path, double sample,
+                                   off_t rotate_bytes) {
+  struct accesslog *log = calloc(1, sizeof *log);
+  if (log == NULL)
+    return NULL;
+
+  log->path = strdup(path);
+  log->fd = -1;
+  log->sample = sample;
+  log->rotate_bytes = rotate_bytes;
+  pthread_mutex_init(&log->lock, NULL);
+  pthread_cond_init(&log->cond, NULL);
+
+  if (log->path == NULL || accesslog_open(log) == -1 ||
+      pthread_create(&log->thread, NULL, accesslog_flusher, log) != 0) {
+    if (log->fd != -1)
+      close(log->fd);
+    free(log->path);
+    free(log);
+    return NULL;
+  }
+
+  return log;
+}
+
+/**
+ * Reopen the file at the next flush, after something else renamed it
+ */
+void accesslog_reopen(struct accesslog *log) {
+  pthread_mutex_lock(&log->lock);
+  log->reopen = 1;
+  pthread_cond_signal(&log->cond);
+  pthread_mutex_unlock(&log->lock);
+}
+
+/**
+ * Lines dropped so far because a buffer was full
+ */
+uint64_t accesslog_dropped(struct accesslog *log) {
+  uint64_t dropped = 0;
+
+  pthread_mutex_lock(&log->lock);
+  for (struct accesslog_buffer *b = log->buffers; b != NULL; b = b->next)
+    dropped += __atomic_load_n(&b->dropped, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&log->lock);
+
+  return dropped;
+}
+
+/**
+ * Flush, stop the flusher and close the file
+ *
+ * Only once no thread logs any more.
+ */
+void accesslog_free(struct accesslog *log) {
+  if (log == NULL)
+    return;
+
+  pthread_mutex_lock(&log->lock);
+  log->stopping = 1;
+  pthread_cond_signal(&log->cond);
+  pthread_mutex_unlock(&log->lock);
+
+  pthread_join(log->thread, NULL);
+
+  while (log->buffers != NULL) {
+    struct accesslog_buffer *next = log->buffers->next;
+
+    free(log->buffers);
+    log->buffers = next;
+  }
+  accesslog_local = NULL;
+
+  close(log->fd);
+  free(log->path);
+  free(log);
+}
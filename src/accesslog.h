@@ -0,0 +1,64 @@
+#ifndef _ACCESSLOG_H_
+#define _ACCESSLOG_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define ACCESSLOG_BUFFER_SIZE (1024 * 1024) // per thread
+#define ACCESSLOG_LINE_MAX 1024
+#define ACCESSLOG_FLUSH_MS 100
+#define ACCESSLOG_KEEP 5 // rotated files kept, path.1 (newest) to path.5
+
+// One thread's formatted lines awaiting the flusher
+//
+// A single-producer, single-consumer byte ring: the owning thread appends
+// at head and the flusher writes out from tail. Each side stores only its
+// own index, so neither takes a lock.
+struct accesslog_buffer {
+  char data[ACCESSLOG_BUFFER_SIZE];
+  uint64_t head;    // bytes ever appended; owning thread
+  uint64_t tail;    // bytes ever flushed; flusher
+  uint64_t dropped; // lines that didn't fit; owning thread
+
+  // Owning thread only
+  uint64_t rng; // for sampling
+  time_t second; // stamp holds this second, formatted
+  char stamp[24];
+
+  struct accesslog_buffer *next;
+};
+
+// Asynchronous access log
+struct accesslog {
+  char *path;
+  int fd;
+  off_t size;         // of the current file
+  off_t rotate_bytes; // rotate once the file reaches this; 0 never
+  double sample;      // fraction of successful requests logged
+
+  pthread_t thread;
+  pthread_mutex_t lock; // buffers, stopping, reopen
+  pthread_cond_t cond;  // flusher: stop, reopen, or a buffer half full
+  struct accesslog_buffer *buffers;
+  int stopping;
+  int reopen;
+
+  // Flusher statistics
+  unsigned long flushes, rotations, write_errors;
+};
+
+extern struct accesslog *access_log; // NULL when not logging
+
+extern struct accesslog *accesslog_create(char *path, double sample,
+                                          off_t rotate_bytes);
+extern void accesslog_free(struct accesslog *log);
+extern void accesslog_request(struct accesslog *log,
+                              struct sockaddr_storage *peer, char *request,
+                              int status, off_t bytes, uint64_t ns);
+extern void accesslog_reopen(struct accesslog *log);
+extern uint64_t accesslog_dropped(struct accesslog *log);
+
+#endif
@@ -0,0 +1,441 @@
+/**
+ * Group-committed append log for POST bodies
+ *
+ * Handlers queue records and park their connection. The committer thread
+ * takes every record queued since its last batch, appends each file's
+ * records with one writev() on an O_APPEND descriptor and, depending on the
+ * policy, fdatasync()s each file once for the whole batch. Under load a
+ * batch holds many records, so the cost of a sync is shared between them.
+ */
+
+#include "applog.h"
+#include "hashtable.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+// A file open for appending until the next interval sync
+struct applog_file {
+  char *path;
+  int fd;
+};
+
+// The records for one file within a batch, in arrival order
+struct applog_group {
+  char *path;
+  struct applog_record *head, *tail;
+  struct applog_group *next;
+};
+
+/**
+ * Map a policy name from the command line, or -1 if it's unknown
+ */
+int applog_policy_parse(char *name) {
+  if (strcmp(name, "none") == 0)
+    return APPLOG_SYNC_NONE;
+  if (strcmp(name, "interval") == 0)
+    return APPLOG_SYNC_INTERVAL;
+  if (strcmp(name, "batch") == 0)
+    return APPLOG_SYNC_BATCH;
+
+  return -1;
+}
+
+/**
+ * Write all of iov[0..iovcnt), resuming after short writes
+ *
+ * Returns 0 or -errno.
+ */
+int applog_writev_all(int fd, struct iovec *iov, int iovcnt) {
+  while (iovcnt > 0) {
+    ssize_t n = writev(fd, iov, iovcnt > IOV_MAX ? IOV_MAX : iovcnt);
+
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      return -errno;
+    }
+
+    while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * hashtable_foreach() callback: sync and close one dirty file
+ */
+void applog_sync_file(void *data, void *arg) {
+  struct applog_file *f = data;
+  struct applog *log = arg;
+
+  if (fdatasync(f->fd) == -1)
+    perror("applog: fdatasync");
+  log->syncs++;
+
+  close(f->fd);
+  free(f->path);
+  free(f);
+}
+
+/**
+ * Committer: make everything written since the last interval durable
+ */
+void applog_sync_dirty(struct applog *log) {
+  if (log->dirty == NULL || log->dirty->num_entries == 0)
+    return;
+
+  hashtable_foreach(log->dirty, applog_sync_file, log);
+  hashtable_destroy(log->dirty);
+  log->dirty = hashtable_create(0, NULL);
+}
+
+/**
+ * Committer: append one file's records for this batch
+ */
+void applog_commit_group(struct applog *log, struct applog_group *g) {
+  struct applog_file *f = NULL;
+  struct applog_record *rec;
+  int count = 0, status = 0, fd;
+
+  for (rec = g->head; rec != NULL; rec = rec->next)
+    count++;
+
+  // Interval mode keeps files open between syncs
+  if (log->dirty != NULL)
+    f = hashtable_get(log->dirty, g->path);
+
+  if (f != NULL) {
+    fd = f->fd;
+  } else {
+    // Appends only extend existing files, like a save only replaces one
+    fd = open(g->path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (fd == -1)
+      status = -errno;
+  }
+
+  struct iovec *iov = status == 0 ? malloc(count * sizeof *iov) : NULL;
+  if (status == 0 && iov == NULL)
+    status = -ENOMEM;
+
+  if (status == 0) {
+    int i = 0;
+    for (rec = g->head; rec != NULL; rec = rec->next, i++) {
+      iov[i].iov_base = rec->data;
+      iov[i].iov_len = rec->length;
+    }
+
+    status = applog_writev_all(fd, iov, count);
+  }
+
+  free(iov);
+
+  if (fd != -1 && f == NULL) {
+    if (status == 0 && log->policy == APPLOG_SYNC_BATCH) {
+      if (fdatasync(fd) == -1)
+        status = -errno;
+      log->syncs++;
+    }
+
+    if (status == 0 && log->policy == APPLOG_SYNC_INTERVAL &&
+        (f = malloc(sizeof *f)) != NULL) {
+      f->path = strdup(g->path);
+      f->fd = fd;
+      hashtable_put(log->dirty, f->path, f);
+    } else {
+      close(fd);
+    }
+  }
+
+  for (rec = g->head; rec != NULL; rec = rec->next)
+    rec->status = status;
+}
+
+/**
+ * Committer: write a batch, one group per file
+ *
+ * The records are regrouped through their next pointers; the returned list
+ * holds the same records, file by file, each file's in arrival order.
+ */
+struct applog_record *applog_commit(struct applog *log,
+                                    struct applog_record *batch) {
+  struct hashtable *files = hashtable_create(0, NULL);
+  struct applog_group *groups = NULL, **last = &groups;
+
+  while (batch != NULL) {
+    struct applog_record *rec = batch;
+    batch = rec->next;
+    rec->next = NULL;
+    log->records++;
+
+    struct applog_group *g = hashtable_get(files, rec->path);
+    if (g == NULL) {
+      g = calloc(1, sizeof *g);
+      g->path = rec->path;
+      hashtable_put(files, g->path, g);
+      *last = g;
+      last = &g->next;
+    } else {
+      g->tail->next = rec;
+    }
+
+    if (g->head == NULL)
+      g->head = rec;
+    g->tail = rec;
+  }
+
+  struct applog_record *head = NULL, *tail = NULL;
+
+  while (groups != NULL) {
+    struct applog_group *g = groups;
+    groups = g->next;
+
+    applog_commit_group(log, g);
+
+    if (tail != NULL)
+      tail->next = g->head;
+    else
+      head = g->head;
+    tail = g->tail;
+
+    free(g);
+  }
+
+  hashtable_destroy(files);
+
+  return head;
+}
+
+/**
+ * Committer thread: one batch per wakeup
+ */
+void *applog_committer(void *arg) {
+  struct applog *log = arg;
+  struct timespec next_sync = {0, 0};
+  const uint64_t one = 1;
+
+  pthread_mutex_lock(&log->lock);
+
+  for (;;) {
+    while (log->pending_head == NULL && !log->stopping) {
+      if (log->dirty == NULL || log->dirty->num_entries == 0) {
+        pthread_cond_wait(&log->cond, &log->lock);
+        continue;
+      }
+
+      if (pthread_cond_timedwait(&log->cond, &log->lock, &next_sync) ==
+          ETIMEDOUT) {
+        pthread_mutex_unlock(&log->lock);
+        applog_sync_dirty(log);
+        pthread_mutex_lock(&log->lock);
+      }
+    }
+
+    struct applog_record *batch = log->pending_head;
+    if (batch == NULL)
+      break;
+    log->pending_head = log->pending_tail = NULL;
+    pthread_mutex_unlock(&log->lock);
+
+    // The interval runs from the first write it covers
+    int was_clean = log->dirty == NULL || log->dirty->num_entries == 0;
+
+    batch = applog_commit(log, batch);
+    log->batches++;
+
+    if (was_clean && log->policy == APPLOG_SYNC_INTERVAL) {
+      clock_gettime(CLOCK_REALTIME, &next_sync);
+      next_sync.tv_sec += log->interval_ms / 1000;
+      next_sync.tv_nsec += (long)(log->interval_ms % 1000) * 1000000;
+      if (next_sync.tv_nsec >= 1000000000) {
+        next_sync.tv_sec++;
+        next_sync.tv_nsec -= 1000000000;
+      }
+    }
+
+    pthread_mutex_lock(&log->lock);
+
+    int queued_done = 0;
+    while (batch != NULL) {
+      struct applog_record *rec = batch;
+      batch = rec->next;
+
+      rec->committed = 1;
+      if (rec->waiting)
+        continue;
+
+      rec->next = NULL;
+      if (log->done_tail != NULL)
+        log->done_tail->next = rec;
+      else
+        log->done_head = rec;
+      log->done_tail = rec;
+      queued_done = 1;
+    }
+
+    pthread_cond_broadcast(&log->committed);
+
+    if (queued_done && write(log->fd, &one, sizeof one) == -1)
+      perror("applog: eventfd");
+  }
+
+  pthread_mutex_unlock(&log->lock);
+
+  applog_sync_dirty(log);
+
+  return NULL;
+}
+
+/**
+ * Start the committer with a sync policy
+ *
+ * interval_ms only matters for APPLOG_SYNC_INTERVAL.
+ */
+struct applog *applog_create(int policy, int interval_ms) {
+  struct applog *log = calloc(1, sizeof *log);
+  if (log == NULL)
+    return NULL;
+
+  log->policy = policy;
+  log->interval_ms = interval_ms > 0 ? interval_ms : 1;
+  log->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  pthread_mutex_init(&log->lock, NULL);
+  pthread_cond_init(&log->cond, NULL);
+  pthread_cond_init(&log->committed, NULL);
+
+  if (policy == APPLOG_SYNC_INTERVAL)
+    log->dirty = hashtable_create(0, NULL);
+
+  if (log->fd == -1 ||
+      pthread_create(&log->thread, NULL, applog_committer, log) != 0) {
+    perror("applog");
+    if (log->fd != -1)
+      close(log->fd);
+    if (log->dirty != NULL)
+      hashtable_destroy(log->dirty);
+    free(log);
+    return NULL;
+  }
+
+  return log;
+}
+
+/**
+ * Stop the committer
+ *
+ * Queued records are still written and synced, and every one gets its
+ * done() call here.
+ */
+void applog_free(struct applog *log) {
+  if (log == NULL)
+    return;
+
+  pthread_mutex_lock(&log->lock);
+  log->stopping = 1;
+  pthread_cond_signal(&log->cond);
+  pthread_mutex_unlock(&log->lock);
+
+  pthread_join(log->thread, NULL);
+
+  applog_complete(log);
+  close(log->fd);
+
+  if (log->dirty != NULL)
+    hashtable_destroy(log->dirty);
+  pthread_cond_destroy(&log->committed);
+  pthread_cond_destroy(&log->cond);
+  pthread_mutex_destroy(&log->lock);
+  free(log);
+}
+
+/**
+ * Queue a record for the next batch
+ *
+ * rec->path and rec->data must stay valid until done() is called on the
+ * loop thread, which happens once log->fd is readable and
+ * applog_complete() runs.
+ */
+void applog_append(struct applog *log, struct applog_record *rec) {
+  rec->next = NULL;
+  rec->status = 0;
+  rec->committed = 0;
+
+  pthread_mutex_lock(&log->lock);
+
+  if (log->pending_tail != NULL)
+    log->pending_tail->next = rec;
+  else
+    log->pending_head = rec;
+  log->pending_tail = rec;
+
+  pthread_cond_signal(&log->cond);
+  pthread_mutex_unlock(&log->lock);
+}
+
+/**
+ * Append a record and block until its batch is committed
+ *
+ * For serving loops that can't park a connection. done() isn't called.
+ * Returns 0 or -errno.
+ */
+int applog_append_wait(struct applog *log, struct applog_record *rec) {
+  rec->waiting = 1;
+  applog_append(log, rec);
+
+  pthread_mutex_lock(&log->lock);
+  while (!rec->committed)
+    pthread_cond_wait(&log->committed, &log->lock);
+  pthread_mutex_unlock(&log->lock);
+
+  return rec->status;
+}
+
+/**
+ * Run done() for every committed record
+ *
+ * Call on the loop thread when log->fd is readable. Never blocks. Returns
+ * the number of records completed.
+ */
+int applog_complete(struct applog *log) {
+  uint64_t count;
+  int completed = 0;
+
+  if (read(log->fd, &count, sizeof count) == -1 && errno != EAGAIN)
+    perror("applog: eventfd");
+
+  pthread_mutex_lock(&log->lock);
+  struct applog_record *rec = log->done_head;
+  log->done_head = log->done_tail = NULL;
+  pthread_mutex_unlock(&log->lock);
+
+  while (rec != NULL) {
+    struct applog_record *next = rec->next;
+
+    rec->done(rec);
+    completed++;
+    rec = next;
+  }
+
+  return completed;
+}
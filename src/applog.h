@@ -0,0 +1,62 @@
+#ifndef _APPLOG_H_
+#define _APPLOG_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+// When appended data is made durable
+enum applog_sync {
+  APPLOG_SYNC_NONE,     // leave it to the kernel
+  APPLOG_SYNC_INTERVAL, // fdatasync() dirty files every interval
+  APPLOG_SYNC_BATCH,    // fdatasync() before any record in a batch completes
+};
+
+// One payload to append to a file
+struct applog_record {
+  char *path;
+  void *data;
+  size_t length;
+  int status; // 0, or -errno once committed
+
+  void (*done)(struct applog_record *rec); // on the loop thread, via fd
+  void *arg;
+
+  int waiting; // applog_append_wait() is blocked on this record
+  int committed;
+  struct applog_record *next;
+};
+
+// Group-committing append log
+//
+// Writers queue records; one committer thread takes everything queued,
+// writes each file's records with a single writev() and syncs once per file
+// per batch, so throughput grows with the batch size.
+struct applog {
+  int fd; // eventfd, readable when committed records await done()
+  int policy;
+  int interval_ms;
+
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;      // committer: work queued
+  pthread_cond_t committed; // applog_append_wait(): a batch finished
+  struct applog_record *pending_head, *pending_tail;
+  struct applog_record *done_head, *done_tail;
+  int stopping;
+
+  struct hashtable *dirty; // path -> fd awaiting the interval sync
+
+  // Committer statistics
+  unsigned long batches, records, syncs;
+};
+
+extern struct applog *applog_create(int policy, int interval_ms);
+extern void applog_free(struct applog *log);
+extern int applog_policy_parse(char *name);
+extern void applog_append(struct applog *log, struct applog_record *rec);
+extern int applog_append_wait(struct applog *log, struct applog_record *rec);
+extern int applog_complete(struct applog *log);
+extern int applog_writev_all(int fd, struct iovec *iov, int iovcnt);
+
+#endif
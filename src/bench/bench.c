@@ -0,0 +1,660 @@
+/**
+ * bench.c -- microbenchmarks for the server's core data structures
+ *
+ * Build and run from src/ with:
+ *
+ *    make bench
+ *
+ * Results go to bench/results.json, one record per benchmark and parameter
+ * set, so runs from two commits can be diffed directly:
+ *
+ *    make bench BENCH_OUT=before.json
+ *    ... change things ...
+ *    make bench BENCH_OUT=after.json
+ *
+ * (Running bench/bench by hand writes the JSON to stdout; a summary goes to
+ * stderr either way.)
+ *
+ * Each benchmark is run with a growing number of operations until it takes
+ * at least BENCH_MIN_NS, Go-style. Reported per operation:
+ *
+ *    ns_per_op      wall clock
+ *    cycles_per_op  time stamp counter ticks (x86 only, else 0); these are
+ *                   reference cycles, not core cycles under frequency scaling
+ *    allocs_per_op  malloc()/calloc()/realloc() calls made by server code;
+ *                   counted by wrapping them at link time, so allocations
+ *                   inside libc itself (strdup(), stdio) don't show up
+ */
+
+#include "../cache.h"
+#include "../conn.h"
+#include "../hashtable.h"
+#include "../llist.h"
+#include "../mime.h"
+#include "../route.h"
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define bench_cycles() __rdtsc()
+#else
+#define bench_cycles() 0ULL
+#endif
+
+#define BENCH_MIN_NS 200000000ULL // 0.2s per benchmark
+#define BENCH_MAX_OPS (1L << 30)
+
+#define ZIPF_KEYS 10000
+#define ZIPF_SEQUENCE (1 << 20)
+
+/**
+ * Allocation counting: the link wraps malloc() and friends with these
+ */
+long bench_allocs = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+  bench_allocs++;
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size) {
+  bench_allocs++;
+  return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+  bench_allocs++;
+  return __real_realloc(ptr, size);
+}
+
+// One run of a benchmark function
+struct bench {
+  long n; // operations to do
+
+  // Timed so far, and when the current timed stretch began
+  uint64_t ns, cycles;
+  long allocs;
+  uint64_t start_ns, start_cycles;
+  long start_allocs;
+
+  double extra; // a benchmark-specific figure, e.g. a hit ratio
+  const char *extra_name;
+};
+
+/**
+ * Monotonic clock in nanoseconds
+ */
+uint64_t bench_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Start (or resume) timing
+ */
+void bench_start(struct bench *b) {
+  b->start_allocs = bench_allocs;
+  b->start_cycles = bench_cycles();
+  b->start_ns = bench_now();
+}
+
+/**
+ * Stop (or pause) timing, e.g. around setup that shouldn't count
+ */
+void bench_stop(struct bench *b) {
+  uint64_t ns = bench_now();
+  uint64_t cycles = bench_cycles();
+
+  b->ns += ns - b->start_ns;
+  b->cycles += cycles - b->start_cycles;
+  b->allocs += bench_allocs - b->start_allocs;
+}
+
+int bench_count = 0;
+
+/**
+ * Run fn with more and more operations until it's timed for long enough,
+ * then print its record
+ *
+ * params: the inside of a JSON object describing this case.
+ */
+void bench_run(const char *name, const char *params,
+               void (*fn)(struct bench *b, void *arg), void *arg) {
+  struct bench b;
+  long n = 1;
+
+  for (;;) {
+    memset(&b, 0, sizeof b);
+    b.n = n;
+    fn(&b, arg);
+
+    if (b.ns >= BENCH_MIN_NS || n >= BENCH_MAX_OPS)
+      break;
+
+    // Aim a little past the target, but never grow more than 100x a step
+    uint64_t want = b.ns > 0 ? 1.2 * BENCH_MIN_NS / b.ns * n : n * 100.0;
+    if (want > (uint64_t)n * 100)
+      want = (uint64_t)n * 100;
+    if (want <= (uint64_t)n)
+      want = (uint64_t)n * 2;
+    n = want;
+  }
+
+  fprintf(stderr, "%-24s %-40s %10.1f ns/op\n", name, params,
+          (double)b.ns / b.n);
+
+  printf("%s\n    {\"name\": \"%s\", \"params\": {%s}, \"iterations\": %ld, "
+         "\"ns_per_op\": %.2f, \"cycles_per_op\": %.2f, "
+         "\"allocs_per_op\": %.3f",
+         bench_count++ > 0 ? "," : "", name, params, b.n, (double)b.ns / b.n,
+         (double)b.cycles / b.n, (double)b.allocs / b.n);
+  if (b.extra_name != NULL)
+    printf(", \"%s\": %.4f", b.extra_name, b.extra);
+  printf("}");
+}
+
+/**
+ * xorshift64*: cheap, good enough to pick keys
+ */
+uint64_t bench_rand(uint64_t *state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 2685821657736338717ULL;
+}
+
+/**
+ * Keys shaped like the server's cache keys
+ */
+char **bench_keys(int count) {
+  char **keys = malloc(count * sizeof *keys);
+
+  for (int i = 0; i < count; i++) {
+    keys[i] = malloc(48);
+    snprintf(keys[i], 48, "./serverroot/assets/file-%d.html", i);
+  }
+
+  return keys;
+}
+
+void bench_keys_free(char **keys, int count) {
+  for (int i = 0; i < count; i++)
+    free(keys[i]);
+  free(keys);
+}
+
+/**
+ * A shuffled 0..count-1
+ */
+int *bench_order(int count, uint64_t seed) {
+  int *order = malloc(count * sizeof *order);
+
+  for (int i = 0; i < count; i++)
+    order[i] = i;
+
+  for (int i = count - 1; i > 0; i--) {
+    int j = bench_rand(&seed) % (i + 1);
+    int t = order[i];
+    order[i] = order[j];
+    order[j] = t;
+  }
+
+  return order;
+}
+
+// A hashtable case: how many entries, and how many per bucket
+struct hashtable_case {
+  int entries;
+  double load;
+  char **keys;
+  int *order; // a shuffled visiting order
+};
+
+/**
+ * A table sized for the case's load factor, filled or empty
+ */
+struct hashtable *bench_table(struct hashtable_case *c, int fill) {
+  int size = c->entries / c->load;
+  struct hashtable *ht = hashtable_create(size > 0 ? size : 1, NULL);
+
+  for (int i = 0; fill && i < c->entries; i++)
+    hashtable_put(ht, c->keys[i], c->keys[i]);
+
+  return ht;
+}
+
+void bench_hashtable_put(struct bench *b, void *arg) {
+  struct hashtable_case *c = arg;
+
+  for (long done = 0; done < b->n;) {
+    struct hashtable *ht = bench_table(c, 0);
+    long batch = b->n - done < c->entries ? b->n - done : c->entries;
+
+    bench_start(b);
+    for (long i = 0; i < batch; i++)
+      hashtable_put(ht, c->keys[c->order[i]], c->keys[i]);
+    bench_stop(b);
+
+    hashtable_destroy(ht);
+    done += batch;
+  }
+}
+
+void bench_hashtable_get(struct bench *b, void *arg) {
+  struct hashtable_case *c = arg;
+  struct hashtable *ht = bench_table(c, 1);
+  long found = 0;
+
+  bench_start(b);
+  for (long i = 0; i < b->n; i++)
+    found += hashtable_get(ht, c->keys[c->order[i % c->entries]]) != NULL;
+  bench_stop(b);
+
+  if (found != b->n)
+    fprintf(stderr, "bench: hashtable_get lost keys\n");
+
+  hashtable_destroy(ht);
+}
+
+void bench_hashtable_delete(struct bench *b, void *arg) {
+  struct hashtable_case *c = arg;
+
+  for (long done = 0; done < b->n;) {
+    struct hashtable *ht = bench_table(c, 1);
+    long batch = b->n - done < c->entries ? b->n - done : c->entries;
+
+    bench_start(b);
+    for (long i = 0; i < batch; i++)
+      hashtable_delete(ht, c->keys[c->order[i]]);
+    bench_stop(b);
+
+    hashtable_destroy(ht);
+    done += batch;
+  }
+}
+
+// A cache case: capacity and how skewed the popularity of ZIPF_KEYS keys is
+struct cache_case {
+  int capacity;
+  double skew;
+  char **keys;
+  int *sequence; // ZIPF_SEQUENCE key indexes, Zipf-distributed
+};
+
+/**
+ * Draw a Zipf(skew) sequence over count keys by inverting the CDF
+ */
+int *bench_zipf(int count, double skew, int length, uint64_t seed) {
+  double *cdf = malloc(count * sizeof *cdf);
+  int *sequence = malloc(length * sizeof *sequence);
+  double sum = 0;
+
+  for (int i = 0; i < count; i++)
+    cdf[i] = sum += 1.0 / pow(i + 1, skew);
+
+  for (int i = 0; i < length; i++) {
+    double u = (bench_rand(&seed) >> 11) * (1.0 / 9007199254740992.0) * sum;
+    int lo = 0, hi = count - 1;
+
+    while (lo < hi) {
+      int mid = (lo + hi) / 2;
+      if (cdf[mid] < u)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+    sequence[i] = lo;
+  }
+
+  free(cdf);
+  return sequence;
+}
+
+/**
+ * What the server does per request: a lookup, then a put on a miss
+ */
+void bench_cache_get_put(struct bench *b, void *arg) {
+  struct cache_case *c = arg;
+  struct cache *cache = cache_create(c->capacity, 0);
+  static char content[1024];
+  long hits = 0;
+
+  bench_start(b);
+  for (long i = 0; i < b->n; i++) {
+    char *key = c->keys[c->sequence[i & (ZIPF_SEQUENCE - 1)]];
+
+    if (cache_get(cache, key) != NULL)
+      hits++;
+    else
+      cache_put(cache, key, "text/html", content, sizeof content);
+  }
+  bench_stop(b);
+
+  b->extra_name = "hit_ratio";
+  b->extra = (double)hits / b->n;
+
+  cache_free(cache);
+}
+
+char *bench_mime_names[] = {
+    "./serverroot/index.html", "./serverroot/cat.jpg",
+    "./serverroot/style.css",  "./serverroot/app.js",
+    "./serverroot/data.json",  "./serverroot/README",
+    "./serverroot/logo.PNG",   "./serverroot/notes.txt",
+};
+
+void bench_mime_type_get(struct bench *b, void *arg) {
+  int count = sizeof bench_mime_names / sizeof bench_mime_names[0];
+  size_t sink = 0;
+  (void)arg;
+
+  bench_start(b);
+  for (long i = 0; i < b->n; i++)
+    sink += strlen(mime_type_get(bench_mime_names[i % count]));
+  bench_stop(b);
+
+  if (sink == 0)
+    fprintf(stderr, "bench: no mime types\n");
+}
+
+int bench_ptrcmp(void *a, void *b) { return a != b; }
+
+// A list case: how long the list is
+struct llist_case {
+  int length;
+  char **items;
+};
+
+/**
+ * A list holding the case's items
+ */
+struct llist *bench_list(struct llist_case *c) {
+  struct llist *l = llist_create();
+
+  for (int i = 0; i < c->length; i++)
+    llist_append(l, c->items[i]);
+
+  return l;
+}
+
+void bench_llist_append(struct bench *b, void *arg) {
+  struct llist_case *c = arg;
+
+  for (long done = 0; done < b->n;) {
+    struct llist *l = llist_create();
+    long batch = b->n - done < c->length ? b->n - done : c->length;
+
+    bench_start(b);
+    for (long i = 0; i < batch; i++)
+      llist_append(l, c->items[i]);
+    bench_stop(b);
+
+    llist_destroy(l);
+    done += batch;
+  }
+}
+
+void bench_llist_insert(struct bench *b, void *arg) {
+  struct llist_case *c = arg;
+
+  for (long done = 0; done < b->n;) {
+    struct llist *l = llist_create();
+    long batch = b->n - done < c->length ? b->n - done : c->length;
+
+    bench_start(b);
+    for (long i = 0; i < batch; i++)
+      llist_insert(l, c->items[i]);
+    bench_stop(b);
+
+    llist_destroy(l);
+    done += batch;
+  }
+}
+
+void bench_llist_find(struct bench *b, void *arg) {
+  struct llist_case *c = arg;
+  struct llist *l = bench_list(c);
+  uint64_t seed = 42;
+  long found = 0;
+
+  bench_start(b);
+  for (long i = 0; i < b->n; i++)
+    found += llist_find(l, c->items[bench_rand(&seed) % c->length],
+                        bench_ptrcmp) != NULL;
+  bench_stop(b);
+
+  if (found != b->n)
+    fprintf(stderr, "bench: llist_find lost items\n");
+
+  llist_destroy(l);
+}
+
+/**
+ * Empty a list in random order: on average an item is found a quarter of
+ * the way along the list that's left
+ */
+void bench_llist_delete(struct bench *b, void *arg) {
+  struct llist_case *c = arg;
+  int *order = bench_order(c->length, 3);
+
+  for (long done = 0; done < b->n;) {
+    struct llist *l = bench_list(c);
+    long batch = b->n - done < c->length ? b->n - done : c->length;
+
+    bench_start(b);
+    for (long i = 0; i < batch; i++)
+      llist_delete(l, c->items[order[i]], bench_ptrcmp);
+    bench_stop(b);
+
+    llist_destroy(l);
+    done += batch;
+  }
+
+  free(order);
+}
+
+// Requests as they arrive
+char *bench_requests[] = {
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: localhost:3490\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:120.0) Gecko/20100101 "
+    "Firefox/120.0\r\n"
+    "Accept: text/html,application/xhtml+xml,*/*;q=0.8\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n",
+
+    "POST /save HTTP/1.1\r\n"
+    "Host: localhost:3490\r\n"
+    "User-Agent: curl/8.5.0\r\n"
+    "Accept: */*\r\n"
+    "Content-Type: text/plain\r\n"
+    "Content-Length: 19\r\n"
+    "\r\n"
+    "Hello, sample data!",
+};
+
+/**
+ * What the serving loop and handle_http_request() do with a request before
+ * dispatching it: check it's complete, then read the request line
+ */
+void bench_parse(struct bench *b, void *arg) {
+  struct conn conn;
+  char *request = arg;
+  char opr[16], path[256];
+  long complete = 0;
+
+  memset(&conn, 0, sizeof conn);
+  conn.request = request;
+  conn.request_length = strlen(request);
+  conn.request_size = conn.request_length + 1;
+
+  bench_start(b);
+  for (long i = 0; i < b->n; i++) {
+    complete += conn_request_complete(&conn);
+    sscanf(conn.request, "%15s %255s", opr, path);
+  }
+  bench_stop(b);
+
+  if (complete != b->n)
+    fprintf(stderr, "bench: incomplete request\n");
+}
+
+// Dispatch with the server's own routes plus extra ones alongside
+struct route_case {
+  int extra; // /api/vN/items/:id routes
+  const char *path;
+};
+
+void bench_route_handler(struct conn *conn, struct route_match *match) {
+  (void)conn;
+  (void)match;
+}
+
+/**
+ * Find the route for a request path
+ */
+void bench_route(struct bench *b, void *arg) {
+  struct route_case *c = arg;
+  struct router *r = router_create();
+  struct route_match match;
+  char pattern[64];
+  long found = 0;
+
+  router_add(r, ROUTE_GET, "/d20", bench_route_handler, 0);
+  router_add(r, ROUTE_GET, "/metrics", bench_route_handler, 0);
+  router_add(r, ROUTE_GET, "/*path", bench_route_handler, 0);
+  router_add(r, ROUTE_POST, "/*path", bench_route_handler, 0);
+  for (int i = 0; i < c->extra; i++) {
+    snprintf(pattern, sizeof pattern, "/api/v%d/items/:id", i);
+    router_add(r, ROUTE_GET, pattern, bench_route_handler, 0);
+  }
+
+  bench_start(b);
+  for (long i = 0; i < b->n; i++)
+    found += router_find(r, ROUTE_GET, c->path, &match) != NULL;
+  bench_stop(b);
+
+  if (found != b->n)
+    fprintf(stderr, "bench: no route for %s\n", c->path);
+
+  router_free(r);
+}
+
+/**
+ * Main
+ */
+int main(void) {
+  char params[128];
+
+  printf("{\"benchmarks\": [");
+
+  // hashtable: a couple of sizes, from roomy to crowded buckets
+  int entries[] = {1024, 16384};
+  double loads[] = {0.5, 2, 8};
+
+  for (int e = 0; e < 2; e++) {
+    struct hashtable_case c;
+
+    c.entries = entries[e];
+    c.keys = bench_keys(c.entries);
+    c.order = bench_order(c.entries, 1);
+
+    for (int l = 0; l < 3; l++) {
+      c.load = loads[l];
+      snprintf(params, sizeof params, "\"entries\": %d, \"load\": %g",
+               c.entries, c.load);
+
+      bench_run("hashtable_put", params, bench_hashtable_put, &c);
+      bench_run("hashtable_get", params, bench_hashtable_get, &c);
+      bench_run("hashtable_delete", params, bench_hashtable_delete, &c);
+    }
+
+    free(c.order);
+    bench_keys_free(c.keys, c.entries);
+  }
+
+  // cache: the server's default capacity and bigger ones, mild and steep
+  // popularity curves
+  int capacities[] = {10, 100, 1000};
+  double skews[] = {0.8, 1.1};
+  char **zipf_keys = bench_keys(ZIPF_KEYS);
+
+  for (int s = 0; s < 2; s++) {
+    struct cache_case c;
+
+    c.skew = skews[s];
+    c.keys = zipf_keys;
+    c.sequence = bench_zipf(ZIPF_KEYS, c.skew, ZIPF_SEQUENCE, 7);
+
+    for (int k = 0; k < 3; k++) {
+      c.capacity = capacities[k];
+      snprintf(params, sizeof params,
+               "\"keys\": %d, \"capacity\": %d, \"zipf_s\": %g", ZIPF_KEYS,
+               c.capacity, c.skew);
+
+      bench_run("cache_get_put", params, bench_cache_get_put, &c);
+    }
+
+    free(c.sequence);
+  }
+
+  bench_keys_free(zipf_keys, ZIPF_KEYS);
+
+  bench_run("mime_type_get", "", bench_mime_type_get, NULL);
+
+  // llist: what a hashtable bucket looks like, and much longer
+  int lengths[] = {8, 256};
+
+  for (int l = 0; l < 2; l++) {
+    struct llist_case c;
+
+    c.length = lengths[l];
+    c.items = bench_keys(c.length);
+    snprintf(params, sizeof params, "\"length\": %d", c.length);
+
+    bench_run("llist_append", params, bench_llist_append, &c);
+    bench_run("llist_insert", params, bench_llist_insert, &c);
+    bench_run("llist_find", params, bench_llist_find, &c);
+    bench_run("llist_delete", params, bench_llist_delete, &c);
+
+    bench_keys_free(c.items, c.length);
+  }
+
+  bench_run("parse", "\"request\": \"GET\"", bench_parse, bench_requests[0]);
+  bench_run("parse", "\"request\": \"POST\"", bench_parse, bench_requests[1]);
+
+  // route: cost should follow the path, not the number of routes
+  int extras[] = {0, 60, 1020};
+  const char *route_paths[] = {"/d20", "/index.html", "/api/v0/items/42"};
+
+  for (int e = 0; e < 3; e++) {
+    for (int p = 0; p < 3; p++) {
+      struct route_case c = {extras[e], route_paths[p]};
+
+      if (c.extra == 0 && p == 2)
+        continue;
+
+      snprintf(params, sizeof params, "\"routes\": %d, \"path\": \"%s\"",
+               4 + c.extra, c.path);
+      bench_run("route", params, bench_route, &c);
+    }
+  }
+
+  printf("\n]}\n");
+
+  return 0;
+}
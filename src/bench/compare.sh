@@ -0,0 +1,57 @@
+#!/bin/sh
+#
+# Compare build variants under load: make compare
+#
+# Each server binary given on the command line (or, if none are, listed in
+# COMPARE_SERVERS) is started in turn on port 3490 and driven closed loop
+# by loadgen, first with a single cached file (the hot request path:
+# parse, cache hit, send) and then with the test_load.py mix. Prints
+# requests/s and latency percentiles per variant.
+#
+# COMPARE_SECONDS and COMPARE_CONNECTIONS override the run length and
+# connection count.
+
+seconds=${COMPARE_SECONDS:-10}
+connections=${COMPARE_CONNECTIONS:-32}
+servers=${*:-$COMPARE_SERVERS}
+
+run() {
+  server=$1
+  shift
+
+  ./$server > /dev/null &
+  pid=$!
+  sleep 1
+  # Warm the cache so the first run doesn't pay for disk loads
+  ./loadgen/loadgen -d 1 -c 4 "$@" > /dev/null
+  ./loadgen/loadgen -d $seconds -c $connections "$@" |
+    awk -v server=$server '
+      /^  completed/ { rate = $3; sub(/\(/, "", rate); sub(/\/s,/, "", rate) }
+      /^  errors/ { errors = $2; sub(/,/, "", errors) }
+      /^  p50 / { p50 = $2 }
+      /^  p99 / { p99 = $2 }
+      /^  p99.9 / { p999 = $2 }
+      END {
+        printf "  %-16s %10s %10s %10s %10s %8s\n", server, rate, p50, p99,
+          p999, errors
+      }'
+  kill -INT $pid
+  wait $pid
+}
+
+for workload in hot mix; do
+  if [ $workload = hot ]; then
+    echo "Hot path: GET /index.html, cached ($seconds s, $connections connections)"
+    set -- -u /index.html
+  else
+    echo "Mix: test_load.py requests ($seconds s, $connections connections)"
+    set --
+  fi
+  printf "  %-16s %10s %10s %10s %10s %8s\n" binary "req/s" "p50 ms" \
+    "p99 ms" "p99.9 ms" errors
+
+  for server in $servers; do
+    run $server "$@"
+  done
+  echo
+done
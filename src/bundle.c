@@ -0,0 +1,139 @@
+#include "bundle.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * Map a bundle built by mkbundle
+ *
+ * Only the header is checked here, so opening costs the same however many
+ * files the bundle holds; records are bounds-checked as they're looked up.
+ * Returns NULL if the file is missing or isn't a bundle.
+ */
+struct bundle *bundle_open(char *filename) {
+  struct stat s;
+  struct bundle_header *header;
+
+  int fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    perror(filename);
+    return NULL;
+  }
+
+  if (fstat(fd, &s) == -1 || (size_t)s.st_size < sizeof *header) {
+    fprintf(stderr, "%s: not a bundle\n", filename);
+    close(fd);
+    return NULL;
+  }
+
+  void *map = mmap(NULL, s.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    perror("mmap");
+    return NULL;
+  }
+
+  header = map;
+  if (memcmp(header->magic, BUNDLE_MAGIC, sizeof header->magic) != 0 ||
+      header->size != (uint64_t)s.st_size ||
+      header->index_offset > header->size ||
+      header->count > (header->size - header->index_offset) /
+                          sizeof(struct bundle_record)) {
+    fprintf(stderr, "%s: not a bundle or truncated\n", filename);
+    munmap(map, s.st_size);
+    return NULL;
+  }
+
+  struct bundle *b = malloc(sizeof *b);
+  if (b == NULL) {
+    munmap(map, s.st_size);
+    return NULL;
+  }
+
+  b->map = map;
+  b->size = s.st_size;
+  b->index = (struct bundle_record *)((char *)map + header->index_offset);
+  b->count = header->count;
+
+  return b;
+}
+
+/**
+ * Unmap a bundle
+ */
+void bundle_close(struct bundle *b) {
+  if (b == NULL)
+    return;
+
+  munmap(b->map, b->size);
+  free(b);
+}
+
+/**
+ * Return a pointer to a NUL-terminated string in the bundle, or NULL if the
+ * offset is out of bounds or the string runs off the end
+ */
+char *bundle_string(struct bundle *b, uint64_t offset) {
+  if (offset >= b->size)
+    return NULL;
+
+  char *s = (char *)b->map + offset;
+  if (memchr(s, '\0', b->size - offset) == NULL)
+    return NULL;
+
+  return s;
+}
+
+/**
+ * Is [offset, offset + length) inside the bundle?
+ */
+int bundle_range_ok(struct bundle *b, uint64_t offset, uint64_t length) {
+  return offset <= b->size && length <= b->size - offset;
+}
+
+/**
+ * Look up an asset by path
+ *
+ * Binary search over the sorted index. Returns 1 and fills in asset if
+ * found, 0 otherwise.
+ */
+int bundle_find(struct bundle *b, char *path, struct bundle_asset *asset) {
+  uint64_t lo = 0, hi = b->count;
+
+  while (lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    struct bundle_record *rec = &b->index[mid];
+    char *rec_path = bundle_string(b, rec->path_offset);
+
+    if (rec_path == NULL)
+      return 0;
+
+    int cmp = strcmp(path, rec_path);
+    if (cmp < 0) {
+      hi = mid;
+    } else if (cmp > 0) {
+      lo = mid + 1;
+    } else {
+      asset->content_type = bundle_string(b, rec->mime_offset);
+      asset->etag = bundle_string(b, rec->etag_offset);
+
+      if (asset->content_type == NULL || asset->etag == NULL ||
+          !bundle_range_ok(b, rec->data_offset, rec->data_length) ||
+          !bundle_range_ok(b, rec->gzip_offset, rec->gzip_length))
+        return 0;
+
+      asset->data = (char *)b->map + rec->data_offset;
+      asset->length = rec->data_length;
+      asset->gzip_data = (char *)b->map + rec->gzip_offset;
+      asset->gzip_length = rec->gzip_length;
+
+      return 1;
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,52 @@
+#ifndef _BUNDLE_H_
+#define _BUNDLE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BUNDLE_MAGIC "CWSBDL01"
+
+// Bundle file header, at offset 0
+struct bundle_header {
+  char magic[8];
+  uint64_t size;         // Total file size, checked against the mapping
+  uint64_t index_offset; // Array of count bundle_records, sorted by path
+  uint64_t count;
+};
+
+// Bundle index record. Offsets are from the start of the bundle; strings are
+// NUL-terminated.
+struct bundle_record {
+  uint64_t path_offset; // Same form as cache keys: "./serverroot/index.html"
+  uint64_t mime_offset;
+  uint64_t etag_offset; // Quoted, ready for the ETag header
+  uint64_t data_offset;
+  uint64_t data_length;
+  uint64_t gzip_offset; // Precompressed variant, gzip_length 0 if none
+  uint64_t gzip_length;
+};
+
+// A mapped bundle
+struct bundle {
+  void *map;
+  size_t size;
+  struct bundle_record *index;
+  uint64_t count;
+};
+
+// An asset found in a bundle. Every pointer points into the mapping.
+struct bundle_asset {
+  char *content_type;
+  char *etag;
+  void *data;
+  size_t length;
+  void *gzip_data;
+  size_t gzip_length;
+};
+
+extern struct bundle *bundle_open(char *filename);
+extern void bundle_close(struct bundle *b);
+extern int bundle_find(struct bundle *b, char *path,
+                       struct bundle_asset *asset);
+
+#endif
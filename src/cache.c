@@ -1,15 +1,18 @@
 #include "cache.h"
 #include "hashtable.h"
+#include "shcache.h"
+#include "tier.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <time.h>
 
 /**
  * Allocate a cache entry
  */
 struct cache_entry *alloc_entry(char *path, char *content_type, void *content,
-                                int content_length) {
+                                off_t content_length) {
   if (path == NULL || content_type == NULL || content == NULL)
     return NULL;
 
@@ -33,7 +36,41 @@ struct cache_entry *alloc_entry(char *path, char *content_type, void *content,
   memcpy(entry->content_type, content_type, strlen(content_type) + 1);
   memcpy(entry->content, content, content_length);
   entry->content_length = content_length;
-  entry->dirty = 0; // this is not dirty at begining
+  entry->version = 1;
+  entry->refs = 1; // the reference held by whoever allocated it
+
+  return entry;
+}
+
+/**
+ * Allocate a cache entry for content in a shared cache
+ *
+ * It takes over the reference to se, dropping it if out of memory.
+ */
+struct cache_entry *alloc_shared_entry(struct shcache *sh,
+                                       struct shcache_entry *se) {
+  struct cache_entry *entry = calloc(1, sizeof *entry);
+
+  if (entry != NULL) {
+    entry->path = strdup(shcache_path(se));
+    entry->content_type = strdup(shcache_content_type(se));
+  }
+  if (entry == NULL || entry->path == NULL || entry->content_type == NULL) {
+    if (entry != NULL) {
+      free(entry->path);
+      free(entry->content_type);
+      free(entry);
+    }
+    shcache_release(sh, se);
+    return NULL;
+  }
+
+  entry->content = shcache_content(se);
+  entry->content_length = se->content_length;
+  entry->version = 1;
+  entry->refs = 1;
+  entry->shared = sh;
+  entry->shared_entry = se;
 
   return entry;
 }
@@ -46,8 +83,11 @@ void free_entry(struct cache_entry *entry) {
   if (entry == NULL)
     return;
 
-  // firstly we free memory inversely
-  free(entry->content);
+  // firstly we free memory inversely; shared content isn't ours to free
+  if (entry->shared_entry != NULL)
+    shcache_release(entry->shared, entry->shared_entry);
+  else
+    free(entry->content);
   free(entry->content_type);
   free(entry->path);
 
@@ -65,6 +105,19 @@ void free_entry(struct cache_entry *entry) {
   free(entry);
 }
 
+/**
+ * Take a reference to an entry so it outlives eviction
+ */
+void cache_entry_retain(struct cache_entry *entry) { ++(entry->refs); }
+
+/**
+ * Drop a reference, deallocating the entry with the last one
+ */
+void cache_entry_release(struct cache_entry *entry) {
+  if (entry != NULL && --(entry->refs) == 0)
+    free_entry(entry);
+}
+
 /**
  * Insert a cache entry at the head of the linked list
  */
@@ -104,6 +157,25 @@ void dllist_move_to_head(struct cache *cache, struct cache_entry *ce) {
   }
 }
 
+/**
+ * Unlink a cache entry from wherever it sits in the list
+ *
+ * NOTE: does not deallocate the entry
+ */
+void dllist_remove(struct cache *cache, struct cache_entry *ce) {
+  if (ce->prev != NULL)
+    ce->prev->next = ce->next;
+  else
+    cache->head = ce->next;
+
+  if (ce->next != NULL)
+    ce->next->prev = ce->prev;
+  else
+    cache->tail = ce->prev;
+
+  ce->prev = ce->next = NULL;
+}
+
 /**
  * Removes the tail from the list and returns it
  *
@@ -112,8 +184,7 @@ void dllist_move_to_head(struct cache *cache, struct cache_entry *ce) {
 struct cache_entry *dllist_remove_tail(struct cache *cache) {
   struct cache_entry *oldtail = cache->tail;
 
-  cache->tail = oldtail->prev;
-  cache->tail->next = NULL;
+  dllist_remove(cache, oldtail);
 
   return oldtail;
 }
@@ -129,18 +200,42 @@ struct cache *cache_create(int max_size, int hashsize) {
   memset(newcache, 0, sizeof(struct cache));
   newcache->index = hashtable_create(hashsize, NULL);
   newcache->max_size = max_size;
+  newcache->missing = hashtable_create(0, NULL);
+  newcache->missing_max = CACHE_MISSING_MAX;
+  newcache->flights = hashtable_create(0, NULL);
   return newcache;
 }
 
 void cache_free(struct cache *cache) {
   struct cache_entry *cur_entry = cache->head;
+  struct cache_missing *missing = cache->missing_head;
 
   hashtable_destroy(cache->index);
+  hashtable_destroy(cache->missing);
+  hashtable_destroy(cache->flights);
+
+  // Nobody is left to answer the waiters of loads still in flight
+  while (cache->flights_head != NULL) {
+    struct cache_flight *next = cache->flights_head->next;
+
+    free(cache->flights_head->path);
+    free(cache->flights_head);
+    cache->flights_head = next;
+  }
+
+  while (missing != NULL) {
+    struct cache_missing *next = missing->next;
+
+    free(missing->path);
+    free(missing);
+    missing = next;
+  }
 
   while (cur_entry != NULL) {
     struct cache_entry *next_entry = cur_entry->next;
 
-    free_entry(cur_entry);
+    cur_entry->prev = cur_entry->next = NULL;
+    cache_entry_release(cur_entry);
 
     cur_entry = next_entry;
   }
@@ -149,50 +244,501 @@ void cache_free(struct cache *cache) {
 }
 
 /**
- * Store an entry in the cache
+ * Unindex an entry and drop the cache's reference to it
+ */
+void cache_remove(struct cache *cache, struct cache_entry *entry) {
+  hashtable_delete(cache->index, entry->path);
+  dllist_remove(cache, entry);
+  cache->bytes -= entry->content_length;
+  cache->blocks -= entry->block;
+  --(cache->cur_size);
+  cache_entry_release(entry);
+}
+
+/**
+ * The entry indexed for path, or NULL
  *
- * This will also remove the least-recently-used items as necessary.
+ * An entry whose shared copy another worker has deleted since is dropped:
+ * the file changed, or that worker replaced it.
  */
-void cache_put(struct cache *cache, char *path, char *content_type,
-               void *content, int content_length) {
-  if (cache == NULL || path == NULL || content_type == NULL || content == NULL)
-    return;
+struct cache_entry *cache_lookup(struct cache *cache, char *path) {
+  struct cache_entry *entry = hashtable_get(cache->index, path);
 
-  // is the required cache entry exsisting ?
-  struct cache_entry *existing = cache_get(cache, path);
-  if (existing) {
-    // if YES , check the dirty tag
-    if (existing->dirty) {
-      // if DIRTY , this should really be update
-      free(existing->content);
-      existing->content = malloc(content_length);
-      memset(existing->content, 0, content_length);
-      memcpy(existing->content, content, content_length);
-      existing->content_length = content_length;
-      existing->dirty = 0;
-    }
-    // if NOT ,
-    // we even don't need to put it on head
-    // cause it's already done by cache_get called before
-  } else {
-    // if NO , let's store it in cache
-    struct cache_entry *entry =
-        alloc_entry(path, content_type, content, content_length);
-    if (entry == NULL)
-      return;
+  if (entry != NULL && entry->shared_entry != NULL &&
+      shcache_stale(entry->shared_entry)) {
+    cache_remove(cache, entry);
+    return NULL;
+  }
 
-    dllist_insert_head(cache, entry);
-    hashtable_put(cache->index, path, entry);
-    ++(cache->cur_size);
+  return entry;
+}
+
+/**
+ * Allocate an entry for content about to be cached: in the shared cache if
+ * there is one and it fits, in our own memory otherwise
+ */
+struct cache_entry *cache_entry_create(struct cache *cache, char *path,
+                                       char *content_type, void *content,
+                                       off_t content_length) {
+  if (cache->shared != NULL && path != NULL && content_type != NULL &&
+      content != NULL) {
+    struct shcache_entry *se = shcache_put(cache->shared, path, content_type,
+                                           content, content_length);
+    if (se != NULL)
+      return alloc_shared_entry(cache->shared, se);
   }
 
+  return alloc_entry(path, content_type, content, content_length);
+}
+
+/**
+ * Remove the least-recently-used entry if the cache is over its size
+ *
+ * With cache->clock, hits haven't kept the list in recency order; the
+ * first entry not hit since the hand last passed it goes instead.
+ *
+ * With a warm tier, it's demoted there rather than lost.
+ */
+void cache_evict(struct cache *cache) {
   // if cache is full, remove using LRU
   if (cache->cur_size > cache->max_size) {
-    struct cache_entry *removed = dllist_remove_tail(cache);
-    hashtable_delete(cache->index, removed->path);
-    free_entry(removed);
-    --(cache->cur_size);
+    // or CLOCK, whose hand is the tail: entries hit since it last passed
+    // go round again
+    while (cache->clock && cache->tail->referenced) {
+      cache->tail->referenced = 0;
+      dllist_move_to_head(cache, cache->tail);
+    }
+
+    if (cache->tier != NULL && tier_put(cache->tier, cache->tail) == 0)
+      ++(cache->demotions);
+
+    cache_remove(cache, cache->tail);
+    ++(cache->evictions);
+  }
+}
+
+/**
+ * Put an entry copied out of the warm tier into RAM, in place of its item
+ */
+void cache_promoted(struct cache *cache, struct tier_item *item,
+                    struct cache_entry *entry) {
+  entry->version = item->version;
+  entry->validator = item->validator;
+  entry->hits = item->hits;
+  entry->block = item->block;
+  tier_remove(cache->tier, item);
+
+  dllist_insert_head(cache, entry);
+  hashtable_put(cache->index, entry->path, entry);
+  ++(cache->cur_size);
+  cache->bytes += entry->content_length;
+  cache->blocks += entry->block;
+  ++(cache->promotions);
+
+  cache_evict(cache);
+}
+
+/**
+ * Bring path back from the warm tier, if it's there
+ *
+ * The entry moves: it's copied into RAM at the head of the LRU and dropped
+ * from the tier. One being copied in or out already isn't there yet.
+ * Returns it, or NULL.
+ */
+struct cache_entry *cache_promote(struct cache *cache, char *path) {
+  struct tier_item *item = tier_get(cache->tier, path);
+  if (item == NULL || item->busy)
+    return NULL;
+
+  struct cache_entry *entry =
+      alloc_entry(path, item->content_type, tier_content(cache->tier, item),
+                  item->content_length);
+  if (entry == NULL)
+    return NULL;
+
+  cache_promoted(cache, item, entry);
+
+  return entry;
+}
+
+/**
+ * Start bringing path back from the warm tier, to copy it out elsewhere
+ *
+ * Returns its item, busy until cache_promote_finish(), or NULL if it isn't
+ * there to copy. The caller copies it out with alloc_entry(), which is safe
+ * off the loop thread.
+ */
+struct tier_item *cache_promote_begin(struct cache *cache, char *path) {
+  if (cache == NULL || path == NULL)
+    return NULL;
+
+  struct tier_item *item = tier_get(cache->tier, path);
+  if (item == NULL || item->busy)
+    return NULL;
+
+  item->busy = 1;
+  return item;
+}
+
+/**
+ * Put the copy of a promoted item into RAM, as a hit
+ *
+ * entry is the copy, or NULL if it couldn't be made. Returns it, or NULL if
+ * there's none or the item was dropped meanwhile, its path invalidated or
+ * cached anew; the copy is then let go.
+ */
+struct cache_entry *cache_promote_finish(struct cache *cache,
+                                         struct tier_item *item,
+                                         struct cache_entry *entry) {
+  int dropped = item->dropped;
+
+  tier_copied(cache->tier, item);
+  if (dropped || entry == NULL) {
+    cache_entry_release(entry);
+    return NULL;
+  }
+
+  cache_promoted(cache, item, entry);
+  ++(cache->hits);
+  ++(entry->hits);
+
+  return entry;
+}
+
+/**
+ * Index path's entry in the shared cache, if another worker put it there
+ *
+ * Returns it, at the head of the LRU, or NULL.
+ */
+struct cache_entry *cache_adopt(struct cache *cache, char *path) {
+  struct shcache_entry *se = shcache_get(cache->shared, path);
+  if (se == NULL)
+    return NULL;
+
+  struct cache_entry *entry = alloc_shared_entry(cache->shared, se);
+  if (entry == NULL)
+    return NULL;
+
+  entry->block = se->block;
+  dllist_insert_head(cache, entry);
+  hashtable_put(cache->index, path, entry);
+  ++(cache->cur_size);
+  cache->bytes += entry->content_length;
+  cache->blocks += entry->block;
+
+  cache_evict(cache);
+
+  return entry;
+}
+
+/**
+ * Unlink a negative entry and deallocate it
+ */
+void cache_missing_remove(struct cache *cache, struct cache_missing *m) {
+  hashtable_delete(cache->missing, m->path);
+
+  if (m->prev != NULL)
+    m->prev->next = m->next;
+  else
+    cache->missing_head = m->next;
+
+  if (m->next != NULL)
+    m->next->prev = m->prev;
+  else
+    cache->missing_tail = m->prev;
+
+  free(m->path);
+  free(m);
+  --(cache->missing_count);
+}
+
+/**
+ * Drop the negative entry for path, if there is one
+ */
+void cache_forget_missing(struct cache *cache, char *path) {
+  if (cache->missing_count == 0)
+    return;
+
+  struct cache_missing *m = hashtable_get(cache->missing, path);
+  if (m != NULL)
+    cache_missing_remove(cache, m);
+}
+
+/**
+ * Remember that path doesn't exist
+ *
+ * Past missing_max negative entries, the least recently used goes.
+ */
+void cache_put_missing(struct cache *cache, char *path) {
+  if (cache == NULL || path == NULL || cache->missing_max <= 0 ||
+      hashtable_get(cache->missing, path) != NULL)
+    return;
+
+  struct cache_missing *m = malloc(sizeof *m);
+  if (m == NULL)
+    return;
+
+  m->path = strdup(path);
+  if (m->path == NULL) {
+    free(m);
+    return;
+  }
+
+  m->prev = NULL;
+  m->next = cache->missing_head;
+  if (cache->missing_head != NULL)
+    cache->missing_head->prev = m;
+  else
+    cache->missing_tail = m;
+  cache->missing_head = m;
+
+  hashtable_put(cache->missing, path, m);
+  ++(cache->missing_count);
+
+  if (cache->missing_count > cache->missing_max)
+    cache_missing_remove(cache, cache->missing_tail);
+}
+
+/**
+ * Is path known not to exist?
+ */
+int cache_is_missing(struct cache *cache, char *path) {
+  if (cache == NULL || path == NULL || cache->missing_count == 0)
+    return 0;
+
+  struct cache_missing *m = hashtable_get(cache->missing, path);
+  if (m == NULL)
+    return 0;
+
+  // Move it to the head
+  if (m != cache->missing_head) {
+    m->prev->next = m->next;
+    if (m->next != NULL)
+      m->next->prev = m->prev;
+    else
+      cache->missing_tail = m->prev;
+
+    m->prev = NULL;
+    m->next = cache->missing_head;
+    cache->missing_head->prev = m;
+    cache->missing_head = m;
+  }
+
+  ++(cache->missing_hits);
+  return 1;
+}
+
+/**
+ * Store an entry in the cache
+ *
+ * This will also remove the least-recently-used items as necessary. If the
+ * path is already cached, that entry is kept: new content for a path goes
+ * in through cache_replace(). Returns the entry now cached for path, or
+ * NULL if none could be.
+ */
+struct cache_entry *cache_put(struct cache *cache, char *path,
+                              char *content_type, void *content,
+                              off_t content_length) {
+  if (cache == NULL || path == NULL || content_type == NULL || content == NULL)
+    return NULL;
+
+  // is the required cache entry exsisting ? if YES, just move it to the
+  // head; this isn't a lookup, so it doesn't count as a hit
+  struct cache_entry *existing = cache_lookup(cache, path);
+  if (existing != NULL) {
+    dllist_move_to_head(cache, existing);
+    return existing;
   }
+
+  cache_forget_missing(cache, path);
+  tier_delete(cache->tier, path);
+
+  // if NO , let's store it in cache
+  struct cache_entry *entry =
+      cache_entry_create(cache, path, content_type, content, content_length);
+  if (entry == NULL)
+    return NULL;
+
+  dllist_insert_head(cache, entry);
+  hashtable_put(cache->index, path, entry);
+  ++(cache->cur_size);
+  cache->bytes += content_length;
+
+  cache_evict(cache);
+
+  // Under CLOCK, entries given a second chance may be ahead of it now
+  return hashtable_get(cache->index, path) == entry ? entry : NULL;
+}
+
+/**
+ * The load in flight for path, or NULL if there's none
+ */
+struct cache_flight *cache_flight_find(struct cache *cache, char *path) {
+  if (cache == NULL || path == NULL || cache->flights_head == NULL)
+    return NULL;
+
+  return hashtable_get(cache->flights, path);
+}
+
+/**
+ * Record that the caller is loading path, so later misses can wait on it
+ *
+ * The caller must cache_flight_finish() it. Returns NULL if out of memory;
+ * the caller loads anyway, just alone.
+ */
+struct cache_flight *cache_flight_start(struct cache *cache, char *path) {
+  if (cache == NULL || path == NULL)
+    return NULL;
+
+  struct cache_flight *flight = calloc(1, sizeof *flight);
+  if (flight == NULL)
+    return NULL;
+
+  flight->path = strdup(path);
+  if (flight->path == NULL) {
+    free(flight);
+    return NULL;
+  }
+
+  flight->next = cache->flights_head;
+  if (cache->flights_head != NULL)
+    cache->flights_head->prev = flight;
+  cache->flights_head = flight;
+  hashtable_put(cache->flights, path, flight);
+
+  return flight;
+}
+
+/**
+ * Wait on a load in flight; waiters are answered in the order they came
+ */
+void cache_flight_wait(struct cache *cache, struct cache_flight *flight,
+                       struct cache_waiter *waiter) {
+  waiter->next = NULL;
+  if (flight->last_waiter != NULL)
+    flight->last_waiter->next = waiter;
+  else
+    flight->waiters = waiter;
+  flight->last_waiter = waiter;
+
+  ++(cache->coalesced);
+}
+
+/**
+ * Stop a load from taking new waiters; it still answers the ones it has
+ */
+void cache_flight_detach(struct cache *cache, struct cache_flight *flight) {
+  if (hashtable_get(cache->flights, flight->path) == flight)
+    hashtable_delete(cache->flights, flight->path);
+}
+
+/**
+ * A load is done: answer everyone waiting on it with entry (NULL if it
+ * failed), then forget it
+ */
+void cache_flight_finish(struct cache *cache, struct cache_flight *flight,
+                         struct cache_entry *entry) {
+  if (flight == NULL)
+    return;
+
+  cache_flight_detach(cache, flight);
+
+  if (flight->prev != NULL)
+    flight->prev->next = flight->next;
+  else
+    cache->flights_head = flight->next;
+  if (flight->next != NULL)
+    flight->next->prev = flight->prev;
+
+  for (struct cache_waiter *w = flight->waiters; w != NULL;) {
+    struct cache_waiter *next = w->next;
+
+    w->done(w, entry);
+    w = next;
+  }
+
+  free(flight->path);
+  free(flight);
+}
+
+/**
+ * Install new content for a path, as written through to validator's file
+ *
+ * The entry goes in as the next version at the head of the cache. Whoever
+ * still holds the previous version keeps a complete copy of it. Loads in
+ * flight for the path are invalidated. Returns the new entry, or NULL if
+ * it couldn't be allocated, in which case the path is left uncached.
+ */
+struct cache_entry *cache_replace(struct cache *cache, char *path,
+                                  char *content_type, void *content,
+                                  off_t content_length,
+                                  struct cache_validator *validator) {
+  if (cache == NULL || path == NULL)
+    return NULL;
+
+  struct cache_entry *old = hashtable_get(cache->index, path);
+  unsigned long version = old != NULL ? old->version + 1 : 1;
+  unsigned long hits = old != NULL ? old->hits : 0;
+
+  cache_delete(cache, path);
+
+  struct cache_entry *entry =
+      cache_entry_create(cache, path, content_type, content, content_length);
+  if (entry == NULL)
+    return NULL;
+
+  entry->version = version;
+  entry->hits = hits;
+  if (validator != NULL)
+    entry->validator = *validator;
+
+  dllist_insert_head(cache, entry);
+  hashtable_put(cache->index, path, entry);
+  ++(cache->cur_size);
+  cache->bytes += content_length;
+
+  cache_evict(cache);
+
+  return entry;
+}
+
+/**
+ * Describe the file st was taken from
+ */
+void cache_validator_set(struct cache_validator *validator, struct stat *st) {
+  memset(validator, 0, sizeof *validator);
+  validator->dev = st->st_dev;
+  validator->ino = st->st_ino;
+  validator->size = st->st_size;
+  validator->mtime = st->st_mtim;
+}
+
+/**
+ * A path changed on disk: drop its entry, in RAM or the warm tier, unless
+ * it already matches
+ *
+ * validator describes the file there now, or is NULL if there is none.
+ * Returns 1 if an entry was removed, 0 otherwise.
+ */
+int cache_revalidate(struct cache *cache, char *path,
+                     struct cache_validator *validator) {
+  if (cache == NULL || path == NULL)
+    return 0;
+
+  struct cache_entry *entry = hashtable_get(cache->index, path);
+  struct tier_item *item = entry == NULL ? tier_get(cache->tier, path) : NULL;
+  struct cache_validator *cached = entry != NULL  ? &entry->validator
+                                   : item != NULL ? &item->validator
+                                                  : NULL;
+
+  if (cached != NULL && validator != NULL && cached->ino != 0 &&
+      cached->dev == validator->dev && cached->ino == validator->ino &&
+      cached->size == validator->size &&
+      cached->mtime.tv_sec == validator->mtime.tv_sec &&
+      cached->mtime.tv_nsec == validator->mtime.tv_nsec)
+    return 0;
+
+  return cache_delete(cache, path);
 }
 
 /**
@@ -202,9 +748,172 @@ struct cache_entry *cache_get(struct cache *cache, char *path) {
   if (cache == NULL || path == NULL)
     return NULL;
 
-  struct cache_entry *entry = hashtable_get(cache->index, path);
-  if (entry == NULL)
+  struct cache_entry *entry = cache_lookup(cache, path);
+  if (entry == NULL && cache->tier != NULL)
+    entry = cache_promote(cache, path);
+  if (entry == NULL && cache->shared != NULL)
+    entry = cache_adopt(cache, path);
+  if (entry == NULL) {
+    ++(cache->misses);
     return entry;
-  dllist_move_to_head(cache, entry);
+  }
+  ++(cache->hits);
+  ++(entry->hits);
+  if (cache->clock)
+    entry->referenced = 1;
+  else
+    dllist_move_to_head(cache, entry);
   return entry;
 }
+
+/**
+ * The cache key for the block of path at offset
+ *
+ * '#' can't reach us in a request path: browsers keep fragments to
+ * themselves. Returns -1 if it doesn't fit in size.
+ */
+int cache_block_key(char *key, size_t size, char *path, off_t offset) {
+  int n = snprintf(key, size, "%s#%lld", path, (long long)offset);
+
+  return n >= 0 && (size_t)n < size ? 0 : -1;
+}
+
+/**
+ * Store one block of a file too big to cache whole
+ *
+ * Blocks are ordinary entries under their own keys, so the hot ranges of a
+ * large file stay cached by LRU like anything else, and go with the file's
+ * path when it's deleted. Returns the entry now cached, or NULL.
+ */
+struct cache_entry *cache_put_block(struct cache *cache, char *path,
+                                    off_t offset, char *content_type,
+                                    void *content, off_t content_length) {
+  char key[4200];
+
+  if (cache == NULL || path == NULL ||
+      cache_block_key(key, sizeof key, path, offset) == -1)
+    return NULL;
+
+  struct cache_entry *entry = cache_lookup(cache, key);
+  if (entry != NULL) {
+    dllist_move_to_head(cache, entry);
+    return entry;
+  }
+
+  entry = cache_put(cache, key, content_type, content, content_length);
+  if (entry != NULL) {
+    entry->block = 1;
+    cache->blocks++;
+  }
+
+  return entry;
+}
+
+/**
+ * Retrieve the block of path at offset
+ */
+struct cache_entry *cache_get_block(struct cache *cache, char *path,
+                                    off_t offset) {
+  char key[4200];
+
+  if (cache == NULL || path == NULL ||
+      (cache->blocks == 0 && cache->shared == NULL &&
+       (cache->tier == NULL || cache->tier->blocks == 0)) ||
+      cache_block_key(key, sizeof key, path, offset) == -1)
+    return NULL;
+
+  return cache_get(cache, key);
+}
+
+/**
+ * Remove an entry from the cache and deallocate it
+ *
+ * Any blocks cached for the path go too. Returns 1 if the path was cached,
+ * 0 otherwise.
+ */
+int cache_delete(struct cache *cache, char *path) {
+  if (cache == NULL || path == NULL)
+    return 0;
+
+  // Even when nothing is cached: a load in flight may now be stale
+  ++(cache->invalidations);
+  cache_forget_missing(cache, path);
+
+  struct cache_flight *flight = cache_flight_find(cache, path);
+  if (flight != NULL)
+    cache_flight_detach(cache, flight);
+
+  if (cache->blocks > 0) {
+    size_t path_len = strlen(path);
+
+    for (struct cache_entry *e = cache->head; e != NULL;) {
+      struct cache_entry *next = e->next;
+
+      if (e->block && strncmp(e->path, path, path_len) == 0 &&
+          e->path[path_len] == '#')
+        cache_remove(cache, e);
+
+      e = next;
+    }
+  }
+
+  tier_delete_blocks(cache->tier, path);
+  shcache_delete_blocks(cache->shared, path);
+  int removed = tier_delete(cache->tier, path);
+  removed |= shcache_delete(cache->shared, path);
+
+  struct cache_entry *entry = hashtable_get(cache->index, path);
+  if (entry == NULL)
+    return removed;
+
+  cache_remove(cache, entry);
+
+  return 1;
+}
+
+/**
+ * Remove every entry whose path begins with prefix
+ *
+ * Used when a whole directory is renamed or deleted. Returns the number of
+ * entries removed.
+ */
+int cache_delete_prefix(struct cache *cache, char *prefix) {
+  if (cache == NULL || prefix == NULL)
+    return 0;
+
+  size_t prefix_len = strlen(prefix);
+  struct cache_entry *cur_entry = cache->head;
+  int removed = 0;
+
+  ++(cache->invalidations);
+
+  for (struct cache_flight *f = cache->flights_head; f != NULL; f = f->next)
+    if (strncmp(f->path, prefix, prefix_len) == 0)
+      cache_flight_detach(cache, f);
+
+  for (struct cache_missing *m = cache->missing_head; m != NULL;) {
+    struct cache_missing *next = m->next;
+
+    if (strncmp(m->path, prefix, prefix_len) == 0)
+      cache_missing_remove(cache, m);
+
+    m = next;
+  }
+
+  removed += tier_delete_prefix(cache->tier, prefix);
+  int shared = shcache_delete_prefix(cache->shared, prefix);
+
+  while (cur_entry != NULL) {
+    struct cache_entry *next_entry = cur_entry->next;
+
+    if (strncmp(cur_entry->path, prefix, prefix_len) == 0) {
+      cache_remove(cache, cur_entry);
+      removed++;
+    }
+
+    cur_entry = next_entry;
+  }
+
+  // Our entries are the shared ones we'd indexed, not more besides
+  return removed > shared ? removed : shared;
+}
@@ -1,32 +1,157 @@
 #ifndef _WEBCACHE_H_
 #define _WEBCACHE_H_
 
+#include <sys/types.h>
+#include <time.h>
+
+struct shcache;
+struct shcache_entry;
+struct stat;
+struct tier;
+struct tier_item;
+
+#define CACHE_MISSING_MAX 1024 // default bound on remembered missing paths
+
+// Which file on disk an entry's content matches; all zero if unknown
+struct cache_validator {
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+};
+
 // Individual hash table entry
+//
+// An entry's content never changes once it's in the cache: new content for
+// a path goes in as a new version, and responses still sending the old one
+// keep it alive through refs.
 struct cache_entry {
   char *path; // Endpoint path--key to the cache
   char *content_type;
-  int content_length;
+  off_t content_length;
   void *content;
-  int dirty;
+  unsigned long version; // 1, plus one per cache_replace() of the path
+  int block;             // a block of a larger file: see cache_put_block()
+  struct cache_validator validator;
+  unsigned long hits; // cache_get() lookups it answered: its popularity
+  int referenced;     // hit since the CLOCK hand last passed
+  int refs; // One for the cache, one per response still sending it
+
+  // With a shared cache, content is the copy in the segment, held by a
+  // reference to its entry there; otherwise both are NULL
+  struct shcache *shared;
+  struct shcache_entry *shared_entry;
 
   struct cache_entry *prev, *next; // Doubly-linked list
 };
 
+// A path recently found not to exist
+struct cache_missing {
+  char *path;
+  struct cache_missing *prev, *next; // Doubly-linked list
+};
+
+// A requester waiting on a load in flight
+struct cache_waiter {
+  // Called with the loaded entry, or NULL if the load has none to share (it
+  // failed, or the file is too big to cache): the waiter looks again. The
+  // entry is only good for the call unless retained.
+  void (*done)(struct cache_waiter *waiter, struct cache_entry *entry);
+  struct cache_waiter *next;
+};
+
+// A load in flight for a path
+//
+// The first miss for a path starts one and does the load; later misses
+// wait on it and are all answered from the one entry it produces.
+struct cache_flight {
+  char *path;
+  struct cache_waiter *waiters, *last_waiter;
+  struct cache_flight *prev, *next; // Doubly-linked list
+};
+
 // A cache
 struct cache {
   struct hashtable *index;
   struct cache_entry *head, *tail; // Doubly-linked list
   int max_size;                    // Maxiumum number of entries
   int cur_size;                    // Current number of entries
+  int blocks;                      // ...of which blocks of larger files
+  int clock; // evict by CLOCK: a hit sets entry->referenced, not move it
+  unsigned long invalidations;     // Bumped by every cache_delete*() call
+
+  // Negative entries, so repeated lookups of a missing path skip the disk.
+  // Only sound while something calls cache_delete*() or cache_revalidate()
+  // for every file that appears; 0 missing_max turns them off.
+  struct hashtable *missing;
+  struct cache_missing *missing_head, *missing_tail;
+  int missing_max;
+  int missing_count;
+
+  // Loads in flight, by path; a path invalidated meanwhile is dropped from
+  // here, so later misses start a fresh load
+  struct hashtable *flights;
+  struct cache_flight *flights_head;
+
+  // Warm tier on local disk that evictions are demoted to, or NULL; owned
+  // by whoever attached it
+  struct tier *tier;
+
+  // Cache shared with other worker processes, or NULL; owned by whoever
+  // attached it. Entries then only index content kept there, so each file
+  // is in memory once however many workers hold it.
+  struct shcache *shared;
+
+  // Statistics
+  unsigned long hits, misses; // cache_get() lookups
+  unsigned long evictions;    // entries pushed out by LRU
+  unsigned long missing_hits; // cache_is_missing() lookups that hit
+  unsigned long coalesced;    // misses that waited on a load in flight
+  unsigned long demotions;    // evictions kept in the warm tier
+  unsigned long promotions;   // hits served from the warm tier
+  long bytes;                 // content held by cached entries
 };
 
 extern struct cache_entry *alloc_entry(char *path, char *content_type,
-                                       void *content, int content_length);
+                                       void *content, off_t content_length);
 extern void free_entry(struct cache_entry *entry);
+extern void cache_entry_retain(struct cache_entry *entry);
+extern void cache_entry_release(struct cache_entry *entry);
 extern struct cache *cache_create(int max_size, int hashsize);
 extern void cache_free(struct cache *cache);
-extern void cache_put(struct cache *cache, char *path, char *content_type,
-                      void *content, int content_length);
+extern struct cache_entry *cache_put(struct cache *cache, char *path,
+                                     char *content_type, void *content,
+                                     off_t content_length);
 extern struct cache_entry *cache_get(struct cache *cache, char *path);
+extern struct tier_item *cache_promote_begin(struct cache *cache, char *path);
+extern struct cache_entry *cache_promote_finish(struct cache *cache,
+                                                struct tier_item *item,
+                                                struct cache_entry *entry);
+extern struct cache_entry *cache_put_block(struct cache *cache, char *path,
+                                           off_t offset, char *content_type,
+                                           void *content,
+                                           off_t content_length);
+extern struct cache_entry *cache_get_block(struct cache *cache, char *path,
+                                           off_t offset);
+extern int cache_delete(struct cache *cache, char *path);
+extern int cache_delete_prefix(struct cache *cache, char *prefix);
+extern struct cache_entry *cache_replace(struct cache *cache, char *path,
+                                         char *content_type, void *content,
+                                         off_t content_length,
+                                         struct cache_validator *validator);
+extern void cache_validator_set(struct cache_validator *validator,
+                                struct stat *st);
+extern int cache_revalidate(struct cache *cache, char *path,
+                            struct cache_validator *validator);
+extern void cache_put_missing(struct cache *cache, char *path);
+extern int cache_is_missing(struct cache *cache, char *path);
+extern struct cache_flight *cache_flight_find(struct cache *cache, char *path);
+extern struct cache_flight *cache_flight_start(struct cache *cache,
+                                               char *path);
+extern void cache_flight_wait(struct cache *cache, struct cache_flight *flight,
+                              struct cache_waiter *waiter);
+extern void cache_flight_finish(struct cache *cache,
+                                struct cache_flight *flight,
+                                struct cache_entry *entry);
 
 #endif
@@ -1,9 +1,15 @@
 #include "../cache.h"
 #include "../hashtable.h"
+#include "../shcache.h"
+#include "../snapshot.h"
+#include "../tier.h"
 #include "minunit.h"
 #include "utils.h"
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 char *test_cache_create() {
   int max_size = 10;
@@ -243,6 +249,652 @@ char *test_cache_get() {
   return NULL;
 }
 
+char *test_cache_delete() {
+  // Create a cache with 3 slots
+  struct cache *cache = cache_create(3, 0);
+  // Create 3 test entries, two of them under the same directory
+  struct cache_entry *test_entry_1 = alloc_entry("/a/1", "text/plain", "1", 2);
+  struct cache_entry *test_entry_2 = alloc_entry("/b/2", "text/html", "2", 2);
+  struct cache_entry *test_entry_3 =
+      alloc_entry("/a/3", "application/json", "3", 2);
+
+  cache_put(cache, test_entry_1->path, test_entry_1->content_type,
+            test_entry_1->content, test_entry_1->content_length);
+  cache_put(cache, test_entry_2->path, test_entry_2->content_type,
+            test_entry_2->content, test_entry_2->content_length);
+  cache_put(cache, test_entry_3->path, test_entry_3->content_type,
+            test_entry_3->content, test_entry_3->content_length);
+
+  // Delete the entry in the middle of the list
+  mu_assert(cache_delete(cache, test_entry_2->path) == 1,
+            "Your cache_delete function did not report removing a cached path");
+  mu_assert(cache->cur_size == 2,
+            "Your cache_delete function did not decrement the cur_size field");
+  mu_assert(cache_get(cache, test_entry_2->path) == NULL,
+            "Your cache_delete function did not remove the entry from the "
+            "hashtable");
+  mu_assert(check_cache_entries(cache->head->next, test_entry_1) == 0 &&
+                cache->head->next->prev == cache->head,
+            "Your cache_delete function did not relink the neighbours of the "
+            "removed entry");
+  mu_assert(cache_delete(cache, test_entry_2->path) == 0,
+            "Your cache_delete function reported removing an uncached path");
+
+  // Delete everything under /a/
+  mu_assert(cache_delete_prefix(cache, "/a/") == 2,
+            "Your cache_delete_prefix function did not remove every entry "
+            "under the prefix");
+  mu_assert(cache->cur_size == 0 && cache->head == NULL && cache->tail == NULL,
+            "Your cache_delete_prefix function did not leave an empty cache");
+
+  free_entry(test_entry_1);
+  free_entry(test_entry_2);
+  free_entry(test_entry_3);
+  cache_free(cache);
+
+  return NULL;
+}
+
+char *test_cache_replace() {
+  // Create a cache with 2 slots
+  struct cache *cache = cache_create(2, 0);
+  struct cache_validator validator;
+
+  memset(&validator, 0, sizeof validator);
+  validator.dev = 1;
+  validator.ino = 42;
+  validator.size = 4;
+
+  cache_put(cache, "/1", "text/plain", "old", 4);
+  cache_put(cache, "/2", "text/plain", "two", 4);
+
+  // A response still sending the first version holds on to it
+  struct cache_entry *old = cache_get(cache, "/1");
+  cache_entry_retain(old);
+
+  struct cache_entry *new =
+      cache_replace(cache, "/1", "text/plain", "new", 4, &validator);
+  mu_assert(new != NULL && cache_get(cache, "/1") == new,
+            "Your cache_replace function did not install the new content");
+  mu_assert(new->version == old->version + 1,
+            "Your cache_replace function did not bump the version");
+  mu_assert(cache->cur_size == 2 && cache->head == new,
+            "Your cache_replace function did not put the new version at the "
+            "head in place of the old one");
+  mu_assert(check_strings(old->content, "old") == 0,
+            "Your cache_replace function changed content a reader still held");
+  cache_entry_release(old);
+
+  // The file it was written to shows up on disk: keep it
+  mu_assert(cache_revalidate(cache, "/1", &validator) == 0 &&
+                cache_get(cache, "/1") == new,
+            "Your cache_revalidate function dropped an entry that matches");
+
+  // Someone else changed it: drop it
+  validator.size = 5;
+  mu_assert(cache_revalidate(cache, "/1", &validator) == 1 &&
+                cache_get(cache, "/1") == NULL,
+            "Your cache_revalidate function kept an entry that doesn't match");
+
+  // Entries without a validator never match
+  mu_assert(cache_revalidate(cache, "/2", &validator) == 1,
+            "Your cache_revalidate function kept an entry without a "
+            "validator");
+
+  cache_free(cache);
+
+  return NULL;
+}
+
+char *test_cache_missing() {
+  struct cache *cache = cache_create(2, 0);
+  struct cache_validator validator;
+
+  memset(&validator, 0, sizeof validator);
+  cache->missing_max = 2;
+
+  cache_put_missing(cache, "/a/1");
+  cache_put_missing(cache, "/a/2");
+  mu_assert(cache_is_missing(cache, "/a/1") && cache_is_missing(cache, "/a/2"),
+            "Your cache_is_missing function forgot a missing path");
+  mu_assert(!cache_is_missing(cache, "/b/3"),
+            "Your cache_is_missing function reported a path never missed");
+
+  // /a/2 was looked up last, so /a/1 is the one to go
+  cache_is_missing(cache, "/a/2");
+  cache_put_missing(cache, "/b/3");
+  mu_assert(cache->missing_count == 2 && !cache_is_missing(cache, "/a/1") &&
+                cache_is_missing(cache, "/a/2"),
+            "Your cache_put_missing function did not evict the least recently "
+            "used missing path");
+
+  // Files appearing on disk clear them
+  cache_delete(cache, "/b/3");
+  mu_assert(!cache_is_missing(cache, "/b/3"),
+            "Your cache_delete function left a path marked missing");
+  cache_put_missing(cache, "/b/3");
+  cache_revalidate(cache, "/b/3", &validator);
+  mu_assert(!cache_is_missing(cache, "/b/3"),
+            "Your cache_revalidate function left a path marked missing");
+  cache_put_missing(cache, "/b/3");
+  cache_put(cache, "/b/3", "text/plain", "3", 2);
+  mu_assert(!cache_is_missing(cache, "/b/3"),
+            "Your cache_put function left a path marked missing");
+  cache_put_missing(cache, "/b/4");
+  mu_assert(cache_delete_prefix(cache, "/a/") == 0 &&
+                !cache_is_missing(cache, "/a/2") &&
+                cache_is_missing(cache, "/b/4"),
+            "Your cache_delete_prefix function did not clear missing paths "
+            "under the prefix alone");
+
+  // Turned off, nothing is remembered
+  cache->missing_max = 0;
+  cache_put_missing(cache, "/c/5");
+  mu_assert(!cache_is_missing(cache, "/c/5"),
+            "Your cache_put_missing function remembered a path while off");
+
+  cache_free(cache);
+
+  return NULL;
+}
+
+// A waiter that records what its load produced
+struct test_waiter {
+  struct cache_waiter waiter; // must be first
+  struct cache_entry *entry;
+  int calls;
+};
+
+void test_waiter_done(struct cache_waiter *waiter, struct cache_entry *entry) {
+  struct test_waiter *tw = (struct test_waiter *)waiter;
+
+  tw->entry = entry;
+  tw->calls++;
+}
+
+char *test_cache_flight() {
+  struct cache *cache = cache_create(2, 0);
+  struct test_waiter w1 = {{test_waiter_done, NULL}, NULL, 0};
+  struct test_waiter w2 = {{test_waiter_done, NULL}, NULL, 0};
+  struct test_waiter w3 = {{test_waiter_done, NULL}, NULL, 0};
+
+  mu_assert(cache_flight_find(cache, "/1") == NULL,
+            "Your cache_flight_find function found a load never started");
+
+  // Misses after the first wait on its load
+  struct cache_flight *flight = cache_flight_start(cache, "/1");
+  mu_assert(cache_flight_find(cache, "/1") == flight,
+            "Your cache_flight_find function did not find a load in flight");
+  cache_flight_wait(cache, flight, &w1.waiter);
+  cache_flight_wait(cache, flight, &w2.waiter);
+
+  // and all get the one entry it produces
+  struct cache_entry *entry = cache_put(cache, "/1", "text/plain", "1", 2);
+  mu_assert(entry != NULL && cache_get(cache, "/1") == entry,
+            "Your cache_put function did not return the entry it cached");
+  cache_flight_finish(cache, flight, entry);
+  mu_assert(w1.calls == 1 && w1.entry == entry && w2.calls == 1 &&
+                w2.entry == entry,
+            "Your cache_flight_finish function did not answer every waiter "
+            "with the loaded entry");
+  mu_assert(cache->coalesced == 2 && cache_flight_find(cache, "/1") == NULL,
+            "Your cache_flight_finish function left the load in flight");
+
+  // Once the path is invalidated, misses start a fresh load; the old one
+  // still answers whoever was already waiting
+  flight = cache_flight_start(cache, "/2");
+  cache_flight_wait(cache, flight, &w3.waiter);
+  cache_delete(cache, "/2");
+  mu_assert(cache_flight_find(cache, "/2") == NULL,
+            "Your cache_delete function left a stale load taking waiters");
+  struct cache_flight *fresh = cache_flight_start(cache, "/2");
+  cache_flight_finish(cache, flight, NULL);
+  mu_assert(w3.calls == 1 && w3.entry == NULL &&
+                cache_flight_find(cache, "/2") == fresh,
+            "Your cache_flight_finish function disturbed the fresh load");
+
+  // Loads still in flight at the end are freed with the cache
+  cache_flight_start(cache, "/3/a");
+  cache_delete_prefix(cache, "/3/");
+  mu_assert(cache_flight_find(cache, "/3/a") == NULL,
+            "Your cache_delete_prefix function left a stale load taking "
+            "waiters");
+
+  cache_free(cache);
+
+  return NULL;
+}
+
+char *test_cache_block() {
+  struct cache *cache = cache_create(4, 0);
+
+  mu_assert(cache_get_block(cache, "/big", 0) == NULL,
+            "Your cache_get_block function found a block never cached");
+
+  struct cache_entry *b0 = cache_put_block(cache, "/big", 0, "video/mp4",
+                                           "0123", 4);
+  struct cache_entry *b1 = cache_put_block(cache, "/big", 4, "video/mp4",
+                                           "4567", 4);
+  cache_put(cache, "/big2", "text/plain", "2", 2);
+  mu_assert(b0 != NULL && b1 != NULL && b0 != b1 && cache->blocks == 2,
+            "Your cache_put_block function did not cache each block");
+  mu_assert(cache_get_block(cache, "/big", 0) == b0 &&
+                cache_get_block(cache, "/big", 4) == b1 &&
+                cache_get_block(cache, "/big", 8) == NULL,
+            "Your cache_get_block function did not find blocks by offset");
+  mu_assert(cache_get(cache, "/big") == NULL,
+            "Your cache_put_block function cached the whole path");
+
+  // Blocks go with their file, and only theirs
+  mu_assert(cache_delete(cache, "/big") == 0,
+            "Your cache_delete function counted blocks as the path itself");
+  mu_assert(cache_get_block(cache, "/big", 0) == NULL &&
+                cache_get_block(cache, "/big", 4) == NULL &&
+                cache->blocks == 0 && cache->cur_size == 1 &&
+                cache_get(cache, "/big2") != NULL,
+            "Your cache_delete function did not drop the path's blocks alone");
+
+  cache_free(cache);
+
+  return NULL;
+}
+
+char *test_cache_tier() {
+  char tier_file[] = "/tmp/cache_tests_tier_XXXXXX";
+  int fd = mkstemp(tier_file);
+  struct tier *tier = tier_open(tier_file, 2 * TIER_PAGE_SIZE + 1);
+  struct cache *cache = cache_create(2, 0);
+  struct cache_validator validator;
+
+  close(fd);
+  unlink(tier_file);
+  mu_assert(tier != NULL && tier->capacity == 2 * TIER_PAGE_SIZE,
+            "Your tier_open function did not map the cache file");
+  cache->tier = tier;
+
+  // Evictions from RAM are demoted, not lost
+  cache_put(cache, "/1", "text/plain", "1", 2);
+  cache_put(cache, "/2", "text/html", "2", 2);
+  cache_put(cache, "/3", "application/json", "3", 2);
+  mu_assert(cache->cur_size == 2 && cache->demotions == 1 &&
+                tier_get(tier, "/1") != NULL,
+            "Your cache_evict function did not demote to the warm tier");
+
+  // and a hit there is promoted, demoting the next one down
+  struct cache_entry *entry = cache_get(cache, "/1");
+  mu_assert(entry != NULL && strcmp(entry->content, "1") == 0 &&
+                strcmp(entry->content_type, "text/plain") == 0 &&
+                cache->head == entry && cache->promotions == 1 &&
+                cache->hits == 1 && cache->misses == 0,
+            "Your cache_get function did not promote from the warm tier");
+  mu_assert(tier_get(tier, "/1") == NULL && tier_get(tier, "/2") != NULL &&
+                tier->count == 1,
+            "Your cache_promote function left the entry in two tiers");
+
+  // Revalidation and deletion reach the tier too
+  memset(&validator, 0, sizeof validator);
+  validator.ino = 1;
+  tier_get(tier, "/2")->validator = validator;
+  mu_assert(cache_revalidate(cache, "/2", &validator) == 0 &&
+                tier_get(tier, "/2") != NULL,
+            "Your cache_revalidate function dropped a demoted entry that "
+            "matches");
+  validator.size = 1;
+  mu_assert(cache_revalidate(cache, "/2", &validator) == 1 &&
+                tier_get(tier, "/2") == NULL,
+            "Your cache_revalidate function kept a demoted entry that "
+            "doesn't match");
+  cache_put(cache, "/a/4", "text/plain", "4", 2);
+  cache_put(cache, "/a/5", "text/plain", "5", 2);
+  mu_assert(tier->count == 2 && cache_delete_prefix(cache, "/") == 4 &&
+                tier->count == 0 && cache_get(cache, "/1") == NULL &&
+                cache_get(cache, "/3") == NULL,
+            "Your cache_delete_prefix function did not clear the warm tier");
+
+  // Once the file is handed out, a full class evicts its least recently
+  // demoted item
+  char *big = calloc(1, TIER_PAGE_SIZE + 1);
+  cache->tier = NULL;
+  cache_put(cache, "/6", "text/plain", big, TIER_PAGE_SIZE);
+  cache_put(cache, "/7", "text/plain", big, TIER_PAGE_SIZE);
+  mu_assert(tier_put(tier, cache_get(cache, "/6")) == 0 &&
+                tier_put(tier, cache_get(cache, "/7")) == 0 &&
+                tier_get(tier, "/6") == NULL && tier_get(tier, "/7") != NULL &&
+                tier->evictions == 1,
+            "Your tier_put function did not evict within a full class");
+  cache_put(cache, "/8", "text/plain", big, TIER_PAGE_SIZE + 1);
+  mu_assert(tier_put(tier, cache_get(cache, "/8")) == -1,
+            "Your tier_put function stored an entry bigger than a page");
+  free(big);
+
+  cache_free(cache);
+  tier_close(tier);
+
+  return NULL;
+}
+
+// The item whose copy into the tier was last started, and left to the test
+struct tier_item *copying = NULL;
+
+void test_copy_in(struct tier *tier, struct tier_item *item) {
+  (void)tier;
+
+  copying = item;
+}
+
+/**
+ * Finish the copy test_copy_in() left, as the disk pool would
+ */
+void test_copy_done(struct tier *tier) {
+  memcpy(tier_content(tier, copying), copying->source->content,
+         copying->content_length);
+  tier_copied(tier, copying);
+  copying = NULL;
+}
+
+char *test_cache_tier_copies() {
+  char tier_file[] = "/tmp/cache_tests_tier_XXXXXX";
+  int fd = mkstemp(tier_file);
+  struct tier *tier = tier_open(tier_file, TIER_PAGE_SIZE);
+  struct cache *cache = cache_create(1, 0);
+
+  close(fd);
+  unlink(tier_file);
+  cache->tier = tier;
+  tier->copy_in = test_copy_in;
+
+  // A demotion being copied in holds its entry, and isn't promoted yet
+  cache_put(cache, "/1", "text/plain", "1", 2);
+  cache_put(cache, "/2", "text/plain", "2", 2);
+  struct tier_item *item = tier_get(tier, "/1");
+  mu_assert(item != NULL && item == copying && item->busy &&
+                item->source->refs == 1,
+            "Your tier_put function did not hand the copy in off");
+  mu_assert(cache_get(cache, "/1") == NULL && tier_get(tier, "/1") == item,
+            "Your cache_get function promoted an item still being copied in");
+  test_copy_done(tier);
+  mu_assert(!item->busy, "Your tier_copied function left the item busy");
+  struct cache_entry *entry = cache_get(cache, "/1");
+  mu_assert(entry != NULL && strcmp(entry->content, "1") == 0,
+            "Your cache_get function did not promote a copied item");
+
+  // Dropped while it's copied in, it keeps its chunk until that's done
+  int nfree = tier->classes[0].nfree;
+  mu_assert(copying != NULL && cache_delete(cache, "/2") == 1 &&
+                tier->count == 0 && tier->classes[0].nfree == nfree,
+            "Your tier_remove function freed a chunk being copied into");
+  test_copy_done(tier);
+  mu_assert(tier->classes[0].nfree == nfree + 1,
+            "Your tier_copied function did not free a dropped item's chunk");
+
+  // Promoted elsewhere: the item is busy until the copy comes back
+  cache_put(cache, "/3", "text/plain", "3", 2);
+  test_copy_done(tier);
+  item = cache_promote_begin(cache, "/1");
+  mu_assert(item != NULL && item->busy && cache_get(cache, "/1") == NULL &&
+                cache_promote_begin(cache, "/1") == NULL,
+            "Your cache_promote_begin function let an item be promoted twice");
+  entry = cache_promote_finish(
+      cache, item,
+      alloc_entry(item->path, item->content_type, tier_content(tier, item),
+                  item->content_length));
+  mu_assert(entry != NULL && strcmp(entry->content, "1") == 0 &&
+                cache->head == entry && tier_get(tier, "/1") == NULL &&
+                cache->promotions == 2,
+            "Your cache_promote_finish function did not cache the copy");
+  test_copy_done(tier);
+
+  // and one invalidated meanwhile is let go
+  item = cache_promote_begin(cache, "/3");
+  mu_assert(item != NULL && cache_delete(cache, "/3") == 1 &&
+                cache_promote_finish(
+                    cache, item,
+                    alloc_entry("/3", "text/plain", "3", 2)) == NULL &&
+                hashtable_get(cache->index, "/3") == NULL,
+            "Your cache_promote_finish function cached an invalidated copy");
+
+  cache_free(cache);
+  tier_close(tier);
+
+  return NULL;
+}
+
+char *test_cache_snapshot() {
+  char dir[] = "/tmp/cache_tests_snapshot_XXXXXX";
+  char file_a[64], file_b[64], snapshot_file[64];
+  struct stat st;
+
+  mu_assert(mkdtemp(dir) != NULL, "Could not make a directory to test in");
+  snprintf(file_a, sizeof file_a, "%s/a", dir);
+  snprintf(file_b, sizeof file_b, "%s/b", dir);
+  snprintf(snapshot_file, sizeof snapshot_file, "%s/snapshot", dir);
+
+  struct cache *cache = cache_create(10, 0);
+  char *files[] = {file_a, file_b};
+  for (int i = 0; i < 2; i++) {
+    FILE *fp = fopen(files[i], "w");
+
+    // The content as read, NUL and all
+    fwrite("content", 8, 1, fp);
+    fclose(fp);
+    stat(files[i], &st);
+    cache_validator_set(&cache_put(cache, files[i], "text/plain", "content",
+                                   8)->validator,
+                        &st);
+  }
+  // Without a validator there's no telling if it's still good: not saved
+  cache_put(cache, "/unknown", "text/plain", "?", 2);
+  cache_get(cache, file_a);
+  cache_get(cache, file_a);
+
+  struct snapshot *snap = snapshot_create(snapshot_file, 0);
+  mu_assert(snapshot_save(snap, cache) == 2,
+            "Your snapshot_save function did not save the validated entries");
+  cache_free(cache);
+
+  // Restored in LRU order, with their popularity
+  cache = cache_create(10, 0);
+  struct cache_entry *entry;
+  mu_assert(snapshot_load(snap, cache) == 2 && snap->stale == 0 &&
+                (entry = hashtable_get(cache->index, file_a)) != NULL &&
+                cache->head == entry && entry->hits == 2 &&
+                strcmp(entry->content, "content") == 0 &&
+                entry->validator.ino != 0 &&
+                hashtable_get(cache->index, "/unknown") == NULL,
+            "Your snapshot_load function did not restore the saved entries");
+  cache_free(cache);
+
+  // A file changed since is left out
+  FILE *fp = fopen(file_b, "a");
+  fputs("more", fp);
+  fclose(fp);
+  cache = cache_create(10, 0);
+  mu_assert(snapshot_load(snap, cache) == 1 && snap->stale == 1 &&
+                hashtable_get(cache->index, file_b) == NULL,
+            "Your snapshot_load function restored a stale entry");
+  cache_free(cache);
+
+  // A corrupt length stops the load, even one that would wrap a sum
+  struct snapshot_record rec;
+  fp = fopen(snapshot_file, "r+");
+  fseek(fp, sizeof(struct snapshot_header), SEEK_SET);
+  mu_assert(fread(&rec, sizeof rec, 1, fp) == 1, "Could not read a record");
+  rec.content_length = UINT64_MAX - sizeof rec;
+  fseek(fp, sizeof(struct snapshot_header), SEEK_SET);
+  fwrite(&rec, sizeof rec, 1, fp);
+  fclose(fp);
+  cache = cache_create(10, 0);
+  mu_assert(snapshot_load(snap, cache) == 0 && cache->cur_size == 0,
+            "Your snapshot_load function read a record past the file");
+  cache_free(cache);
+
+  snapshot_free(snap);
+  unlink(snapshot_file);
+  unlink(file_a);
+  unlink(file_b);
+  rmdir(dir);
+
+  return NULL;
+}
+
+char *test_cache_shared() {
+  struct shcache *sh = shcache_create(2 * SHCACHE_PAGE_SIZE);
+  struct cache *a = cache_create(2, 0), *b = cache_create(2, 0);
+
+  mu_assert(sh != NULL && sh->header->npages == 2,
+            "Your shcache_create function did not map the segment");
+  a->shared = b->shared = sh;
+
+  // What one worker caches, another finds, with one copy between them
+  struct cache_entry *entry = cache_put(a, "/1", "text/plain", "one", 4);
+  struct cache_entry *other = cache_get(b, "/1");
+  mu_assert(entry != NULL && other != NULL &&
+                other->content == entry->content &&
+                strcmp(other->content, "one") == 0 &&
+                strcmp(other->content_type, "text/plain") == 0 &&
+                sh->header->count == 1 && other->shared_entry->referenced,
+            "Your cache_get function did not find an entry in the shared "
+            "cache");
+
+  // A replacement by one is seen by the other
+  cache_replace(b, "/1", "text/plain", "uno", 4, NULL);
+  entry = cache_get(a, "/1");
+  mu_assert(entry != NULL && strcmp(entry->content, "uno") == 0 &&
+                sh->header->count == 1,
+            "Your cache_get function served a shared entry replaced since");
+
+  // as is a deletion
+  mu_assert(cache_delete(a, "/1") == 1 && sh->header->count == 0 &&
+                cache_get(b, "/1") == NULL && b->cur_size == 0,
+            "Your cache_delete function did not reach the shared cache");
+
+  // A full class evicts what no worker is using, never what one is
+  char *big = calloc(1, SHCACHE_PAGE_SIZE / 2);
+  cache_put(a, "/2", "text/plain", big, SHCACHE_PAGE_SIZE / 4);
+  cache_put(b, "/3", "text/plain", big, SHCACHE_PAGE_SIZE / 4);
+  cache_delete(b, "/3");
+  cache_put(b, "/3", "text/plain", big, SHCACHE_PAGE_SIZE / 4);
+  mu_assert(sh->header->evictions == 0 && sh->header->count == 2,
+            "Your shcache_put function did not reuse a freed chunk");
+  cache_free(b);
+  b = cache_create(2, 0);
+  b->shared = sh;
+  cache_put(b, "/4", "text/plain", big, SHCACHE_PAGE_SIZE / 4);
+  mu_assert(sh->header->evictions == 1 && cache_get(a, "/2") != NULL &&
+                cache_get(b, "/3") == NULL && cache_get(b, "/4") != NULL,
+            "Your shcache_put function evicted an entry in use");
+  free(big);
+
+  // A chunk out of the index isn't reused while a lookup may be reading it
+  entry = cache_put(a, "/5", "text/plain", "five", 5);
+  uint64_t retired = (char *)entry->shared_entry - sh->map;
+  sh->header->readers[1].epoch = sh->header->epoch;
+  cache_delete(a, "/5");
+  shcache_reclaim(sh, 0);
+  mu_assert(sh->header->classes[0].limbo == retired,
+            "Your shcache_reclaim function freed a chunk a lookup may read");
+  sh->header->readers[1].epoch = 0;
+  shcache_reclaim(sh, 0);
+  mu_assert(sh->header->classes[0].limbo == 0 &&
+                sh->header->classes[0].free == retired,
+            "Your shcache_reclaim function did not free a chunk once no lookup "
+            "could read it");
+
+  cache_free(a);
+  cache_free(b);
+  mu_assert(sh->header->count == 2 &&
+                sh->header->bytes == SHCACHE_PAGE_SIZE / 2,
+            "Your cache_free function did not leave the shared cache be");
+  shcache_free(sh);
+
+  return NULL;
+}
+
+char *test_cache_shared_crash() {
+  struct shcache *sh = shcache_create(SHCACHE_PAGE_SIZE);
+  struct shcache_entry *e = shcache_put(sh, "/1", "text/plain", "one", 4);
+
+  shcache_release(sh, e);
+
+  // A worker that dies holding references leaves them in its ledger, for
+  // the one started in its slot to drop
+  pid_t pid = fork();
+  if (pid == 0) {
+    shcache_set_reader(sh, 1);
+    shcache_get(sh, "/1");
+    shcache_get(sh, "/1");
+    _exit(0);
+  }
+  waitpid(pid, NULL, 0);
+  mu_assert(e->state == (2 << 1 | 1) && sh->header->readers[1].held == 1,
+            "Your shcache_get function did not note its references");
+  shcache_set_reader(sh, 1);
+  mu_assert(e->state == 1 && sh->header->readers[1].held == 0,
+            "Your shcache_set_reader function did not drop the references "
+            "a dead worker held");
+  shcache_set_reader(sh, 0);
+
+  // One that dies holding the lock, part way through changing the lists,
+  // leaves them to be rebuilt
+  pid = fork();
+  if (pid == 0) {
+    shcache_lock(sh);
+    sh->header->classes[0].head = sh->header->classes[0].tail = 0;
+    sh->header->classes[0].free = 12345;
+    sh->header->count = 0;
+    _exit(0);
+  }
+  waitpid(pid, NULL, 0);
+  e = shcache_put(sh, "/2", "text/plain", "two", 4);
+  mu_assert(e != NULL && (char *)e - sh->map != 12345 &&
+                sh->header->count == 2 && sh->header->classes[0].count == 2 &&
+                sh->header->classes[0].tail != 0,
+            "Your shcache_lock function did not rebuild the lists after a "
+            "worker died holding it");
+  shcache_release(sh, e);
+  e = shcache_get(sh, "/1");
+  mu_assert(e != NULL && strcmp(shcache_content(e), "one") == 0,
+            "Your shcache_lock function lost an entry rebuilding the index");
+  shcache_release(sh, e);
+  mu_assert(shcache_delete(sh, "/1") == 1 && shcache_delete(sh, "/2") == 1 &&
+                sh->header->count == 0 && sh->header->classes[0].head == 0,
+            "Your shcache_delete function did not unlink a rebuilt entry");
+
+  shcache_free(sh);
+
+  return NULL;
+}
+
+char *test_cache_clock() {
+  struct cache *cache = cache_create(2, 0);
+
+  cache->clock = 1;
+  cache_put(cache, "/1", "text/plain", "1", 2);
+  cache_put(cache, "/2", "text/plain", "2", 2);
+
+  // A hit only sets a bit
+  struct cache_entry *entry = cache_get(cache, "/1");
+  mu_assert(entry != NULL && entry->referenced && cache->tail == entry,
+            "Your cache_get function moved an entry under CLOCK");
+
+  // which saves it from the next eviction, once
+  mu_assert(cache_put(cache, "/3", "text/plain", "3", 2) != NULL &&
+                cache_get(cache, "/2") == NULL && !entry->referenced &&
+                cache->tail == hashtable_get(cache->index, "/3"),
+            "Your cache_evict function did not give a hit entry a second "
+            "chance");
+  cache_put(cache, "/4", "text/plain", "4", 2);
+  cache_put(cache, "/5", "text/plain", "5", 2);
+  mu_assert(hashtable_get(cache->index, "/1") == NULL &&
+                hashtable_get(cache->index, "/3") == NULL &&
+                hashtable_get(cache->index, "/5") != NULL,
+            "Your cache_evict function gave an entry a third chance");
+
+  cache_free(cache);
+
+  return NULL;
+}
+
 char *all_tests() {
   mu_suite_start();
 
@@ -250,6 +902,17 @@ char *all_tests() {
   mu_run_test(test_cache_alloc_entry);
   mu_run_test(test_cache_put);
   mu_run_test(test_cache_get);
+  mu_run_test(test_cache_delete);
+  mu_run_test(test_cache_replace);
+  mu_run_test(test_cache_missing);
+  mu_run_test(test_cache_flight);
+  mu_run_test(test_cache_block);
+  mu_run_test(test_cache_tier);
+  mu_run_test(test_cache_tier_copies);
+  mu_run_test(test_cache_snapshot);
+  mu_run_test(test_cache_shared);
+  mu_run_test(test_cache_shared_crash);
+  mu_run_test(test_cache_clock);
 
   return NULL;
 }
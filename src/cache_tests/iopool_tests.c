@@ -0,0 +1,198 @@
+#include "../iopool.h"
+#include "minunit.h"
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Stands in for the metrics shard: jobs the pool threads stole
+int stolen_jobs = 0;
+
+void metrics_disk_job(int stolen) {
+  __atomic_add_fetch(&stolen_jobs, stolen, __ATOMIC_RELAXED);
+}
+
+struct test_job {
+  struct iopool_job job; // must be first
+  int *gate;             // if set, work waits until it's non-zero
+  int started, ran, done;
+  pthread_t done_thread;
+};
+
+void test_job_work(struct iopool_job *job) {
+  struct test_job *tj = (struct test_job *)job;
+
+  __atomic_store_n(&tj->started, 1, __ATOMIC_RELEASE);
+  while (tj->gate != NULL && !__atomic_load_n(tj->gate, __ATOMIC_ACQUIRE))
+    poll(NULL, 0, 1);
+  tj->ran++;
+}
+
+void test_job_done(struct iopool_job *job) {
+  struct test_job *tj = (struct test_job *)job;
+
+  tj->done++;
+  tj->done_thread = pthread_self();
+}
+
+void test_job_init(struct test_job *tj, int *gate) {
+  memset(tj, 0, sizeof *tj);
+  tj->job.work = test_job_work;
+  tj->job.done = test_job_done;
+  tj->gate = gate;
+}
+
+/**
+ * Complete jobs until count have been, or a second passes with none
+ */
+int test_complete(struct iopool *pool, int count) {
+  struct pollfd pfd = {pool->fd, POLLIN, 0};
+  int completed = 0;
+
+  while (completed < count && poll(&pfd, 1, 1000) > 0)
+    completed += iopool_complete(pool);
+
+  return completed;
+}
+
+char *test_iopool_ring() {
+  struct iopool_job jobs[5];
+  struct iopool_ring ring;
+
+  memset(&ring, 0, sizeof ring);
+  ring.mask = 3;
+  ring.jobs = calloc(4, sizeof *ring.jobs);
+
+  mu_assert(iopool_ring_take(&ring) == NULL,
+            "Your iopool_ring_take function took from an empty ring");
+
+  for (int i = 0; i < 4; i++)
+    mu_assert(iopool_ring_push(&ring, &jobs[i]) == 0,
+              "Your iopool_ring_push function refused a job with room left");
+  mu_assert(iopool_ring_push(&ring, &jobs[4]) == -1,
+            "Your iopool_ring_push function overfilled the ring");
+
+  // Oldest first, and the slots come round again
+  mu_assert(iopool_ring_take(&ring) == &jobs[0] &&
+                iopool_ring_take(&ring) == &jobs[1],
+            "Your iopool_ring_take function didn't take the oldest job");
+  mu_assert(iopool_ring_push(&ring, &jobs[4]) == 0,
+            "Your iopool_ring_push function didn't reuse a taken slot");
+  for (int i = 2; i < 5; i++)
+    mu_assert(iopool_ring_take(&ring) == &jobs[i],
+              "Your iopool_ring_take function lost order as the ring wrapped");
+  mu_assert(iopool_ring_take(&ring) == NULL,
+            "Your iopool_ring_take function took a job twice");
+
+  free(ring.jobs);
+
+  return NULL;
+}
+
+char *test_iopool_run() {
+  enum { NJOBS = 10000 };
+  struct iopool *pool = iopool_create(4, 64);
+  struct test_job *jobs = calloc(NJOBS, sizeof *jobs);
+  int queued = 0;
+
+  mu_assert(pool != NULL && pool->started == 4,
+            "Your iopool_create function did not start its threads");
+
+  // What doesn't fit is done inline, as the server does
+  for (int i = 0; i < NJOBS; i++) {
+    test_job_init(&jobs[i], NULL);
+    if (iopool_submit(pool, &jobs[i].job) == 0) {
+      queued++;
+    } else {
+      test_job_work(&jobs[i].job);
+      test_job_done(&jobs[i].job);
+    }
+    if (i % 16 == 0)
+      queued -= iopool_complete(pool);
+  }
+  queued -= test_complete(pool, queued);
+  mu_assert(queued == 0, "Your iopool did not finish every job it took");
+
+  for (int i = 0; i < NJOBS; i++)
+    mu_assert(jobs[i].ran == 1 && jobs[i].done == 1 &&
+                  pthread_equal(jobs[i].done_thread, pthread_self()),
+              "Your iopool did not run each job once, then done() on the "
+              "loop thread");
+
+  iopool_free(pool);
+  free(jobs);
+
+  return NULL;
+}
+
+char *test_iopool_steal() {
+  enum { NJOBS = 9 };
+  struct iopool *pool = iopool_create(2, 64);
+  struct test_job slow, jobs[NJOBS];
+  int gate = 0;
+
+  // One thread is held up by the first job; the jobs dealt to its ring
+  // after it are done by the other
+  test_job_init(&slow, &gate);
+  iopool_submit(pool, &slow.job);
+  for (int i = 0; i < NJOBS; i++) {
+    test_job_init(&jobs[i], NULL);
+    mu_assert(iopool_submit(pool, &jobs[i].job) == 0,
+              "Your iopool_submit function refused a job with room left");
+  }
+
+  mu_assert(test_complete(pool, NJOBS) == NJOBS && slow.done == 0,
+            "Your iopool left jobs behind one held up");
+  mu_assert(__atomic_load_n(&stolen_jobs, __ATOMIC_RELAXED) > 0,
+            "Your iopool did not steal from the held up thread's ring");
+
+  __atomic_store_n(&gate, 1, __ATOMIC_RELEASE);
+  mu_assert(test_complete(pool, 1) == 1 && slow.done == 1,
+            "Your iopool did not finish the held up job");
+
+  iopool_free(pool);
+
+  return NULL;
+}
+
+char *test_iopool_full() {
+  struct iopool *pool = iopool_create(1, 4);
+  struct test_job slow, jobs[5];
+  int gate = 0;
+
+  // Hold the only thread, then fill its ring
+  test_job_init(&slow, &gate);
+  iopool_submit(pool, &slow.job);
+  while (!__atomic_load_n(&slow.started, __ATOMIC_ACQUIRE))
+    poll(NULL, 0, 1);
+
+  for (int i = 0; i < 4; i++) {
+    test_job_init(&jobs[i], NULL);
+    mu_assert(iopool_submit(pool, &jobs[i].job) == 0,
+              "Your iopool_submit function refused a job with room left");
+  }
+  test_job_init(&jobs[4], NULL);
+  mu_assert(iopool_submit(pool, &jobs[4].job) == -1,
+            "Your iopool_submit function queued past max_queued");
+
+  // Stopping still runs what's queued, and hands every job back
+  __atomic_store_n(&gate, 1, __ATOMIC_RELEASE);
+  iopool_free(pool);
+  mu_assert(slow.done == 1 && jobs[0].done == 1 && jobs[3].done == 1 &&
+                jobs[4].ran == 0,
+            "Your iopool_free function dropped queued jobs");
+
+  return NULL;
+}
+
+char *all_tests() {
+  mu_suite_start();
+
+  mu_run_test(test_iopool_ring);
+  mu_run_test(test_iopool_run);
+  mu_run_test(test_iopool_steal);
+  mu_run_test(test_iopool_full);
+
+  return NULL;
+}
+
+RUN_TESTS(all_tests)
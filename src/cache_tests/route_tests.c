@@ -0,0 +1,172 @@
+#include "../route.h"
+#include "minunit.h"
+#include <string.h>
+
+void test_handler(struct conn *conn, struct route_match *match) {
+  (void)conn;
+  (void)match;
+}
+
+/**
+ * The endpoint of the route for a GET of path, or -1 if none matches
+ */
+int test_find(struct router *r, const char *path, struct route_match *match) {
+  struct route *route = router_find(r, ROUTE_GET, path, match);
+
+  return route != NULL ? route->endpoint : -1;
+}
+
+/**
+ * Does the match have name set to value?
+ */
+int test_param_is(struct route_match *match, const char *name,
+                  const char *value) {
+  int length;
+  const char *found = route_param(match, name, &length);
+
+  return found != NULL && length == (int)strlen(value) &&
+         strncmp(found, value, length) == 0;
+}
+
+char *test_route_split() {
+  struct router *r = router_create();
+  struct route_match match;
+
+  // Each shorter route splits the edge the longer ones share
+  mu_assert(router_add(r, ROUTE_GET, "/static/app.js", test_handler, 1) == 0 &&
+                router_add(r, ROUTE_GET, "/static/app.css", test_handler, 2) ==
+                    0 &&
+                router_add(r, ROUTE_GET, "/stats", test_handler, 3) == 0 &&
+                router_add(r, ROUTE_GET, "/s", test_handler, 4) == 0,
+            "Your router_add function refused routes that share a prefix");
+  mu_assert(test_find(r, "/static/app.js", &match) == 1 &&
+                test_find(r, "/static/app.css", &match) == 2 &&
+                test_find(r, "/stats", &match) == 3 &&
+                test_find(r, "/s", &match) == 4,
+            "Your router_find function lost a route when an edge was split");
+  mu_assert(test_find(r, "/stat", &match) == -1 &&
+                test_find(r, "/static/app", &match) == -1 &&
+                test_find(r, "/static/app.jsx", &match) == -1,
+            "Your router_find function matched part of an edge");
+
+  router_free(r);
+
+  return NULL;
+}
+
+char *test_route_params() {
+  struct router *r = router_create();
+  struct route_match match;
+
+  router_add(r, ROUTE_GET, "/users/:id", test_handler, 1);
+  router_add(r, ROUTE_GET, "/users/me", test_handler, 2);
+  router_add(r, ROUTE_GET, "/users/:id/posts/:post", test_handler, 3);
+
+  // Static bytes are tried before the parameter
+  mu_assert(test_find(r, "/users/me", &match) == 2 && match.nparams == 0,
+            "Your router_find function preferred :id to a static segment");
+  mu_assert(test_find(r, "/users/42", &match) == 1 &&
+                test_param_is(&match, "id", "42"),
+            "Your router_find function did not match :id");
+
+  // and a static branch that fails further down falls back to it
+  mu_assert(test_find(r, "/users/me/posts/7", &match) == 3 &&
+                test_param_is(&match, "id", "me") &&
+                test_param_is(&match, "post", "7"),
+            "Your router_find function did not fall back to :id");
+
+  // A parameter matches one whole, non-empty segment
+  mu_assert(test_find(r, "/users/", &match) == -1 &&
+                test_find(r, "/users/42/posts", &match) == -1,
+            "Your router_find function matched :id to an empty or partial "
+            "path");
+
+  router_free(r);
+
+  return NULL;
+}
+
+char *test_route_wildcard() {
+  struct router *r = router_create();
+  struct route_match match;
+
+  router_add(r, ROUTE_GET, "/files/*rest", test_handler, 1);
+  router_add(r, ROUTE_GET, "/files/:name", test_handler, 2);
+  router_add(r, ROUTE_GET, "/files/index.html", test_handler, 3);
+
+  mu_assert(test_find(r, "/files/index.html", &match) == 3 &&
+                test_find(r, "/files/a.txt", &match) == 2 &&
+                test_param_is(&match, "name", "a.txt"),
+            "Your router_find function tried the wildcard too early");
+
+  // It takes whatever nothing else will, the empty rest included
+  mu_assert(test_find(r, "/files/a/b.txt", &match) == 1 &&
+                test_param_is(&match, "rest", "a/b.txt") &&
+                test_find(r, "/files/index.html/x", &match) == 1 &&
+                test_param_is(&match, "rest", "index.html/x") &&
+                test_find(r, "/files/", &match) == 1 &&
+                test_param_is(&match, "rest", ""),
+            "Your router_find function did not fall back to the wildcard");
+
+  // only for the methods it was added for
+  mu_assert(router_find(r, ROUTE_POST, "/files/a/b.txt", &match) == NULL,
+            "Your router_find function matched a wildcard for another "
+            "method");
+
+  router_free(r);
+
+  return NULL;
+}
+
+char *test_route_conflicts() {
+  struct router *r = router_create();
+  struct route_match match;
+
+  mu_assert(router_add(r, ROUTE_GET, "/a", test_handler, 1) == 0 &&
+                router_add(r, ROUTE_GET, "/a", test_handler, 2) == -1 &&
+                router_add(r, ROUTE_POST, "/a", test_handler, 3) == 0,
+            "Your router_add function took the same method and path twice");
+  mu_assert(router_add(r, ROUTE_GET, "/u/:id", test_handler, 4) == 0 &&
+                router_add(r, ROUTE_GET, "/u/:name/x", test_handler, 5) ==
+                    -1 &&
+                router_add(r, ROUTE_GET, "/w/*a", test_handler, 6) == 0 &&
+                router_add(r, ROUTE_GET, "/w/*a", test_handler, 7) == -1 &&
+                router_add(r, ROUTE_POST, "/w/*b", test_handler, 8) == -1,
+            "Your router_add function took two names for one segment");
+  mu_assert(router_add(r, ROUTE_GET, "a", test_handler, 9) == -1 &&
+                router_add(r, ROUTE_GET, "/:", test_handler, 9) == -1 &&
+                router_add(r, ROUTE_GET, "/*", test_handler, 9) == -1 &&
+                router_add(r, ROUTE_GET, "/*a/b", test_handler, 9) == -1,
+            "Your router_add function took a malformed pattern");
+
+  // Bytes past the first of a label key children too once it's split, so
+  // none may be outside the fanout
+  mu_assert(router_add(r, ROUTE_GET, "/caf\xc3\xa9", test_handler, 10) == -1 &&
+                router_add(r, ROUTE_GET, "/cafe", test_handler, 11) == 0 &&
+                router_add(r, ROUTE_GET, "/caf", test_handler, 12) == 0,
+            "Your router_add function took a byte outside ROUTE_FANOUT");
+  mu_assert(test_find(r, "/cafe", &match) == 11 &&
+                test_find(r, "/caf", &match) == 12 &&
+                test_find(r, "/caf\xc3\xa9", &match) == -1 &&
+                test_find(r, "/a", &match) == 1,
+            "Your router lost routes after refusing one");
+  mu_assert(r->count == 6,
+            "Your router_add function counted routes it refused");
+
+  router_free(r);
+
+  return NULL;
+}
+
+char *all_tests() {
+  mu_suite_start();
+
+  mu_run_test(test_route_split);
+  mu_run_test(test_route_params);
+  mu_run_test(test_route_wildcard);
+  mu_run_test(test_route_conflicts);
+
+  return NULL;
+}
+
+RUN_TESTS(all_tests)
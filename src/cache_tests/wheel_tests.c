@@ -0,0 +1,169 @@
+#include "../wheel.h"
+#include "minunit.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_TICK_MS 100
+
+struct test_timer {
+  struct wheel_timer timer;
+  int fired;
+  uint64_t fired_at;          // tick
+  int rearm;                  // times left to re-arm itself, 3 ticks on
+  struct test_timer *victim;  // disarmed when this fires, if set
+  struct test_timer *spawn;   // armed for the current tick when this fires
+};
+
+struct wheel test_wheel;
+
+void test_expired(struct wheel_timer *timer) {
+  struct test_timer *tt = WHEEL_ENTRY(timer, struct test_timer, timer);
+
+  tt->fired++;
+  tt->fired_at = test_wheel.now;
+
+  if (tt->victim != NULL)
+    wheel_del(&test_wheel, &tt->victim->timer);
+  if (tt->spawn != NULL)
+    wheel_add(&test_wheel, &tt->spawn->timer, test_wheel.now * TEST_TICK_MS);
+  if (tt->rearm-- > 0)
+    wheel_add(&test_wheel, timer, (test_wheel.now + 3) * TEST_TICK_MS);
+}
+
+void test_timer_init(struct test_timer *tt) {
+  memset(tt, 0, sizeof *tt);
+  tt->timer.expired = test_expired;
+}
+
+/**
+ * Advance the wheel a tick at a time up to tick
+ */
+void test_advance_to(uint64_t tick) {
+  for (uint64_t t = test_wheel.now + 1; t <= tick; t++)
+    wheel_advance(&test_wheel, t * TEST_TICK_MS);
+}
+
+char *test_wheel_timeout() {
+  struct test_timer tt;
+
+  wheel_init(&test_wheel, TEST_TICK_MS, 1000);
+  mu_assert(wheel_timeout(&test_wheel, 1000) == -1,
+            "Your wheel_timeout function asked an idle loop to wake");
+
+  test_timer_init(&tt);
+  wheel_add(&test_wheel, &tt.timer, 5000);
+  mu_assert(wheel_timeout(&test_wheel, 1000) == 100 &&
+                wheel_timeout(&test_wheel, 1060) == 40 &&
+                wheel_timeout(&test_wheel, 1200) == 0,
+            "Your wheel_timeout function did not wait for the next tick");
+
+  wheel_del(&test_wheel, &tt.timer);
+  wheel_del(&test_wheel, &tt.timer);
+  mu_assert(test_wheel.count == 0 && wheel_timeout(&test_wheel, 1000) == -1,
+            "Your wheel_del function left the wheel waking");
+
+  // Nothing pending: a long sleep is skipped in one step
+  mu_assert(wheel_advance(&test_wheel, 1000000) == 0 &&
+                test_wheel.now == 1000000 / TEST_TICK_MS,
+            "Your wheel_advance function did not catch up while idle");
+
+  return NULL;
+}
+
+char *test_wheel_cascade() {
+  // Due ticks either side of each level's turn, from a start that isn't
+  // aligned to any of them
+  uint64_t start = 6300 / TEST_TICK_MS;
+  uint64_t due[] = {64,   65,   127,  128,   4095,  4096,
+                    4097, 4159, 5000, 65536, 262143, 300000};
+  enum { NDUE = sizeof due / sizeof due[0] };
+  struct test_timer timers[NDUE];
+
+  wheel_init(&test_wheel, TEST_TICK_MS, start * TEST_TICK_MS);
+  for (int i = 0; i < NDUE; i++) {
+    test_timer_init(&timers[i]);
+    wheel_add(&test_wheel, &timers[i].timer, due[i] * TEST_TICK_MS);
+  }
+
+  test_advance_to(due[NDUE - 1]);
+  for (int i = 0; i < NDUE; i++)
+    mu_assert(timers[i].fired == 1 && timers[i].fired_at == due[i],
+              "Your wheel did not fire a timer on its tick after cascading");
+  mu_assert(test_wheel.count == 0,
+            "Your wheel_advance function left fired timers counted");
+
+  // Jumping straight past them all fires each on its own tick still
+  wheel_init(&test_wheel, TEST_TICK_MS, start * TEST_TICK_MS);
+  for (int i = 0; i < NDUE; i++) {
+    test_timer_init(&timers[i]);
+    wheel_add(&test_wheel, &timers[i].timer, due[i] * TEST_TICK_MS);
+  }
+  mu_assert(wheel_advance(&test_wheel, due[NDUE - 1] * TEST_TICK_MS) == NDUE,
+            "Your wheel_advance function missed timers in a long step");
+  for (int i = 0; i < NDUE; i++)
+    mu_assert(timers[i].fired_at == due[i],
+              "Your wheel_advance function fired a timer off its tick");
+
+  // A deadline in the past fires on the next tick, not this one
+  test_timer_init(&timers[0]);
+  wheel_add(&test_wheel, &timers[0].timer, 0);
+  mu_assert(wheel_advance(&test_wheel, due[NDUE - 1] * TEST_TICK_MS) == 0 &&
+                wheel_advance(&test_wheel, (due[NDUE - 1] + 1) * TEST_TICK_MS) ==
+                    1,
+            "Your wheel_add function did not push a past deadline a tick on");
+
+  return NULL;
+}
+
+char *test_wheel_callbacks() {
+  struct test_timer periodic, killer, victim, parent, child;
+
+  wheel_init(&test_wheel, TEST_TICK_MS, 0);
+  test_timer_init(&periodic);
+  test_timer_init(&killer);
+  test_timer_init(&victim);
+  test_timer_init(&parent);
+  test_timer_init(&child);
+
+  // Re-armed from its own callback
+  periodic.rearm = 2;
+  wheel_add(&test_wheel, &periodic.timer, 10 * TEST_TICK_MS);
+
+  // Disarms another due the same tick, before it fires
+  killer.victim = &victim;
+  wheel_add(&test_wheel, &killer.timer, 20 * TEST_TICK_MS);
+  wheel_add(&test_wheel, &victim.timer, 20 * TEST_TICK_MS);
+
+  // Arms another for the tick being run, which waits for the next
+  parent.spawn = &child;
+  wheel_add(&test_wheel, &parent.timer, 30 * TEST_TICK_MS);
+
+  test_advance_to(29);
+  mu_assert(periodic.fired == 3 && periodic.fired_at == 16 &&
+                periodic.timer.next == NULL,
+            "Your wheel did not re-arm a timer from its callback");
+  mu_assert(killer.fired == 1 && victim.fired == 0 && test_wheel.count == 1,
+            "Your wheel fired a timer disarmed by another's callback");
+
+  test_advance_to(30);
+  mu_assert(parent.fired == 1 && child.fired == 0 && test_wheel.count == 1,
+            "Your wheel fired a timer on the tick it was armed in");
+  test_advance_to(31);
+  mu_assert(child.fired == 1 && child.fired_at == 31 && test_wheel.count == 0 &&
+                wheel_timeout(&test_wheel, 3100) == -1,
+            "Your wheel did not fire a timer armed from a callback");
+
+  return NULL;
+}
+
+char *all_tests() {
+  mu_suite_start();
+
+  mu_run_test(test_wheel_timeout);
+  mu_run_test(test_wheel_cascade);
+  mu_run_test(test_wheel_callbacks);
+
+  return NULL;
+}
+
+RUN_TESTS(all_tests)
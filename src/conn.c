@@ -0,0 +1,641 @@
+#include "conn.h"
+#include "accesslog.h"
+#include "cache.h"
+#include "file.h"
+#include "iopool.h"
+#include "loop.h"
+#include "metrics.h"
+#include "trace.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/**
+ * Initialise a connection for a freshly accepted socket
+ *
+ * Returns 0, or -1 if the request buffer can't be allocated.
+ */
+int conn_init(struct conn *conn, int fd, struct cache *cache) {
+  memset(conn, 0, sizeof *conn);
+
+  conn->fd = fd;
+  conn->cache = cache;
+  conn->body_fd = -1;
+  conn->endpoint = METRICS_EP_OTHER;
+  conn->accepted_ns = metrics_now();
+  conn->request = malloc(CONN_REQUEST_SIZE);
+  if (conn->request == NULL)
+    return -1;
+  conn->request_size = CONN_REQUEST_SIZE;
+
+  conn->request[0] = '\0';
+  metrics_connections(+1);
+
+  TRACE_INSTANT("accept", conn);
+  TRACE_BEGIN("connection", conn);
+  TRACE_BEGIN("recv", conn);
+
+  return 0;
+}
+
+/**
+ * Release everything a connection holds except its socket and the struct
+ * itself
+ */
+void conn_release(struct conn *conn) {
+  if (conn->request == NULL)
+    return;
+
+  // The status code is the second word of the status line
+  if (conn->head_length > 0) {
+    uint64_t now = metrics_now();
+    int status = atoi(conn->head + 9);
+
+    metrics_observe(METRICS_SEND, now - conn->ready_ns);
+    metrics_request(conn->endpoint, status, conn->sent);
+    if (access_log != NULL)
+      accesslog_request(access_log, &conn->peer, conn->request, status,
+                        conn->sent, now - conn->accepted_ns);
+    TRACE_AT('b', "send_response", conn, conn->ready_ns);
+    TRACE_END("send_response", conn);
+  }
+  metrics_connections(-1);
+
+  TRACE_INSTANT("close", conn);
+  TRACE_END("connection", conn);
+
+  conn_clear_body(conn);
+  free(conn->request);
+  conn->request = NULL;
+}
+
+/**
+ * Allocate a connection
+ */
+struct conn *conn_create(int fd, struct cache *cache) {
+  struct conn *conn = malloc(sizeof *conn);
+
+  if (conn == NULL)
+    return NULL;
+
+  if (conn_init(conn, fd, cache) == -1) {
+    free(conn);
+    return NULL;
+  }
+
+  return conn;
+}
+
+/**
+ * Close the socket and free a connection from conn_create()
+ */
+void conn_free(struct conn *conn) {
+  if (conn == NULL)
+    return;
+
+  conn_release(conn);
+  if (conn->fd != -1)
+    close(conn->fd);
+  free(conn);
+}
+
+/**
+ * Length of the request headers, including the blank line after them, or 0
+ * if they haven't all arrived
+ */
+int conn_head_length(struct conn *conn) {
+  char *end = strstr(conn->request, "\r\n\r\n");
+
+  if (end != NULL)
+    return end + 4 - conn->request;
+
+  if ((end = strstr(conn->request, "\n\n")) != NULL)
+    return end + 2 - conn->request;
+
+  return 0;
+}
+
+/**
+ * Has the whole request arrived?
+ *
+ * True once the headers are complete and, if there is a Content-Length,
+ * that much body has followed; the buffer is grown to hold a body of up to
+ * CONN_BODY_MAX. Also true, with request_error set, if the request can't
+ * be read whole: 431 if the headers don't fit the buffer, 413 if the body
+ * is bigger than that.
+ */
+int conn_request_complete(struct conn *conn) {
+  int head_length = conn_head_length(conn);
+  if (head_length == 0) {
+    if (conn->request_length < conn->request_size - 1)
+      return 0;
+    conn->request_error = 431;
+    return 1;
+  }
+
+  // Look for a body length among the headers
+  char *end = conn->request + head_length - 2;
+  for (char *p = conn->request; p != NULL && p < end; p = strchr(p, '\n')) {
+    p++;
+    if (strncasecmp(p, "Content-Length:", 15) != 0)
+      continue;
+
+    long long body_length = atoll(p + 15);
+    if (body_length > CONN_BODY_MAX) {
+      conn->request_error = 413;
+      return 1;
+    }
+
+    if (conn->request_length >= head_length + body_length)
+      return 1;
+
+    // Make room for the rest, the NUL included
+    int size = head_length + body_length + 1;
+    if (size > conn->request_size) {
+      char *request = realloc(conn->request, size);
+
+      if (request == NULL) {
+        conn->request_error = 413;
+        return 1;
+      }
+      conn->request = request;
+      conn->request_size = size;
+    }
+    return 0;
+  }
+
+  return 1;
+}
+
+/**
+ * Which deadline a connection still reading its request is up against:
+ * an enum metrics_timeout
+ */
+int conn_read_stage(struct conn *conn) {
+  if (conn->request_length == 0)
+    return METRICS_TIMEOUT_IDLE;
+
+  return conn_head_length(conn) == 0 ? METRICS_TIMEOUT_HEADER
+                                     : METRICS_TIMEOUT_BODY;
+}
+
+/**
+ * Attach a response body that lives elsewhere
+ *
+ * release(arg), if given, is called once the body has been sent.
+ */
+void conn_set_body(struct conn *conn, void *body, off_t length,
+                   void (*release)(void *), void *arg) {
+  conn_clear_body(conn);
+
+  conn->body_type = CONN_BODY_MEMORY;
+  conn->body = body;
+  conn->body_length = length;
+  conn->body_release = release;
+  conn->body_release_arg = arg;
+}
+
+/**
+ * Attach a private copy of a response body
+ *
+ * Returns 0, or -1 if out of memory.
+ */
+int conn_set_body_copy(struct conn *conn, void *body, off_t length) {
+  conn_clear_body(conn);
+
+  if (body == NULL || length <= 0)
+    return 0;
+
+  void *copy = malloc(length);
+  if (copy == NULL)
+    return -1;
+
+  memcpy(copy, body, length);
+  conn_set_body(conn, copy, length, free, copy);
+
+  return 0;
+}
+
+/**
+ * Attach an open file as the response body
+ *
+ * The connection takes ownership of fd. If cache_path is given, the file is
+ * put in the cache under it once the serving loop has read it.
+ */
+void conn_set_body_file(struct conn *conn, int fd, off_t length,
+                        char *cache_path, char *content_type) {
+  conn_clear_body(conn);
+
+  conn->body_type = CONN_BODY_FILE;
+  conn->body_fd = fd;
+  conn->body_length = length;
+  conn->cache_path = cache_path != NULL ? strdup(cache_path) : NULL;
+  conn->content_type = content_type != NULL ? strdup(content_type) : NULL;
+  conn->invalidations = conn->cache != NULL ? conn->cache->invalidations : 0;
+}
+
+/**
+ * Drop the response body, releasing whatever backs it
+ */
+void conn_clear_body(struct conn *conn) {
+  if (conn->body_type == CONN_BODY_MEMORY && conn->body_release != NULL)
+    conn->body_release(conn->body_release_arg);
+
+  if (conn->body_fd != -1)
+    close(conn->body_fd);
+
+  free(conn->cache_path);
+  free(conn->content_type);
+  free(conn->block_buffer);
+  cache_entry_release(conn->block_entry);
+
+  conn->body_type = CONN_BODY_NONE;
+  conn->body = NULL;
+  conn->body_length = 0;
+  conn->body_release = NULL;
+  conn->body_release_arg = NULL;
+  conn->body_fd = -1;
+  conn->cache_path = NULL;
+  conn->content_type = NULL;
+  conn->block = conn->block_buffer = NULL;
+  conn->block_length = conn->block_sent = 0;
+  conn->block_offset = 0;
+  conn->block_entry = NULL;
+  conn->block_error = 0;
+}
+
+/**
+ * A file body has been read into memory: cache it if that was asked for,
+ * noting which file it came from
+ */
+void conn_file_loaded(struct conn *conn, void *data, off_t length) {
+  struct stat st;
+
+  if (conn->cache == NULL || conn->cache_path == NULL)
+    return;
+
+  struct cache_entry *entry = cache_put(conn->cache, conn->cache_path,
+                                       conn->content_type, data, length);
+
+  if (entry != NULL && entry->validator.ino == 0 &&
+      fstat(conn->body_fd, &st) == 0)
+    cache_validator_set(&entry->validator, &st);
+}
+
+/**
+ * Mark a connection as waiting on the disk pool
+ */
+void conn_park(struct conn *conn) { conn->parked = 1; }
+
+/**
+ * The parked work is done and a response is queued: hand the connection
+ * back to its serving loop
+ */
+void conn_resume(struct conn *conn) {
+  conn->parked = 0;
+
+  if (conn->resume != NULL)
+    conn->resume(conn);
+}
+
+/**
+ * Read the request, blocking until it's complete
+ *
+ * With timeouts, gives up on a client that misses a stage's deadline, kept
+ * as the loops keep them, by bounding each recv() with what's left.
+ * Returns the number of bytes read, or -1 on error, early EOF or timeout.
+ */
+int conn_recv_blocking(struct conn *conn, struct loop_timeouts *timeouts) {
+  int stage = -1;
+  uint64_t deadline = 0; // ms, 0 for none
+
+  while (!conn_request_complete(conn)) {
+    if (timeouts != NULL) {
+      uint64_t now = metrics_now() / 1000000;
+      int reached = conn_read_stage(conn);
+
+      // Header deadlines run from the first byte; body ones from the last
+      if (reached != stage || reached == METRICS_TIMEOUT_BODY) {
+        int ms = loop_timeout_ms(timeouts, reached);
+
+        stage = reached;
+        deadline = ms > 0 ? now + ms : 0;
+      }
+
+      if (deadline != 0 && now >= deadline) {
+        metrics_timeout(stage);
+        return -1;
+      }
+
+      uint64_t left = deadline != 0 ? deadline - now : 0;
+      struct timeval tv = {left / 1000, (left % 1000) * 1000};
+      setsockopt(conn->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+    }
+
+    int n = recv(conn->fd, conn->request + conn->request_length,
+                 conn->request_size - 1 - conn->request_length, 0);
+
+    if (n == -1 && errno == EINTR)
+      continue;
+
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      // The deadline passed while we waited
+      metrics_timeout(stage);
+      return -1;
+    }
+
+    if (n < 0) {
+      perror("recv");
+      return -1;
+    }
+
+    if (n == 0)
+      return conn->request_length > 0 ? conn->request_length : -1;
+
+    conn->request_length += n;
+    conn->request[conn->request_length] = '\0';
+  }
+
+  return conn->request_length;
+}
+
+/**
+ * Read a file body into memory so it can be sent like any other
+ */
+int conn_load_file_body(struct conn *conn) {
+  off_t length = conn->body_length, done = 0;
+  uint64_t start = metrics_now();
+  char *data = malloc(length > 0 ? length : 1);
+
+  if (data == NULL)
+    return -1;
+
+  while (done < length) {
+    ssize_t n = pread(conn->body_fd, data + done, length - done, done);
+
+    if (n == -1 && errno == EINTR)
+      continue;
+
+    if (n <= 0) {
+      perror("pread");
+      free(data);
+      return -1;
+    }
+
+    done += n;
+  }
+
+  metrics_observe(METRICS_DISK_LOAD, metrics_now() - start);
+  TRACE_AT('b', "file_load", conn, start);
+  TRACE_END("file_load", conn);
+
+  conn_file_loaded(conn, data, length);
+  conn_set_body(conn, data, length, free, data);
+
+  return 0;
+}
+
+/**
+ * Whether the body is a file too big to load whole, sent a block at a time
+ */
+int conn_body_streams(struct conn *conn) {
+  return conn->body_type == CONN_BODY_FILE &&
+         conn->body_length > FILE_STREAM_MIN;
+}
+
+/**
+ * Whether blocks of the body may go in and out of the cache: only if asked
+ * for, and nothing has been invalidated since the file was opened
+ */
+int conn_caches_blocks(struct conn *conn) {
+  return conn->cache != NULL && conn->cache_path != NULL &&
+         conn->cache->invalidations == conn->invalidations;
+}
+
+/**
+ * Move a streaming body on to its next block, once the last has gone
+ *
+ * Returns 1 if it's ready (the cache had it, or the body is done), or 0 if
+ * it has to be read with conn_read_block() or conn_read_block_async().
+ */
+int conn_next_block(struct conn *conn) {
+  cache_entry_release(conn->block_entry);
+  conn->block_entry = NULL;
+  conn->block_offset += conn->block_length;
+  conn->block = NULL;
+  conn->block_length = conn->block_sent = 0;
+
+  off_t left = conn->body_length - conn->block_offset;
+  if (left <= 0)
+    return 1;
+
+  struct cache_entry *entry =
+      conn_caches_blocks(conn)
+          ? cache_get_block(conn->cache, conn->cache_path, conn->block_offset)
+          : NULL;
+  if (entry == NULL)
+    return 0;
+
+  cache_entry_retain(entry);
+  conn->block_entry = entry;
+  conn->block = entry->content;
+  conn->block_length =
+      entry->content_length < left ? entry->content_length : left;
+
+  return 1;
+}
+
+/**
+ * Read the block at block_offset into block_buffer
+ *
+ * Returns the number of bytes read; 0 if the file shrank under us.
+ */
+ssize_t conn_pread_block(struct conn *conn) {
+  off_t left = conn->body_length - conn->block_offset;
+  size_t want = left < CONN_BLOCK_SIZE ? left : CONN_BLOCK_SIZE;
+  ssize_t n;
+
+  do
+    n = pread(conn->body_fd, conn->block_buffer, want, conn->block_offset);
+  while (n == -1 && errno == EINTR);
+
+  return n;
+}
+
+/**
+ * A block has been read into block_buffer: send it, and cache it if asked
+ */
+void conn_block_read(struct conn *conn, size_t length) {
+  conn->block = conn->block_buffer;
+  conn->block_length = length;
+  conn->block_sent = 0;
+
+  if (conn_caches_blocks(conn))
+    cache_put_block(conn->cache, conn->cache_path, conn->block_offset,
+                    conn->content_type, conn->block, length);
+}
+
+/**
+ * Read the next block of a streaming body, blocking
+ *
+ * Returns 0, or -1 on error or if the file shrank: the promised
+ * Content-Length can't be met.
+ */
+int conn_read_block(struct conn *conn) {
+  if (conn->block_buffer == NULL &&
+      (conn->block_buffer = malloc(CONN_BLOCK_SIZE)) == NULL)
+    return -1;
+
+  ssize_t n = conn_pread_block(conn);
+  if (n <= 0) {
+    if (n == -1)
+      perror("pread");
+    return -1;
+  }
+
+  conn_block_read(conn, n);
+  return 0;
+}
+
+// A block of a streaming body read on the disk pool
+struct conn_block_job {
+  struct iopool_job job; // must be first
+  struct conn *conn;
+  ssize_t n;
+  int error; // errno, if n is -1
+};
+
+/**
+ * Pool thread: read the block
+ */
+void conn_block_job_work(struct iopool_job *job) {
+  struct conn_block_job *bj = (struct conn_block_job *)job;
+
+  bj->n = conn_pread_block(bj->conn);
+  bj->error = bj->n == -1 ? errno : 0;
+}
+
+/**
+ * Loop thread: hand the connection back with its block, or with
+ * block_error set
+ */
+void conn_block_job_done(struct iopool_job *job) {
+  struct conn_block_job *bj = (struct conn_block_job *)job;
+  struct conn *conn = bj->conn;
+
+  if (bj->n > 0)
+    conn_block_read(conn, bj->n);
+  else
+    conn->block_error = bj->n == 0 ? EIO : bj->error;
+
+  free(bj);
+  conn_resume(conn);
+}
+
+/**
+ * Read the next block of a streaming body on the disk pool, parking the
+ * connection until it's in
+ *
+ * Returns 0, or -1 if the pool is full and the caller should read inline.
+ */
+int conn_read_block_async(struct conn *conn) {
+  if (conn->block_buffer == NULL &&
+      (conn->block_buffer = malloc(CONN_BLOCK_SIZE)) == NULL)
+    return -1;
+
+  struct conn_block_job *bj = malloc(sizeof *bj);
+  if (bj == NULL)
+    return -1;
+
+  bj->job.work = conn_block_job_work;
+  bj->job.done = conn_block_job_done;
+  bj->conn = conn;
+
+  if (iopool_submit(conn->pool, &bj->job) == -1) {
+    free(bj);
+    return -1;
+  }
+
+  conn_park(conn);
+  return 0;
+}
+
+/**
+ * Send the queued response, blocking until it's all gone
+ *
+ * Returns 0, or -1 on error.
+ */
+int conn_send_blocking(struct conn *conn) {
+  int streams = conn_body_streams(conn);
+  off_t head_sent = 0, body_sent = 0;
+
+  if (conn->body_type == CONN_BODY_FILE && !streams &&
+      conn_load_file_body(conn) == -1)
+    return -1;
+
+  off_t body_length = conn->body_type == CONN_BODY_MEMORY ? conn->body_length
+                                                          : 0;
+
+  for (;;) {
+    struct iovec iov[2];
+    struct msghdr msg;
+
+    // A streaming body's next block, once the last has gone
+    if (streams && conn->block_sent == conn->block_length &&
+        !conn_next_block(conn) && conn_read_block(conn) == -1)
+      return -1;
+
+    iov[0].iov_base = conn->head + head_sent;
+    iov[0].iov_len = conn->head_length - head_sent;
+    if (streams) {
+      iov[1].iov_base = conn->block + conn->block_sent;
+      iov[1].iov_len = conn->block_length - conn->block_sent;
+    } else {
+      iov[1].iov_base = (char *)conn->body + body_sent;
+      iov[1].iov_len = body_length - body_sent;
+    }
+
+    if (iov[0].iov_len + iov[1].iov_len == 0)
+      break;
+
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    ssize_t n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+
+    if (n == -1 && errno == EINTR)
+      continue;
+
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      // The socket's send timeout ran out
+      metrics_timeout(METRICS_TIMEOUT_WRITE);
+      return -1;
+    }
+
+    if (n < 0) {
+      if (errno != EPIPE && errno != ECONNRESET)
+        perror("send");
+      return -1;
+    }
+
+    conn->sent += n;
+
+    // Step over what went out: head first, then body
+    size_t step = (size_t)n < iov[0].iov_len ? (size_t)n : iov[0].iov_len;
+    head_sent += step;
+    if (streams)
+      conn->block_sent += n - step;
+    else
+      body_sent += n - step;
+  }
+
+  return 0;
+}
@@ -0,0 +1,104 @@
+#ifndef _CONN_H_
+#define _CONN_H_
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#define CONN_REQUEST_SIZE 65536 // 64K, to start with; the headers must fit
+#define CONN_BODY_MAX (16 * 1024 * 1024) // the buffer grows to hold this much
+#define CONN_HEAD_SIZE 1024
+#define CONN_BLOCK_SIZE (256 * 1024) // streaming file bodies go this at a time
+
+struct cache;
+struct cache_entry;
+struct iopool;
+struct loop_timeouts;
+
+// Where a response body comes from
+enum conn_body_type {
+  CONN_BODY_NONE,
+  CONN_BODY_MEMORY, // body, released with body_release() once sent
+  CONN_BODY_FILE,   // body_fd, read from offset 0; streamed a block at a
+                    // time if over FILE_STREAM_MIN
+};
+
+// A client connection and the response queued on it
+//
+// Handlers only fill in the response; the serving loop moves the bytes.
+struct conn {
+  int fd;
+  struct sockaddr_storage peer; // client address, if the loop recorded it
+  struct cache *cache;
+  struct iopool *pool; // disk I/O pool, or NULL to do file I/O inline
+
+  // A handler that hands work to the pool parks the connection; the job
+  // queues the response and calls conn_resume(), which calls back into the
+  // serving loop
+  int parked;
+  void (*resume)(struct conn *conn);
+
+  char *request; // NUL-terminated
+  int request_length;
+  int request_size; // allocated
+  int request_error; // status to answer with if the request can't be read
+                     // whole (413 or 431), else 0
+
+  char head[CONN_HEAD_SIZE]; // status line and headers
+  int head_length;
+
+  int body_type;
+  void *body;
+  off_t body_length;
+  void (*body_release)(void *arg);
+  void *body_release_arg;
+
+  int body_fd;
+  char *cache_path;   // cache a file body (or its blocks) under this path
+  char *content_type; // ...with this type
+  unsigned long invalidations; // cache->invalidations when the file was set
+
+  // A streaming file body goes out through one block at a time:
+  // block_length bytes from block_offset, block_sent of them written. block
+  // points into block_buffer, or into block_entry if the cache had it.
+  char *block;
+  size_t block_length, block_sent;
+  off_t block_offset;
+  char *block_buffer;
+  struct cache_entry *block_entry;
+  int block_error; // errno from a block read on the pool, or 0
+
+  // Accounting, reported to metrics and the access log when the
+  // connection is released
+  uint64_t accepted_ns;
+  int endpoint;      // enum metrics_endpoint
+  uint64_t ready_ns; // when the response was queued
+  off_t sent;        // bytes of it written so far
+};
+
+extern int conn_init(struct conn *conn, int fd, struct cache *cache);
+extern void conn_release(struct conn *conn);
+extern struct conn *conn_create(int fd, struct cache *cache);
+extern void conn_free(struct conn *conn);
+extern int conn_head_length(struct conn *conn);
+extern int conn_request_complete(struct conn *conn);
+extern int conn_read_stage(struct conn *conn);
+extern void conn_set_body(struct conn *conn, void *body, off_t length,
+                          void (*release)(void *), void *arg);
+extern int conn_set_body_copy(struct conn *conn, void *body, off_t length);
+extern void conn_set_body_file(struct conn *conn, int fd, off_t length,
+                               char *cache_path, char *content_type);
+extern void conn_clear_body(struct conn *conn);
+extern void conn_file_loaded(struct conn *conn, void *data, off_t length);
+extern int conn_load_file_body(struct conn *conn);
+extern int conn_body_streams(struct conn *conn);
+extern int conn_next_block(struct conn *conn);
+extern int conn_read_block(struct conn *conn);
+extern int conn_read_block_async(struct conn *conn);
+extern void conn_park(struct conn *conn);
+extern void conn_resume(struct conn *conn);
+extern int conn_recv_blocking(struct conn *conn,
+                              struct loop_timeouts *timeouts);
+extern int conn_send_blocking(struct conn *conn);
+
+#endif
@@ -0,0 +1,535 @@
+/**
+ * epoll.c -- non-blocking epoll serving loop
+ *
+ * Serves many connections at once from one thread. Cache misses and POST
+ * saves go to the disk I/O pool and their connections are parked until the
+ * pool's completion wakes the loop, so hits keep flowing while the disk is
+ * slow. Files too big to load whole stream out a block at a time, parking
+ * while each block is read. Appending POSTs park the same way on the
+ * append log. Every connection waiting on its client has a deadline on the
+ * loop's timing wheel.
+ */
+
+#define _GNU_SOURCE // accept4()
+
+#include "conn.h"
+#include "iopool.h"
+#include "loop.h"
+#include "metrics.h"
+#include "wheel.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define EPOLL_MAX_EVENTS 64
+
+// What an epoll event is for, kept in the low bits of the event data
+enum epoll_tag {
+  TAG_LISTENER = 1,
+  TAG_SOURCE,
+  TAG_POOL,
+  TAG_CONN,
+};
+
+#define TAG_MASK 0x7ULL
+
+enum epoll_conn_state {
+  EC_READING,
+  EC_PARKED, // out of the epoll set until the pool hands it back
+  EC_WRITING,
+};
+
+struct epoll_loop;
+
+// A connection as the loop sees it
+struct epoll_conn {
+  struct conn conn; // must be first: conn_resume() hands us a struct conn
+  struct epoll_loop *loop;
+  struct epoll_conn *prev, *next;
+
+  int state;
+  off_t head_sent, body_sent;
+
+  struct wheel_timer timer; // while waiting on the client
+  int stage;                // enum metrics_timeout the timer is armed for
+};
+
+struct epoll_loop {
+  int epfd;
+  struct loop_config *cfg;
+  struct epoll_conn *conns;
+  int nconns;
+  int parked;
+  int stopping;
+  int accept_paused; // listener out of the epoll set: enum epoll_pause
+  struct wheel wheel;
+};
+
+// Why the listener is out of the epoll set
+enum epoll_pause {
+  EP_ACCEPTING,
+  EP_LIMIT,       // a connection limit
+  EP_DESCRIPTORS, // accept() ran out of file descriptors
+};
+
+#define EPOLL_PAUSED_POLL_MS 100 // recheck limits this often while paused
+
+/**
+ * Add, change or drop a descriptor in the epoll set
+ */
+int epoll_set(struct epoll_loop *loop, int op, int fd, uint32_t events,
+              void *data, int tag) {
+  struct epoll_event ev;
+
+  memset(&ev, 0, sizeof ev);
+  ev.events = events;
+  ev.data.u64 = (uint64_t)(uintptr_t)data | tag;
+
+  if (epoll_ctl(loop->epfd, op, fd, op == EPOLL_CTL_DEL ? NULL : &ev) == -1) {
+    perror("epoll_ctl");
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Stop watching the listener (why is an enum epoll_pause), or start again
+ * with EP_ACCEPTING
+ *
+ * While paused, new connections wait in the listen queue.
+ */
+void epoll_pause_accept(struct epoll_loop *loop, int why) {
+  if ((loop->accept_paused != EP_ACCEPTING) != (why != EP_ACCEPTING))
+    epoll_set(loop, EPOLL_CTL_MOD, loop->cfg->listenfd,
+              why != EP_ACCEPTING ? 0 : EPOLLIN, NULL, TAG_LISTENER);
+
+  loop->accept_paused = why;
+}
+
+/**
+ * Start accepting again if we're back under the limits
+ */
+void epoll_maybe_resume(struct epoll_loop *loop) {
+  if (loop->accept_paused && !loop->stopping &&
+      !loop_at_limit(loop->cfg, loop->nconns, 1))
+    epoll_pause_accept(loop, EP_ACCEPTING);
+}
+
+/**
+ * Close and free a connection
+ */
+void epoll_conn_close(struct epoll_loop *loop, struct epoll_conn *c) {
+  if (c->prev != NULL)
+    c->prev->next = c->next;
+  else
+    loop->conns = c->next;
+  if (c->next != NULL)
+    c->next->prev = c->prev;
+  wheel_del(&loop->wheel, &c->timer);
+
+  // close() takes the socket out of the epoll set
+  conn_release(&c->conn);
+  close(c->conn.fd);
+  free(c);
+
+  loop->nconns--;
+  loop_conn_closed(loop->cfg);
+  epoll_maybe_resume(loop);
+}
+
+/**
+ * Take a connection out of the epoll set until the pool hands it back
+ */
+void epoll_conn_park(struct epoll_loop *loop, struct epoll_conn *c) {
+  wheel_del(&loop->wheel, &c->timer);
+  c->state = EC_PARKED;
+  loop->parked++;
+  epoll_set(loop, EPOLL_CTL_DEL, c->conn.fd, 0, c, TAG_CONN);
+}
+
+/**
+ * Send as much of the response as the socket will take
+ *
+ * A streaming file body goes a block at a time; with a pool, the
+ * connection parks while each block is read. Closes the connection when
+ * everything has gone, or on error.
+ */
+void epoll_conn_write(struct epoll_loop *loop, struct epoll_conn *c) {
+  struct conn *conn = &c->conn;
+  int streams = conn_body_streams(conn);
+  off_t body_length = conn->body_type == CONN_BODY_MEMORY ? conn->body_length
+                                                          : 0;
+
+  for (;;) {
+    struct iovec iov[2];
+    struct msghdr msg;
+
+    // A streaming body's next block, once the last has gone
+    if (streams && conn->block_sent == conn->block_length) {
+      if (conn->block_error != 0)
+        break;
+
+      if (!conn_next_block(conn)) {
+        if (conn->pool != NULL && conn_read_block_async(conn) == 0) {
+          epoll_conn_park(loop, c);
+          return;
+        }
+        if (conn_read_block(conn) == -1)
+          break;
+      }
+    }
+
+    iov[0].iov_base = conn->head + c->head_sent;
+    iov[0].iov_len = conn->head_length - c->head_sent;
+    if (streams) {
+      iov[1].iov_base = conn->block + conn->block_sent;
+      iov[1].iov_len = conn->block_length - conn->block_sent;
+    } else {
+      iov[1].iov_base = (char *)conn->body + c->body_sent;
+      iov[1].iov_len = body_length - c->body_sent;
+    }
+
+    if (iov[0].iov_len + iov[1].iov_len == 0)
+      break;
+
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    ssize_t n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+    if (n == -1 && errno == EINTR)
+      continue;
+
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      // Socket buffer full: come back when it drains, if the client
+      // reads in time
+      epoll_set(loop, EPOLL_CTL_MOD, conn->fd, EPOLLOUT, c, TAG_CONN);
+      c->stage = METRICS_TIMEOUT_WRITE;
+      loop_arm(loop->cfg, &loop->wheel, &c->timer, c->stage);
+      return;
+    }
+
+    if (n < 0) {
+      if (errno != EPIPE && errno != ECONNRESET)
+        perror("send");
+      break;
+    }
+
+    conn->sent += n;
+
+    size_t step = (size_t)n < iov[0].iov_len ? (size_t)n : iov[0].iov_len;
+    c->head_sent += step;
+    if (streams)
+      conn->block_sent += n - step;
+    else
+      c->body_sent += n - step;
+  }
+
+  epoll_conn_close(loop, c);
+}
+
+/**
+ * Serving loop hook: a parked connection has its response
+ */
+void epoll_conn_resume(struct conn *conn) {
+  struct epoll_conn *c = (struct epoll_conn *)conn;
+  struct epoll_loop *loop = c->loop;
+
+  loop->parked--;
+
+  if (loop->stopping ||
+      epoll_set(loop, EPOLL_CTL_ADD, conn->fd, EPOLLOUT, c, TAG_CONN) == -1) {
+    epoll_conn_close(loop, c);
+    return;
+  }
+
+  // A small file left by a handler that fell back to reading inline
+  if (conn->body_type == CONN_BODY_FILE && !conn_body_streams(conn) &&
+      conn_load_file_body(conn) == -1) {
+    epoll_conn_close(loop, c);
+    return;
+  }
+
+  c->state = EC_WRITING;
+  epoll_conn_write(loop, c);
+}
+
+/**
+ * The request is in: run the handler and start sending, or park
+ */
+void epoll_conn_respond(struct epoll_loop *loop, struct epoll_conn *c) {
+  // From here on we're waiting on the disk or the client's reads
+  wheel_del(&loop->wheel, &c->timer);
+  handle_http_request(&c->conn);
+
+  if (c->conn.parked) {
+    epoll_conn_park(loop, c);
+    return;
+  }
+
+  // Handlers only leave small file bodies when there's no pool to read
+  // them; big ones stream
+  if (c->conn.body_type == CONN_BODY_FILE && !conn_body_streams(&c->conn) &&
+      conn_load_file_body(&c->conn) == -1) {
+    epoll_conn_close(loop, c);
+    return;
+  }
+
+  c->state = EC_WRITING;
+  epoll_conn_write(loop, c);
+}
+
+/**
+ * Read whatever request bytes have arrived
+ */
+void epoll_conn_read(struct epoll_loop *loop, struct epoll_conn *c) {
+  struct conn *conn = &c->conn;
+
+  for (;;) {
+    ssize_t n = recv(conn->fd, conn->request + conn->request_length,
+                     conn->request_size - 1 - conn->request_length, 0);
+
+    if (n == -1 && errno == EINTR)
+      continue;
+
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return;
+
+    if (n <= 0) {
+      if (n < 0 && errno != ECONNRESET)
+        perror("recv");
+      epoll_conn_close(loop, c);
+      return;
+    }
+
+    conn->request_length += n;
+    conn->request[conn->request_length] = '\0';
+
+    if (conn_request_complete(conn)) {
+      epoll_conn_respond(loop, c);
+      return;
+    }
+
+    c->stage = loop_arm_read(loop->cfg, &loop->wheel, &c->timer, c->stage,
+                             conn);
+  }
+}
+
+/**
+ * Wheel callback: a connection missed its deadline
+ */
+void epoll_conn_expired(struct wheel_timer *timer) {
+  struct epoll_conn *c = WHEEL_ENTRY(timer, struct epoll_conn, timer);
+
+  metrics_timeout(c->stage);
+  epoll_conn_close(c->loop, c);
+}
+
+/**
+ * Take on one accepted socket
+ */
+void epoll_conn_add(struct epoll_loop *loop, int fd,
+                    struct sockaddr_storage *peer) {
+  struct epoll_conn *c = calloc(1, sizeof *c);
+  if (c == NULL || conn_init(&c->conn, fd, loop->cfg->cache) == -1) {
+    free(c);
+    close(fd);
+    return;
+  }
+
+  c->conn.peer = *peer;
+  c->loop = loop;
+  c->conn.pool = loop->cfg->pool;
+  c->conn.resume = epoll_conn_resume;
+  c->state = EC_READING;
+  c->timer.expired = epoll_conn_expired;
+  c->stage = METRICS_TIMEOUT_IDLE;
+  loop_arm(loop->cfg, &loop->wheel, &c->timer, c->stage);
+
+  c->next = loop->conns;
+  if (loop->conns != NULL)
+    loop->conns->prev = c;
+  loop->conns = c;
+  loop->nconns++;
+  loop_conn_opened(loop->cfg);
+
+  if (epoll_set(loop, EPOLL_CTL_ADD, fd, EPOLLIN | EPOLLRDHUP, c, TAG_CONN) ==
+      -1)
+    epoll_conn_close(loop, c);
+}
+
+/**
+ * Accept a batch of new connections
+ *
+ * Takes up to LOOP_ACCEPT_BATCH, so a burst doesn't starve the connections
+ * already open, and pauses the listener at a connection limit or when out
+ * of descriptors rather than waking on it again and again.
+ */
+void epoll_accept(struct epoll_loop *loop) {
+  for (int i = 0; i < LOOP_ACCEPT_BATCH; i++) {
+    struct sockaddr_storage their_addr; // connector's address information
+    socklen_t sin_size = sizeof their_addr;
+
+    if (loop_at_limit(loop->cfg, loop->nconns, 0)) {
+      epoll_pause_accept(loop, EP_LIMIT);
+      return;
+    }
+
+    int fd = accept4(loop->cfg->listenfd, (struct sockaddr *)&their_addr,
+                     &sin_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      if (errno == EMFILE || errno == ENFILE) {
+        // Resumes when a connection closes, or at the next recheck
+        epoll_pause_accept(loop, EP_DESCRIPTORS);
+        return;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        perror("accept");
+      return;
+    }
+
+    epoll_conn_add(loop, fd, &their_addr);
+  }
+}
+
+/**
+ * Dispatch one epoll event
+ */
+void epoll_dispatch(struct epoll_loop *loop, struct epoll_event *ev) {
+  int tag = ev->data.u64 & TAG_MASK;
+  void *data = (void *)(uintptr_t)(ev->data.u64 & ~TAG_MASK);
+
+  switch (tag) {
+  case TAG_LISTENER:
+    epoll_accept(loop);
+    break;
+
+  case TAG_SOURCE: {
+    struct loop_source *src = data;
+
+    src->ready(src->arg, loop->cfg->cache);
+    break;
+  }
+
+  case TAG_POOL:
+    iopool_complete(loop->cfg->pool);
+    break;
+
+  case TAG_CONN: {
+    struct epoll_conn *c = data;
+
+    if (c->state == EC_READING)
+      epoll_conn_read(loop, c);
+    else if (c->state == EC_WRITING)
+      epoll_conn_write(loop, c);
+    break;
+  }
+  }
+}
+
+/**
+ * epoll serving loop
+ *
+ * Serves until cfg->stop is set. Returns -1 if epoll can't be set up.
+ */
+int serve_epoll(struct loop_config *cfg) {
+  struct epoll_loop loop;
+  struct epoll_event events[EPOLL_MAX_EVENTS];
+
+  memset(&loop, 0, sizeof loop);
+  loop.cfg = cfg;
+  wheel_init(&loop.wheel, LOOP_TICK_MS, wheel_now_ms());
+  loop.epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (loop.epfd == -1) {
+    perror("epoll_create1");
+    return -1;
+  }
+
+  // Readiness can be stale by the time we accept; never block on it
+  fcntl(cfg->listenfd, F_SETFL, fcntl(cfg->listenfd, F_GETFL) | O_NONBLOCK);
+
+  for (int i = 0; i < cfg->nsources; i++)
+    epoll_set(&loop, EPOLL_CTL_ADD, cfg->sources[i].fd, EPOLLIN,
+              &cfg->sources[i], TAG_SOURCE);
+  if (cfg->pool != NULL)
+    epoll_set(&loop, EPOLL_CTL_ADD, cfg->pool->fd, EPOLLIN, NULL, TAG_POOL);
+  epoll_set(&loop, EPOLL_CTL_ADD, cfg->listenfd, EPOLLIN, NULL, TAG_LISTENER);
+
+  while (!*cfg->stop) {
+    // Paused on a limit shared with other loops, or on running out of
+    // descriptors, nothing here may close to wake us: poll for it. Wake
+    // for the next tick, too, while any deadline is pending.
+    int timeout = wheel_timeout(&loop.wheel, wheel_now_ms());
+    if (loop.accept_paused &&
+        (timeout == -1 || timeout > EPOLL_PAUSED_POLL_MS))
+      timeout = EPOLL_PAUSED_POLL_MS;
+
+    int n = epoll_wait(loop.epfd, events, EPOLL_MAX_EVENTS, timeout);
+
+    if (n == -1) {
+      if (errno != EINTR)
+        perror("epoll_wait");
+      continue;
+    }
+
+    // Side sources first, whatever order the kernel reported them in: file
+    // changes are applied before requests in the same wakeup are served
+    for (int i = 0; i < n; i++)
+      if ((events[i].data.u64 & TAG_MASK) == TAG_SOURCE)
+        epoll_dispatch(&loop, &events[i]);
+    for (int i = 0; i < n; i++)
+      if ((events[i].data.u64 & TAG_MASK) != TAG_SOURCE)
+        epoll_dispatch(&loop, &events[i]);
+
+    // Expire only after the batch: it may hold events for the same
+    // connections
+    wheel_advance(&loop.wheel, wheel_now_ms());
+
+    // A limit is rechecked on every wakeup; running out of descriptors
+    // only once a recheck interval has passed quietly
+    if (loop.accept_paused == EP_LIMIT || n == 0)
+      epoll_maybe_resume(&loop);
+  }
+
+  // Parked connections belong to pool jobs or side sources (the append
+  // log); let those finish first
+  loop.stopping = 1;
+  while (loop.parked > 0) {
+    struct pollfd pfds[1 + LOOP_MAX_SOURCES];
+    int npfds = 0;
+
+    for (int i = 0; i < cfg->nsources; i++, npfds++)
+      pfds[npfds] = (struct pollfd){cfg->sources[i].fd, POLLIN, 0};
+    if (cfg->pool != NULL)
+      pfds[npfds++] = (struct pollfd){cfg->pool->fd, POLLIN, 0};
+
+    if (poll(pfds, npfds, -1) <= 0)
+      continue;
+
+    for (int i = 0; i < cfg->nsources; i++) {
+      if (pfds[i].revents & POLLIN)
+        cfg->sources[i].ready(cfg->sources[i].arg, cfg->cache);
+    }
+    if (cfg->pool != NULL && (pfds[npfds - 1].revents & POLLIN))
+      iopool_complete(cfg->pool);
+  }
+
+  while (loop.conns != NULL)
+    epoll_conn_close(&loop, loop.conns);
+
+  close(loop.epfd);
+
+  return 0;
+}
@@ -1,57 +1,69 @@
 #include "file.h"
-#include <bits/types/struct_iovec.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 /**
- * Loads a file into memory and returns a pointer to the data.
+ * Open a regular file for reading and fill in st for it
  *
- * Buffer is not NUL-terminated.
+ * Returns the descriptor, or -1 with errno set: EISDIR if it isn't a
+ * regular file.
  */
-struct file_data *file_load(char *filename) {
-  char *buffer, *p;
-  struct stat buf;
-  int bytes_read, bytes_remaining, total_bytes = 0;
+int file_open(char *filename, struct stat *st) {
+  int fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return -1;
 
-  // Get the file size
-  if (stat(filename, &buf) == -1) {
-    return NULL;
-  }
+  if (fstat(fd, st) == -1) {
+    int saved_errno = errno;
 
-  // Make sure it's a regular file
-  if (!(buf.st_mode & S_IFREG)) {
-    return NULL;
+    close(fd);
+    errno = saved_errno;
+    return -1;
   }
 
-  // Open the file for reading
-  FILE *fp = fopen(filename, "rb");
-  if (fp == NULL) {
-    return NULL;
+  if (!S_ISREG(st->st_mode)) {
+    close(fd);
+    errno = EISDIR;
+    return -1;
   }
 
-  // Allocate that many bytes
-  bytes_remaining = buf.st_size;
-  p = buffer = malloc(bytes_remaining);
+  return fd;
+}
+
+/**
+ * Read size bytes of an open file into memory, as file_load() does
+ *
+ * filename is recorded for file_save(). The file may shrink as we go, but
+ * not grow.
+ */
+struct file_data *file_read(int fd, char *filename, off_t size) {
+  off_t total_bytes = 0;
 
-  if (buffer == NULL) {
-    fclose(fp);
+  // Allocate that many bytes
+  char *buffer = malloc(size > 0 ? size : 1);
+  if (buffer == NULL)
     return NULL;
-  }
 
   // Read in the entire file
-  while (bytes_read = fread(p, 1, bytes_remaining, fp),
-         bytes_read != 0 && bytes_remaining > 0) {
+  while (total_bytes < size) {
+    ssize_t bytes_read = read(fd, buffer + total_bytes, size - total_bytes);
+
+    if (bytes_read == -1 && errno == EINTR)
+      continue;
+
     if (bytes_read == -1) {
       free(buffer);
-      fclose(fp);
       return NULL;
     }
 
-    bytes_remaining -= bytes_read;
-    p += bytes_read;
+    if (bytes_read == 0)
+      break;
+
     total_bytes += bytes_read;
   }
 
@@ -60,78 +72,143 @@ struct file_data *file_load(char *filename) {
 
   if (filedata == NULL) {
     free(buffer);
-    fclose(fp);
     return NULL;
   }
 
-  filedata->name = malloc(strlen(filename) + 1);
+  filedata->name = strdup(filename);
 
   if (filedata->name == NULL) {
+    free(buffer);
     free(filedata);
-    fclose(fp);
     return NULL;
   }
 
-  memcpy(filedata->name, filename, strlen(filename) + 1);
   filedata->data = buffer;
   filedata->size = total_bytes;
 
-  fclose(fp);
   return filedata;
 }
 
 /**
- * Save data to the file
+ * Loads a file into memory and returns a pointer to the data.
+ *
+ * Buffer is not NUL-terminated. Files over FILE_STREAM_MIN should be
+ * streamed instead.
  */
-int file_save(struct file_data *filedata) {
-  void *buffer, *p;
+struct file_data *file_load(char *filename) {
+  struct stat buf;
+
+  // Open it, making sure it's a regular file, and get the size
+  int fd = file_open(filename, &buf);
+  if (fd == -1)
+    return NULL;
+
+  struct file_data *filedata = file_read(fd, filename, buf.st_size);
+
+  int saved_errno = errno;
+  close(fd);
+  errno = saved_errno;
+
+  return filedata;
+}
+
+/**
+ * Replace a file's contents with size bytes of data
+ *
+ * The data goes to a temporary file in the same directory, which is synced
+ * and renamed over the target, so a reader (or a crash) only ever sees the
+ * complete old or new contents. It's written straight from data; nothing is
+ * copied.
+ *
+ * The target must already exist as a regular file. If st isn't NULL, it's
+ * filled in for the new file. Returns 1 on success or 0 on failure with
+ * errno set: ENOENT if there's no such file.
+ */
+int file_replace(char *filename, const void *data, size_t size,
+                 struct stat *st) {
+  char tmpname[4096];
   struct stat s;
-  int bytes_remaining, bytes_write;
+  const char *p = data;
 
-  // get file state
-  if (stat(filedata->name, &s) == -1)
+  // get file state; also, make sure it's a regular file instead of a
+  // directory or device
+  if (stat(filename, &s) == -1)
     return 0;
-
-  // also , make sure it's regular file instead of directory or links
-  if (!(s.st_mode & S_IFREG))
+  if (!S_ISREG(s.st_mode)) {
+    errno = ENOENT;
     return 0;
+  }
 
-  // open up the file
-  FILE *fp = fopen(filedata->name, "wb");
-  if (fp == NULL) {
+  // the temporary file is a hidden sibling, so the rename can't cross
+  // filesystems
+  char *slash = strrchr(filename, '/');
+  int dirlen = slash != NULL ? slash - filename + 1 : 0;
+  if (snprintf(tmpname, sizeof tmpname, "%.*s.%s.XXXXXX", dirlen, filename,
+               filename + dirlen) >= (int)sizeof tmpname) {
+    errno = ENAMETOOLONG;
     return 0;
   }
 
-  // copy data into buffer
-  p = buffer = malloc(filedata->size);
-  bytes_remaining = filedata->size;
-  if (buffer == NULL) {
-    fclose(fp);
+  int fd = mkstemp(tmpname);
+  if (fd == -1)
     return 0;
+
+  // mkstemp() makes it 0600; keep the permissions of what it replaces
+  int ok = fchmod(fd, s.st_mode & 07777) == 0;
+
+  while (ok && size > 0) {
+    ssize_t n = write(fd, p, size);
+
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      ok = 0;
+      break;
+    }
+
+    p += n;
+    size -= n;
   }
-  if (memcpy(buffer, filedata->data, filedata->size) == NULL) {
-    free(buffer);
-    fclose(fp);
-    return 0;
+
+  ok = ok && fsync(fd) == 0;
+  ok = ok && (st == NULL || fstat(fd, st) == 0);
+
+  int saved_errno = errno;
+  if (close(fd) == -1 && ok) {
+    saved_errno = errno;
+    ok = 0;
   }
 
-  // write buffer into file
-  while ((bytes_write = fwrite(p, 1, bytes_remaining, fp)) > 0 &&
-         bytes_remaining > 0) {
-    if (bytes_write == -1) {
-      free(buffer);
-      fclose(fp);
-      return 0;
-    }
+  if (ok && rename(tmpname, filename) == -1) {
+    saved_errno = errno;
+    ok = 0;
+  }
 
-    bytes_remaining -= bytes_write;
-    p += bytes_write;
+  if (!ok) {
+    unlink(tmpname);
+    errno = saved_errno;
+    return 0;
+  }
+
+  // make the rename itself durable
+  snprintf(tmpname, sizeof tmpname, "%.*s", dirlen > 0 ? dirlen : 1,
+           dirlen > 0 ? filename : ".");
+  int dirfd = open(tmpname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dirfd != -1) {
+    fsync(dirfd);
+    close(dirfd);
   }
 
-  fclose(fp);
   return 1;
 }
 
+/**
+ * Save data to the file
+ */
+int file_save(struct file_data *filedata) {
+  return file_replace(filedata->name, filedata->data, filedata->size, NULL);
+}
+
 /**
  * modify data of the giving file structure
  *
@@ -1,15 +1,26 @@
 #ifndef _FILELS_H_ // This was just _FILE_H_, but that interfered with Cygwin
 #define _FILELS_H_
 
+#include <stddef.h>
+#include <sys/types.h>
+
+#define FILE_STREAM_MIN (4 * 1024 * 1024) // bigger files aren't loaded whole
+
+struct stat;
+
 struct file_data {
   char *name;
-  int size;
+  off_t size;
   void *data;
 };
 
+extern int file_open(char *filename, struct stat *st);
+extern struct file_data *file_read(int fd, char *filename, off_t size);
 extern struct file_data *file_load(char *filename);
 extern int file_modify(struct file_data *filedata, const void *data);
 extern int file_save(struct file_data *filedata);
+extern int file_replace(char *filename, const void *data, size_t size,
+                        struct stat *st);
 extern void file_free(struct file_data *filedata);
 
 #endif
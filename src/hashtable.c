@@ -115,9 +115,11 @@ struct hashtable *hashtable_create(int size, int (*hashf)(void *, int, int)) {
  * Free an htent
  */
 void htent_free(void *htent, void *arg) {
+  struct htent *ent = htent;
   (void)arg;
 
-  free(htent);
+  free(ent->key);
+  free(ent);
 }
 
 /**
@@ -133,6 +135,7 @@ void hashtable_destroy(struct hashtable *ht) {
     llist_destroy(llist);
   }
 
+  free(ht->bucket);
   free(ht);
 }
 
@@ -242,6 +245,7 @@ void *hashtable_delete_bin(struct hashtable *ht, void *key, int key_size) {
 
   void *data = ent->data;
 
+  free(ent->key);
   free(ent);
 
   add_entry_count(ht, -1);
@@ -0,0 +1,275 @@
+#include "iopool.h"
+#include "metrics.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+/**
+ * Add a job at the tail of a ring; loop thread only
+ *
+ * Returns 0, or -1 if the ring is full.
+ */
+int iopool_ring_push(struct iopool_ring *r, struct iopool_job *job) {
+  uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+  uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+  // head only grows, so a stale one can only make us think it's fuller
+  if (tail - head > r->mask)
+    return -1;
+
+  __atomic_store_n(&r->jobs[tail & r->mask], job, __ATOMIC_RELAXED);
+  // Publishes the slot, and is ordered before the loop reads pool->idle
+  __atomic_store_n(&r->tail, tail + 1, __ATOMIC_SEQ_CST);
+
+  return 0;
+}
+
+/**
+ * Take the oldest job in a ring, or NULL if it's empty
+ *
+ * Safe from any number of threads at once: each claims a slot by moving
+ * head past it, and one that loses the race tries the next.
+ */
+struct iopool_job *iopool_ring_take(struct iopool_ring *r) {
+  uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+  for (;;) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if (head >= tail)
+      return NULL;
+
+    // The slot can only be refilled once head has moved past it, in which
+    // case the CAS fails and what we read is thrown away
+    struct iopool_job *job =
+        __atomic_load_n(&r->jobs[head & r->mask], __ATOMIC_RELAXED);
+    if (__atomic_compare_exchange_n(&r->head, &head, head + 1, 0,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE))
+      return job;
+  }
+}
+
+/**
+ * Next job for a pool thread: the oldest in its own ring, or else one
+ * stolen from the next thread along that has any
+ */
+struct iopool_job *iopool_take(struct iopool *pool, struct iopool_thread *self,
+                               int *stolen) {
+  for (int i = 0; i < pool->nthreads; i++) {
+    int n = (self->index + i) % pool->nthreads;
+    struct iopool_job *job = iopool_ring_take(&pool->threads[n].ring);
+
+    if (job != NULL) {
+      *stolen = i > 0;
+      return job;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Pool thread: run jobs until the pool stops
+ */
+void *iopool_worker(void *arg) {
+  struct iopool_thread *self = arg;
+  struct iopool *pool = self->pool;
+  const uint64_t one = 1;
+
+  for (;;) {
+    int stolen = 0;
+    struct iopool_job *job = iopool_take(pool, self, &stolen);
+
+    if (job == NULL) {
+      pthread_mutex_lock(&pool->lock);
+
+      // Either the loop sees us idle and signals, or we see its push here
+      __atomic_add_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+      while ((job = iopool_take(pool, self, &stolen)) == NULL &&
+             !pool->stopping)
+        pthread_cond_wait(&pool->cond, &pool->lock);
+      __atomic_sub_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+
+      pthread_mutex_unlock(&pool->lock);
+
+      // Finish what's queued before stopping
+      if (job == NULL)
+        break;
+    }
+
+    job->work(job);
+    metrics_disk_job(stolen);
+
+    pthread_mutex_lock(&pool->lock);
+    job->next = NULL;
+    if (pool->done_tail != NULL)
+      pool->done_tail->next = job;
+    else
+      pool->done_head = job;
+    pool->done_tail = job;
+
+    if (write(pool->fd, &one, sizeof one) == -1)
+      perror("iopool: eventfd");
+    pthread_mutex_unlock(&pool->lock);
+  }
+
+  return NULL;
+}
+
+/**
+ * Start a pool of nthreads threads
+ *
+ * About max_queued jobs wait for a thread, split between their rings;
+ * iopool_submit() refuses more.
+ */
+struct iopool *iopool_create(int nthreads, int max_queued) {
+  struct iopool *pool = calloc(1, sizeof *pool);
+  if (pool == NULL)
+    return NULL;
+
+  if (nthreads < 1)
+    nthreads = 1;
+
+  // Each ring is a power of two
+  uint64_t slots = 1;
+  while (slots * nthreads < (uint64_t)max_queued)
+    slots *= 2;
+
+  pool->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  pool->threads =
+      aligned_alloc(_Alignof(struct iopool_thread),
+                    (size_t)nthreads * sizeof(struct iopool_thread));
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->cond, NULL);
+
+  int ok = pool->fd != -1 && pool->threads != NULL;
+  if (pool->threads != NULL) {
+    memset(pool->threads, 0, (size_t)nthreads * sizeof *pool->threads);
+    pool->nthreads = nthreads;
+  }
+
+  for (int i = 0; ok && i < nthreads; i++) {
+    struct iopool_thread *t = &pool->threads[i];
+
+    t->pool = pool;
+    t->index = i;
+    t->ring.mask = slots - 1;
+    t->ring.jobs = calloc(slots, sizeof *t->ring.jobs);
+    ok = t->ring.jobs != NULL;
+  }
+
+  if (!ok) {
+    perror("iopool");
+    iopool_free(pool);
+    return NULL;
+  }
+
+  // A ring whose thread didn't start is still served by the others
+  int started = 0;
+  for (; started < nthreads; started++)
+    if (pthread_create(&pool->threads[started].thread, NULL, iopool_worker,
+                       &pool->threads[started]) != 0)
+      break;
+
+  if (started == 0) {
+    iopool_free(pool);
+    return NULL;
+  }
+  pool->started = started;
+
+  return pool;
+}
+
+/**
+ * Stop the pool
+ *
+ * Queued jobs are still run, and every finished job gets its done() call
+ * here, so nothing handed to the pool is leaked.
+ */
+void iopool_free(struct iopool *pool) {
+  if (pool == NULL)
+    return;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = 1;
+  pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (int i = 0; i < pool->started; i++)
+    pthread_join(pool->threads[i].thread, NULL);
+
+  if (pool->fd != -1) {
+    iopool_complete(pool);
+    close(pool->fd);
+  }
+
+  pthread_cond_destroy(&pool->cond);
+  pthread_mutex_destroy(&pool->lock);
+  for (int i = 0; i < pool->nthreads; i++)
+    free(pool->threads[i].ring.jobs);
+  free(pool->threads);
+  free(pool);
+}
+
+/**
+ * Queue a job for a pool thread
+ *
+ * Jobs are dealt round the threads' rings without a lock; a thread that
+ * gets stuck on a slow one leaves the rest of its ring to be stolen by
+ * the others. Wakes a thread only if one is asleep. Call on the loop
+ * thread. Returns 0, or -1 if every ring is full; the caller should then
+ * do the work itself.
+ */
+int iopool_submit(struct iopool *pool, struct iopool_job *job) {
+  if (pool->stopping)
+    return -1;
+
+  for (int i = 0; i < pool->nthreads; i++) {
+    int n = pool->next;
+
+    pool->next = (n + 1) % pool->nthreads;
+    if (iopool_ring_push(&pool->threads[n].ring, job) == 0) {
+      if (__atomic_load_n(&pool->idle, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_signal(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+      }
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+/**
+ * Run done() for every finished job
+ *
+ * Call on the loop thread when pool->fd is readable. Never blocks. Returns
+ * the number of jobs completed.
+ */
+int iopool_complete(struct iopool *pool) {
+  uint64_t count;
+  int completed = 0;
+
+  if (read(pool->fd, &count, sizeof count) == -1 && errno != EAGAIN)
+    perror("iopool: eventfd");
+
+  pthread_mutex_lock(&pool->lock);
+  struct iopool_job *job = pool->done_head;
+  pool->done_head = pool->done_tail = NULL;
+  pthread_mutex_unlock(&pool->lock);
+
+  while (job != NULL) {
+    struct iopool_job *next = job->next;
+
+    job->done(job);
+    completed++;
+    job = next;
+  }
+
+  return completed;
+}
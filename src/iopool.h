@@ -0,0 +1,63 @@
+#ifndef _IOPOOL_H_
+#define _IOPOOL_H_
+
+#include <pthread.h>
+#include <stdint.h>
+
+// A unit of filesystem work. Embed it as the first member of a bigger struct
+// to carry arguments and results.
+struct iopool_job {
+  void (*work)(struct iopool_job *job); // runs on a pool thread
+  void (*done)(struct iopool_job *job); // runs back on the loop thread
+  struct iopool_job *next;
+};
+
+// Jobs handed to one pool thread: a fixed ring, first in first out
+//
+// Single producer, many consumers. Only the loop thread adds jobs, at the
+// tail. Every pool thread, its owner included, takes the oldest from the
+// head with a compare-and-swap on it, its own ring first, so whichever is
+// idle picks up the jobs queued behind one stuck on a slow disk.
+struct iopool_ring {
+  uint64_t head; // next job to take
+  uint64_t tail; // next slot to fill
+  uint64_t mask; // slots - 1, a power of two
+  struct iopool_job **jobs;
+} __attribute__((aligned(64)));
+
+// A pool thread and its ring, on cache lines of their own
+struct iopool_thread {
+  struct iopool_ring ring;
+  struct iopool *pool;
+  pthread_t thread;
+  int index;
+} __attribute__((aligned(64)));
+
+// Bounded pool of threads for blocking filesystem calls
+//
+// Submitting and taking jobs takes no lock. The lock is for handing
+// finished jobs back and for putting idle threads to sleep; the loop only
+// signals when one is asleep.
+struct iopool {
+  int fd; // eventfd, readable when finished jobs are waiting for done()
+
+  struct iopool_thread *threads;
+  int nthreads; // rings
+  int started;  // threads running, on the first rings
+  int next; // ring the next job goes to, round robin
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int idle; // threads asleep, or about to be, on cond
+  struct iopool_job *done_head, *done_tail; // waiting for done()
+  int stopping;
+};
+
+extern struct iopool *iopool_create(int nthreads, int max_queued);
+extern void iopool_free(struct iopool *pool);
+extern int iopool_submit(struct iopool *pool, struct iopool_job *job);
+extern int iopool_complete(struct iopool *pool);
+extern int iopool_ring_push(struct iopool_ring *r, struct iopool_job *job);
+extern struct iopool_job *iopool_ring_take(struct iopool_ring *r);
+
+#endif
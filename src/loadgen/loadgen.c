@@ -0,0 +1,996 @@
+/**
+ * loadgen.c -- open-loop HTTP load generator
+ *
+ * Build from src/ with:
+ *
+ *    make loadgen
+ *
+ * then, with the server running:
+ *
+ *    ./loadgen/loadgen -r 20000 -c 256 -t 4 -d 30
+ *
+ * Requests are issued at a fixed rate (-r) whatever the server does: each
+ * one has an intended start time on a fixed schedule, and its latency is
+ * measured from that time rather than from when it was actually written.
+ * A server that stalls for a second therefore shows a second's worth of
+ * slow requests instead of one (coordinated omission correction, as in
+ * wrk2). Uncorrected service times are reported alongside. With -r 0 every
+ * connection keeps -P requests in flight back to back (closed loop).
+ *
+ * Connections ask for keep-alive and pipeline up to -P requests, but only
+ * once a response has shown the server will keep the connection open. A
+ * "Connection: close" response closes and reopens it; anything pipelined
+ * behind that response is sent again on the new connection, with its
+ * original intended start time.
+ *
+ * The URL mix defaults to the REQUESTS table in tests/test_load.py; -u
+ * replaces it, one path per flag with an optional weight:
+ *
+ *    ./loadgen/loadgen -r 5000 -u /=4 -u /cat.jpg -u /nonexistent
+ *
+ * Latencies go into HDR histograms (3 significant digits, 1ns to ~275s).
+ * -o also writes the full percentile distribution in HdrHistogram's .hgrm
+ * text format, for plotting.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOADGEN_PIPELINE_MAX 64
+#define LOADGEN_REQUEST_MAX 512 // bytes of one request
+#define LOADGEN_INPUT_MAX 65536 // response read buffer
+#define LOADGEN_RETRY_NS 100000000ULL // reconnect backoff after a failure
+#define LOADGEN_EVENTS 256
+
+/**
+ * HDR histogram
+ *
+ * Values are bucketed by power of two, and each power is split linearly
+ * into HIST_SUB_HALF sub-buckets, so every recorded value is kept to
+ * within 1/HIST_SUB_HALF (3 significant digits).
+ */
+#define HIST_SUB_BITS 11
+#define HIST_SUB_HALF (1 << (HIST_SUB_BITS - 1))
+#define HIST_BUCKETS 28
+#define HIST_COUNTS ((HIST_BUCKETS + 1) * HIST_SUB_HALF)
+#define HIST_MAX ((1ULL << (HIST_SUB_BITS + HIST_BUCKETS - 1)) - 1)
+
+struct hist {
+  uint64_t counts[HIST_COUNTS];
+  uint64_t total;
+  uint64_t max;
+};
+
+// One entry of the URL mix
+struct target {
+  char *path;
+  int weight;
+  char request[LOADGEN_REQUEST_MAX];
+  int length;
+};
+
+// A request waiting to be sent, or sent and waiting for its response
+struct request {
+  uint64_t intended; // scheduled start time
+  uint64_t sent;
+  int target;
+};
+
+struct worker;
+
+struct client {
+  int fd; // -1 while closed
+  int connecting;
+  int reusable; // a response has come back without "Connection: close"
+  int ready; // on the worker's ready stack
+  int generation; // bumped on every reconnect
+  uint64_t retry_at;
+  struct worker *w;
+
+  struct request inflight[LOADGEN_PIPELINE_MAX];
+  int head, count;
+
+  char out[LOADGEN_PIPELINE_MAX * LOADGEN_REQUEST_MAX];
+  int out_length, out_sent;
+
+  char in[LOADGEN_INPUT_MAX];
+  int in_length;
+  int in_body; // headers parsed, reading the body
+  long long body_left; // -1: until the server closes
+  int status;
+  int close; // the response carried "Connection: close"
+};
+
+struct worker {
+  pthread_t thread;
+  int epfd;
+  int index;
+  uint64_t rng;
+
+  struct client *clients;
+  int nclients;
+  struct client **ready; // clients that can take another request
+  int nready;
+  int down; // clients waiting out LOADGEN_RETRY_NS
+
+  uint64_t interval; // ns between intended starts; 0 for closed loop
+  uint64_t next; // next intended start
+
+  // Due but not yet sent; a ring that grows as the server falls behind
+  struct request *pending;
+  size_t pending_head, pending_count, pending_size;
+
+  struct hist corrected;
+  struct hist uncorrected;
+  uint64_t completed, errors, connect_errors, reconnects, bytes;
+  uint64_t status[6]; // 1xx..5xx, other
+  uint64_t *per_target; // completed, by target
+  uint64_t unfinished; // in flight or pending at the end
+};
+
+// Settings shared by every worker
+char *host = "127.0.0.1";
+char *port = "3490";
+int nthreads = 1;
+int nconnections = 16;
+double rate = 0;
+double duration = 10;
+int depth = 1;
+int keepalive = 1;
+struct target *targets;
+int ntargets;
+int total_weight;
+struct sockaddr_storage addr;
+socklen_t addrlen;
+uint64_t start_ns, end_ns;
+
+/**
+ * Monotonic time in nanoseconds
+ */
+uint64_t now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Histogram index for a value
+ */
+int hist_index(uint64_t v) {
+  int bucket = 63 - __builtin_clzll(v | ((1ULL << HIST_SUB_BITS) - 1)) -
+               (HIST_SUB_BITS - 1);
+
+  return (bucket << (HIST_SUB_BITS - 1)) + (int)(v >> bucket);
+}
+
+/**
+ * Highest value that lands in a histogram index
+ */
+uint64_t hist_value(int index) {
+  int bucket = (index >> (HIST_SUB_BITS - 1)) - 1;
+  uint64_t sub;
+
+  if (bucket < 0)
+    bucket = 0;
+  sub = index - (bucket << (HIST_SUB_BITS - 1));
+
+  return (sub << bucket) + (1ULL << bucket) - 1;
+}
+
+void hist_record(struct hist *h, uint64_t v) {
+  if (v > HIST_MAX)
+    v = HIST_MAX;
+  h->counts[hist_index(v)]++;
+  h->total++;
+  if (v > h->max)
+    h->max = v;
+}
+
+void hist_merge(struct hist *into, struct hist *from) {
+  for (int i = 0; i < HIST_COUNTS; i++)
+    into->counts[i] += from->counts[i];
+  into->total += from->total;
+  if (from->max > into->max)
+    into->max = from->max;
+}
+
+/**
+ * Mean and standard deviation, taking each index at its midpoint
+ */
+void hist_stats(struct hist *h, double *mean, double *stddev) {
+  double sum = 0, squares = 0;
+
+  *mean = *stddev = 0;
+  if (h->total == 0)
+    return;
+
+  for (int i = 0; i < HIST_COUNTS; i++) {
+    double low = i == 0 ? 0 : hist_value(i - 1) + 1;
+
+    sum += h->counts[i] * (low + hist_value(i)) / 2;
+  }
+  *mean = sum / h->total;
+
+  for (int i = 0; i < HIST_COUNTS; i++) {
+    double low = i == 0 ? 0 : hist_value(i - 1) + 1;
+    double d = (low + hist_value(i)) / 2 - *mean;
+
+    squares += h->counts[i] * d * d;
+  }
+  *stddev = sqrt(squares / h->total);
+}
+
+/**
+ * Value at a percentile (0-100)
+ */
+uint64_t hist_percentile(struct hist *h, double percentile) {
+  uint64_t want = (uint64_t)(percentile / 100.0 * h->total + 0.5);
+  uint64_t seen = 0;
+
+  if (want < 1)
+    want = 1;
+
+  for (int i = 0; i < HIST_COUNTS; i++) {
+    seen += h->counts[i];
+    if (seen >= want) {
+      uint64_t v = hist_value(i);
+      return v < h->max ? v : h->max;
+    }
+  }
+
+  return h->max;
+}
+
+/**
+ * Write the percentile distribution in HdrHistogram's .hgrm format
+ *
+ * Values are in milliseconds. As in HdrHistogram's own output there are
+ * five lines each time the distance to 100% halves.
+ */
+void hist_write(FILE *f, struct hist *h) {
+  double percentile = 0, mean, stddev;
+
+  fprintf(f, "%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount",
+          "1/(1-Percentile)");
+
+  while (h->total > 0) {
+    uint64_t v = hist_percentile(h, percentile);
+    uint64_t count = 0;
+
+    for (int i = 0; i <= hist_index(v); i++)
+      count += h->counts[i];
+
+    if (count >= h->total) {
+      fprintf(f, "%12.3f %1.12f %10llu\n", h->max / 1e6, 1.0,
+              (unsigned long long)h->total);
+      break;
+    }
+    fprintf(f, "%12.3f %1.12f %10llu %14.2f\n", v / 1e6, percentile / 100,
+            (unsigned long long)count, 1 / (1 - percentile / 100));
+
+    percentile += 100 / (5 * pow(2, floor(log2(100 / (100 - percentile))) + 1));
+  }
+
+  hist_stats(h, &mean, &stddev);
+  fprintf(f, "#[Mean    = %12.3f, StdDeviation   = %12.3f]\n", mean / 1e6,
+          stddev / 1e6);
+  fprintf(f, "#[Max     = %12.3f, Total count    = %12llu]\n", h->max / 1e6,
+          (unsigned long long)h->total);
+}
+
+/**
+ * xorshift64*, per worker
+ */
+uint64_t worker_rand(struct worker *w) {
+  w->rng ^= w->rng >> 12;
+  w->rng ^= w->rng << 25;
+  w->rng ^= w->rng >> 27;
+  return w->rng * 2685821657736338717ULL;
+}
+
+/**
+ * Pick a target from the mix by weight
+ */
+int worker_target(struct worker *w) {
+  int r = (int)(worker_rand(w) % total_weight);
+
+  for (int i = 0; i < ntargets; i++) {
+    if (r < targets[i].weight)
+      return i;
+    r -= targets[i].weight;
+  }
+
+  return ntargets - 1;
+}
+
+/**
+ * Add a request to the back of the pending ring, or the front to resend it
+ */
+void pending_push(struct worker *w, struct request *r, int front) {
+  if (w->pending_count == w->pending_size) {
+    size_t size = w->pending_size ? w->pending_size * 2 : 1024;
+    struct request *p = malloc(size * sizeof *p);
+
+    for (size_t i = 0; i < w->pending_count; i++)
+      p[i] = w->pending[(w->pending_head + i) % w->pending_size];
+    free(w->pending);
+    w->pending = p;
+    w->pending_head = 0;
+    w->pending_size = size;
+  }
+
+  if (front) {
+    w->pending_head = (w->pending_head + w->pending_size - 1) % w->pending_size;
+    w->pending[w->pending_head] = *r;
+  } else {
+    w->pending[(w->pending_head + w->pending_count) % w->pending_size] = *r;
+  }
+  w->pending_count++;
+}
+
+/**
+ * Take the next request to send
+ *
+ * Returns 0 if there is nothing due. In closed loop mode there always is,
+ * intended to start right now.
+ */
+int pending_pop(struct worker *w, struct request *r, uint64_t now) {
+  if (w->pending_count > 0) {
+    *r = w->pending[w->pending_head];
+    w->pending_head = (w->pending_head + 1) % w->pending_size;
+    w->pending_count--;
+    return 1;
+  }
+
+  if (w->interval == 0) {
+    r->intended = now;
+    r->target = worker_target(w);
+    return 1;
+  }
+
+  return 0;
+}
+
+/**
+ * Requests a client may have in flight
+ */
+int client_capacity(struct client *c) {
+  if (c->fd == -1 || c->connecting)
+    return 0;
+  return (c->reusable ? depth : 1) - c->count;
+}
+
+void client_mark_ready(struct client *c) {
+  if (!c->ready && client_capacity(c) > 0) {
+    c->ready = 1;
+    c->w->ready[c->w->nready++] = c;
+  }
+}
+
+void client_unready(struct client *c) {
+  struct worker *w = c->w;
+
+  if (!c->ready)
+    return;
+  for (int i = 0; i < w->nready; i++) {
+    if (w->ready[i] == c) {
+      w->ready[i] = w->ready[--w->nready];
+      break;
+    }
+  }
+  c->ready = 0;
+}
+
+/**
+ * Start a non-blocking connect
+ */
+void client_open(struct client *c) {
+  struct epoll_event ev;
+  int one = 1;
+
+  c->fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (c->fd == -1) {
+    perror("socket");
+    exit(1);
+  }
+  setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+  c->connecting = 1;
+  c->reusable = 0;
+  c->in_length = 0;
+  c->in_body = 0;
+  c->out_length = c->out_sent = 0;
+
+  if (connect(c->fd, (struct sockaddr *)&addr, addrlen) == 0)
+    c->connecting = 0;
+  else if (errno != EINPROGRESS) {
+    close(c->fd);
+    c->fd = -1;
+    c->w->connect_errors++;
+    c->retry_at = now_ns() + LOADGEN_RETRY_NS;
+    c->w->down++;
+    return;
+  }
+
+  ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+  ev.data.ptr = c;
+  epoll_ctl(c->w->epfd, EPOLL_CTL_ADD, c->fd, &ev);
+
+  if (!c->connecting)
+    client_mark_ready(c);
+}
+
+/**
+ * Close a client and connect it again
+ *
+ * Requests still in flight are resent if the server announced the close
+ * (resend), and count as errors if it didn't.
+ */
+void client_reset(struct client *c, int resend, int failed) {
+  struct worker *w = c->w;
+
+  // Newest first, so they land at the front of pending in order
+  for (int i = c->count - 1; i >= 0; i--) {
+    struct request *r = &c->inflight[(c->head + i) % LOADGEN_PIPELINE_MAX];
+
+    if (resend)
+      pending_push(w, r, 1);
+    else
+      w->errors++;
+  }
+  c->count = 0;
+  c->generation++;
+
+  client_unready(c);
+  close(c->fd);
+  c->fd = -1;
+
+  if (failed) {
+    c->retry_at = now_ns() + LOADGEN_RETRY_NS;
+    w->down++;
+  } else {
+    w->reconnects++;
+    client_open(c);
+  }
+}
+
+/**
+ * Write out queued request bytes
+ *
+ * Returns -1 if the connection failed.
+ */
+int client_flush(struct client *c) {
+  while (c->out_sent < c->out_length) {
+    ssize_t n = send(c->fd, c->out + c->out_sent, c->out_length - c->out_sent,
+                     MSG_NOSIGNAL);
+
+    if (n == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 0;
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    c->out_sent += n;
+  }
+
+  c->out_length = c->out_sent = 0;
+  return 0;
+}
+
+/**
+ * Hand pending requests to clients with room for them
+ */
+void worker_dispatch(struct worker *w, uint64_t now) {
+  while (w->nready > 0 && (w->interval == 0 || w->pending_count > 0)) {
+    struct client *c = w->ready[w->nready - 1];
+    struct request r;
+    int sent = 0;
+
+    while (client_capacity(c) > 0 && pending_pop(w, &r, now)) {
+      struct target *t = &targets[r.target];
+
+      if (c->out_length + t->length > (int)sizeof c->out)
+        break;
+      memcpy(c->out + c->out_length, t->request, t->length);
+      c->out_length += t->length;
+
+      r.sent = now;
+      c->inflight[(c->head + c->count) % LOADGEN_PIPELINE_MAX] = r;
+      c->count++;
+      sent++;
+    }
+
+    if (client_capacity(c) <= 0 || sent == 0) {
+      w->nready--;
+      c->ready = 0;
+    }
+    if (sent > 0 && client_flush(c) == -1)
+      client_reset(c, 0, 1);
+  }
+}
+
+/**
+ * A whole response has arrived for the oldest request in flight
+ */
+void client_complete(struct client *c) {
+  struct worker *w = c->w;
+  struct request *r = &c->inflight[c->head];
+  uint64_t now = now_ns();
+  int class = c->status / 100;
+
+  hist_record(&w->corrected, now - r->intended);
+  hist_record(&w->uncorrected, now - r->sent);
+  w->completed++;
+  w->per_target[r->target]++;
+  w->status[class >= 1 && class <= 5 ? class - 1 : 5]++;
+
+  c->head = (c->head + 1) % LOADGEN_PIPELINE_MAX;
+  c->count--;
+  c->in_body = 0;
+
+  if (c->close)
+    client_reset(c, 1, 0);
+  else {
+    c->reusable = keepalive;
+    client_mark_ready(c);
+  }
+}
+
+/**
+ * Parse a response head at the start of the input buffer
+ *
+ * Returns its length, 0 if it isn't all there yet, or -1 if it's not HTTP.
+ */
+int client_parse_head(struct client *c) {
+  char *end, *p;
+  int length;
+
+  c->in[c->in_length] = '\0';
+  if ((end = strstr(c->in, "\r\n\r\n")) != NULL)
+    length = end - c->in + 4;
+  else if ((end = strstr(c->in, "\n\n")) != NULL)
+    length = end - c->in + 2;
+  else
+    return c->in_length >= LOADGEN_INPUT_MAX - 1 ? -1 : 0;
+
+  if (sscanf(c->in, "HTTP/%*d.%*d %d", &c->status) != 1)
+    return -1;
+
+  c->body_left = -1;
+  c->close = !keepalive;
+  for (p = strchr(c->in, '\n'); p != NULL && p < end; p = strchr(p, '\n')) {
+    p++;
+    if (strncasecmp(p, "Content-Length:", 15) == 0)
+      c->body_left = atoll(p + 15);
+    else if (strncasecmp(p, "Connection:", 11) == 0) {
+      char *v = p + 11;
+
+      while (*v == ' ')
+        v++;
+      if (strncasecmp(v, "close", 5) == 0)
+        c->close = 1;
+    }
+  }
+  if (c->body_left == -1)
+    c->close = 1;
+
+  return length;
+}
+
+/**
+ * Read and account for whatever the server has sent
+ */
+void client_read(struct client *c) {
+  for (;;) {
+    ssize_t n = recv(c->fd, c->in + c->in_length,
+                     LOADGEN_INPUT_MAX - 1 - c->in_length, 0);
+
+    if (n == 0 || (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK &&
+                   errno != EINTR)) {
+      // A body that runs to the close is complete now
+      if (n == 0 && c->in_body && c->body_left == -1) {
+        c->close = 1;
+        client_complete(c);
+      } else {
+        client_reset(c, 0, 0);
+      }
+      return;
+    }
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      return;
+    }
+
+    c->w->bytes += n;
+    c->in_length += n;
+
+    while (c->in_length > 0) {
+      int used;
+
+      if (c->count == 0) {
+        // Nothing asked for
+        c->w->errors++;
+        client_reset(c, 0, 0);
+        return;
+      }
+
+      if (!c->in_body) {
+        used = client_parse_head(c);
+        if (used == 0)
+          break;
+        if (used == -1) {
+          client_reset(c, 0, 0);
+          return;
+        }
+        c->in_body = 1;
+      } else {
+        used = c->body_left == -1 || c->body_left > c->in_length
+                   ? c->in_length
+                   : (int)c->body_left;
+        if (c->body_left != -1)
+          c->body_left -= used;
+      }
+
+      memmove(c->in, c->in + used, c->in_length - used);
+      c->in_length -= used;
+
+      if (c->in_body && c->body_left == 0) {
+        int generation = c->generation;
+
+        client_complete(c);
+        if (c->generation != generation)
+          return; // reconnected, the rest of the input is gone
+      }
+    }
+  }
+}
+
+void client_event(struct client *c, uint32_t events) {
+  if (c->connecting) {
+    int error = 0;
+    socklen_t length = sizeof error;
+
+    if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+      return;
+    getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &error, &length);
+    if (error != 0) {
+      c->w->connect_errors++;
+      client_reset(c, 1, 1);
+      return;
+    }
+    c->connecting = 0;
+    client_mark_ready(c);
+  }
+
+  if (events & EPOLLOUT) {
+    if (client_flush(c) == -1) {
+      client_reset(c, 0, 1);
+      return;
+    }
+  }
+
+  if (events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+    client_read(c);
+}
+
+void *worker_run(void *arg) {
+  struct worker *w = arg;
+  struct epoll_event events[LOADGEN_EVENTS];
+
+  for (int i = 0; i < w->nclients; i++)
+    client_open(&w->clients[i]);
+
+  for (;;) {
+    uint64_t now = now_ns();
+    int timeout, n;
+
+    if (now >= end_ns)
+      break;
+
+    if (w->down > 0) {
+      for (int i = 0; i < w->nclients; i++) {
+        struct client *c = &w->clients[i];
+
+        if (c->fd == -1 && c->retry_at <= now) {
+          w->down--;
+          client_open(c);
+        }
+      }
+    }
+
+    if (w->interval > 0) {
+      while (w->next <= now) {
+        struct request r = {w->next, 0, worker_target(w)};
+
+        pending_push(w, &r, 0);
+        w->next += w->interval;
+      }
+    }
+
+    if (now >= start_ns)
+      worker_dispatch(w, now);
+
+    // Sleep until the next request is due, whole milliseconds at most
+    if (now < start_ns)
+      timeout = 1;
+    else if (w->interval > 0)
+      timeout = (int)((w->next - now) / 1000000);
+    else
+      timeout = 100;
+    if (w->down > 0 && timeout > 10)
+      timeout = 10;
+    if ((end_ns - now) / 1000000 < (uint64_t)timeout)
+      timeout = (int)((end_ns - now) / 1000000);
+
+    n = epoll_wait(w->epfd, events, LOADGEN_EVENTS, timeout);
+    for (int i = 0; i < n; i++)
+      client_event(events[i].data.ptr, events[i].events);
+  }
+
+  w->unfinished = w->pending_count;
+  for (int i = 0; i < w->nclients; i++) {
+    struct client *c = &w->clients[i];
+
+    w->unfinished += c->count;
+    if (c->fd != -1)
+      close(c->fd);
+  }
+
+  return NULL;
+}
+
+/**
+ * Add an entry to the URL mix, "path" or "path=weight"
+ */
+void target_add(char *spec) {
+  char *path = strdup(spec);
+  char *eq = strrchr(path, '=');
+  int weight = 1;
+  struct target *t;
+
+  if (eq != NULL && eq[1] >= '0' && eq[1] <= '9') {
+    *eq = '\0';
+    weight = atoi(eq + 1);
+  }
+  if (path[0] != '/' || weight < 1) {
+    fprintf(stderr, "loadgen: bad URL %s\n", spec);
+    exit(1);
+  }
+
+  targets = realloc(targets, (ntargets + 1) * sizeof *targets);
+  t = &targets[ntargets++];
+  t->path = path;
+  t->weight = weight;
+  t->length = snprintf(t->request, sizeof t->request,
+                       "GET %s HTTP/1.1\r\n"
+                       "Host: %s:%s\r\n"
+                       "Connection: %s\r\n"
+                       "\r\n",
+                       path, host, port, keepalive ? "keep-alive" : "close");
+  if (t->length >= (int)sizeof t->request) {
+    fprintf(stderr, "loadgen: URL too long %s\n", spec);
+    exit(1);
+  }
+  total_weight += weight;
+}
+
+void print_latency(char *title, struct hist *h) {
+  double percentiles[] = {50, 75, 90, 99, 99.9, 99.99};
+
+  double mean, stddev;
+
+  hist_stats(h, &mean, &stddev);
+  printf("Latency, %s (ms)\n", title);
+  printf("  %-8s %10.3f (stddev %.3f)\n", "mean", mean / 1e6, stddev / 1e6);
+  for (size_t i = 0; i < sizeof percentiles / sizeof percentiles[0]; i++)
+    printf("  p%-7g %10.3f\n", percentiles[i],
+           hist_percentile(h, percentiles[i]) / 1e6);
+  printf("  %-8s %10.3f\n", "max", h->max / 1e6);
+}
+
+void usage(void) {
+  fprintf(stderr,
+          "usage: loadgen [-H host] [-p port] [-c connections] [-t threads]\n"
+          "               [-r rate] [-d seconds] [-P depth] [-K]\n"
+          "               [-u path[=weight]]... [-o file.hgrm]\n"
+          "  -r  requests per second, open loop; 0 for closed loop "
+          "(default)\n"
+          "  -P  pipelined requests per connection (default 1, max %d)\n"
+          "  -K  no keep-alive: one request per connection\n"
+          "  -u  URL to request, weighted; repeat for a mix (default: /, "
+          "/cat.jpg,\n"
+          "      /rubbish.txt and /nonexistent, as tests/test_load.py)\n"
+          "  -o  also write the corrected latency distribution as .hgrm\n",
+          LOADGEN_PIPELINE_MAX);
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  char *urls[64];
+  int nurls = 0;
+  char *hgrm = NULL;
+  struct addrinfo hints, *res;
+  struct worker *workers;
+  struct hist *corrected, *uncorrected;
+  uint64_t completed = 0, errors = 0, connect_errors = 0, reconnects = 0;
+  uint64_t bytes = 0, unfinished = 0, status[6] = {0};
+  int opt, rv;
+
+  while ((opt = getopt(argc, argv, "H:p:c:t:r:d:P:Ku:o:")) != -1) {
+    switch (opt) {
+    case 'H':
+      host = optarg;
+      break;
+    case 'p':
+      port = optarg;
+      break;
+    case 'c':
+      nconnections = atoi(optarg);
+      break;
+    case 't':
+      nthreads = atoi(optarg);
+      break;
+    case 'r':
+      rate = atof(optarg);
+      break;
+    case 'd':
+      duration = atof(optarg);
+      break;
+    case 'P':
+      depth = atoi(optarg);
+      break;
+    case 'K':
+      keepalive = 0;
+      break;
+    case 'u':
+      if (nurls == (int)(sizeof urls / sizeof urls[0]))
+        usage();
+      urls[nurls++] = optarg;
+      break;
+    case 'o':
+      hgrm = optarg;
+      break;
+    default:
+      usage();
+    }
+  }
+
+  if (nthreads < 1 || nconnections < nthreads || rate < 0 || duration <= 0 ||
+      depth < 1 || depth > LOADGEN_PIPELINE_MAX)
+    usage();
+  if (!keepalive)
+    depth = 1;
+
+  if (nurls == 0) {
+    target_add("/");
+    target_add("/cat.jpg");
+    target_add("/rubbish.txt");
+    target_add("/nonexistent");
+  }
+  for (int i = 0; i < nurls; i++)
+    target_add(urls[i]);
+
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if ((rv = getaddrinfo(host, port, &hints, &res)) != 0) {
+    fprintf(stderr, "loadgen: %s: %s\n", host, gai_strerror(rv));
+    return 1;
+  }
+  memcpy(&addr, res->ai_addr, res->ai_addrlen);
+  addrlen = res->ai_addrlen;
+  freeaddrinfo(res);
+
+  printf("%gs at %s:%s, %d threads, %d connections, ", duration, host, port,
+         nthreads, nconnections);
+  if (rate > 0)
+    printf("%g req/s", rate);
+  else
+    printf("closed loop");
+  printf(", pipeline %d%s\n", depth, keepalive ? "" : ", no keep-alive");
+  for (int i = 0; i < ntargets; i++)
+    printf("  %-24s weight %d\n", targets[i].path, targets[i].weight);
+
+  workers = calloc(nthreads, sizeof *workers);
+  start_ns = now_ns() + 10000000; // let every thread get going first
+  end_ns = start_ns + (uint64_t)(duration * 1e9);
+
+  for (int i = 0; i < nthreads; i++) {
+    struct worker *w = &workers[i];
+
+    w->index = i;
+    w->rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+    w->epfd = epoll_create1(0);
+    w->nclients = nconnections / nthreads + (i < nconnections % nthreads);
+    w->clients = calloc(w->nclients, sizeof *w->clients);
+    w->ready = calloc(w->nclients, sizeof *w->ready);
+    w->per_target = calloc(ntargets, sizeof *w->per_target);
+    for (int j = 0; j < w->nclients; j++) {
+      w->clients[j].fd = -1;
+      w->clients[j].w = w;
+    }
+
+    // Each thread takes every nthreads'th slot of the overall schedule
+    if (rate > 0) {
+      w->interval = (uint64_t)(1e9 * nthreads / rate);
+      w->next = start_ns + (uint64_t)(1e9 * i / rate);
+    }
+
+    pthread_create(&w->thread, NULL, worker_run, w);
+  }
+
+  corrected = calloc(1, sizeof *corrected);
+  uncorrected = calloc(1, sizeof *uncorrected);
+
+  for (int i = 0; i < nthreads; i++) {
+    struct worker *w = &workers[i];
+
+    pthread_join(w->thread, NULL);
+    hist_merge(corrected, &w->corrected);
+    hist_merge(uncorrected, &w->uncorrected);
+    completed += w->completed;
+    errors += w->errors;
+    connect_errors += w->connect_errors;
+    reconnects += w->reconnects;
+    bytes += w->bytes;
+    unfinished += w->unfinished;
+    for (int j = 0; j < 6; j++)
+      status[j] += w->status[j];
+  }
+
+  printf("\nRequests\n");
+  printf("  completed   %llu (%.1f/s, %.2f MB/s read)\n",
+         (unsigned long long)completed, completed / duration,
+         bytes / duration / 1e6);
+  printf("  errors      %llu, connect errors %llu\n",
+         (unsigned long long)errors, (unsigned long long)connect_errors);
+  printf("  reconnects  %llu\n", (unsigned long long)reconnects);
+  printf("  unfinished  %llu (in flight or overdue at the end)\n",
+         (unsigned long long)unfinished);
+  printf("  status      1xx %llu, 2xx %llu, 3xx %llu, 4xx %llu, 5xx %llu, "
+         "other %llu\n",
+         (unsigned long long)status[0], (unsigned long long)status[1],
+         (unsigned long long)status[2], (unsigned long long)status[3],
+         (unsigned long long)status[4], (unsigned long long)status[5]);
+  for (int i = 0; i < ntargets; i++) {
+    uint64_t n = 0;
+
+    for (int j = 0; j < nthreads; j++)
+      n += workers[j].per_target[i];
+    printf("  %-24s %llu\n", targets[i].path, (unsigned long long)n);
+  }
+
+  printf("\n");
+  if (rate > 0)
+    print_latency("from intended start (corrected)", corrected);
+  print_latency("from send (uncorrected)", uncorrected);
+
+  if (hgrm != NULL) {
+    FILE *f = fopen(hgrm, "w");
+
+    if (f == NULL) {
+      perror(hgrm);
+      return 1;
+    }
+    hist_write(f, rate > 0 ? corrected : uncorrected);
+    fclose(f);
+  }
+
+  return errors > 0 || connect_errors > 0;
+}
@@ -0,0 +1,90 @@
+/**
+ * Connection accounting and deadlines shared by the serving loops
+ */
+
+#include "loop.h"
+#include "conn.h"
+#include "metrics.h"
+#include "wheel.h"
+
+/**
+ * Is n at a limit? Once paused, it stays so until n drops below the
+ * resume watermark.
+ */
+int loop_limit_hit(int n, int limit, int paused) {
+  if (limit <= 0)
+    return 0;
+
+  if (paused)
+    return n > (long)limit * LOOP_RESUME_PERCENT / 100;
+
+  return n >= limit;
+}
+
+/**
+ * Should a loop with loop_conns open connections (not) be accepting?
+ *
+ * paused says whether it is paused now, for the hysteresis.
+ */
+int loop_at_limit(struct loop_config *cfg, int loop_conns, int paused) {
+  int open = __atomic_load_n(&cfg->conns, __ATOMIC_RELAXED);
+
+  return loop_limit_hit(open, cfg->max_conns, paused) ||
+         loop_limit_hit(loop_conns, cfg->max_loop_conns, paused);
+}
+
+void loop_conn_opened(struct loop_config *cfg) {
+  __atomic_add_fetch(&cfg->conns, 1, __ATOMIC_RELAXED);
+}
+
+void loop_conn_closed(struct loop_config *cfg) {
+  __atomic_sub_fetch(&cfg->conns, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * The limit on a stage (an enum metrics_timeout) in ms, 0 for none
+ */
+int loop_timeout_ms(struct loop_timeouts *timeouts, int stage) {
+  switch (stage) {
+  case METRICS_TIMEOUT_IDLE:
+    return timeouts->idle;
+  case METRICS_TIMEOUT_HEADER:
+    return timeouts->header;
+  case METRICS_TIMEOUT_BODY:
+    return timeouts->body;
+  default:
+    return timeouts->write;
+  }
+}
+
+/**
+ * Arm a connection's timer for a stage, counting from now, or disarm it if
+ * that stage has no limit
+ */
+void loop_arm(struct loop_config *cfg, struct wheel *w, struct wheel_timer *t,
+              int stage) {
+  int ms = loop_timeout_ms(&cfg->timeouts, stage);
+
+  if (ms > 0)
+    wheel_add(w, t, wheel_now_ms() + ms);
+  else
+    wheel_del(w, t);
+}
+
+/**
+ * Re-arm a reading connection's timer after it received something
+ *
+ * stage is the one the timer was armed for. The header deadline runs from
+ * the first byte, however the headers trickle in; the body deadline
+ * restarts with every read, so a slow but steady upload survives. Returns
+ * the stage now armed.
+ */
+int loop_arm_read(struct loop_config *cfg, struct wheel *w,
+                  struct wheel_timer *t, int stage, struct conn *conn) {
+  int now = conn_read_stage(conn);
+
+  if (now != stage || now == METRICS_TIMEOUT_BODY)
+    loop_arm(cfg, w, t, now);
+
+  return now;
+}
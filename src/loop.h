@@ -0,0 +1,75 @@
+#ifndef _LOOP_H_
+#define _LOOP_H_
+
+#include <signal.h>
+
+#define LOOP_MAX_SOURCES 8
+
+struct cache;
+struct conn;
+struct iopool;
+struct wheel;
+struct wheel_timer;
+
+// A descriptor the serving loop watches next to the listener
+struct loop_source {
+  int fd;
+  // Called on the loop thread when fd is readable
+  void (*ready)(void *arg, struct cache *cache);
+  void *arg;
+};
+
+// How long a connection may take over each stage, in ms; 0 for no limit
+struct loop_timeouts {
+  int idle;   // from accept to the first request byte
+  int header; // from the first byte to the end of the headers
+  int body;   // between reads of a request body
+  int write;  // between writes of the response
+};
+
+#define LOOP_TICK_MS 100 // deadline resolution
+#define LOOP_IDLE_TIMEOUT_MS 10000
+#define LOOP_HEADER_TIMEOUT_MS 10000
+#define LOOP_BODY_TIMEOUT_MS 10000
+#define LOOP_WRITE_TIMEOUT_MS 30000
+
+// Everything a serving loop needs
+struct loop_config {
+  int listenfd;
+  struct cache *cache;
+  struct iopool *pool; // disk I/O for loops that park misses, or NULL
+  struct loop_source sources[LOOP_MAX_SOURCES];
+  int nsources;
+  volatile sig_atomic_t *stop; // loop returns once this is set
+
+  // Connection limits, 0 for none. A loop stops accepting on reaching one
+  // and starts again below LOOP_RESUME_PERCENT of it, leaving the rest in
+  // the listen queue rather than thrashing.
+  int max_conns;      // across every loop
+  int max_loop_conns; // per loop
+  int conns;          // open across every loop; atomic
+  int exact_limits;   // set by hand, so never overshot even briefly
+
+  struct loop_timeouts timeouts;
+};
+
+#define LOOP_RESUME_PERCENT 90
+#define LOOP_ACCEPT_BATCH 64 // accepts per listener wakeup
+
+// Provided by server.c
+extern void handle_http_request(struct conn *conn);
+
+extern int loop_at_limit(struct loop_config *cfg, int loop_conns, int paused);
+extern void loop_conn_opened(struct loop_config *cfg);
+extern void loop_conn_closed(struct loop_config *cfg);
+extern int loop_timeout_ms(struct loop_timeouts *timeouts, int stage);
+extern void loop_arm(struct loop_config *cfg, struct wheel *w,
+                     struct wheel_timer *t, int stage);
+extern int loop_arm_read(struct loop_config *cfg, struct wheel *w,
+                         struct wheel_timer *t, int stage, struct conn *conn);
+
+extern int serve_blocking(struct loop_config *cfg);
+extern int serve_epoll(struct loop_config *cfg);
+extern int serve_uring(struct loop_config *cfg);
+
+#endif
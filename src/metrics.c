@@ -0,0 +1,492 @@
+/**
+ * Request and cache metrics, exposed in Prometheus text format
+ *
+ * Each thread counts into its own shard, found through a thread-local
+ * pointer, so recording is a handful of uncontended stores. Shards are
+ * never freed while the server runs; a scrape walks them all and adds them
+ * up.
+ */
+
+#define _GNU_SOURCE // open_memstream()
+
+#include "metrics.h"
+#include "accesslog.h"
+#include "cache.h"
+#include "shcache.h"
+#include "tier.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+__thread struct metrics_shard *metrics_local = NULL;
+
+struct metrics_shard *metrics_shards = NULL;
+pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Prefork worker this process is, put on every sample as a label so each
+// worker's counters are a series of their own; -1 without -P
+int metrics_worker = -1;
+
+const char *metrics_endpoint_names[METRICS_EP_COUNT] = {
+    "static", "d20", "metrics", "save", "other",
+};
+
+const char *metrics_code_names[METRICS_CODE_COUNT] = {
+    "200", "304", "400", "404", "500", "other",
+};
+
+const char *metrics_phase_names[METRICS_PHASE_COUNT] = {
+    "parse", "cache_lookup", "disk_load", "send",
+};
+
+const char *metrics_timeout_names[METRICS_TIMEOUT_COUNT] = {
+    "idle", "header", "body", "write",
+};
+
+/**
+ * Monotonic clock in nanoseconds
+ */
+uint64_t metrics_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * This thread's shard, registered on first use
+ */
+struct metrics_shard *metrics_shard(void) {
+  if (metrics_local != NULL)
+    return metrics_local;
+
+  struct metrics_shard *shard = calloc(1, sizeof *shard);
+  if (shard == NULL)
+    return NULL;
+
+  pthread_mutex_lock(&metrics_lock);
+  shard->next = metrics_shards;
+  metrics_shards = shard;
+  pthread_mutex_unlock(&metrics_lock);
+
+  return metrics_local = shard;
+}
+
+/**
+ * Add to a counter in this thread's shard
+ *
+ * The owner is the only writer: a relaxed store is enough for a scrape on
+ * another thread to see a whole value.
+ */
+void metrics_add(uint64_t *counter, uint64_t n) {
+  __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+/**
+ * Bucket for a latency, or -1 if it's past the last one
+ */
+int metrics_bucket(uint64_t ns) {
+  if (ns < (1ULL << METRICS_MIN_SHIFT))
+    return 0;
+
+  int power = 63 - __builtin_clzll(ns);
+  if (power >= METRICS_MIN_SHIFT + METRICS_POWERS)
+    return -1;
+
+  int sub = (ns >> (power - METRICS_SUB_BITS)) & (METRICS_SUB - 1);
+
+  return 1 + (power - METRICS_MIN_SHIFT) * METRICS_SUB + sub;
+}
+
+/**
+ * Upper bound of a bucket, in nanoseconds
+ */
+uint64_t metrics_bucket_bound(int bucket) {
+  if (bucket == 0)
+    return 1ULL << METRICS_MIN_SHIFT;
+
+  int power = METRICS_MIN_SHIFT + (bucket - 1) / METRICS_SUB;
+  int sub = (bucket - 1) % METRICS_SUB;
+
+  return (uint64_t)(METRICS_SUB + sub + 1) << (power - METRICS_SUB_BITS);
+}
+
+/**
+ * Record how long a phase of a request took
+ */
+void metrics_observe(int phase, uint64_t ns) {
+  struct metrics_shard *shard = metrics_shard();
+  if (shard == NULL)
+    return;
+
+  struct metrics_histogram *h = &shard->latency[phase];
+  int bucket = metrics_bucket(ns);
+
+  if (bucket != -1)
+    metrics_add(&h->buckets[bucket], 1);
+  metrics_add(&h->count, 1);
+  metrics_add(&h->sum_ns, ns);
+}
+
+/**
+ * Count an answered request
+ */
+void metrics_request(int endpoint, int status, uint64_t bytes) {
+  struct metrics_shard *shard = metrics_shard();
+  if (shard == NULL)
+    return;
+
+  int code;
+  switch (status) {
+  case 200:
+    code = METRICS_CODE_200;
+    break;
+  case 304:
+    code = METRICS_CODE_304;
+    break;
+  case 400:
+    code = METRICS_CODE_400;
+    break;
+  case 404:
+    code = METRICS_CODE_404;
+    break;
+  case 500:
+    code = METRICS_CODE_500;
+    break;
+  default:
+    code = METRICS_CODE_OTHER;
+  }
+
+  metrics_add(&shard->requests[endpoint][code], 1);
+  metrics_add(&shard->bytes_sent, bytes);
+}
+
+/**
+ * Count connections opened (+1) or closed (-1)
+ */
+void metrics_connections(int delta) {
+  struct metrics_shard *shard = metrics_shard();
+  if (shard == NULL)
+    return;
+
+  __atomic_store_n(&shard->connections, shard->connections + delta,
+                   __ATOMIC_RELAXED);
+}
+
+/**
+ * Count a connection closed for missing a deadline (enum metrics_timeout)
+ */
+void metrics_timeout(int stage) {
+  struct metrics_shard *shard = metrics_shard();
+  if (shard == NULL)
+    return;
+
+  __atomic_store_n(&shard->timeouts[stage], shard->timeouts[stage] + 1,
+                   __ATOMIC_RELAXED);
+}
+
+/**
+ * Count a job run by a disk I/O thread, and whether it was stolen from
+ * another thread's ring
+ */
+void metrics_disk_job(int stolen) {
+  struct metrics_shard *shard = metrics_shard();
+  if (shard == NULL)
+    return;
+
+  metrics_add(&shard->disk_jobs, 1);
+  if (stolen)
+    metrics_add(&shard->disk_jobs_stolen, 1);
+}
+
+/**
+ * Add up every shard
+ */
+void metrics_collect(struct metrics_shard *total) {
+  pthread_mutex_lock(&metrics_lock);
+
+  for (struct metrics_shard *s = metrics_shards; s != NULL; s = s->next) {
+    for (int e = 0; e < METRICS_EP_COUNT; e++)
+      for (int c = 0; c < METRICS_CODE_COUNT; c++)
+        total->requests[e][c] +=
+            __atomic_load_n(&s->requests[e][c], __ATOMIC_RELAXED);
+
+    total->bytes_sent += __atomic_load_n(&s->bytes_sent, __ATOMIC_RELAXED);
+    total->connections += __atomic_load_n(&s->connections, __ATOMIC_RELAXED);
+    for (int t = 0; t < METRICS_TIMEOUT_COUNT; t++)
+      total->timeouts[t] += __atomic_load_n(&s->timeouts[t], __ATOMIC_RELAXED);
+    total->disk_jobs += __atomic_load_n(&s->disk_jobs, __ATOMIC_RELAXED);
+    total->disk_jobs_stolen +=
+        __atomic_load_n(&s->disk_jobs_stolen, __ATOMIC_RELAXED);
+
+    for (int p = 0; p < METRICS_PHASE_COUNT; p++) {
+      struct metrics_histogram *h = &s->latency[p];
+
+      for (int b = 0; b < METRICS_BUCKETS; b++)
+        total->latency[p].buckets[b] +=
+            __atomic_load_n(&h->buckets[b], __ATOMIC_RELAXED);
+      total->latency[p].count += __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+      total->latency[p].sum_ns +=
+          __atomic_load_n(&h->sum_ns, __ATOMIC_RELAXED);
+    }
+  }
+
+  pthread_mutex_unlock(&metrics_lock);
+}
+
+/**
+ * Label every sample with this process's worker number
+ */
+void metrics_set_worker(int worker) { metrics_worker = worker; }
+
+/**
+ * Write the rendered metrics in buf to f, with a worker label added to
+ * every sample line
+ */
+void metrics_write_labelled(FILE *f, char *buf, size_t length) {
+  char *end = buf + length;
+
+  for (char *line = buf; line < end;) {
+    char *eol = memchr(line, '\n', end - line);
+    char *next = eol != NULL ? eol + 1 : end;
+
+    if (*line == '#') {
+      fwrite(line, 1, next - line, f);
+    } else {
+      size_t name = strcspn(line, "{ ");
+      int labels = line[name] == '{';
+
+      fprintf(f, "%.*s{worker=\"%d\"%s", (int)name, line, metrics_worker,
+              labels ? "," : "}");
+      fwrite(line + name + labels, 1, next - (line + name + labels), f);
+    }
+
+    line = next;
+  }
+}
+
+/**
+ * Render every metric in Prometheus text format
+ *
+ * cache is read directly, so call this on the thread that owns it. Returns
+ * a malloc()ed buffer of *length bytes, or NULL if out of memory.
+ */
+char *metrics_format(struct cache *cache, size_t *length) {
+  struct metrics_shard total = {0};
+  char *buf = NULL;
+
+  FILE *f = open_memstream(&buf, length);
+  if (f == NULL)
+    return NULL;
+
+  metrics_collect(&total);
+
+  fprintf(f, "# HELP webserver_requests_total Requests answered, by endpoint "
+             "and status code.\n"
+             "# TYPE webserver_requests_total counter\n");
+  for (int e = 0; e < METRICS_EP_COUNT; e++)
+    for (int c = 0; c < METRICS_CODE_COUNT; c++)
+      if (total.requests[e][c] > 0)
+        fprintf(f,
+                "webserver_requests_total{endpoint=\"%s\",code=\"%s\"} "
+                "%llu\n",
+                metrics_endpoint_names[e], metrics_code_names[c],
+                (unsigned long long)total.requests[e][c]);
+
+  fprintf(f,
+          "# HELP webserver_sent_bytes_total Response bytes written to "
+          "sockets.\n"
+          "# TYPE webserver_sent_bytes_total counter\n"
+          "webserver_sent_bytes_total %llu\n"
+          "# HELP webserver_connections Connections currently open.\n"
+          "# TYPE webserver_connections gauge\n"
+          "webserver_connections %lld\n",
+          (unsigned long long)total.bytes_sent, (long long)total.connections);
+
+  fprintf(f, "# HELP webserver_timeouts_total Connections closed for missing "
+             "a deadline, by stage.\n"
+             "# TYPE webserver_timeouts_total counter\n");
+  for (int t = 0; t < METRICS_TIMEOUT_COUNT; t++)
+    fprintf(f, "webserver_timeouts_total{stage=\"%s\"} %llu\n",
+            metrics_timeout_names[t], (unsigned long long)total.timeouts[t]);
+
+  fprintf(f,
+          "# HELP webserver_disk_jobs_total Jobs run by disk I/O threads.\n"
+          "# TYPE webserver_disk_jobs_total counter\n"
+          "webserver_disk_jobs_total %llu\n"
+          "# HELP webserver_disk_jobs_stolen_total Disk jobs an idle thread "
+          "took from a busy one's queue.\n"
+          "# TYPE webserver_disk_jobs_stolen_total counter\n"
+          "webserver_disk_jobs_stolen_total %llu\n",
+          (unsigned long long)total.disk_jobs,
+          (unsigned long long)total.disk_jobs_stolen);
+
+  fprintf(f, "# HELP webserver_phase_seconds Time spent in each phase of a "
+             "request.\n"
+             "# TYPE webserver_phase_seconds histogram\n");
+  for (int p = 0; p < METRICS_PHASE_COUNT; p++) {
+    struct metrics_histogram *h = &total.latency[p];
+    const char *name = metrics_phase_names[p];
+    uint64_t cumulative = 0;
+
+    for (int b = 0; b < METRICS_BUCKETS; b++) {
+      cumulative += h->buckets[b];
+      fprintf(f, "webserver_phase_seconds_bucket{phase=\"%s\",le=\"%.9g\"} "
+                 "%llu\n",
+              name, metrics_bucket_bound(b) / 1e9,
+              (unsigned long long)cumulative);
+    }
+
+    fprintf(f,
+            "webserver_phase_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %llu\n"
+            "webserver_phase_seconds_sum{phase=\"%s\"} %.9f\n"
+            "webserver_phase_seconds_count{phase=\"%s\"} %llu\n",
+            name, (unsigned long long)h->count, name, h->sum_ns / 1e9, name,
+            (unsigned long long)h->count);
+  }
+
+  if (cache != NULL)
+    fprintf(f,
+            "# HELP webserver_cache_hits_total Cache lookups that hit.\n"
+            "# TYPE webserver_cache_hits_total counter\n"
+            "webserver_cache_hits_total %lu\n"
+            "# HELP webserver_cache_misses_total Cache lookups that missed.\n"
+            "# TYPE webserver_cache_misses_total counter\n"
+            "webserver_cache_misses_total %lu\n"
+            "# HELP webserver_cache_evictions_total Entries evicted to make "
+            "room.\n"
+            "# TYPE webserver_cache_evictions_total counter\n"
+            "webserver_cache_evictions_total %lu\n"
+            "# HELP webserver_cache_entries Entries in the cache.\n"
+            "# TYPE webserver_cache_entries gauge\n"
+            "webserver_cache_entries %d\n"
+            "# HELP webserver_cache_bytes Content bytes held by the cache.\n"
+            "# TYPE webserver_cache_bytes gauge\n"
+            "webserver_cache_bytes %ld\n"
+            "# HELP webserver_cache_negative_hits_total Lookups answered from "
+            "the cache of missing paths.\n"
+            "# TYPE webserver_cache_negative_hits_total counter\n"
+            "webserver_cache_negative_hits_total %lu\n"
+            "# HELP webserver_cache_negative_entries Missing paths "
+            "remembered.\n"
+            "# TYPE webserver_cache_negative_entries gauge\n"
+            "webserver_cache_negative_entries %d\n"
+            "# HELP webserver_cache_coalesced_total Misses served by "
+            "waiting on a load already in flight.\n"
+            "# TYPE webserver_cache_coalesced_total counter\n"
+            "webserver_cache_coalesced_total %lu\n",
+            cache->hits, cache->misses, cache->evictions, cache->cur_size,
+            cache->bytes, cache->missing_hits, cache->missing_count,
+            cache->coalesced);
+
+  if (cache != NULL && cache->tier != NULL)
+    fprintf(f,
+            "# HELP webserver_cache_tier_entries Entries in the warm tier "
+            "on disk.\n"
+            "# TYPE webserver_cache_tier_entries gauge\n"
+            "webserver_cache_tier_entries %d\n"
+            "# HELP webserver_cache_tier_bytes Content bytes held by the "
+            "warm tier.\n"
+            "# TYPE webserver_cache_tier_bytes gauge\n"
+            "webserver_cache_tier_bytes %lld\n"
+            "# HELP webserver_cache_tier_demotions_total RAM evictions kept "
+            "in the warm tier.\n"
+            "# TYPE webserver_cache_tier_demotions_total counter\n"
+            "webserver_cache_tier_demotions_total %lu\n"
+            "# HELP webserver_cache_tier_promotions_total Hits served from "
+            "the warm tier.\n"
+            "# TYPE webserver_cache_tier_promotions_total counter\n"
+            "webserver_cache_tier_promotions_total %lu\n"
+            "# HELP webserver_cache_tier_evictions_total Warm tier entries "
+            "evicted to make room.\n"
+            "# TYPE webserver_cache_tier_evictions_total counter\n"
+            "webserver_cache_tier_evictions_total %lu\n",
+            cache->tier->count, (long long)cache->tier->bytes,
+            cache->demotions, cache->promotions, cache->tier->evictions);
+
+  // Read without the lock: a scrape can be off by the odd update
+  if (cache != NULL && cache->shared != NULL) {
+    struct shcache_header *h = cache->shared->header;
+    uint64_t hits, misses;
+
+    shcache_lookups(cache->shared, &hits, &misses);
+
+    fprintf(f,
+            "# HELP webserver_shared_cache_entries Entries in the cache "
+            "shared by workers.\n"
+            "# TYPE webserver_shared_cache_entries gauge\n"
+            "webserver_shared_cache_entries %llu\n"
+            "# HELP webserver_shared_cache_bytes Content bytes held by the "
+            "shared cache.\n"
+            "# TYPE webserver_shared_cache_bytes gauge\n"
+            "webserver_shared_cache_bytes %llu\n"
+            "# HELP webserver_shared_cache_hits_total Misses in a worker's "
+            "own index found in the shared cache.\n"
+            "# TYPE webserver_shared_cache_hits_total counter\n"
+            "webserver_shared_cache_hits_total %llu\n"
+            "# HELP webserver_shared_cache_misses_total Misses in a worker's "
+            "own index not found there either.\n"
+            "# TYPE webserver_shared_cache_misses_total counter\n"
+            "webserver_shared_cache_misses_total %llu\n"
+            "# HELP webserver_shared_cache_evictions_total Shared cache "
+            "entries evicted to make room.\n"
+            "# TYPE webserver_shared_cache_evictions_total counter\n"
+            "webserver_shared_cache_evictions_total %llu\n",
+            (unsigned long long)h->count, (unsigned long long)h->bytes,
+            (unsigned long long)hits, (unsigned long long)misses,
+            (unsigned long long)h->evictions);
+  }
+
+  if (access_log != NULL)
+    fprintf(f,
+            "# HELP webserver_access_log_dropped_total Access log lines "
+            "dropped because a thread's buffer was full.\n"
+            "# TYPE webserver_access_log_dropped_total counter\n"
+            "webserver_access_log_dropped_total %llu\n",
+            (unsigned long long)accesslog_dropped(access_log));
+
+  if (fclose(f) != 0) {
+    free(buf);
+    return NULL;
+  }
+
+  if (metrics_worker == -1)
+    return buf;
+
+  char *unlabelled = buf;
+  size_t unlabelled_length = *length;
+
+  buf = NULL;
+  f = open_memstream(&buf, length);
+  if (f != NULL)
+    metrics_write_labelled(f, unlabelled, unlabelled_length);
+  free(unlabelled);
+
+  if (f == NULL || fclose(f) != 0) {
+    free(buf);
+    return NULL;
+  }
+
+  return buf;
+}
+
+/**
+ * Free every shard; only once no thread records anything any more
+ */
+void metrics_free(void) {
+  pthread_mutex_lock(&metrics_lock);
+
+  while (metrics_shards != NULL) {
+    struct metrics_shard *next = metrics_shards->next;
+
+    free(metrics_shards);
+    metrics_shards = next;
+  }
+
+  pthread_mutex_unlock(&metrics_lock);
+
+  metrics_local = NULL;
+}
@@ -0,0 +1,88 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct cache;
+
+// What a request asked for
+enum metrics_endpoint {
+  METRICS_EP_STATIC,
+  METRICS_EP_D20,
+  METRICS_EP_METRICS,
+  METRICS_EP_SAVE,
+  METRICS_EP_OTHER,
+  METRICS_EP_COUNT,
+};
+
+// Response codes counted separately; anything else is "other"
+enum metrics_code {
+  METRICS_CODE_200,
+  METRICS_CODE_304,
+  METRICS_CODE_400,
+  METRICS_CODE_404,
+  METRICS_CODE_500,
+  METRICS_CODE_OTHER,
+  METRICS_CODE_COUNT,
+};
+
+// Where a request spends its time
+enum metrics_phase {
+  METRICS_PARSE,        // request line to handler
+  METRICS_CACHE_LOOKUP, // cache_get()
+  METRICS_DISK_LOAD,    // reading a whole file into memory
+  METRICS_SEND,         // response queued to connection done
+  METRICS_PHASE_COUNT,
+};
+
+// Deadlines a connection can miss
+enum metrics_timeout {
+  METRICS_TIMEOUT_IDLE,   // accepted, but nothing sent
+  METRICS_TIMEOUT_HEADER, // request headers not all in
+  METRICS_TIMEOUT_BODY,   // request body stalled
+  METRICS_TIMEOUT_WRITE,  // client stopped reading the response
+  METRICS_TIMEOUT_COUNT,
+};
+
+// Log-linear latency buckets: 1.024us, then each power of two up to ~17s
+// split into METRICS_SUB linear steps
+#define METRICS_SUB_BITS 2
+#define METRICS_SUB (1 << METRICS_SUB_BITS)
+#define METRICS_MIN_SHIFT 10
+#define METRICS_POWERS 24
+#define METRICS_BUCKETS (1 + METRICS_POWERS * METRICS_SUB)
+
+struct metrics_histogram {
+  uint64_t buckets[METRICS_BUCKETS]; // not cumulative
+  uint64_t count;
+  uint64_t sum_ns;
+};
+
+// One thread's counters
+//
+// Only the owning thread writes them, so updates are plain relaxed stores;
+// a scrape sums every shard with relaxed loads.
+struct metrics_shard {
+  uint64_t requests[METRICS_EP_COUNT][METRICS_CODE_COUNT];
+  uint64_t bytes_sent;
+  int64_t connections; // opened minus closed on this thread
+  struct metrics_histogram latency[METRICS_PHASE_COUNT];
+  uint64_t timeouts[METRICS_TIMEOUT_COUNT];
+  uint64_t disk_jobs;        // run by an iopool thread
+  uint64_t disk_jobs_stolen; // ...taken from another thread's ring
+
+  struct metrics_shard *next;
+};
+
+extern uint64_t metrics_now(void);
+extern void metrics_observe(int phase, uint64_t ns);
+extern void metrics_request(int endpoint, int status, uint64_t bytes);
+extern void metrics_connections(int delta);
+extern void metrics_timeout(int stage);
+extern void metrics_disk_job(int stolen);
+extern void metrics_set_worker(int worker);
+extern char *metrics_format(struct cache *cache, size_t *length);
+extern void metrics_free(void);
+
+#endif
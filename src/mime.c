@@ -1,20 +1,9 @@
 #include "mime.h"
-#include <ctype.h>
 #include <string.h>
+#include <strings.h>
 
 #define DEFAULT_MIME_TYPE "application/octet-stream"
 
-/**
- * Lowercase a string
- */
-char *strlower(char *s) {
-  for (char *p = s; *p != '\0'; p++) {
-    *p = tolower(*p);
-  }
-
-  return s;
-}
-
 /**
  * Return a MIME type for a given filename
  */
@@ -27,32 +16,32 @@ char *mime_type_get(char *filename) {
 
   ext++;
 
-  strlower(ext);
-
+  // Compare case-insensitively rather than lowercasing in place: filename is
+  // usually also the cache key
   // TODO: this is O(n) and it should be O(1)
 
-  if (strcmp(ext, "html") == 0 || strcmp(ext, "htm") == 0) {
+  if (strcasecmp(ext, "html") == 0 || strcasecmp(ext, "htm") == 0) {
     return "text/html";
   }
-  if (strcmp(ext, "jpeg") == 0 || strcmp(ext, "jpg") == 0) {
+  if (strcasecmp(ext, "jpeg") == 0 || strcasecmp(ext, "jpg") == 0) {
     return "image/jpg";
   }
-  if (strcmp(ext, "css") == 0) {
+  if (strcasecmp(ext, "css") == 0) {
     return "text/css";
   }
-  if (strcmp(ext, "js") == 0) {
+  if (strcasecmp(ext, "js") == 0) {
     return "application/javascript";
   }
-  if (strcmp(ext, "json") == 0) {
+  if (strcasecmp(ext, "json") == 0) {
     return "application/json";
   }
-  if (strcmp(ext, "txt") == 0) {
+  if (strcasecmp(ext, "txt") == 0) {
     return "text/plain";
   }
-  if (strcmp(ext, "gif") == 0) {
+  if (strcasecmp(ext, "gif") == 0) {
     return "image/gif";
   }
-  if (strcmp(ext, "png") == 0) {
+  if (strcasecmp(ext, "png") == 0) {
     return "image/png";
   }
 
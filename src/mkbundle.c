@@ -0,0 +1,229 @@
+/**
+ * mkbundle.c -- pack static assets into a read-only bundle for the server
+ *
+ *    ./mkbundle assets.bundle ./serverroot ./serverfiles
+ *
+ * Every regular file under each directory is stored under the same path the
+ * server builds for it (e.g. "./serverroot/index.html"), with its MIME type,
+ * an ETag, and a gzip variant when that is meaningfully smaller.
+ */
+
+#include "bundle.h"
+#include "file.h"
+#include "mime.h"
+#include <dirent.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+// Only keep the gzip variant if it saves at least this much
+#define GZIP_MIN_SAVING 0.9
+
+// A file waiting to be packed
+struct asset {
+  char *path;
+  struct bundle_record rec;
+};
+
+struct asset_list {
+  struct asset *a;
+  int count, cap;
+};
+
+/**
+ * Collect every regular file under dir
+ */
+void collect(struct asset_list *list, char *dir) {
+  DIR *d = opendir(dir);
+  if (d == NULL) {
+    perror(dir);
+    exit(1);
+  }
+
+  struct dirent *de;
+  while ((de = readdir(d)) != NULL) {
+    char path[PATH_MAX];
+    struct stat s;
+
+    if (de->d_name[0] == '.')
+      continue;
+
+    snprintf(path, sizeof path, "%s/%s", dir, de->d_name);
+    if (stat(path, &s) == -1)
+      continue;
+
+    if (S_ISDIR(s.st_mode)) {
+      collect(list, path);
+    } else if (S_ISREG(s.st_mode)) {
+      if (list->count == list->cap) {
+        list->cap = list->cap ? list->cap * 2 : 64;
+        list->a = realloc(list->a, list->cap * sizeof *list->a);
+      }
+      memset(&list->a[list->count], 0, sizeof *list->a);
+      list->a[list->count++].path = strdup(path);
+    }
+  }
+
+  closedir(d);
+}
+
+/**
+ * qsort comparator: the server binary-searches with strcmp()
+ */
+int asset_cmp(const void *a, const void *b) {
+  return strcmp(((const struct asset *)a)->path,
+                ((const struct asset *)b)->path);
+}
+
+/**
+ * 64-bit FNV-1a, used for ETags
+ */
+uint64_t fnv1a(const void *data, size_t len) {
+  const unsigned char *p = data;
+  uint64_t h = 0xcbf29ce484222325ULL;
+
+  for (size_t i = 0; i < len; i++) {
+    h ^= p[i];
+    h *= 0x100000001b3ULL;
+  }
+
+  return h;
+}
+
+/**
+ * gzip a buffer; returns the compressed length, or 0 if it didn't shrink
+ * enough to be worth storing
+ */
+size_t gzip_buffer(const void *data, size_t len, void **out) {
+  z_stream zs;
+
+  memset(&zs, 0, sizeof zs);
+  if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK)
+    return 0;
+
+  size_t bound = deflateBound(&zs, len);
+  *out = malloc(bound);
+
+  zs.next_in = (Bytef *)data;
+  zs.avail_in = len;
+  zs.next_out = *out;
+  zs.avail_out = bound;
+
+  int rv = deflate(&zs, Z_FINISH);
+  size_t gzlen = zs.total_out;
+  deflateEnd(&zs);
+
+  if (rv != Z_STREAM_END || gzlen > len * GZIP_MIN_SAVING) {
+    free(*out);
+    *out = NULL;
+    return 0;
+  }
+
+  return gzlen;
+}
+
+/**
+ * Append bytes to the bundle, returning their offset
+ */
+uint64_t emit(FILE *fp, const void *data, size_t len) {
+  uint64_t offset = ftell(fp);
+
+  if (len > 0 && fwrite(data, 1, len, fp) != len) {
+    perror("write");
+    exit(1);
+  }
+
+  return offset;
+}
+
+/**
+ * Main
+ */
+int main(int argc, char **argv) {
+  struct asset_list list = {NULL, 0, 0};
+  struct bundle_header header;
+
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s bundle_file dir...\n", argv[0]);
+    return 1;
+  }
+
+  for (int i = 2; i < argc; i++)
+    collect(&list, argv[i]);
+
+  qsort(list.a, list.count, sizeof *list.a, asset_cmp);
+
+  FILE *fp = fopen(argv[1], "wb");
+  if (fp == NULL) {
+    perror(argv[1]);
+    return 1;
+  }
+
+  // Header and index go first and are filled in once offsets are known
+  memset(&header, 0, sizeof header);
+  emit(fp, &header, sizeof header);
+  header.index_offset = ftell(fp);
+  for (int i = 0; i < list.count; i++)
+    emit(fp, &list.a[i].rec, sizeof list.a[i].rec);
+
+  size_t raw_total = 0, gzip_total = 0;
+
+  for (int i = 0; i < list.count; i++) {
+    struct asset *a = &list.a[i];
+    char etag[24];
+    void *gz;
+
+    struct file_data *filedata = file_load(a->path);
+    if (filedata == NULL) {
+      fprintf(stderr, "%s: cannot read\n", a->path);
+      return 1;
+    }
+
+    snprintf(etag, sizeof etag, "\"%016llx\"",
+             (unsigned long long)fnv1a(filedata->data, filedata->size));
+
+    a->rec.path_offset = emit(fp, a->path, strlen(a->path) + 1);
+    a->rec.mime_offset = emit(fp, mime_type_get(a->path),
+                              strlen(mime_type_get(a->path)) + 1);
+    a->rec.etag_offset = emit(fp, etag, strlen(etag) + 1);
+    a->rec.data_offset = emit(fp, filedata->data, filedata->size);
+    a->rec.data_length = filedata->size;
+
+    a->rec.gzip_length = gzip_buffer(filedata->data, filedata->size, &gz);
+    if (a->rec.gzip_length > 0) {
+      a->rec.gzip_offset = emit(fp, gz, a->rec.gzip_length);
+      free(gz);
+    }
+
+    raw_total += a->rec.data_length;
+    gzip_total += a->rec.gzip_length;
+    file_free(filedata);
+  }
+
+  memcpy(header.magic, BUNDLE_MAGIC, sizeof header.magic);
+  header.size = ftell(fp);
+  header.count = list.count;
+
+  fseek(fp, 0, SEEK_SET);
+  emit(fp, &header, sizeof header);
+  for (int i = 0; i < list.count; i++)
+    emit(fp, &list.a[i].rec, sizeof list.a[i].rec);
+
+  if (fclose(fp) != 0) {
+    perror(argv[1]);
+    return 1;
+  }
+
+  printf("mkbundle: %d files, %zu bytes (+%zu gzip) -> %s\n", list.count,
+         raw_total, gzip_total, argv[1]);
+
+  for (int i = 0; i < list.count; i++)
+    free(list.a[i].path);
+  free(list.a);
+
+  return 0;
+}
@@ -7,8 +7,6 @@
 #include <sys/types.h>
 #include <unistd.h>
 
-#define BACKLOG 10 // how many pending connections queue will hold
-
 /**
  * This gets an Internet address, either IPv4 or IPv6
  *
@@ -22,12 +20,30 @@ void *get_in_addr(struct sockaddr *sa) {
   return &(((struct sockaddr_in6 *)sa)->sin6_addr);
 }
 
+/**
+ * The kernel's cap on listen() backlogs, or -1 if it can't be read
+ */
+int get_somaxconn(void) {
+  FILE *f = fopen("/proc/sys/net/core/somaxconn", "r");
+  int n = -1;
+
+  if (f != NULL) {
+    if (fscanf(f, "%d", &n) != 1)
+      n = -1;
+    fclose(f);
+  }
+
+  return n;
+}
+
 /**
  * Return the main listening socket
  *
+ * backlog is how many pending connections the queue will hold.
+ *
  * Returns -1 or error
  */
-int get_listener_socket(char *port) {
+int get_listener_socket(char *port, int backlog) {
   int sockfd;
   struct addrinfo hints, *servinfo, *p;
   int yes = 1;
@@ -90,9 +106,18 @@ int get_listener_socket(char *port) {
     return -3;
   }
 
+  // The kernel silently trims the backlog to somaxconn; say so, since a
+  // short queue drops SYNs under bursts
+  int somaxconn = get_somaxconn();
+  if (somaxconn != -1 && backlog > somaxconn)
+    fprintf(stderr,
+            "webserver: listen backlog %d capped at %d by "
+            "net.core.somaxconn\n",
+            backlog, somaxconn);
+
   // Start listening. This is what allows remote computers to connect
   // to this socket/IP.
-  if (listen(sockfd, BACKLOG) == -1) {
+  if (listen(sockfd, backlog) == -1) {
     // perror("listen");
     close(sockfd);
     return -4;
@@ -3,7 +3,9 @@
 
 #include <sys/socket.h>
 
+#define BACKLOG 4096 // default pending connection queue; see somaxconn
+
 void *get_in_addr(struct sockaddr *sa);
-int get_listener_socket(char *port);
+int get_listener_socket(char *port, int backlog);
 
 #endif
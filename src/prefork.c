@@ -0,0 +1,195 @@
+/**
+ * Prefork: serve from worker processes under a supervising parent
+ *
+ * A crash takes down one worker and its connections, not the server: the
+ * parent starts another in its place. Whatever the workers share (the
+ * listener, the shared cache) is made before they're forked.
+ */
+
+#include "prefork.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Signals the workers act on (log reopening, tracing), passed on to them
+int prefork_forwarded[] = {SIGHUP, SIGUSR1, SIGUSR2};
+#define PREFORK_FORWARDED                                                      \
+  (int)(sizeof prefork_forwarded / sizeof prefork_forwarded[0])
+
+// Bit per signal number, set by prefork_signalled() for the parent to pass on
+volatile sig_atomic_t prefork_pending = 0;
+
+/**
+ * SIGCHLD handler: only there so sigsuspend() returns when a worker exits
+ */
+void prefork_child_exited(int sig) { (void)sig; }
+
+/**
+ * Handler for the forwarded signals: note it for the parent's loop
+ */
+void prefork_signalled(int sig) { prefork_pending |= 1 << sig; }
+
+/**
+ * Fork worker i
+ *
+ * Returns 1 in the new worker, 0 in the parent.
+ */
+int prefork_spawn(pid_t *pids, time_t *started, int i, sigset_t *mask) {
+  // Don't hand the worker a copy of output not yet written
+  fflush(stdout);
+  fflush(stderr);
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    signal(SIGCHLD, SIG_DFL);
+    for (int f = 0; f < PREFORK_FORWARDED; f++)
+      signal(prefork_forwarded[f], SIG_DFL);
+    sigprocmask(SIG_SETMASK, mask, NULL);
+    return 1;
+  }
+
+  if (pid == -1)
+    perror("webserver: fork");
+  pids[i] = pid > 0 ? pid : 0;
+  started[i] = time(NULL);
+  return 0;
+}
+
+/**
+ * Pass the forwarded signals that have arrived on to every worker
+ */
+void prefork_forward(pid_t *pids, int workers) {
+  int pending = prefork_pending;
+
+  prefork_pending = 0;
+  for (int f = 0; f < PREFORK_FORWARDED; f++) {
+    if (!(pending & 1 << prefork_forwarded[f]))
+      continue;
+
+    for (int i = 0; i < workers; i++)
+      if (pids[i] != 0)
+        kill(pids[i], prefork_forwarded[f]);
+  }
+}
+
+/**
+ * Start worker processes and look after them until *stop is set
+ *
+ * Returns the worker's number, from 0, in each worker. In the parent, it
+ * restarts workers as they die and passes SIGHUP, SIGUSR1 and SIGUSR2 on
+ * to them, so the server is signalled as it is without -P. Once *stop is
+ * set it passes SIGTERM on, waits for them all and returns -1.
+ *
+ * The workers get the signal mask prefork() was called with; the parent
+ * takes the forwarded signals even if that blocks them.
+ */
+int prefork(int workers, volatile sig_atomic_t *stop) {
+  pid_t *pids = calloc(workers, sizeof *pids);
+  time_t *started = calloc(workers, sizeof *started);
+  sigset_t block, mask, wait;
+  struct sigaction sa;
+
+  if (pids == NULL || started == NULL) {
+    free(pids);
+    free(started);
+    return -1;
+  }
+
+  memset(&sa, 0, sizeof sa);
+  sa.sa_handler = prefork_child_exited;
+  sigaction(SIGCHLD, &sa, NULL);
+  sa.sa_handler = prefork_signalled;
+  for (int f = 0; f < PREFORK_FORWARDED; f++)
+    sigaction(prefork_forwarded[f], &sa, NULL);
+
+  // Between checking *stop and sleeping, hold the signals that could
+  // change it, so none is missed
+  sigemptyset(&block);
+  sigaddset(&block, SIGCHLD);
+  sigaddset(&block, SIGINT);
+  sigaddset(&block, SIGTERM);
+  for (int f = 0; f < PREFORK_FORWARDED; f++)
+    sigaddset(&block, prefork_forwarded[f]);
+  sigprocmask(SIG_BLOCK, &block, &mask);
+
+  // ...and take them all while sleeping
+  wait = mask;
+  sigdelset(&wait, SIGCHLD);
+  sigdelset(&wait, SIGINT);
+  sigdelset(&wait, SIGTERM);
+  for (int f = 0; f < PREFORK_FORWARDED; f++)
+    sigdelset(&wait, prefork_forwarded[f]);
+
+  int worker = -1;
+  for (int i = 0; i < workers && worker == -1; i++)
+    if (prefork_spawn(pids, started, i, &mask))
+      worker = i;
+
+  while (worker == -1 && !*stop) {
+    int status;
+    pid_t pid;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+      for (int i = 0; i < workers; i++) {
+        if (pids[i] != pid)
+          continue;
+
+        if (WIFSIGNALED(status))
+          fprintf(stderr, "webserver: worker %d killed by signal %d\n", i,
+                  WTERMSIG(status));
+        else
+          fprintf(stderr, "webserver: worker %d exited with status %d\n", i,
+                  WEXITSTATUS(status));
+        pids[i] = 0;
+      }
+    }
+
+    prefork_forward(pids, workers);
+
+    // Restart the dead, pausing for any that die as soon as they start
+    time_t now = time(NULL);
+    int waiting = 0;
+    for (int i = 0; i < workers && worker == -1 && !*stop; i++) {
+      if (pids[i] != 0)
+        continue;
+      if (now - started[i] < PREFORK_RESTART_DELAY)
+        waiting = 1;
+      else if (prefork_spawn(pids, started, i, &mask))
+        worker = i;
+    }
+
+    if (worker == -1 && !*stop) {
+      if (waiting) {
+        struct timespec delay = {PREFORK_RESTART_DELAY, 0};
+
+        sigprocmask(SIG_SETMASK, &wait, NULL);
+        nanosleep(&delay, NULL);
+        sigprocmask(SIG_BLOCK, &block, NULL);
+      } else {
+        sigsuspend(&wait);
+      }
+    }
+  }
+
+  if (worker != -1) {
+    free(pids);
+    free(started);
+    return worker;
+  }
+
+  for (int i = 0; i < workers; i++)
+    if (pids[i] != 0)
+      kill(pids[i], SIGTERM);
+  for (int i = 0; i < workers; i++)
+    if (pids[i] != 0)
+      waitpid(pids[i], NULL, 0);
+
+  sigprocmask(SIG_SETMASK, &mask, NULL);
+  free(pids);
+  free(started);
+  return -1;
+}
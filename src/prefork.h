@@ -0,0 +1,10 @@
+#ifndef _PREFORK_H_
+#define _PREFORK_H_
+
+#include <signal.h>
+
+#define PREFORK_RESTART_DELAY 1 // seconds between restarts of a failing worker
+
+extern int prefork(int workers, volatile sig_atomic_t *stop);
+
+#endif
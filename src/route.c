@@ -0,0 +1,346 @@
+/**
+ * Request routing: handlers keyed by method and path pattern
+ *
+ * Routes are compiled into a radix tree as they're added, so a lookup
+ * walks the path once, byte by byte, however many routes there are.
+ */
+
+#include "route.h"
+#include "conn.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+const char *route_method_names[ROUTE_METHOD_COUNT] = {
+    "GET", "HEAD", "POST", "PUT", "DELETE",
+};
+
+/**
+ * Map a request method to an enum route_method, or -1 if we have none
+ */
+int route_method_parse(const char *method) {
+  for (int m = 0; m < ROUTE_METHOD_COUNT; m++)
+    if (strcmp(method, route_method_names[m]) == 0)
+      return m;
+
+  return -1;
+}
+
+/**
+ * Allocate a node whose edge carries label[0..length)
+ */
+struct route_node *route_node_create(const char *label, int length) {
+  struct route_node *node = calloc(1, sizeof *node);
+  if (node == NULL)
+    return NULL;
+
+  node->label = malloc(length + 1);
+  if (node->label == NULL) {
+    free(node);
+    return NULL;
+  }
+
+  memcpy(node->label, label, length);
+  node->label[length] = '\0';
+  node->label_length = length;
+
+  return node;
+}
+
+void route_node_free(struct route_node *node) {
+  if (node == NULL)
+    return;
+
+  for (int i = 0; i < ROUTE_FANOUT; i++)
+    route_node_free(node->children[i]);
+  route_node_free(node->param);
+
+  free(node->param_name);
+  free(node->wildcard_name);
+  free(node->label);
+  free(node);
+}
+
+struct router *router_create(void) {
+  struct router *r = calloc(1, sizeof *r);
+  if (r == NULL)
+    return NULL;
+
+  r->root = route_node_create("", 0);
+  if (r->root == NULL) {
+    free(r);
+    return NULL;
+  }
+
+  return r;
+}
+
+void router_free(struct router *r) {
+  if (r == NULL)
+    return;
+
+  route_node_free(r->root);
+  free(r);
+}
+
+/**
+ * Find or make the node reached from node by the static bytes s[0..length)
+ *
+ * Splits an edge where s leaves it part way. Returns NULL if out of memory
+ * or s holds bytes outside ROUTE_FANOUT.
+ */
+struct route_node *route_insert_static(struct route_node *node, const char *s,
+                                       int length) {
+  // Every byte may key a child once an edge is split
+  for (int i = 0; i < length; i++)
+    if ((unsigned char)s[i] >= ROUTE_FANOUT)
+      return NULL;
+
+  while (length > 0) {
+    unsigned char c = s[0];
+    struct route_node *child = node->children[c];
+    if (child == NULL) {
+      child = route_node_create(s, length);
+      node->children[c] = child;
+      return child;
+    }
+
+    int common = 0;
+    while (common < length && common < child->label_length &&
+           child->label[common] == s[common])
+      common++;
+
+    if (common < child->label_length) {
+      // Split the edge: a new node for the shared bytes, the old one below
+      // it with what's left of its label
+      struct route_node *mid = route_node_create(s, common);
+      char *rest = strdup(child->label + common);
+
+      if (mid == NULL || rest == NULL) {
+        route_node_free(mid);
+        free(rest);
+        return NULL;
+      }
+
+      free(child->label);
+      child->label = rest;
+      child->label_length -= common;
+      mid->children[(unsigned char)rest[0]] = child;
+      node->children[c] = mid;
+      child = mid;
+    }
+
+    node = child;
+    s += common;
+    length -= common;
+  }
+
+  return node;
+}
+
+/**
+ * Register handler for method on pattern
+ *
+ * endpoint is recorded on each connection the route serves. Returns 0, or
+ * -1 if the pattern is malformed, conflicts with another (two parameter
+ * names for one segment, or the same method and pattern twice), or we're
+ * out of memory.
+ */
+int router_add(struct router *r, int method, const char *pattern,
+               route_handler handler, int endpoint) {
+  struct route_node *node = r->root;
+  const char *p = pattern;
+
+  if (method < 0 || method >= ROUTE_METHOD_COUNT || handler == NULL ||
+      pattern[0] != '/')
+    return -1;
+
+  while (*p != '\0') {
+    int segment = p > pattern && p[-1] == '/';
+
+    if (segment && p[0] == ':') {
+      int length = strcspn(p + 1, "/");
+
+      if (length == 0)
+        return -1;
+
+      if (node->param == NULL) {
+        node->param = route_node_create("", 0);
+        if (node->param == NULL)
+          return -1;
+        node->param_name = strndup(p + 1, length);
+        if (node->param_name == NULL)
+          return -1;
+      } else if ((int)strlen(node->param_name) != length ||
+                 strncmp(node->param_name, p + 1, length) != 0) {
+        return -1;
+      }
+
+      node = node->param;
+      p += 1 + length;
+      continue;
+    }
+
+    if (segment && p[0] == '*') {
+      if (p[1] == '\0' || strchr(p + 1, '/') != NULL)
+        return -1;
+      if (node->wildcard_name != NULL && strcmp(node->wildcard_name, p + 1))
+        return -1;
+      if (node->wildcard[method].handler != NULL)
+        return -1;
+
+      if (node->wildcard_name == NULL) {
+        node->wildcard_name = strdup(p + 1);
+        if (node->wildcard_name == NULL)
+          return -1;
+      }
+
+      node->wildcard[method] = (struct route){handler, endpoint};
+      r->count++;
+      return 0;
+    }
+
+    // Static bytes, up to a segment that starts with : or *
+    int length = 1;
+    while (p[length] != '\0' &&
+           !(p[length - 1] == '/' && (p[length] == ':' || p[length] == '*')))
+      length++;
+
+    node = route_insert_static(node, p, length);
+    if (node == NULL)
+      return -1;
+    p += length;
+  }
+
+  if (node->routes[method].handler != NULL)
+    return -1;
+
+  node->routes[method] = (struct route){handler, endpoint};
+  r->count++;
+
+  return 0;
+}
+
+/**
+ * Compile a table of routes
+ *
+ * Returns NULL, having said which route is at fault, if any can't be added.
+ */
+struct router *router_build(struct route_spec *specs, int count) {
+  struct router *r = router_create();
+  if (r == NULL)
+    return NULL;
+
+  for (int i = 0; i < count; i++) {
+    struct route_spec *s = &specs[i];
+
+    if (router_add(r, route_method_parse(s->method), s->pattern, s->handler,
+                   s->endpoint) == -1) {
+      fprintf(stderr, "route: cannot add %s %s\n", s->method, s->pattern);
+      router_free(r);
+      return NULL;
+    }
+  }
+
+  return r;
+}
+
+/**
+ * Match what's left of the path below node
+ *
+ * Static edges are tried before the parameter, and the parameter before
+ * the wildcard; a branch that fails further down falls back to the next.
+ */
+struct route *route_lookup(struct route_node *node, int method,
+                           const char *path, struct route_match *match) {
+  if (*path == '\0' && node->routes[method].handler != NULL)
+    return &node->routes[method];
+
+  if (*path != '\0') {
+    unsigned char c = *path;
+    struct route_node *child = c < ROUTE_FANOUT ? node->children[c] : NULL;
+
+    if (child != NULL &&
+        strncmp(path, child->label, child->label_length) == 0) {
+      struct route *found =
+          route_lookup(child, method, path + child->label_length, match);
+      if (found != NULL)
+        return found;
+    }
+
+    if (node->param != NULL && *path != '/' &&
+        match->nparams < ROUTE_MAX_PARAMS) {
+      int length = strcspn(path, "/");
+      struct route_param *param = &match->params[match->nparams++];
+
+      *param = (struct route_param){node->param_name, path, length};
+
+      struct route *found =
+          route_lookup(node->param, method, path + length, match);
+      if (found != NULL)
+        return found;
+
+      match->nparams--;
+    }
+  }
+
+  if (node->wildcard[method].handler != NULL) {
+    if (match->nparams < ROUTE_MAX_PARAMS)
+      match->params[match->nparams++] =
+          (struct route_param){node->wildcard_name, path, strlen(path)};
+    return &node->wildcard[method];
+  }
+
+  return NULL;
+}
+
+/**
+ * Find the route for method (an enum route_method) and path
+ *
+ * Fills in match. Returns NULL if no route matches.
+ */
+struct route *router_find(struct router *r, int method, const char *path,
+                          struct route_match *match) {
+  match->path = path;
+  match->nparams = 0;
+
+  if (method < 0 || method >= ROUTE_METHOD_COUNT)
+    return NULL;
+
+  return route_lookup(r->root, method, path, match);
+}
+
+/**
+ * Run the handler for method and path on conn
+ *
+ * Returns 0, or -1 if no route matches and nothing was queued.
+ */
+int router_dispatch(struct router *r, const char *method, const char *path,
+                    struct conn *conn) {
+  struct route_match match;
+  struct route *route =
+      router_find(r, route_method_parse(method), path, &match);
+
+  if (route == NULL)
+    return -1;
+
+  conn->endpoint = route->endpoint;
+  route->handler(conn, &match);
+
+  return 0;
+}
+
+/**
+ * The value of a matched :name or *name, or NULL if there's none
+ */
+const char *route_param(struct route_match *match, const char *name,
+                        int *length) {
+  for (int i = 0; i < match->nparams; i++) {
+    if (strcmp(match->params[i].name, name) == 0) {
+      *length = match->params[i].length;
+      return match->params[i].value;
+    }
+  }
+
+  return NULL;
+}
@@ -0,0 +1,93 @@
+#ifndef _ROUTE_H_
+#define _ROUTE_H_
+
+#define ROUTE_MAX_PARAMS 8
+#define ROUTE_FANOUT 128 // static children, by the first byte of their label
+
+struct conn;
+
+// Methods a route can be registered for
+enum route_method {
+  ROUTE_GET,
+  ROUTE_HEAD,
+  ROUTE_POST,
+  ROUTE_PUT,
+  ROUTE_DELETE,
+  ROUTE_METHOD_COUNT,
+};
+
+// A :name or *name segment as matched
+struct route_param {
+  const char *name;
+  const char *value; // into the path; not NUL-terminated
+  int length;
+};
+
+// What dispatch found
+struct route_match {
+  const char *path; // the whole path asked for
+  struct route_param params[ROUTE_MAX_PARAMS];
+  int nparams;
+};
+
+typedef void (*route_handler)(struct conn *conn, struct route_match *match);
+
+// Handler for one method at one node
+struct route {
+  route_handler handler;
+  int endpoint; // enum metrics_endpoint, recorded on the connection
+};
+
+// A route as written in a table for router_build()
+struct route_spec {
+  const char *method; // "GET", "POST", ...
+  const char *pattern;
+  route_handler handler;
+  int endpoint;
+};
+
+// A node of the radix tree
+//
+// Static segments are compressed: each edge carries as many bytes as its
+// routes share. A node also has at most one parameter child (a whole
+// segment) and at most one wildcard (the rest of the path).
+struct route_node {
+  char *label; // bytes on the edge into this node
+  int label_length;
+  struct route_node *children[ROUTE_FANOUT];
+
+  struct route_node *param; // :name child
+  char *param_name;
+
+  char *wildcard_name; // *name routes, or NULL
+  struct route wildcard[ROUTE_METHOD_COUNT];
+
+  struct route routes[ROUTE_METHOD_COUNT]; // paths ending here
+};
+
+// Routes, compiled into a radix tree keyed by path
+//
+// Patterns are absolute paths whose segments may be :name, matching one
+// non-empty segment, and whose last segment may be *name, matching the
+// rest of the path (possibly empty). At each node static bytes are tried
+// first, then the parameter, then the wildcard. Built at startup, then
+// only read, so any thread may dispatch.
+struct router {
+  struct route_node *root;
+  int count;
+};
+
+extern int route_method_parse(const char *method);
+extern struct router *router_create(void);
+extern void router_free(struct router *r);
+extern struct router *router_build(struct route_spec *specs, int count);
+extern int router_add(struct router *r, int method, const char *pattern,
+                      route_handler handler, int endpoint);
+extern struct route *router_find(struct router *r, int method,
+                                 const char *path, struct route_match *match);
+extern int router_dispatch(struct router *r, const char *method,
+                           const char *path, struct conn *conn);
+extern const char *route_param(struct route_match *match, const char *name,
+                               int *length);
+
+#endif
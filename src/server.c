@@ -6,6 +6,7 @@
  *    curl -D - http://localhost:3490/
  *    curl -D - http://localhost:3490/d20
  *    curl -D - http://localhost:3490/date
+ *    curl http://localhost:3490/metrics
  *
  * You can also test the above URLs in your browser! They should work!
  *
@@ -17,20 +18,44 @@
  * (Posting data is harder to test from a browser.)
  */
 
+#define _GNU_SOURCE // accept4()
+
+#include "accesslog.h"
+#include "applog.h"
+#include "bundle.h"
 #include "cache.h"
+#include "conn.h"
 #include "file.h"
+#include "iopool.h"
+#include "loop.h"
+#include "metrics.h"
 #include "mime.h"
 #include "net.h"
+#include "prefork.h"
+#include "route.h"
+#include "shcache.h"
+#include "snapshot.h"
+#include "tier.h"
+#include "trace.h"
+#include "warmup.h"
+#include "watch.h"
 #include <arpa/inet.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/file.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
@@ -40,312 +65,1736 @@
 #define SERVER_FILES "./serverfiles"
 #define SERVER_ROOT "./serverroot"
 
+// Jobs waiting for a disk thread before misses are served inline
+#define IOPOOL_MAX_QUEUED 1024
+
+// Read-only asset bundle, if one was given with -b
+struct bundle *assets = NULL;
+
+// With -a, POST bodies are appended to their file through this log
+struct applog *append_log = NULL;
+
+// With -k, files too big to cache whole are cached a block at a time
+int cache_blocks = 0;
+
+// Size of the warm cache tier given with -D, unless one is given too
+#define TIER_DEFAULT_MB 1024
+#define SHARED_CACHE_DEFAULT_MB 256
+
+// Where SIGUSR1 writes the trace
+#define TRACE_FILE "webserver-trace.json"
+char *trace_file = TRACE_FILE;
+
+// An error response built once at startup, so error paths never touch the
+// filesystem
+struct error_page {
+  char *header;
+  char *content_type;
+  void *body;
+  int length;
+};
+
+#define ERROR_PAGE(header, body) {header, "text/plain", body, sizeof body - 1}
+
+struct error_page page_400 =
+    ERROR_PAGE("HTTP/1.1 400 Bad Request", "Wtf is this shit request");
+struct error_page page_404 = ERROR_PAGE("HTTP/1.1 404 NOT FOUND", "Not found");
+struct error_page page_413 =
+    ERROR_PAGE("HTTP/1.1 413 Content Too Large", "Request body too large");
+struct error_page page_431 =
+    ERROR_PAGE("HTTP/1.1 431 Request Header Fields Too Large",
+               "Request headers too large");
+struct error_page page_500 =
+    ERROR_PAGE("HTTP/1.1 500 Internal Server Error", "Server crushed...");
+
+// 404.html, when page_404 was loaded from disk
+struct file_data *page_404_file = NULL;
+
 /**
- * Send an HTTP response
+ * Format the status line and headers of an HTTP response
  *
- * header:       "HTTP/1.1 404 NOT FOUND" or "HTTP/1.1 200 OK", etc.
- * content_type: "text/plain", etc.
- * body:         the data to send.
+ * extra_headers: NULL, or complete header lines each ending in "\n".
  *
- * Return the value from the send() function.
+ * Returns 0, or -1 if the headers don't fit.
  */
-int send_response(int fd, char *header, char *content_type, void *body,
-                  int content_length) {
-  const int max_response_size = 262144;
+int set_response_head(struct conn *conn, char *header, char *content_type,
+                      char *extra_headers, off_t content_length) {
   const int time_str_size = 40;
-  char response[max_response_size];
   char date[time_str_size];
 
-  memset(response, 0, max_response_size);
   memset(date, 0, time_str_size);
 
   // Load time info
   time_t rawtime = time(NULL);
   struct tm *tp = localtime(&rawtime);
-  strftime(date, sizeof(date), "Date: %a %b %d %H:%M:%S %Z %Y", tp);
+  strftime(date, sizeof(date), "%a %b %d %H:%M:%S %Z %Y", tp);
+
+  // Build HTTP response header and store it in the connection
+  conn->head_length = snprintf(conn->head, sizeof conn->head,
+                               "%s\n"
+                               "Date: %s\n"
+                               "Content-Type: %s\n"
+                               "Content-Length: %lld\n"
+                               "%s"
+                               "Connection: close\n"
+                               "\n",
+                               header, date, content_type,
+                               (long long)content_length,
+                               extra_headers != NULL ? extra_headers : "");
 
-  // Build HTTP response and store it in response
-  int response_length = snprintf(response, max_response_size,
-                                 "%s\n"
-                                 "Date: %s\n"
-                                 "Content-Type: %s\n"
-                                 "Content-Length: %d\n"
-                                 "Connection: close\n"
-                                 "\n",
-                                 header, date, content_type, content_length);
+  if (conn->head_length >= (int)sizeof conn->head) {
+    conn->head_length = 0;
+    return -1;
+  }
+
+  conn->ready_ns = metrics_now();
 
-  // Send it all!
-  // Send head first
-  int rv = send(fd, response, response_length, 0);
+  return 0;
+}
 
-  if (rv < 0) {
-    perror("send");
+/**
+ * Queue an HTTP response with additional header lines
+ *
+ * extra_headers: NULL, or complete header lines each ending in "\n".
+ *
+ * The body is copied, so it may live on the caller's stack. Returns 0, or -1
+ * on error.
+ */
+int send_response_with_headers(struct conn *conn, char *header,
+                               char *content_type, char *extra_headers,
+                               void *body, int content_length) {
+  if (set_response_head(conn, header, content_type, extra_headers,
+                        content_length) == -1)
+    return -1;
+
+  // The serving loop sends the head and then the body
+  return conn_set_body_copy(conn, body, content_length);
+}
+
+/**
+ * Queue an HTTP response
+ *
+ * header:       "HTTP/1.1 404 NOT FOUND" or "HTTP/1.1 200 OK", etc.
+ * content_type: "text/plain", etc.
+ * body:         the data to send.
+ *
+ * Returns 0, or -1 on error.
+ */
+int send_response(struct conn *conn, char *header, char *content_type,
+                  void *body, int content_length) {
+  return send_response_with_headers(conn, header, content_type, NULL, body,
+                                    content_length);
+}
+
+/**
+ * Find a request header's value
+ *
+ * Copies the value of the first header called name (case-insensitive) into
+ * value. Returns value, or NULL if the request has no such header.
+ */
+char *get_header(const char *request, const char *name, char *value,
+                 size_t value_size) {
+  size_t name_len = strlen(name);
+  const char *line = strchr(request, '\n');
+
+  // Headers end at the first empty line
+  while (line != NULL && line[1] != '\r' && line[1] != '\n' &&
+         line[1] != '\0') {
+    line++;
+
+    if (strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+      const char *v = line + name_len + 1;
+      size_t len;
+
+      v += strspn(v, " \t");
+      len = strcspn(v, "\r\n");
+      if (len >= value_size)
+        len = value_size - 1;
+
+      memcpy(value, v, len);
+      value[len] = '\0';
+      return value;
+    }
+
+    line = strchr(line, '\n');
   }
 
-  // then send binary data...
-  rv = send(fd, body, content_length, 0);
+  return NULL;
+}
 
-  if (rv < 0) {
-    perror("send");
+/**
+ * Send an asset straight out of the mapped bundle
+ *
+ * Honours If-None-Match, and picks the gzip variant when the client
+ * accepts it.
+ */
+void send_bundle_asset(struct conn *conn, char *header,
+                       struct bundle_asset *asset, const char *request) {
+  char value[1024];
+  char extra[256];
+
+  if (request != NULL &&
+      get_header(request, "If-None-Match", value, sizeof value) != NULL &&
+      strstr(value, asset->etag) != NULL) {
+    snprintf(extra, sizeof extra, "ETag: %s\n", asset->etag);
+    send_response_with_headers(conn, "HTTP/1.1 304 Not Modified",
+                               asset->content_type, extra, NULL, 0);
+    return;
+  }
+
+  // The mapping outlives every connection, so the body needs no release
+  if (asset->gzip_length > 0 && request != NULL &&
+      get_header(request, "Accept-Encoding", value, sizeof value) != NULL &&
+      strstr(value, "gzip") != NULL) {
+    snprintf(extra, sizeof extra,
+             "ETag: %s\nContent-Encoding: gzip\nVary: Accept-Encoding\n",
+             asset->etag);
+    set_response_head(conn, header, asset->content_type, extra,
+                      asset->gzip_length);
+    conn_set_body(conn, asset->gzip_data, asset->gzip_length, NULL, NULL);
+    return;
   }
 
-  return rv;
+  snprintf(extra, sizeof extra, "ETag: %s\n%s", asset->etag,
+           asset->gzip_length > 0 ? "Vary: Accept-Encoding\n" : "");
+  set_response_head(conn, header, asset->content_type, extra, asset->length);
+  conn_set_body(conn, asset->data, asset->length, NULL, NULL);
 }
 
 /**
  * Send a /d20 endpoint response
  */
-void get_d20(int fd) {
+void get_d20(struct conn *conn, struct route_match *match) {
   char data[8];
 
+  (void)match;
+
   // Generate a random number between 1 and 20 inclusive
   srand(time(NULL));
   int randv = rand() % 20 + 1;
 
   // Use send_response() to send it back as text/plain data
   snprintf(data, 8, "%d", randv);
-  send_response(fd, "HTTP/1.1 200 OK", "text/plain", data, strlen(data));
+  send_response(conn, "HTTP/1.1 200 OK", "text/plain", data, strlen(data));
 }
 
 /**
- * Send a 404 response
+ * Load 404.html for page_404, from the bundle if there is one
+ *
+ * Without it, 404s go out as plain text.
  */
-void resp_404(int fd) {
+void error_pages_load(void) {
   char filepath[4096];
-  struct file_data *filedata;
-  char *mime_type;
 
-  // Fetch the 404.html file
   snprintf(filepath, sizeof filepath, "%s/404.html", SERVER_FILES);
-  filedata = file_load(filepath);
 
-  if (filedata == NULL) {
-    char *ise_str = "Server crushed...";
-    send_response(fd, "HTTP/1.1 500 Internal Server Error", "text/plain",
-                  ise_str, strlen(ise_str));
-    fprintf(stderr, "cannot find system 404 file\n");
+  // The mapping outlives every connection
+  struct bundle_asset asset;
+  if (assets != NULL && bundle_find(assets, filepath, &asset)) {
+    page_404.content_type = asset.content_type;
+    page_404.body = asset.data;
+    page_404.length = asset.length;
+    return;
   }
 
-  mime_type = mime_type_get(filepath);
+  page_404_file = file_load(filepath);
+  if (page_404_file == NULL) {
+    fprintf(stderr, "webserver: warning: cannot load %s\n", filepath);
+    return;
+  }
 
-  send_response(fd, "HTTP/1.1 404 NOT FOUND", mime_type, filedata->data,
-                filedata->size);
+  page_404.content_type = mime_type_get(filepath);
+  page_404.body = page_404_file->data;
+  page_404.length = page_404_file->size;
+}
 
-  file_free(filedata);
+/**
+ * Queue a preloaded error response; the body is sent from where it lives
+ */
+void send_error_page(struct conn *conn, struct error_page *page) {
+  set_response_head(conn, page->header, page->content_type, NULL,
+                    page->length);
+  conn_set_body(conn, page->body, page->length, NULL, NULL);
 }
 
+/**
+ * Send a 404 response
+ */
+void resp_404(struct conn *conn) { send_error_page(conn, &page_404); }
+
 /**
  * Send bad request repond
  */
-void bad_req_resp(int fd) {
-  char *str = "Wtf is this shit request";
+void bad_req_resp(struct conn *conn) { send_error_page(conn, &page_400); }
 
-  send_response(fd, "HTTP/1.1 400 Bad Request", "text/plain", str, strlen(str));
+/**
+ * Send an internal error response
+ */
+void resp_500(struct conn *conn) { send_error_page(conn, &page_500); }
+
+/**
+ * Does a lookup that failed with error mean there's no file to serve, for
+ * as long as nothing changes on disk?
+ */
+int lookup_missing(int error) {
+  return error == ENOENT || error == ENOTDIR || error == EISDIR;
 }
 
 /**
- * Read and return a file from disk or cache
+ * Serve counters and latency histograms in Prometheus text format
  */
-void get_file(int fd, struct cache *cache, char *request_path) {
-  char filepath[4096];
+void get_metrics(struct conn *conn, struct route_match *match) {
+  size_t length;
+  char *body = metrics_format(conn->cache, &length);
+
+  (void)match;
+  if (body == NULL) {
+    resp_500(conn);
+    return;
+  }
+
+  set_response_head(conn, "HTTP/1.1 200 OK",
+                    "text/plain; version=0.0.4; charset=utf-8", NULL, length);
+  conn_set_body(conn, body, length, free, body);
+}
+
+/**
+ * Release callback for a response body that points into a cache entry
+ */
+void release_cache_entry(void *entry) { cache_entry_release(entry); }
+
+/**
+ * Release callback for a response body loaded by file_load()
+ */
+void release_file_data(void *filedata) { file_free(filedata); }
+
+// A cache miss parked on the disk pool
+struct load_job {
+  struct iopool_job job; // must be first
+  struct conn *conn;
+  unsigned long invalidations; // cache->invalidations when submitted
+  struct cache_flight *flight; // misses for the same path wait on this
   struct file_data *filedata;
+  int fd;     // instead, if the file is too big to load whole
+  off_t size; // ...its size
+  int error;  // errno, if it couldn't be opened or loaded
+  struct cache_validator validator; // of the file opened
+  char filepath[4096];
+};
+
+// A miss parked on another connection's load of the same path
+struct load_waiter {
+  struct cache_waiter waiter; // must be first
+  struct conn *conn;
+  char filepath[]; // to look again if the load has nothing to share
+};
+
+void serve_file(struct conn *conn, char *filepath);
+
+/**
+ * Answer a parked request from a loaded entry
+ */
+void send_loaded_entry(struct conn *conn, struct cache_entry *entry) {
+  set_response_head(conn, "HTTP/1.1 200 OK", entry->content_type, NULL,
+                    entry->content_length);
+  cache_entry_retain(entry);
+  conn_set_body(conn, entry->content, entry->content_length,
+                release_cache_entry, entry);
+}
+
+/**
+ * Loop thread: the load a parked miss was waiting on is done
+ */
+void load_waiter_done(struct cache_waiter *waiter, struct cache_entry *entry) {
+  struct load_waiter *lw = (struct load_waiter *)waiter;
+  struct conn *conn = lw->conn;
+
+  if (entry != NULL) {
+    send_loaded_entry(conn, entry);
+  } else {
+    // Nothing to share: the load failed, or the file streams. Look again
+    // alone; a missing file is in the negative cache by now.
+    conn->parked = 0;
+    serve_file(conn, lw->filepath);
+
+    if (conn->parked) {
+      // On a load of its own, which resumes it
+      free(lw);
+      return;
+    }
+  }
+
+  free(lw);
+  conn_resume(conn);
+}
+
+/**
+ * Park a miss on the load already in flight for its path
+ *
+ * Returns 0, or -1 if out of memory and the caller should load it itself.
+ */
+int load_file_wait(struct conn *conn, struct cache_flight *flight,
+                   char *filepath) {
+  struct load_waiter *lw = malloc(sizeof *lw + strlen(filepath) + 1);
+  if (lw == NULL)
+    return -1;
+
+  lw->waiter.done = load_waiter_done;
+  lw->conn = conn;
+  strcpy(lw->filepath, filepath);
+  cache_flight_wait(conn->cache, flight, &lw->waiter);
+
+  conn_park(conn);
+  return 0;
+}
+
+/**
+ * Pool thread: read the missed file, or just open it if it's too big
+ */
+void load_job_work(struct iopool_job *job) {
+  struct load_job *lj = (struct load_job *)job;
+  struct stat st;
+
+  uint64_t start = metrics_now();
+
+  TRACE_BEGIN("file_load", lj->conn);
+  lj->fd = file_open(lj->filepath, &st);
+  if (lj->fd != -1)
+    cache_validator_set(&lj->validator, &st);
+  if (lj->fd != -1 && st.st_size > FILE_STREAM_MIN) {
+    lj->size = st.st_size;
+  } else if (lj->fd != -1) {
+    lj->filedata = file_read(lj->fd, lj->filepath, st.st_size);
+    close(lj->fd);
+    lj->fd = -1;
+  }
+  lj->error = lj->filedata == NULL && lj->fd == -1 ? errno : 0;
+  TRACE_END("file_load", lj->conn);
+  metrics_observe(METRICS_DISK_LOAD, metrics_now() - start);
+}
+
+/**
+ * Loop thread: answer the parked request from what was read
+ */
+void load_job_done(struct iopool_job *job) {
+  struct load_job *lj = (struct load_job *)job;
+  struct conn *conn = lj->conn;
+  struct file_data *filedata = lj->filedata;
+  struct cache_entry *entry = NULL, *uncached = NULL;
+  char *mime_type = mime_type_get(lj->filepath);
+
+  if (lj->fd != -1) {
+    // Too big to cache whole: stream it from the file we opened
+    set_response_head(conn, "HTTP/1.1 200 OK", mime_type, NULL, lj->size);
+    conn_set_body_file(conn, lj->fd, lj->size,
+                       cache_blocks ? lj->filepath : NULL, mime_type);
+    conn->invalidations = lj->invalidations;
+  } else if (filedata == NULL) {
+    // Remember it's not there, unless it may have appeared meanwhile
+    if (lookup_missing(lj->error) &&
+        conn->cache->invalidations == lj->invalidations)
+      cache_put_missing(conn->cache, lj->filepath);
+    resp_404(conn);
+  } else {
+    // cache not hit but file accessed, we add it into cache. Unless
+    // something was invalidated meanwhile: what we read may be stale.
+    if (conn->cache->invalidations == lj->invalidations)
+      entry = cache_put(conn->cache, lj->filepath, mime_type, filedata->data,
+                        filedata->size);
+    if (entry != NULL && entry->validator.ino == 0)
+      entry->validator = lj->validator;
+
+    // Whoever waited on this load is served the same bytes, cached or not;
+    // alone, we can send what we read as it is
+    if (entry == NULL && lj->flight != NULL && lj->flight->waiters != NULL)
+      entry = uncached = alloc_entry(lj->filepath, mime_type, filedata->data,
+                                     filedata->size);
+
+    if (entry != NULL) {
+      send_loaded_entry(conn, entry);
+      file_free(filedata);
+    } else {
+      set_response_head(conn, "HTTP/1.1 200 OK", mime_type, NULL,
+                        filedata->size);
+      conn_set_body(conn, filedata->data, filedata->size, release_file_data,
+                    filedata);
+    }
+  }
+
+  cache_flight_finish(conn->cache, lj->flight, entry);
+  cache_entry_release(uncached);
+
+  free(lj);
+  conn_resume(conn);
+}
+
+/**
+ * Hand a cache miss to the disk pool and park the connection
+ *
+ * Returns 0, or -1 if the pool is full and the caller should load inline.
+ */
+int load_file_async(struct conn *conn, char *filepath) {
+  struct load_job *lj = malloc(sizeof *lj);
+  if (lj == NULL)
+    return -1;
+
+  lj->job.work = load_job_work;
+  lj->job.done = load_job_done;
+  lj->conn = conn;
+  lj->invalidations = conn->cache->invalidations;
+  lj->filedata = NULL;
+  lj->fd = -1;
+  snprintf(lj->filepath, sizeof lj->filepath, "%s", filepath);
+
+  // Later misses for this path wait on this load rather than repeat it
+  lj->flight = cache_flight_start(conn->cache, filepath);
+
+  if (iopool_submit(conn->pool, &lj->job) == -1) {
+    cache_flight_finish(conn->cache, lj->flight, NULL);
+    free(lj);
+    return -1;
+  }
+
+  conn_park(conn);
+  return 0;
+}
+
+// A warm tier hit parked on the disk pool while it's copied back into RAM
+struct promote_job {
+  struct iopool_job job; // must be first
+  struct conn *conn;
+  struct tier *tier;
+  struct tier_item *item;      // busy until the copy's done
+  struct cache_flight *flight; // misses for the same path wait on this
+  struct cache_entry *entry;   // the copy, NULL if it couldn't be made
+  char filepath[4096];
+};
+
+/**
+ * Pool thread: copy the item out of the tier file, paging it in as need be
+ */
+void promote_job_work(struct iopool_job *job) {
+  struct promote_job *pj = (struct promote_job *)job;
+  struct tier_item *item = pj->item;
+
+  TRACE_BEGIN("tier_promote", pj->conn);
+  pj->entry = alloc_entry(item->path, item->content_type,
+                          tier_content(pj->tier, item), item->content_length);
+  TRACE_END("tier_promote", pj->conn);
+}
+
+/**
+ * Loop thread: cache the copy and answer the parked request from it
+ */
+void promote_job_done(struct iopool_job *job) {
+  struct promote_job *pj = (struct promote_job *)job;
+  struct conn *conn = pj->conn;
+  struct cache_entry *entry =
+      cache_promote_finish(conn->cache, pj->item, pj->entry);
+
+  cache_flight_finish(conn->cache, pj->flight, entry);
+
+  if (entry != NULL) {
+    send_loaded_entry(conn, entry);
+  } else {
+    // Invalidated meanwhile, or out of memory: look again
+    conn->parked = 0;
+    serve_file(conn, pj->filepath);
+
+    if (conn->parked) {
+      free(pj);
+      return;
+    }
+  }
+
+  free(pj);
+  conn_resume(conn);
+}
+
+/**
+ * Hand a warm tier hit to the disk pool and park the connection
+ *
+ * Returns 0, or -1 if path isn't in the tier to copy, is being loaded
+ * already, or the pool is full, and the caller should look it up as usual.
+ */
+int promote_file_async(struct conn *conn, char *filepath) {
+  // A miss while the item was being copied in started a load, which the
+  // caller waits on
+  if (cache_flight_find(conn->cache, filepath) != NULL)
+    return -1;
+
+  struct tier_item *item = cache_promote_begin(conn->cache, filepath);
+  if (item == NULL)
+    return -1;
+
+  struct promote_job *pj = malloc(sizeof *pj);
+  if (pj == NULL) {
+    cache_promote_finish(conn->cache, item, NULL);
+    return -1;
+  }
+
+  pj->job.work = promote_job_work;
+  pj->job.done = promote_job_done;
+  pj->conn = conn;
+  pj->tier = conn->cache->tier;
+  pj->item = item;
+  pj->entry = NULL;
+  snprintf(pj->filepath, sizeof pj->filepath, "%s", filepath);
+
+  // Later misses for this path wait on this copy rather than load it
+  pj->flight = cache_flight_start(conn->cache, filepath);
+
+  if (iopool_submit(conn->pool, &pj->job) == -1) {
+    cache_flight_finish(conn->cache, pj->flight, NULL);
+    cache_promote_finish(conn->cache, item, NULL);
+    free(pj);
+    return -1;
+  }
+
+  conn_park(conn);
+  return 0;
+}
+
+// A demotion's copy into the warm tier, on the disk pool
+struct demote_job {
+  struct iopool_job job; // must be first
+  struct tier *tier;
+  struct tier_item *item; // busy until the copy's done
+  void *to, *from;
+  off_t length;
+};
+
+/**
+ * Pool thread: copy the demoted entry into its chunk
+ */
+void demote_job_work(struct iopool_job *job) {
+  struct demote_job *dj = (struct demote_job *)job;
+
+  memcpy(dj->to, dj->from, dj->length);
+}
+
+/**
+ * Loop thread: the item is in the tier file now
+ */
+void demote_job_done(struct iopool_job *job) {
+  struct demote_job *dj = (struct demote_job *)job;
+
+  tier_copied(dj->tier, dj->item);
+  free(dj);
+}
+
+/**
+ * Tier callback: copy a demoted entry in on the disk pool, whose writes to
+ * the mapping may have to wait on the disk, or here if the pool is full
+ */
+void demote_async(struct tier *tier, struct tier_item *item) {
+  struct demote_job *dj = malloc(sizeof *dj);
+
+  if (dj != NULL) {
+    dj->job.work = demote_job_work;
+    dj->job.done = demote_job_done;
+    dj->tier = tier;
+    dj->item = item;
+    dj->to = tier_content(tier, item);
+    dj->from = item->source->content;
+    dj->length = item->content_length;
+
+    if (iopool_submit(tier->copy_arg, &dj->job) == 0)
+      return;
+    free(dj);
+  }
+
+  memcpy(tier_content(tier, item), item->source->content,
+         item->content_length);
+  tier_copied(tier, item);
+}
+
+/**
+ * Answer with a file from the bundle, the cache or disk
+ */
+void serve_file(struct conn *conn, char *filepath) {
+  struct stat st;
   char *mime_type;
 
-  // root should be redirect to index
-  if (strcmp(request_path, "/") == 0)
-    sprintf(request_path, "%s", "/index.html");
+  // Immutable deployments serve straight from the bundle mapping
+  struct bundle_asset asset;
+  if (assets != NULL && bundle_find(assets, filepath, &asset)) {
+    send_bundle_asset(conn, "HTTP/1.1 200 OK", &asset, conn->request);
+    return;
+  }
 
-  // Fetch file from root dir, but firstly , let's check cache.
-  memset(filepath, 0, 4096);
-  snprintf(filepath, sizeof filepath, "%s/%s", SERVER_ROOT, request_path);
-  struct cache_entry *entry = cache_get(cache, filepath);
+  // A warm tier hit is copied back on the disk pool: its pages may have to
+  // come in from disk first
+  if (conn->pool != NULL && promote_file_async(conn, filepath) == 0)
+    return;
+
+  uint64_t start = metrics_now();
+  TRACE_BEGIN("cache_get", conn);
+  struct cache_entry *entry = cache_get(conn->cache, filepath);
+  TRACE_END("cache_get", conn);
+  metrics_observe(METRICS_CACHE_LOOKUP, metrics_now() - start);
   if (entry != NULL) {
-    // if cache hit, send it directly
-    send_response(fd, "HTTP/1.1 200 OK", entry->content_type, entry->content,
-                  entry->content_length);
+    // if cache hit, send it directly. The entry stays pinned until it's
+    // sent, even if it's evicted meanwhile.
+    set_response_head(conn, "HTTP/1.1 200 OK", entry->content_type, NULL,
+                      entry->content_length);
+    cache_entry_retain(entry);
+    conn_set_body(conn, entry->content, entry->content_length,
+                  release_cache_entry, entry);
+    return;
+  }
+
+  // Scanners asking for the same missing paths never reach the disk
+  if (cache_is_missing(conn->cache, filepath)) {
+    resp_404(conn);
     return;
   }
 
-  filedata = file_load(filepath);
+  // With a disk pool, a miss doesn't hold up the serving loop, and
+  // concurrent misses for one path share a single load
+  if (conn->pool != NULL) {
+    struct cache_flight *flight = cache_flight_find(conn->cache, filepath);
+
+    if (flight != NULL && load_file_wait(conn, flight, filepath) == 0)
+      return;
+    if (load_file_async(conn, filepath) == 0)
+      return;
+  }
 
   // if not found , respond 404 , and end this function
-  if (filedata == NULL) {
-    resp_404(fd);
+  int filefd = file_open(filepath, &st);
+  if (filefd == -1) {
+    if (lookup_missing(errno))
+      cache_put_missing(conn->cache, filepath);
+    resp_404(conn);
     return;
   }
 
   mime_type = mime_type_get(filepath);
 
-  send_response(fd, "HTTP/1.1 200 OK", mime_type, filedata->data,
-                filedata->size);
+  // The serving loop reads the file as it sends it, then caches it; one
+  // too big to cache whole streams, cached block by block with -k
+  set_response_head(conn, "HTTP/1.1 200 OK", mime_type, NULL, st.st_size);
+  conn_set_body_file(conn, filefd, st.st_size,
+                     st.st_size <= FILE_STREAM_MIN || cache_blocks ? filepath
+                                                                   : NULL,
+                     mime_type);
+}
 
-  // cache not hit but file accessed, we add it into cache
-  cache_put(cache, filepath, mime_type, filedata->data, filedata->size);
+/**
+ * Read and return a file from the bundle, the cache or disk
+ */
+void get_file(struct conn *conn, struct route_match *match) {
+  const char *request_path = match->path;
+  char filepath[4096];
+
+  // root should be redirect to index
+  if (strcmp(request_path, "/") == 0)
+    request_path = "/index.html";
 
-  file_free(filedata);
+  // Fetch file from root dir, but firstly , let's check cache.
+  memset(filepath, 0, 4096);
+  snprintf(filepath, sizeof filepath, "%s%s", SERVER_ROOT, request_path);
+
+  serve_file(conn, filepath);
 }
 
 /**
- * Search for the end of the HTTP header
+ * Find the request body and its length
  *
+ * The body stays in the request buffer, so it may hold NUL bytes.
  * "Newlines" in HTTP can be \r\n (carriage return followed by newline) or \n
- * (newline) or \r (carriage return).
+ * (newline). Returns NULL if there's no body, or less of it than the
+ * Content-Length says: the client went away part way through.
  */
-const char *find_start_of_body(char *request) {
-  const char *body_start = strstr(request, "\r\n\r\n");
-  if (body_start == NULL)
+char *request_body(struct conn *conn, int *length) {
+  char value[32];
+  char *body = strstr(conn->request, "\r\n\r\n");
+
+  if (body != NULL) {
+    body += 4;
+  } else if ((body = strstr(conn->request, "\n\n")) != NULL) {
+    body += 2;
+  } else {
     return NULL;
-  body_start += 4; // skip /r/n/r/n sequence
+  }
 
-  size_t bodylen = strlen(body_start);
+  *length = conn->request_length - (body - conn->request);
 
-  // copy to new block
-  char *body = malloc(bodylen + 1);
-  memset(body, 0, bodylen + 1);
-  if (body == NULL) {
-    perror("Memory allocate failed");
-    return NULL;
+  if (get_header(conn->request, "Content-Length", value, sizeof value) !=
+      NULL) {
+    long long declared = atoll(value);
+
+    if (declared < 0 || *length < declared)
+      return NULL;
+    *length = declared;
   }
 
-  memcpy(body, body_start, bodylen);
-  perror(body);
   return body;
 }
 
 /**
- * Save to default file "rubbish.txt"
+ * Replace a file's contents with body
  *
+ * st is filled in for the new file. Returns 1 if saved, 0 if there is no
+ * such file, -1 if the save failed.
  */
-void post_save(int fd, const void *body, struct cache *cache,
-               char *request_path) {
-  char filepath[4096];
-  struct file_data *filedata;
+int save_file(char *filepath, const void *body, int length, struct stat *st) {
+  // written straight from the request, and swapped in whole
+  if (file_replace(filepath, body, length, st))
+    return 1;
+
+  return errno == ENOENT ? 0 : -1;
+}
+
+/**
+ * Queue the response to a POST once the save has been attempted
+ */
+void post_save_respond(struct conn *conn, int status) {
   char *mime = "application/json";
   char *resp_body = "{\"status\":\"ok\"}";
 
+  if (status == 0) {
+    bad_req_resp(conn);
+    return;
+  }
+
+  if (status < 0) {
+    resp_500(conn);
+    return;
+  }
+
+  send_response(conn, "HTTP/1.1 200 OK", mime, resp_body, strlen(resp_body));
+}
+
+/**
+ * Write a saved POST through to the cache, then answer it
+ *
+ * The body goes in as the path's next version, so a GET straight after is
+ * served from memory; st lets the watcher recognise the file as ours.
+ */
+void post_save_done(struct conn *conn, char *filepath, int status, char *body,
+                    int length, struct stat *st) {
+  if (status == 1) {
+    struct cache_validator validator;
+
+    cache_validator_set(&validator, st);
+    cache_replace(conn->cache, filepath, mime_type_get(filepath), body, length,
+                  &validator);
+  }
+
+  post_save_respond(conn, status);
+}
+
+// A POST parked on the disk pool
+struct save_job {
+  struct iopool_job job; // must be first
+  struct conn *conn;
+  char *body; // in conn->request
+  int length;
+  int status;
+  struct stat st;
+  char filepath[4096];
+};
+
+/**
+ * Pool thread: write the file
+ */
+void save_job_work(struct iopool_job *job) {
+  struct save_job *sj = (struct save_job *)job;
+
+  sj->status = save_file(sj->filepath, sj->body, sj->length, &sj->st);
+}
+
+/**
+ * Loop thread: answer the parked POST
+ */
+void save_job_done(struct iopool_job *job) {
+  struct save_job *sj = (struct save_job *)job;
+  struct conn *conn = sj->conn;
+
+  post_save_done(conn, sj->filepath, sj->status, sj->body, sj->length,
+                 &sj->st);
+
+  free(sj);
+  conn_resume(conn);
+}
+
+/**
+ * Replace a file with the request body
+ */
+void post_save(struct conn *conn, const char *request_path) {
+  char filepath[4096];
+  struct stat st;
+  int length;
+  char *body = request_body(conn, &length);
+
+  if (body == NULL) {
+    bad_req_resp(conn);
+    return;
+  }
+
   // find the server root path first.
   memset(filepath, 0, 4096);
-  snprintf(filepath, sizeof filepath, "%s/%s", SERVER_ROOT, request_path);
+  snprintf(filepath, sizeof filepath, "%s%s", SERVER_ROOT, request_path);
+
+  if (conn->pool != NULL) {
+    struct save_job *sj = malloc(sizeof *sj);
+
+    if (sj != NULL) {
+      sj->job.work = save_job_work;
+      sj->job.done = save_job_done;
+      sj->conn = conn;
+      sj->body = body;
+      sj->length = length;
+      sj->status = -1;
+      snprintf(sj->filepath, sizeof sj->filepath, "%s", filepath);
+
+      if (iopool_submit(conn->pool, &sj->job) == 0) {
+        conn_park(conn);
+        return;
+      }
+
+      free(sj);
+    }
+  }
+
+  int status = save_file(filepath, body, length, &st);
+  post_save_done(conn, filepath, status, body, length, &st);
+}
+
+// A POST parked on the append log
+struct append_job {
+  struct applog_record rec; // must be first
+  struct conn *conn;
+  char filepath[4096];
+};
+
+/**
+ * Map an append log status to post_save_respond()'s
+ */
+int append_status(int status) {
+  if (status == 0)
+    return 1;
+
+  return status == -ENOENT ? 0 : -1;
+}
+
+/**
+ * Answer an append; the cached copy, if any, is now short
+ */
+void post_append_respond(struct conn *conn, char *filepath, int status) {
+  if (status == 0)
+    cache_delete(conn->cache, filepath);
+
+  post_save_respond(conn, append_status(status));
+}
 
-  // modify file
-  filedata = file_load(filepath);
-  if (filedata == NULL) {
-    bad_req_resp(fd);
+/**
+ * Loop thread: answer the parked POST once its batch is committed
+ */
+void append_job_done(struct applog_record *rec) {
+  struct append_job *aj = (struct append_job *)rec;
+  struct conn *conn = aj->conn;
+
+  post_append_respond(conn, aj->filepath, rec->status);
+
+  free(aj);
+  conn_resume(conn);
+}
+
+/**
+ * Append the request body to a file through the group-commit log
+ *
+ * The body is written straight from the request buffer, which lives as long
+ * as the parked connection.
+ */
+void post_append(struct conn *conn, const char *request_path) {
+  int length;
+  char *body = request_body(conn, &length);
+
+  if (body == NULL) {
+    bad_req_resp(conn);
     return;
   }
-  file_modify(filedata, body);
 
-  // try to save the modify buffering files
-  if (!file_save(filedata)) {
-    file_free(filedata);
+  struct append_job *aj = malloc(sizeof *aj);
+  if (aj == NULL) {
+    resp_500(conn);
     return;
   }
 
-  // remember to update cache
-  struct cache_entry *entry = cache_get(cache, request_path);
-  if (entry != NULL) {
-    // set dirty
-    entry->dirty = 1;
+  snprintf(aj->filepath, sizeof aj->filepath, "%s%s", SERVER_ROOT,
+           request_path);
+  memset(&aj->rec, 0, sizeof aj->rec);
+  aj->rec.path = aj->filepath;
+  aj->rec.data = body;
+  aj->rec.length = length;
+  aj->rec.done = append_job_done;
+  aj->conn = conn;
+
+  // Loops that can't park a connection wait for the batch instead
+  if (conn->resume == NULL) {
+    int status = applog_append_wait(append_log, &aj->rec);
+
+    post_append_respond(conn, aj->filepath, status);
+    free(aj);
+    return;
   }
 
-  send_response(fd, "HTTP/1.1 200 OK", mime, resp_body, strlen(resp_body));
+  conn_park(conn);
+  applog_append(append_log, &aj->rec);
+}
 
-  file_free(filedata);
+/**
+ * Save a POST body to the file at its path
+ */
+void post_file(struct conn *conn, struct route_match *match) {
+  if (append_log != NULL)
+    post_append(conn, match->path);
+  else
+    post_save(conn, match->path);
 }
 
+// Every endpoint, compiled into a radix tree at startup. Static files are
+// the fallback for whatever a more specific route doesn't match.
+struct route_spec server_routes[] = {
+    {"GET", "/d20", get_d20, METRICS_EP_D20},
+    {"GET", "/metrics", get_metrics, METRICS_EP_METRICS},
+    {"GET", "/*path", get_file, METRICS_EP_STATIC},
+    {"POST", "/*path", post_file, METRICS_EP_SAVE},
+};
+
+struct router *server_router = NULL;
+
 /**
- * Handle HTTP request and send response
+ * Handle a complete HTTP request and queue the response on the connection
  */
-void handle_http_request(int fd, struct cache *cache) {
-  const int request_buffer_size = 65536; // 64K
+void handle_http_request(struct conn *conn) {
   const int oprlen = 16;
   const int pathlen = 256;
-  char request[request_buffer_size];
   char opr[oprlen];
   char path[pathlen];
 
-  memset(request, 0, request_buffer_size);
   memset(opr, 0, oprlen);
   memset(path, 0, pathlen);
 
-  // Read request
-  int bytes_recvd = recv(fd, request, request_buffer_size - 1, 0);
+  TRACE_END("recv", conn);
 
-  if (bytes_recvd < 0) {
-    perror("recv");
+  // Only part of it could be read: answer without looking at the rest
+  if (conn->request_error != 0) {
+    send_error_page(conn,
+                    conn->request_error == 413 ? &page_413 : &page_431);
     return;
   }
 
   // Read the first two components of the first line of the request
-  int nread = sscanf(request, "%s %s", opr, path);
-  if (nread == 0)
+  uint64_t start = metrics_now();
+  TRACE_BEGIN("parse", conn);
+  int nread = sscanf(conn->request, "%15s %255s", opr, path);
+  TRACE_END("parse", conn);
+  metrics_observe(METRICS_PARSE, metrics_now() - start);
+  if (nread < 2) {
+    bad_req_resp(conn);
     return;
+  }
 
-  // If GET, handle the get endpoints
-  if (strcmp(opr, "GET") == 0) {
-    if (strcmp(path, "/d20") == 0)
-      get_d20(fd);
-    // Otherwise serve the requested file by calling get_file()
-    else
-      get_file(fd, cache, path);
-  }
-  // (Stretch) If POST, handle the post request
-  else if (strcmp(opr, "POST") == 0) {
-    post_save(fd, find_start_of_body(request), cache, path);
-  } else {
-    resp_404(fd);
+  if (router_dispatch(server_router, opr, path, conn) == -1)
+    resp_404(conn);
+}
+
+/**
+ * Blocking serving loop: one connection at a time
+ *
+ * Polls the listener together with the side sources (inotify, warm-up), so
+ * file changes are applied before the next request is served and a cache
+ * hit never needs a stat() to be correct.
+ */
+int serve_blocking(struct loop_config *cfg) {
+  struct sockaddr_storage their_addr; // connector's address information
+  struct pollfd pfds[1 + LOOP_MAX_SOURCES];
+  int npfds = 1;
+
+  // Accepts drain the queue until it would block
+  fcntl(cfg->listenfd, F_SETFL, fcntl(cfg->listenfd, F_GETFL) | O_NONBLOCK);
+
+  pfds[0].fd = cfg->listenfd;
+  pfds[0].events = POLLIN;
+  for (int i = 0; i < cfg->nsources; i++, npfds++) {
+    pfds[npfds].fd = cfg->sources[i].fd;
+    pfds[npfds].events = POLLIN;
   }
+
+  while (!*cfg->stop) {
+    // Block until someone connects or a side source has something for us
+    if (poll(pfds, npfds, -1) == -1) {
+      if (errno != EINTR)
+        perror("poll");
+      continue;
+    }
+
+    for (int i = 0; i < cfg->nsources; i++) {
+      if (pfds[1 + i].revents & POLLIN)
+        cfg->sources[i].ready(cfg->sources[i].arg, cfg->cache);
+    }
+
+    if (!(pfds[0].revents & POLLIN))
+      continue;
+
+    // Serve a batch of waiting connections, one after the other, before
+    // polling again. The new sockets block, as conn_recv_blocking() wants.
+    for (int i = 0; i < LOOP_ACCEPT_BATCH && !*cfg->stop; i++) {
+      socklen_t sin_size = sizeof their_addr;
+
+      int newfd = accept4(cfg->listenfd, (struct sockaddr *)&their_addr,
+                          &sin_size, SOCK_CLOEXEC);
+      if (newfd == -1) {
+        if (errno == EINTR || errno == ECONNABORTED)
+          continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+          perror("accept");
+        break;
+      }
+
+      // newfd is a new socket descriptor for the new connection.
+      // listenfd is still listening for new connections.
+      struct conn *conn = conn_create(newfd, cfg->cache);
+      if (conn == NULL) {
+        close(newfd);
+        continue;
+      }
+      conn->peer = their_addr;
+
+      // Each write must make progress in time, as on the other loops
+      struct timeval write_tv = {cfg->timeouts.write / 1000,
+                                 (cfg->timeouts.write % 1000) * 1000};
+      setsockopt(newfd, SOL_SOCKET, SO_SNDTIMEO, &write_tv, sizeof write_tv);
+
+      if (conn_recv_blocking(conn, &cfg->timeouts) > 0) {
+        handle_http_request(conn);
+        conn_send_blocking(conn);
+      }
+
+      conn_free(conn);
+    }
+  }
+
+  return 0;
+}
+
+volatile sig_atomic_t shutting_down = 0;
+
+/**
+ * SIGINT/SIGTERM handler: ask the main loop to stop
+ */
+void request_shutdown(int sig) {
+  (void)sig;
+
+  shutting_down = 1;
+}
+
+/**
+ * Loop source callback: apply file changes to the cache
+ */
+void watcher_ready(void *watcher, struct cache *cache) {
+  watch_process(watcher, cache);
+}
+
+/**
+ * Loop source callback: pick up the tail end of the warm-up
+ */
+void warmup_ready(void *warmup, struct cache *cache) {
+  warmup_drain(warmup, cache);
+}
+
+/**
+ * Loop source callback: answer POSTs whose appends are committed
+ */
+void applog_ready(void *log, struct cache *cache) {
+  (void)cache;
+
+  applog_complete(log);
+}
+
+// A periodic snapshot being written out on the disk pool
+struct snapshot_job {
+  struct iopool_job job; // must be first
+  struct snapshot *snap;
+  struct snapshot_batch *batch;
+  int written; // snapshot_write()'s result
+};
+
+/**
+ * Pool job: write the snapshot's temporary file and sync it
+ */
+void snapshot_job_work(struct iopool_job *job) {
+  struct snapshot_job *sj = (struct snapshot_job *)job;
+
+  sj->written = snapshot_write(sj->snap, sj->batch);
+}
+
+/**
+ * Back on the loop: swap the new snapshot in and let its entries go
+ */
+void snapshot_job_done(struct iopool_job *job) {
+  struct snapshot_job *sj = (struct snapshot_job *)job;
+
+  snapshot_finish(sj->snap, sj->batch, sj->written);
+  sj->snap->saving = 0;
+  free(sj);
+}
+
+/**
+ * Loop source callback: the snapshot interval is up, save the cache
+ *
+ * The loop only collects the entries; writing and syncing them, which can
+ * take seconds for a big cache, is left to the disk pool. An interval that
+ * comes round while the last save is still going is skipped, as is one
+ * with the pool full. Without a pool, the save is done here.
+ */
+void snapshot_ready(void *arg, struct cache *cache) {
+  struct snapshot *snap = arg;
+  uint64_t expirations;
+
+  if (read(snap->fd, &expirations, sizeof expirations) != sizeof expirations ||
+      snap->saving)
+    return;
+
+  if (snap->pool == NULL) {
+    snapshot_save(snap, cache);
+    return;
+  }
+
+  struct snapshot_batch *batch = snapshot_begin(cache);
+  struct snapshot_job *sj = calloc(1, sizeof *sj);
+  if (batch == NULL || sj == NULL) {
+    if (batch != NULL)
+      snapshot_finish(snap, batch, -1);
+    free(sj);
+    return;
+  }
+
+  sj->job.work = snapshot_job_work;
+  sj->job.done = snapshot_job_done;
+  sj->snap = snap;
+  sj->batch = batch;
+  if (iopool_submit(snap->pool, &sj->job) == -1) {
+    snapshot_finish(snap, batch, -1);
+    free(sj);
+    return;
+  }
+
+  snap->saving = 1;
+}
+
+/**
+ * Loop source callback: SIGUSR1 dumps the trace, SIGUSR2 switches tracing
+ * on or off, SIGHUP reopens the access log
+ */
+void signal_ready(void *sigfd, struct cache *cache) {
+  struct signalfd_siginfo si;
+  (void)cache;
+
+  while (read(*(int *)sigfd, &si, sizeof si) == sizeof si) {
+    if (si.ssi_signo == SIGUSR2) {
+      trace_set_enabled(!trace_enabled);
+      printf("webserver: tracing %s\n", trace_enabled ? "on" : "off");
+    } else if (si.ssi_signo == SIGUSR1) {
+      long n = trace_dump(trace_file);
+      if (n >= 0)
+        printf("webserver: wrote %ld trace events to %s\n", n, trace_file);
+    } else if (si.ssi_signo == SIGHUP && access_log != NULL) {
+      accesslog_reopen(access_log);
+    }
+  }
+}
+
+/**
+ * Parse -T idle,header,body,write (seconds; fractions allowed, 0 for no
+ * limit). Fields left out keep their value. Returns -1 if malformed.
+ */
+int parse_timeouts(char *arg, struct loop_timeouts *t) {
+  int *fields[] = {&t->idle, &t->header, &t->body, &t->write};
+
+  for (int i = 0; i < 4 && *arg != '\0'; i++) {
+    char *end;
+    double seconds = strtod(arg, &end);
+
+    if (end == arg && *arg != ',')
+      return -1;
+    if (end != arg) {
+      if (seconds < 0 || seconds > 86400)
+        return -1;
+      *fields[i] = (int)(seconds * 1000);
+    }
+
+    if (*end == '\0')
+      return 0;
+    if (*end != ',')
+      return -1;
+    arg = end + 1;
+  }
+
+  return *arg == '\0' ? 0 : -1;
+}
+
+/**
+ * Print command line help
+ */
+void usage(char *prog) {
+  fprintf(stderr,
+          "usage: %s [-e epoll|uring|blocking] [-d threads] [-b bundle] [-w] "
+          "[-p popularity_file] [-f fraction] [-j threads] [-k]\n"
+          "          [-a none|interval|batch] [-i ms] [-t trace_file]\n"
+          "          [-l access_log] [-S fraction] [-L megabytes]\n"
+          "          [-B backlog] [-m connections] [-M connections]\n"
+          "          [-T idle,header,body,write] [-D file[,megabytes]]\n"
+          "          [-s snapshot_file[,seconds]] [-P workers[,megabytes]]\n"
+          "          [-C]\n"
+          "  -e  I/O backend (default epoll); uring falls back to epoll if "
+          "the\n"
+          "      kernel lacks io_uring\n"
+          "  -d  disk I/O threads for the epoll and uring backends "
+          "(default 4)\n"
+          "  -b  serve static files from a bundle built by mkbundle\n"
+          "  -w  preload SERVER_ROOT into the cache before accepting\n"
+          "  -p  popularity list: read to prioritise warm-up, rewritten "
+          "on exit\n"
+          "  -f  fraction of the warm-up set resident before accepting "
+          "(default 1.0)\n"
+          "  -j  warm-up loader threads (default 4)\n"
+          "  -k  cache files over %d MB a block at a time as they're sent\n"
+          "      (default: stream them uncached)\n"
+          "  -D  keep what the cache evicts in this file on local disk, "
+          "mapped;\n"
+          "      emptied at startup (default %d MB)\n"
+          "  -s  restore the cache from snapshot_file at startup, keeping "
+          "entries\n"
+          "      whose file is unchanged; save it there on exit and every "
+          "seconds\n"
+          "  -P  serve from this many worker processes (at most %d), "
+          "restarted if\n"
+          "      they die, sharing one cache in shared memory (default %d "
+          "MB);\n"
+          "      not with -D or -s\n"
+          "  -C  evict by CLOCK rather than LRU: a hit only sets a bit\n"
+          "  -a  append POST bodies to their file instead of replacing it,\n"
+          "      group-committed; fdatasync() never, every interval, or per "
+          "batch\n"
+          "  -i  sync interval for -a interval, in ms (default 1000)\n"
+          "  -t  start with tracing on; SIGUSR2 switches it on and off, "
+          "SIGUSR1\n"
+          "      writes Chrome trace JSON to trace_file (default " TRACE_FILE
+          ");\n"
+          "      with -P, each worker writes trace_file.worker\n"
+          "  -l  log each request to access_log as a JSON line; SIGHUP "
+          "reopens it;\n"
+          "      with -P, each worker logs to access_log.worker\n"
+          "  -S  fraction of requests below 400 to log (default 1.0)\n"
+          "  -L  rotate the access log at this size, keeping %d old files\n"
+          "  -B  listen backlog (default %d, capped by net.core.somaxconn)\n"
+          "  -m  most connections open at once; accepting pauses there and\n"
+          "      resumes below %d%% (default: half the descriptor limit)\n"
+          "  -M  most connections per serving loop (default no limit)\n"
+          "  -T  seconds a client may take: to start a request, to finish "
+          "its\n"
+          "      headers, between body reads and between response writes;\n"
+          "      0 for no limit (default %g,%g,%g,%g)\n",
+          prog, FILE_STREAM_MIN / (1024 * 1024), TIER_DEFAULT_MB,
+          SHCACHE_READERS, SHARED_CACHE_DEFAULT_MB, ACCESSLOG_KEEP, BACKLOG,
+          LOOP_RESUME_PERCENT, LOOP_IDLE_TIMEOUT_MS / 1000.0,
+          LOOP_HEADER_TIMEOUT_MS / 1000.0, LOOP_BODY_TIMEOUT_MS / 1000.0,
+          LOOP_WRITE_TIMEOUT_MS / 1000.0);
 }
 
 /**
  * Main
  */
-int main(void) {
-  int newfd; // listen on sock_fd, new connection on newfd
-  struct sockaddr_storage their_addr; // connector's address information
-  char s[INET6_ADDRSTRLEN];
+int main(int argc, char **argv) {
+  int warm = 0, warm_threads = 4, disk_threads = 4, opt;
+  int append_policy = -1, sync_interval = 1000;
+  double warm_fraction = 1.0;
+  char *popularity = NULL, *bundle_file = NULL, *backend = "epoll";
+  char *access_file = NULL, *tier_file = NULL, *snapshot_file = NULL;
+  char *prefork_arg = NULL;
+  int clock_eviction = 0;
+  double access_sample = 1.0;
+  off_t access_rotate = 0;
+  int backlog = BACKLOG, max_conns = -1, max_loop_conns = 0;
+  struct loop_timeouts timeouts = {LOOP_IDLE_TIMEOUT_MS, LOOP_HEADER_TIMEOUT_MS,
+                                   LOOP_BODY_TIMEOUT_MS, LOOP_WRITE_TIMEOUT_MS};
+
+  while ((opt = getopt(argc, argv,
+                       "e:d:b:wp:f:j:a:i:t:l:S:L:B:m:M:T:kD:s:P:C")) != -1) {
+    switch (opt) {
+    case 'e':
+      backend = optarg;
+      break;
+    case 'd':
+      disk_threads = atoi(optarg);
+      break;
+    case 'b':
+      bundle_file = optarg;
+      break;
+    case 'w':
+      warm = 1;
+      break;
+    case 'k':
+      cache_blocks = 1;
+      break;
+    case 'D':
+      tier_file = optarg;
+      break;
+    case 's':
+      snapshot_file = optarg;
+      break;
+    case 'P':
+      prefork_arg = optarg;
+      break;
+    case 'C':
+      clock_eviction = 1;
+      break;
+    case 'p':
+      popularity = optarg;
+      break;
+    case 'f':
+      warm_fraction = atof(optarg);
+      break;
+    case 'j':
+      warm_threads = atoi(optarg);
+      break;
+    case 'a':
+      append_policy = applog_policy_parse(optarg);
+      if (append_policy == -1) {
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'i':
+      sync_interval = atoi(optarg);
+      break;
+    case 't':
+      trace_file = optarg;
+      trace_set_enabled(1);
+      break;
+    case 'l':
+      access_file = optarg;
+      break;
+    case 'S':
+      access_sample = atof(optarg);
+      break;
+    case 'L':
+      access_rotate = (off_t)(atof(optarg) * 1024 * 1024);
+      break;
+    case 'B':
+      backlog = atoi(optarg);
+      break;
+    case 'm':
+      max_conns = atoi(optarg);
+      break;
+    case 'M':
+      max_loop_conns = atoi(optarg);
+      break;
+    case 'T':
+      if (parse_timeouts(optarg, &timeouts) == -1) {
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    default:
+      usage(argv[0]);
+      exit(1);
+    }
+  }
+
+  if (strcmp(backend, "epoll") != 0 && strcmp(backend, "uring") != 0 &&
+      strcmp(backend, "blocking") != 0) {
+    usage(argv[0]);
+    exit(1);
+  }
+
+  // The tier file and snapshot belong to one process's cache
+  if (prefork_arg != NULL && (tier_file != NULL || snapshot_file != NULL)) {
+    usage(argv[0]);
+    exit(1);
+  }
+
+  // Stop cleanly so the popularity list can be saved. No SA_RESTART: the
+  // serving loop must wake up to see the flag.
+  struct sigaction sa;
+  memset(&sa, 0, sizeof sa);
+  sa.sa_handler = request_shutdown;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  // Trace and log control signals arrive through the serving loop. Block
+  // them before any thread starts, so every thread inherits the mask.
+  sigset_t control_signals;
+  sigemptyset(&control_signals);
+  sigaddset(&control_signals, SIGUSR1);
+  sigaddset(&control_signals, SIGUSR2);
+  sigaddset(&control_signals, SIGHUP);
+  sigprocmask(SIG_BLOCK, &control_signals, NULL);
+  int sigfd = signalfd(-1, &control_signals, SFD_NONBLOCK | SFD_CLOEXEC);
+
+  // -P workers[,megabytes]: the workers share the listener and the cache;
+  // everything else, threads included, each makes for itself
+  int listenfd = -1, worker = -1;
+  struct shcache *shared = NULL;
+  if (prefork_arg != NULL) {
+    char *size = strchr(prefork_arg, ',');
+    double mb = size != NULL ? atof(size + 1) : SHARED_CACHE_DEFAULT_MB;
+    int workers = atoi(prefork_arg);
+
+    if (workers < 1 || workers > SHCACHE_READERS) {
+      usage(argv[0]);
+      exit(1);
+    }
+    shared = shcache_create((size_t)(mb * 1024 * 1024));
+    if (shared == NULL) {
+      perror("webserver: shared cache");
+      exit(1);
+    }
+    listenfd = get_listener_socket(PORT, backlog);
+    if (listenfd < 0) {
+      fprintf(stderr, "webserver: fatal error getting listening socket\n");
+      exit(1);
+    }
+    printf("webserver: %d workers sharing a %llu MB cache\n", workers,
+           (unsigned long long)(shared->header->npages *
+                                (SHCACHE_PAGE_SIZE / (1024 * 1024))));
+
+    worker = prefork(workers, &shutting_down);
+    if (worker == -1) {
+      printf("webserver: shutting down\n");
+      close(listenfd);
+      shcache_free(shared);
+      exit(0);
+    }
+    shcache_set_reader(shared, worker);
+  }
+
+  // Each worker has a log of its own, so each rotates only its own files,
+  // and a trace file of its own; its metrics carry its number
+  char worker_access_file[4096], worker_trace_file[4096];
+  if (worker != -1) {
+    if (access_file != NULL) {
+      snprintf(worker_access_file, sizeof worker_access_file, "%s.%d",
+               access_file, worker);
+      access_file = worker_access_file;
+    }
+    snprintf(worker_trace_file, sizeof worker_trace_file, "%s.%d", trace_file,
+             worker);
+    trace_file = worker_trace_file;
+    metrics_set_worker(worker);
+  }
+
+  if (access_file != NULL) {
+    access_log = accesslog_create(access_file, access_sample, access_rotate);
+    if (access_log == NULL)
+      exit(1);
+  }
+
+  if (bundle_file != NULL) {
+    assets = bundle_open(bundle_file);
+    if (assets == NULL)
+      exit(1);
+    printf("webserver: serving %llu files from %s\n",
+           (unsigned long long)assets->count, bundle_file);
+  }
+
+  error_pages_load();
+
+  server_router = router_build(server_routes, sizeof server_routes /
+                                                  sizeof server_routes[0]);
+  if (server_router == NULL)
+    exit(1);
 
   struct cache *cache = cache_create(10, 0);
+  cache->shared = shared;
+  cache->clock = clock_eviction;
 
-  // Get a listening socket
-  int listenfd = get_listener_socket(PORT);
+  // -D file[,megabytes]
+  struct tier *tier = NULL;
+  if (tier_file != NULL) {
+    char *size = strchr(tier_file, ',');
+    double mb = size != NULL ? atof(size + 1) : TIER_DEFAULT_MB;
+
+    if (size != NULL)
+      *size = '\0';
+    tier = tier_open(tier_file, (off_t)(mb * 1024 * 1024));
+    if (tier == NULL) {
+      perror(tier_file);
+      exit(1);
+    }
+    cache->tier = tier;
+    printf("webserver: warm cache tier of %lld MB in %s\n",
+           (long long)(tier->capacity / (1024 * 1024)), tier_file);
+  }
+
+  // -s file[,seconds]: start warm from the last run's cache
+  struct snapshot *snapshot = NULL;
+  if (snapshot_file != NULL) {
+    char *interval = strchr(snapshot_file, ',');
+
+    if (interval != NULL)
+      *interval = '\0';
+    snapshot = snapshot_create(snapshot_file,
+                               interval != NULL ? atoi(interval + 1) : 0);
+    if (snapshot == NULL) {
+      perror(snapshot_file);
+      exit(1);
+    }
+    if (snapshot_load(snapshot, cache) != -1)
+      printf("webserver: restored %d cached files from %s, %d changed since\n",
+             snapshot->restored, snapshot_file, snapshot->stale);
+  }
+
+  struct loop_config cfg;
+  memset(&cfg, 0, sizeof cfg);
+  cfg.cache = cache;
+  cfg.stop = &shutting_down;
+  cfg.max_conns = max_conns;
+  cfg.max_loop_conns = max_loop_conns;
+  cfg.exact_limits = max_conns > 0 || max_loop_conns > 0;
+  cfg.timeouts = timeouts;
+
+  // A connection can hold two descriptors (socket and file body); keep
+  // some for the cache, logs and watcher too, so accept() never has to
+  // fail with EMFILE under load
+  struct rlimit nofile;
+  if (max_conns == -1) {
+    cfg.max_conns = 0;
+    if (getrlimit(RLIMIT_NOFILE, &nofile) == 0 &&
+        nofile.rlim_cur != RLIM_INFINITY && nofile.rlim_cur > 128)
+      cfg.max_conns = (nofile.rlim_cur - 64) / 2;
+  }
+
+  if (sigfd != -1)
+    cfg.sources[cfg.nsources++] =
+        (struct loop_source){sigfd, signal_ready, &sigfd};
+
+  // Invalidate cached files as soon as they change on disk
+  struct watcher *watcher = watch_create(SERVER_ROOT);
+  if (watcher == NULL) {
+    fprintf(stderr, "webserver: warning: cache will not track file changes\n");
+    // ...so it can't tell when a missing file appears
+    cache->missing_max = 0;
+  } else {
+    cfg.sources[cfg.nsources++] =
+        (struct loop_source){watcher->fd, watcher_ready, watcher};
+  }
+
+  if (snapshot != NULL && snapshot->fd != -1)
+    cfg.sources[cfg.nsources++] =
+        (struct loop_source){snapshot->fd, snapshot_ready, snapshot};
+
+  if (append_policy != -1) {
+    append_log = applog_create(append_policy, sync_interval);
+    if (append_log == NULL)
+      exit(1);
+    cfg.sources[cfg.nsources++] =
+        (struct loop_source){append_log->fd, applog_ready, append_log};
+  }
+
+  // Preload the hot set; the rest keeps loading once we're accepting.
+  // Workers sharing a cache leave it to the first.
+  struct warmup *warmup = NULL;
+  if (warm && worker <= 0) {
+    warmup = warmup_start(SERVER_ROOT, popularity, cache->max_size,
+                          warm_threads);
+    if (warmup != NULL) {
+      warmup_wait(warmup, cache, warm_fraction);
+      printf("webserver: warm-up: %d of %d files resident\n",
+             warmup->resident, warmup->hot);
+      cfg.sources[cfg.nsources++] =
+          (struct loop_source){warmup->fd, warmup_ready, warmup};
+    }
+  }
+
+  // Get a listening socket, unless the parent made one for every worker
+  if (listenfd == -1)
+    listenfd = get_listener_socket(PORT, backlog);
 
   if (listenfd < 0) {
     fprintf(stderr, "webserver: fatal error getting listening socket\n");
     exit(1);
   }
 
+  cfg.listenfd = listenfd;
+
   printf("webserver: waiting for connections on port %s...\n", PORT);
 
   // This is the main loop that accepts incoming connections and
-  // responds to the request. The main parent process
-  // then goes back to waiting for new connections.
+  // responds to the request. It runs until we're asked to shut down.
+  int served = -1;
 
-  while (1) {
-    socklen_t sin_size = sizeof their_addr;
+  // Blocking filesystem calls happen on the pool, never on the loop
+  if (strcmp(backend, "blocking") != 0)
+    cfg.pool = iopool_create(disk_threads, IOPOOL_MAX_QUEUED);
+  if (snapshot != NULL)
+    snapshot->pool = cfg.pool;
+  if (tier != NULL && cfg.pool != NULL) {
+    tier->copy_in = demote_async;
+    tier->copy_arg = cfg.pool;
+  }
 
-    // Parent process will block on the accept() call until someone
-    // makes a new connection:
-    newfd = accept(listenfd, (struct sockaddr *)&their_addr, &sin_size);
-    if (newfd == -1) {
-      perror("accept");
-      continue;
+  if (strcmp(backend, "uring") == 0) {
+    served = serve_uring(&cfg);
+    if (served == -1) {
+      fprintf(stderr, "webserver: io_uring unavailable, using epoll\n");
+      backend = "epoll";
     }
+  }
 
-    // Print out a message that we got the connection
-    inet_ntop(their_addr.ss_family, get_in_addr((struct sockaddr *)&their_addr),
-              s, sizeof s);
-    printf("server: got connection from %s\n", s);
+  if (served == -1 && strcmp(backend, "epoll") == 0)
+    served = serve_epoll(&cfg);
 
-    // newfd is a new socket descriptor for the new connection.
-    // listenfd is still listening for new connections.
+  // Also finishes any periodic snapshot still being written, so the
+  // synchronous one below is the last
+  iopool_free(cfg.pool);
+  cfg.pool = NULL;
+  if (snapshot != NULL)
+    snapshot->pool = NULL;
+  if (tier != NULL)
+    tier->copy_in = NULL;
 
-    handle_http_request(newfd, cache);
+  if (served == -1)
+    serve_blocking(&cfg);
 
-    close(newfd);
-  }
+  printf("webserver: shutting down\n");
 
-  // Unreachable code
+  if (popularity != NULL && worker <= 0)
+    warmup_save(cache, SERVER_ROOT, popularity);
+  if (snapshot != NULL && snapshot_save(snapshot, cache) != -1)
+    printf("webserver: saved %d cached files to %s\n", snapshot->saved,
+           snapshot->filename);
+
+  close(listenfd);
+  applog_free(append_log);
+  warmup_free(warmup);
+  snapshot_free(snapshot);
+  watch_free(watcher);
+  cache_free(cache);
+  tier_close(tier);
+  shcache_free(shared);
+  router_free(server_router);
+  if (page_404_file != NULL)
+    file_free(page_404_file);
+  bundle_close(assets);
+  if (access_log != NULL) {
+    uint64_t dropped = accesslog_dropped(access_log);
+
+    if (dropped > 0)
+      printf("webserver: access log dropped %llu lines\n",
+             (unsigned long long)dropped);
+    accesslog_free(access_log);
+    access_log = NULL;
+  }
+  metrics_free();
+  trace_free();
+  if (sigfd != -1)
+    close(sigfd);
 
   return 0;
 }
@@ -0,0 +1,796 @@
+/**
+ * Shared cache: one cache in a shared memory segment for every worker
+ *
+ * The segment holds a header, a hash index of entry offsets, and pages
+ * handed out to power-of-two size classes as they need them, as in the
+ * warm tier. An entry and its content share one chunk, so putting it costs
+ * one allocation and deleting it one free.
+ */
+
+#define _GNU_SOURCE // memfd_create()
+#include "shcache.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+void *shcache_at(struct shcache *sh, uint64_t offset) {
+  return sh->map + offset;
+}
+
+uint64_t shcache_offset(struct shcache *sh, void *p) {
+  return (char *)p - sh->map;
+}
+
+/**
+ * FNV-1a of a path
+ */
+uint64_t shcache_hash(char *path) {
+  uint64_t hash = 14695981039346656037ULL;
+
+  for (unsigned char *p = (unsigned char *)path; *p != '\0'; p++) {
+    hash ^= *p;
+    hash *= 1099511628211ULL;
+  }
+
+  return hash;
+}
+
+/**
+ * Make a segment of about capacity bytes of pages, at least one
+ *
+ * Call before forking the workers that share it. Returns NULL with errno
+ * set on failure.
+ */
+struct shcache *shcache_create(size_t capacity) {
+  struct shcache *sh = calloc(1, sizeof *sh);
+  if (sh == NULL)
+    return NULL;
+
+  uint32_t npages = capacity / SHCACHE_PAGE_SIZE;
+  if (npages == 0)
+    npages = 1;
+
+  uint64_t nbuckets = 1024;
+  while (nbuckets < (uint64_t)npages * SHCACHE_PAGE_SIZE / SHCACHE_ENTRY_SIZE)
+    nbuckets *= 2;
+
+  uint64_t buckets = (sizeof(struct shcache_header) + 63) & ~63ULL;
+  uint64_t page_classes = buckets + nbuckets * sizeof(uint64_t);
+  uint64_t ledgers = (page_classes + npages + 63) & ~63ULL;
+  uint64_t pages = (ledgers + (uint64_t)SHCACHE_READERS * SHCACHE_HELD *
+                                  sizeof(struct shcache_held) +
+                    4095) &
+                   ~4095ULL;
+  sh->size = pages + (uint64_t)npages * SHCACHE_PAGE_SIZE;
+
+  int fd = memfd_create("webserver-cache", MFD_CLOEXEC);
+  if (fd == -1) {
+    free(sh);
+    return NULL;
+  }
+
+  sh->map = MAP_FAILED;
+  if (ftruncate(fd, sh->size) == 0)
+    sh->map = mmap(NULL, sh->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+  int saved_errno = errno;
+  close(fd);
+  if (sh->map == MAP_FAILED) {
+    free(sh);
+    errno = saved_errno;
+    return NULL;
+  }
+
+  // The file starts zeroed: every bucket and list is already empty
+  struct shcache_header *h = sh->header = (struct shcache_header *)sh->map;
+  pthread_mutexattr_t attr;
+
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(&h->lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+
+  h->epoch = 1;
+  h->nbuckets = nbuckets;
+  h->buckets = buckets;
+  h->page_classes = page_classes;
+  h->ledgers = ledgers;
+  h->pages = pages;
+  h->npages = npages;
+  for (int c = 0; c < SHCACHE_CLASSES; c++)
+    h->classes[c].chunk_size = (uint64_t)SHCACHE_MIN_CHUNK << c;
+
+  return sh;
+}
+
+/**
+ * Unmap the segment from this process
+ */
+void shcache_free(struct shcache *sh) {
+  if (sh == NULL)
+    return;
+
+  munmap(sh->map, sh->size);
+  free(sh);
+}
+
+uint64_t *shcache_bucket(struct shcache *sh, uint64_t hash) {
+  uint64_t *buckets = shcache_at(sh, sh->header->buckets);
+
+  return &buckets[hash & (sh->header->nbuckets - 1)];
+}
+
+char *shcache_path(struct shcache_entry *e) { return (char *)(e + 1); }
+
+char *shcache_content_type(struct shcache_entry *e) {
+  return shcache_path(e) + e->path_length;
+}
+
+void *shcache_content(struct shcache_entry *e) {
+  return shcache_content_type(e) + e->type_length;
+}
+
+/**
+ * The entry for path, or NULL
+ *
+ * Called with the lock held, or by a lookup inside its epoch: links are
+ * loaded atomically, as writers may change them meanwhile.
+ */
+struct shcache_entry *shcache_find(struct shcache *sh, char *path,
+                                   uint64_t hash) {
+  uint64_t off = __atomic_load_n(shcache_bucket(sh, hash), __ATOMIC_ACQUIRE);
+
+  while (off != 0) {
+    struct shcache_entry *e = shcache_at(sh, off);
+
+    if (e->hash == hash && strcmp(shcache_path(e), path) == 0)
+      return e;
+    off = __atomic_load_n(&e->hash_next, __ATOMIC_ACQUIRE);
+  }
+
+  return NULL;
+}
+
+void shcache_list_unlink(struct shcache *sh, struct shcache_entry *e) {
+  struct shcache_class *class = &sh->header->classes[e->cls];
+
+  if (e->prev != 0)
+    ((struct shcache_entry *)shcache_at(sh, e->prev))->next = e->next;
+  else
+    class->head = e->next;
+  if (e->next != 0)
+    ((struct shcache_entry *)shcache_at(sh, e->next))->prev = e->prev;
+  else
+    class->tail = e->prev;
+
+  e->prev = e->next = 0;
+}
+
+void shcache_list_push(struct shcache *sh, struct shcache_entry *e) {
+  struct shcache_class *class = &sh->header->classes[e->cls];
+  uint64_t off = shcache_offset(sh, e);
+
+  e->prev = 0;
+  e->next = class->head;
+  if (class->head != 0)
+    ((struct shcache_entry *)shcache_at(sh, class->head))->prev = off;
+  class->head = off;
+  if (class->tail == 0)
+    class->tail = off;
+}
+
+/**
+ * Rebuild the index, the CLOCK lists and the free lists from the chunks
+ * themselves, with the lock held
+ *
+ * For when a worker died holding the lock, maybe part way through changing
+ * them. An entry is in the index if its state says so. A chunk nobody
+ * holds goes to limbo, as a lookup may be reading it; one held but out of
+ * the index is retired by its last release, as ever. Lookups walking the
+ * old chains meanwhile just miss.
+ */
+void shcache_rebuild(struct shcache *sh) {
+  struct shcache_header *h = sh->header;
+  uint64_t *buckets = shcache_at(sh, h->buckets);
+  uint8_t *page_classes = shcache_at(sh, h->page_classes);
+
+  for (uint64_t b = 0; b < h->nbuckets; b++)
+    __atomic_store_n(&buckets[b], 0, __ATOMIC_RELEASE);
+
+  for (int c = 0; c < SHCACHE_CLASSES; c++) {
+    struct shcache_class *class = &h->classes[c];
+
+    class->free = class->limbo = class->head = class->tail = 0;
+    class->pages = class->count = 0;
+  }
+  h->count = h->blocks = h->bytes = 0;
+
+  for (uint32_t p = 0; p < h->next_page; p++) {
+    int c = page_classes[p];
+    struct shcache_class *class = &h->classes[c];
+    uint64_t page = h->pages + (uint64_t)p * SHCACHE_PAGE_SIZE;
+
+    class->pages++;
+    for (uint64_t off = page; off < page + SHCACHE_PAGE_SIZE;
+         off += class->chunk_size) {
+      struct shcache_entry *e = shcache_at(sh, off);
+      uint32_t state = __atomic_load_n(&e->state, __ATOMIC_ACQUIRE);
+
+      e->cls = c;
+      if (state & 1) {
+        uint64_t *bucket = shcache_bucket(sh, e->hash);
+
+        e->hash_next = *bucket;
+        __atomic_store_n(bucket, off, __ATOMIC_RELEASE);
+        shcache_list_push(sh, e);
+
+        class->count++;
+        h->count++;
+        h->blocks += e->block;
+        h->bytes += e->content_length;
+      } else if (state == 0) {
+        e->prev = h->epoch;
+        e->next = class->limbo;
+        class->limbo = off;
+      }
+    }
+  }
+
+  __atomic_store_n(&h->epoch, h->epoch + 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Take the writers' lock, picking it up from a worker that died holding it
+ */
+void shcache_lock(struct shcache *sh) {
+  if (pthread_mutex_lock(&sh->header->lock) == EOWNERDEAD) {
+    shcache_rebuild(sh);
+    pthread_mutex_consistent(&sh->header->lock);
+  }
+}
+
+void shcache_unlock(struct shcache *sh) {
+  pthread_mutex_unlock(&sh->header->lock);
+}
+
+/**
+ * Put a chunk on its class's free list
+ */
+void shcache_free_chunk(struct shcache *sh, int c, uint64_t off) {
+  struct shcache_class *class = &sh->header->classes[c];
+
+  *(uint64_t *)shcache_at(sh, off) = class->free;
+  class->free = off;
+}
+
+/**
+ * Hold a chunk taken out of the index until no lookup can be reading it
+ */
+void shcache_retire(struct shcache *sh, struct shcache_entry *e) {
+  struct shcache_header *h = sh->header;
+  struct shcache_class *class = &h->classes[e->cls];
+
+  e->prev = h->epoch;
+  e->next = class->limbo;
+  class->limbo = shcache_offset(sh, e);
+  __atomic_store_n(&h->epoch, h->epoch + 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Free the chunks in class c's limbo retired before any lookup still
+ * running began
+ */
+void shcache_reclaim(struct shcache *sh, int c) {
+  struct shcache_header *h = sh->header;
+  struct shcache_class *class = &h->classes[c];
+  uint64_t oldest = UINT64_MAX;
+
+  if (class->limbo == 0)
+    return;
+
+  // Either a lookup's epoch is seen here, or it sees every unlink made
+  // before its epoch was bumped
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  for (int r = 0; r < SHCACHE_READERS; r++) {
+    uint64_t epoch = __atomic_load_n(&h->readers[r].epoch, __ATOMIC_ACQUIRE);
+
+    if (epoch != 0 && epoch < oldest)
+      oldest = epoch;
+  }
+
+  for (uint64_t *link = &class->limbo; *link != 0;) {
+    uint64_t off = *link;
+    struct shcache_entry *e = shcache_at(sh, off);
+
+    if (e->prev < oldest) {
+      *link = e->next;
+      shcache_free_chunk(sh, c, off);
+    } else {
+      link = &e->next;
+    }
+  }
+}
+
+/**
+ * Take a reference to an entry, unless it's been taken out of the index
+ */
+int shcache_ref(struct shcache_entry *e) {
+  uint32_t state = __atomic_load_n(&e->state, __ATOMIC_ACQUIRE);
+
+  do {
+    if (!(state & 1))
+      return 0;
+  } while (!__atomic_compare_exchange_n(&e->state, &state, state + 2, 1,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+  return 1;
+}
+
+/**
+ * A reader's ledger
+ */
+struct shcache_held *shcache_ledger(struct shcache *sh, int reader) {
+  struct shcache_held *ledgers = shcache_at(sh, sh->header->ledgers);
+
+  return ledgers + (size_t)reader * SHCACHE_HELD;
+}
+
+/**
+ * The ledger slot the entry at off is looked for from
+ */
+uint64_t shcache_held_home(uint64_t off) {
+  return (off / SHCACHE_MIN_CHUNK * 11400714819323198485ULL) >>
+         (64 - SHCACHE_HELD_BITS);
+}
+
+/**
+ * This process's ledger slot for the entry at off, or the empty one it
+ * would go in
+ */
+struct shcache_held *shcache_held_slot(struct shcache *sh, uint64_t off) {
+  struct shcache_held *ledger = shcache_ledger(sh, sh->reader);
+  uint64_t i = shcache_held_home(off);
+
+  while (ledger[i].count != 0 && ledger[i].entry != off)
+    i = (i + 1) & (SHCACHE_HELD - 1);
+
+  return &ledger[i];
+}
+
+/**
+ * Note in this process's ledger a reference it has taken to the entry at
+ * off
+ *
+ * Returns -1 if the ledger is too full for another entry.
+ */
+int shcache_hold(struct shcache *sh, uint64_t off) {
+  struct shcache_reader *r = &sh->header->readers[sh->reader];
+  struct shcache_held *slot = shcache_held_slot(sh, off);
+
+  if (slot->count == 0) {
+    if (r->held >= SHCACHE_HELD / 4 * 3)
+      return -1;
+    r->held++;
+    slot->entry = off;
+  }
+
+  // Counted once the offset is in, so no slot is ever half filled
+  __atomic_store_n(&slot->count, slot->count + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/**
+ * Strike a reference to the entry at off from this process's ledger,
+ * before dropping it
+ *
+ * Emptying a slot moves the run of slots after it back, so each can still
+ * be found from its home. A move empties the old slot before filling the
+ * new one: dying in between loses the entry, leaving it pinned, rather
+ * than listing it twice.
+ */
+void shcache_unhold(struct shcache *sh, uint64_t off) {
+  struct shcache_held *ledger = shcache_ledger(sh, sh->reader);
+  struct shcache_held *slot = shcache_held_slot(sh, off);
+  uint64_t mask = SHCACHE_HELD - 1, gap = slot - ledger;
+
+  if (slot->count == 0)
+    return;
+
+  __atomic_store_n(&slot->count, slot->count - 1, __ATOMIC_RELEASE);
+  if (slot->count > 0)
+    return;
+  sh->header->readers[sh->reader].held--;
+
+  for (uint64_t i = (gap + 1) & mask; ledger[i].count != 0;
+       i = (i + 1) & mask) {
+    uint64_t home = shcache_held_home(ledger[i].entry);
+
+    // Its home is between the gap and here: it can't move back past it
+    if (((i - home) & mask) < ((i - gap) & mask))
+      continue;
+
+    struct shcache_held moved = ledger[i];
+    __atomic_store_n(&ledger[i].count, 0, __ATOMIC_RELEASE);
+    ledger[gap].entry = moved.entry;
+    __atomic_store_n(&ledger[gap].count, moved.count, __ATOMIC_RELEASE);
+    gap = i;
+  }
+}
+
+/**
+ * Drop n references to an entry, retiring it with the last if it's out of
+ * the index
+ */
+void shcache_unref(struct shcache *sh, struct shcache_entry *e, uint32_t n) {
+  if (__atomic_sub_fetch(&e->state, 2 * n, __ATOMIC_ACQ_REL) != 0)
+    return;
+
+  shcache_lock(sh);
+  shcache_retire(sh, e);
+  shcache_unlock(sh);
+}
+
+/**
+ * Take a reference to an entry for this process, unless it's been taken
+ * out of the index or the ledger is full
+ *
+ * It's counted on the entry before it's noted in the ledger, so dying in
+ * between leaves the entry pinned rather than dropped twice.
+ */
+int shcache_take(struct shcache *sh, struct shcache_entry *e) {
+  if (!shcache_ref(e))
+    return 0;
+
+  if (shcache_hold(sh, shcache_offset(sh, e)) == -1) {
+    shcache_unref(sh, e, 1);
+    return 0;
+  }
+
+  return 1;
+}
+
+/**
+ * Use slot reader for this process's lookups, clearing whatever a worker
+ * that had it before left there: a lookup's epoch, and the references its
+ * ledger lists
+ */
+void shcache_set_reader(struct shcache *sh, int reader) {
+  struct shcache_header *h = sh->header;
+  struct shcache_held *ledger = shcache_ledger(sh, reader);
+
+  sh->reader = reader;
+  __atomic_store_n(&h->readers[reader].epoch, 0, __ATOMIC_RELEASE);
+
+  for (int i = 0; i < SHCACHE_HELD; i++) {
+    uint64_t off = ledger[i].entry, count = ledger[i].count;
+
+    // Struck before dropped, as by shcache_unhold()
+    __atomic_store_n(&ledger[i].count, 0, __ATOMIC_RELEASE);
+    if (count != 0 && off >= h->pages && off < sh->size)
+      shcache_unref(sh, shcache_at(sh, off), count);
+  }
+  h->readers[reader].held = 0;
+}
+
+/**
+ * Take an entry out of the index and the CLOCK; with the lock held
+ *
+ * Its chunk is retired now, or by the last shcache_release() if it's in
+ * use. Lookups already past it in its bucket carry on to the next.
+ */
+void shcache_unlink(struct shcache *sh, struct shcache_entry *e) {
+  struct shcache_header *h = sh->header;
+  uint64_t off = shcache_offset(sh, e);
+  uint64_t *link = shcache_bucket(sh, e->hash);
+
+  while (*link != off)
+    link = &((struct shcache_entry *)shcache_at(sh, *link))->hash_next;
+  __atomic_store_n(link, e->hash_next, __ATOMIC_RELEASE);
+
+  shcache_list_unlink(sh, e);
+  h->classes[e->cls].count--;
+  h->count--;
+  h->blocks -= e->block;
+  h->bytes -= e->content_length;
+
+  if (__atomic_fetch_and(&e->state, ~1u, __ATOMIC_ACQ_REL) == 1)
+    shcache_retire(sh, e);
+}
+
+/**
+ * Find a chunk in class c: a free one, one from a new page, or the one
+ * held by an entry the CLOCK hand evicts
+ *
+ * The hand sweeps from the tail. An entry looked up since it last passed
+ * gets a second chance at the head, as does one in use; the first that's
+ * neither goes. Returns the chunk's offset, or 0 if there's none to be had
+ * yet.
+ */
+uint64_t shcache_chunk(struct shcache *sh, int c) {
+  struct shcache_header *h = sh->header;
+  struct shcache_class *class = &h->classes[c];
+
+  if (class->free == 0)
+    shcache_reclaim(sh, c);
+
+  if (class->free == 0 && h->next_page < h->npages) {
+    uint64_t page = h->pages + (uint64_t)h->next_page * SHCACHE_PAGE_SIZE;
+    uint8_t *page_classes = shcache_at(sh, h->page_classes);
+
+    page_classes[h->next_page] = c;
+
+    for (uint64_t n = SHCACHE_PAGE_SIZE / class->chunk_size; n > 0; n--)
+      shcache_free_chunk(sh, c, page + (n - 1) * class->chunk_size);
+
+    h->next_page++;
+    class->pages++;
+  }
+
+  for (uint32_t n = 2 * class->count; class->free == 0 && n > 0; n--) {
+    struct shcache_entry *e = shcache_at(sh, class->tail);
+
+    if (__atomic_load_n(&e->referenced, __ATOMIC_RELAXED) ||
+        __atomic_load_n(&e->state, __ATOMIC_ACQUIRE) > 1) {
+      __atomic_store_n(&e->referenced, 0, __ATOMIC_RELAXED);
+      shcache_list_unlink(sh, e);
+      shcache_list_push(sh, e);
+      continue;
+    }
+
+    shcache_unlink(sh, e);
+    h->evictions++;
+    shcache_reclaim(sh, c);
+    break;
+  }
+
+  uint64_t off = class->free;
+  if (off != 0)
+    class->free = *(uint64_t *)shcache_at(sh, off);
+
+  return off;
+}
+
+/**
+ * Find a chunk in class c for a new entry, held by this process while it
+ * fills it in; with the lock held
+ *
+ * Returns the chunk's offset, or 0 if there's none to be had yet or the
+ * ledger is full.
+ */
+uint64_t shcache_claim(struct shcache *sh, int c) {
+  uint64_t off = shcache_chunk(sh, c);
+  if (off == 0)
+    return 0;
+
+  struct shcache_entry *e = shcache_at(sh, off);
+  e->cls = c;
+  __atomic_store_n(&e->state, 2, __ATOMIC_RELEASE);
+
+  if (shcache_hold(sh, off) == -1) {
+    e->state = 0;
+    shcache_free_chunk(sh, c, off);
+    return 0;
+  }
+
+  return off;
+}
+
+/**
+ * Look up path, taking a reference to its entry
+ *
+ * Takes no lock: the only shared writes are to the entry's reference count
+ * and, on the first hit since the CLOCK hand passed, its referenced bit.
+ * The entry and its content stay put until shcache_release(), even if it's
+ * deleted meanwhile. Returns NULL if path isn't cached.
+ */
+struct shcache_entry *shcache_get(struct shcache *sh, char *path) {
+  struct shcache_header *h = sh->header;
+  struct shcache_reader *r = &h->readers[sh->reader];
+  uint64_t hash = shcache_hash(path);
+
+  __atomic_store_n(&r->epoch, __atomic_load_n(&h->epoch, __ATOMIC_ACQUIRE),
+                   __ATOMIC_SEQ_CST);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  struct shcache_entry *e = shcache_find(sh, path, hash);
+  if (e != NULL && !shcache_ref(e))
+    e = NULL;
+
+  __atomic_store_n(&r->epoch, 0, __ATOMIC_RELEASE);
+
+  // Counted before it's noted, as by shcache_take()
+  if (e != NULL && shcache_hold(sh, shcache_offset(sh, e)) == -1) {
+    shcache_unref(sh, e, 1);
+    e = NULL;
+  }
+
+  if (e != NULL) {
+    if (!__atomic_load_n(&e->referenced, __ATOMIC_RELAXED))
+      __atomic_store_n(&e->referenced, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&r->hits, r->hits + 1, __ATOMIC_RELAXED);
+  } else {
+    __atomic_store_n(&r->misses, r->misses + 1, __ATOMIC_RELAXED);
+  }
+
+  return e;
+}
+
+/**
+ * Copy content into the segment under path, taking a reference to it
+ *
+ * If path is already cached, that entry is kept, as with cache_put().
+ * Returns the entry now cached for path, or NULL if it's too big for a
+ * chunk or every chunk it could have is in use.
+ */
+struct shcache_entry *shcache_put(struct shcache *sh, char *path,
+                                  char *content_type, void *content,
+                                  uint64_t content_length) {
+  uint32_t path_length = strlen(path) + 1;
+  uint32_t type_length = strlen(content_type) + 1;
+  uint64_t length =
+      sizeof(struct shcache_entry) + path_length + type_length + content_length;
+  uint64_t hash = shcache_hash(path);
+
+  int c = 0;
+  while (c < SHCACHE_CLASSES && length > (uint64_t)SHCACHE_MIN_CHUNK << c)
+    c++;
+  if (c == SHCACHE_CLASSES)
+    return NULL;
+
+  shcache_lock(sh);
+
+  // Under the lock, nothing in the index can leave it: only a full ledger
+  // stops the ref
+  struct shcache_entry *e = shcache_find(sh, path, hash);
+  uint64_t off = e == NULL ? shcache_claim(sh, c) : 0;
+  if (e != NULL && !shcache_take(sh, e))
+    e = NULL;
+
+  shcache_unlock(sh);
+
+  if (off == 0)
+    return e;
+
+  // Fill the chunk without the lock: it's in no list, so nobody else can
+  // reach it. Its class and state were set when it was claimed.
+  e = shcache_at(sh, off);
+  e->hash_next = e->prev = e->next = 0;
+  e->referenced = 0;
+  e->hash = hash;
+  e->content_length = content_length;
+  e->path_length = path_length;
+  e->type_length = type_length;
+  e->block = strchr(path, '#') != NULL;
+  memcpy(shcache_path(e), path, path_length);
+  memcpy(shcache_content_type(e), content_type, type_length);
+  memcpy(shcache_content(e), content, content_length);
+
+  shcache_lock(sh);
+
+  // Another worker may have put the same path meanwhile: share theirs
+  struct shcache_entry *existing = shcache_find(sh, path, hash);
+  if (existing != NULL) {
+    shcache_unhold(sh, off);
+    e->state = 0;
+    shcache_free_chunk(sh, c, off);
+    e = shcache_take(sh, existing) ? existing : NULL;
+  } else {
+    uint64_t *bucket = shcache_bucket(sh, hash);
+
+    // Our reference, and in the index; complete before lookups can see it
+    __atomic_store_n(&e->state, 2 | 1, __ATOMIC_RELEASE);
+    e->hash_next = *bucket;
+    __atomic_store_n(bucket, off, __ATOMIC_RELEASE);
+    shcache_list_push(sh, e);
+
+    sh->header->classes[c].count++;
+    sh->header->count++;
+    sh->header->blocks += e->block;
+    sh->header->bytes += content_length;
+  }
+
+  shcache_unlock(sh);
+  return e;
+}
+
+/**
+ * Drop a reference taken by shcache_get() or shcache_put()
+ *
+ * Only takes the lock to retire an entry deleted meanwhile.
+ */
+void shcache_release(struct shcache *sh, struct shcache_entry *e) {
+  shcache_unhold(sh, shcache_offset(sh, e));
+  shcache_unref(sh, e, 1);
+}
+
+/**
+ * Has the entry been taken out of the index since the reference was taken?
+ *
+ * Read without the lock: another worker may have replaced the path.
+ */
+int shcache_stale(struct shcache_entry *e) {
+  return !(__atomic_load_n(&e->state, __ATOMIC_ACQUIRE) & 1);
+}
+
+/**
+ * Drop the entry for path; returns 1 if there was one
+ */
+int shcache_delete(struct shcache *sh, char *path) {
+  if (sh == NULL)
+    return 0;
+
+  uint64_t hash = shcache_hash(path);
+
+  shcache_lock(sh);
+
+  struct shcache_entry *e = shcache_find(sh, path, hash);
+  if (e != NULL)
+    shcache_unlink(sh, e);
+
+  shcache_unlock(sh);
+  return e != NULL;
+}
+
+/**
+ * Drop every entry matching: a block of path, or, with blocks 0, any path
+ * under prefix
+ */
+int shcache_delete_matching(struct shcache *sh, char *prefix, int blocks) {
+  size_t prefix_len = strlen(prefix);
+  int removed = 0;
+
+  shcache_lock(sh);
+
+  for (int c = 0; c < SHCACHE_CLASSES; c++) {
+    for (uint64_t off = sh->header->classes[c].head; off != 0;) {
+      struct shcache_entry *e = shcache_at(sh, off);
+      char *path = shcache_path(e);
+
+      off = e->next;
+      if (strncmp(path, prefix, prefix_len) == 0 &&
+          (!blocks || (e->block && path[prefix_len] == '#'))) {
+        shcache_unlink(sh, e);
+        removed++;
+      }
+    }
+  }
+
+  shcache_unlock(sh);
+  return removed;
+}
+
+/**
+ * Drop the blocks cached for path
+ */
+int shcache_delete_blocks(struct shcache *sh, char *path) {
+  if (sh == NULL || __atomic_load_n(&sh->header->blocks, __ATOMIC_RELAXED) == 0)
+    return 0;
+
+  return shcache_delete_matching(sh, path, 1);
+}
+
+/**
+ * Drop every entry whose path begins with prefix
+ */
+int shcache_delete_prefix(struct shcache *sh, char *prefix) {
+  if (sh == NULL)
+    return 0;
+
+  return shcache_delete_matching(sh, prefix, 0);
+}
+
+/**
+ * Lookups so far, summed over every process's slot
+ */
+void shcache_lookups(struct shcache *sh, uint64_t *hits, uint64_t *misses) {
+  *hits = *misses = 0;
+
+  for (int r = 0; r < SHCACHE_READERS; r++) {
+    *hits += __atomic_load_n(&sh->header->readers[r].hits, __ATOMIC_RELAXED);
+    *misses +=
+        __atomic_load_n(&sh->header->readers[r].misses, __ATOMIC_RELAXED);
+  }
+}
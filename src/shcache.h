@@ -0,0 +1,129 @@
+#ifndef _SHCACHE_H_
+#define _SHCACHE_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHCACHE_PAGE_SIZE (8 * 1024 * 1024) // slab: what a size class grows by
+#define SHCACHE_MIN_CHUNK 256
+#define SHCACHE_CLASSES 16 // chunks of SHCACHE_MIN_CHUNK doubling to a page
+#define SHCACHE_ENTRY_SIZE 4096 // average, for sizing the index
+#define SHCACHE_READERS 64      // processes that may look up: one slot each
+#define SHCACHE_HELD_BITS 12    // ledger of 4096 slots per reader
+#define SHCACHE_HELD (1 << SHCACHE_HELD_BITS)
+
+// An entry, at the start of its chunk, followed by its path and content
+// type (each with its NUL) and then its content
+//
+// Links are offsets from the start of the segment, 0 for none, so they
+// mean the same in every process whatever address it's mapped at.
+struct shcache_entry {
+  uint64_t hash_next; // next in its bucket
+  // CLOCK order within its class. Once retired, next links the class's
+  // limbo list and prev holds the epoch it was retired in.
+  uint64_t prev, next;
+  uint64_t hash;
+  uint64_t content_length;
+  uint32_t path_length, type_length;
+  int32_t cls;
+  uint32_t state;     // references << 1, | 1 while it's in the index; 0
+                      // in a chunk nobody holds
+  int32_t referenced; // CLOCK bit: looked up since the hand last passed
+  int32_t block;      // a block of a larger file: its path has a '#'
+};
+
+// Chunks of one size, carved from the pages given to the class
+struct shcache_class {
+  uint64_t chunk_size;
+  uint64_t free;  // first chunk holding no entry; each links to the next
+  uint64_t limbo; // retired chunks a lookup may still be reading
+  uint64_t head, tail; // CLOCK: the hand is at the tail
+  uint32_t pages;
+  uint32_t count; // entries
+};
+
+// One process's lookups, on a cache line of its own
+struct shcache_reader {
+  uint64_t epoch; // the global epoch when its lookup began; 0 between them
+  uint64_t hits, misses;
+  uint32_t held; // entries in its ledger
+} __attribute__((aligned(64)));
+
+// A reader's references to one entry, in its ledger: an open addressed
+// table of SHCACHE_HELD slots that only it writes, so whoever takes its
+// slot after it dies can drop what it held
+struct shcache_held {
+  uint64_t entry; // offset
+  uint64_t count; // 0 for an empty slot
+};
+
+// The start of the segment
+struct shcache_header {
+  pthread_mutex_t lock;  // process-shared and robust; for writers only
+  uint64_t epoch;        // from 1; bumped whenever a chunk is retired
+  uint64_t nbuckets;     // a power of two
+  uint64_t buckets;      // offset of the index: nbuckets entry offsets
+  uint64_t page_classes; // offset of a byte per page: the class given it
+  uint64_t ledgers;      // offset of the readers' ledgers, one after another
+  uint64_t pages;        // offset of the first page
+  uint32_t npages, next_page;
+  struct shcache_class classes[SHCACHE_CLASSES];
+
+  // Statistics, besides the readers' own
+  uint64_t count;  // entries
+  uint64_t blocks; // ...of which blocks of larger files
+  uint64_t bytes;  // content held, not counting slack in chunks
+  uint64_t evictions;
+
+  struct shcache_reader readers[SHCACHE_READERS];
+};
+
+// A cache in a shared memory segment, for prefork workers
+//
+// Made before the workers are forked, so each inherits the mapping: every
+// worker sees the same hot set, with one copy of each file.
+//
+// Lookups take no lock and write nothing shared but the entry's reference
+// count: they walk the index with atomic loads, and recency is a CLOCK bit
+// set on a hit, not a move in a list. Writers (put, delete, eviction) take
+// a robust process-shared mutex. A chunk taken out of the index isn't
+// reused until every lookup that might still be reading it has finished:
+// each process announces the epoch it started a lookup in, and a chunk
+// retired in an epoch waits in limbo until no lookup is that old. An entry
+// in use is pinned by a reference, so a worker can send from it long after
+// its lookup.
+//
+// A worker that dies with the lock held may have left a list half changed,
+// so the next taker rebuilds them all from the chunks. Each process keeps a
+// ledger of the references it holds, and the worker started in a dead one's
+// slot drops whatever that ledger lists.
+struct shcache {
+  char *map;
+  size_t size;
+  struct shcache_header *header;
+  int reader; // this process's slot in header->readers
+};
+
+extern struct shcache *shcache_create(size_t capacity);
+extern void shcache_free(struct shcache *sh);
+extern void shcache_set_reader(struct shcache *sh, int reader);
+extern struct shcache_entry *shcache_get(struct shcache *sh, char *path);
+extern struct shcache_entry *shcache_put(struct shcache *sh, char *path,
+                                         char *content_type, void *content,
+                                         uint64_t content_length);
+extern void shcache_lock(struct shcache *sh);
+extern void shcache_unlock(struct shcache *sh);
+extern void shcache_reclaim(struct shcache *sh, int c);
+extern void shcache_release(struct shcache *sh, struct shcache_entry *e);
+extern int shcache_stale(struct shcache_entry *e);
+extern char *shcache_path(struct shcache_entry *e);
+extern char *shcache_content_type(struct shcache_entry *e);
+extern void *shcache_content(struct shcache_entry *e);
+extern int shcache_delete(struct shcache *sh, char *path);
+extern int shcache_delete_blocks(struct shcache *sh, char *path);
+extern int shcache_delete_prefix(struct shcache *sh, char *prefix);
+extern void shcache_lookups(struct shcache *sh, uint64_t *hits,
+                            uint64_t *misses);
+
+#endif
@@ -0,0 +1,321 @@
+/**
+ * Cache snapshots: the cache saved to a file so a restart begins warm
+ *
+ * The file holds each entry's path, content type, validator, hit count and
+ * content, least recently used first. Loading maps it and puts the entries
+ * back in that order, so the LRU comes back as it was. An entry is only
+ * restored if its file still has the dev, inode, size and mtime it was read
+ * with; anything changed while we were down is left for the next miss.
+ */
+
+#include "snapshot.h"
+#include "cache.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#define SNAPSHOT_ALIGN(n) (((n) + 7) & ~(uint64_t)7)
+
+/**
+ * Set up snapshots to filename, saved every interval seconds if non-zero
+ *
+ * Returns NULL with errno set if the timer can't be made.
+ */
+struct snapshot *snapshot_create(char *filename, int interval) {
+  struct snapshot *snap = calloc(1, sizeof *snap);
+  if (snap == NULL)
+    return NULL;
+
+  snap->filename = strdup(filename);
+  snap->interval = interval > 0 ? interval : 0;
+  snap->fd = -1;
+
+  if (snap->interval > 0) {
+    struct itimerspec its = {{snap->interval, 0}, {snap->interval, 0}};
+
+    snap->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (snap->fd == -1 || timerfd_settime(snap->fd, 0, &its, NULL) == -1) {
+      snapshot_free(snap);
+      return NULL;
+    }
+  }
+
+  return snap;
+}
+
+void snapshot_free(struct snapshot *snap) {
+  if (snap == NULL)
+    return;
+
+  if (snap->fd != -1) {
+    int saved_errno = errno;
+
+    close(snap->fd);
+    errno = saved_errno;
+  }
+  free(snap->filename);
+  free(snap);
+}
+
+/**
+ * Does the file at path still match what a record was read from?
+ */
+int snapshot_record_current(struct snapshot_record *rec, char *path) {
+  struct stat st;
+
+  if (stat(path, &st) == -1 || !S_ISREG(st.st_mode))
+    return 0;
+
+  return st.st_dev == (dev_t)rec->dev && st.st_ino == (ino_t)rec->ino &&
+         st.st_size == rec->size && st.st_mtim.tv_sec == rec->mtime_sec &&
+         st.st_mtim.tv_nsec == rec->mtime_nsec;
+}
+
+/**
+ * Put the entries of the snapshot file back in the cache
+ *
+ * Must be called from the thread that owns the cache. Stops at the first
+ * record that runs past the end of the file, so a truncated snapshot still
+ * gives up what it has. Returns the number of entries restored, or -1 if
+ * there's no snapshot or it isn't one.
+ */
+int snapshot_load(struct snapshot *snap, struct cache *cache) {
+  struct stat st;
+
+  int fd = open(snap->filename, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return -1;
+
+  if (fstat(fd, &st) == -1 ||
+      st.st_size < (off_t)sizeof(struct snapshot_header)) {
+    close(fd);
+    return -1;
+  }
+
+  char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return -1;
+
+  struct snapshot_header *header = (struct snapshot_header *)map;
+  if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof header->magic) != 0) {
+    munmap(map, st.st_size);
+    return -1;
+  }
+
+  // Read once, front to back
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+  uint64_t size = st.st_size, offset = sizeof *header;
+  snap->restored = snap->stale = 0;
+
+  for (uint64_t i = 0; i < header->count; i++) {
+    if (size - offset < sizeof(struct snapshot_record))
+      break;
+
+    struct snapshot_record *rec = (struct snapshot_record *)(map + offset);
+    char *path = (char *)(rec + 1);
+    char *content_type = path + rec->path_length;
+    char *content = content_type + rec->type_length;
+
+    // Each length against what's left on its own, so no sum can wrap
+    uint64_t left = size - offset - sizeof *rec;
+    if (rec->path_length == 0 || rec->path_length > left)
+      break;
+    left -= rec->path_length;
+    if (rec->type_length == 0 || rec->type_length > left)
+      break;
+    left -= rec->type_length;
+    if (rec->content_length > left || path[rec->path_length - 1] != '\0' ||
+        content_type[rec->type_length - 1] != '\0')
+      break;
+
+    offset += sizeof *rec + (uint64_t)rec->path_length + rec->type_length +
+              rec->content_length;
+    offset = SNAPSHOT_ALIGN(offset) < size ? SNAPSHOT_ALIGN(offset) : size;
+
+    // Content that isn't the size its file was can't be what was read
+    if (rec->content_length != (uint64_t)rec->size ||
+        !snapshot_record_current(rec, path)) {
+      snap->stale++;
+      continue;
+    }
+
+    struct cache_entry *entry =
+        cache_put(cache, path, content_type, content, rec->content_length);
+    if (entry == NULL)
+      continue;
+
+    entry->hits = rec->hits;
+    entry->validator.dev = rec->dev;
+    entry->validator.ino = rec->ino;
+    entry->validator.size = rec->size;
+    entry->validator.mtime.tv_sec = rec->mtime_sec;
+    entry->validator.mtime.tv_nsec = rec->mtime_nsec;
+    snap->restored++;
+  }
+
+  munmap(map, st.st_size);
+  return snap->restored;
+}
+
+/**
+ * Collect what to save: every entry that knows which file it came from,
+ * least recently used first
+ *
+ * Without a validator there'd be no telling at startup whether an entry is
+ * still good; blocks of streamed files are left out too. On the thread
+ * that owns the cache, which also fills in the records, so the entries'
+ * hit counts aren't read as they change. Returns NULL if out of memory.
+ */
+struct snapshot_batch *snapshot_begin(struct cache *cache) {
+  struct snapshot_batch *batch = calloc(1, sizeof *batch);
+  int max = cache->cur_size;
+
+  if (batch == NULL)
+    return NULL;
+
+  batch->entries = calloc(max > 0 ? max : 1, sizeof *batch->entries);
+  batch->records = calloc(max > 0 ? max : 1, sizeof *batch->records);
+  if (batch->entries == NULL || batch->records == NULL) {
+    free(batch->entries);
+    free(batch->records);
+    free(batch);
+    return NULL;
+  }
+
+  for (struct cache_entry *ce = cache->tail; ce != NULL && batch->count < max;
+       ce = ce->prev) {
+    struct snapshot_record *rec = &batch->records[batch->count];
+
+    if (ce->block || ce->validator.ino == 0)
+      continue;
+
+    rec->content_length = ce->content_length;
+    rec->hits = ce->hits;
+    rec->dev = ce->validator.dev;
+    rec->ino = ce->validator.ino;
+    rec->size = ce->validator.size;
+    rec->mtime_sec = ce->validator.mtime.tv_sec;
+    rec->mtime_nsec = ce->validator.mtime.tv_nsec;
+    rec->path_length = strlen(ce->path) + 1;
+    rec->type_length = strlen(ce->content_type) + 1;
+
+    cache_entry_retain(ce);
+    batch->entries[batch->count++] = ce;
+  }
+
+  return batch;
+}
+
+/**
+ * Write one entry's record
+ */
+int snapshot_write_entry(FILE *fp, struct snapshot_record *rec,
+                         struct cache_entry *entry) {
+  char pad[8] = {0};
+  uint64_t length = sizeof *rec + (uint64_t)rec->path_length +
+                    rec->type_length + rec->content_length;
+  size_t padding = SNAPSHOT_ALIGN(length) - length;
+
+  return fwrite(rec, sizeof *rec, 1, fp) == 1 &&
+         fwrite(entry->path, rec->path_length, 1, fp) == 1 &&
+         fwrite(entry->content_type, rec->type_length, 1, fp) == 1 &&
+         (rec->content_length == 0 ||
+          fwrite(entry->content, rec->content_length, 1, fp) == 1) &&
+         (padding == 0 || fwrite(pad, padding, 1, fp) == 1);
+}
+
+/**
+ * Write a batch to the snapshot's temporary file, and sync it
+ *
+ * Touches nothing the cache's thread changes, so it can run on another.
+ * Returns 0, or -1 on failure, with the temporary file gone.
+ */
+int snapshot_write(struct snapshot *snap, struct snapshot_batch *batch) {
+  char tmppath[4096];
+  struct snapshot_header header;
+
+  snprintf(tmppath, sizeof tmppath, "%s.tmp", snap->filename);
+  FILE *fp = fopen(tmppath, "w");
+  if (fp == NULL) {
+    perror(tmppath);
+    return -1;
+  }
+
+  memset(&header, 0, sizeof header);
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof header.magic);
+  header.count = batch->count;
+  int ok = fwrite(&header, sizeof header, 1, fp) == 1;
+
+  for (int i = 0; ok && i < batch->count; i++)
+    ok = snapshot_write_entry(fp, &batch->records[i], batch->entries[i]);
+
+  // On disk before it takes the old one's name, or a crash could leave
+  // an empty snapshot there
+  ok = ok && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+
+  if (fclose(fp) != 0 || !ok) {
+    perror(tmppath);
+    unlink(tmppath);
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Put a written batch in place of the snapshot file, if written is 0, and
+ * let its entries go
+ *
+ * On the thread that owns the cache. Returns the number of entries saved,
+ * or -1 if the batch wasn't written or can't be put in place, leaving any
+ * earlier snapshot there.
+ */
+int snapshot_finish(struct snapshot *snap, struct snapshot_batch *batch,
+                    int written) {
+  int saved = -1;
+
+  if (written == 0) {
+    char tmppath[4096];
+
+    snprintf(tmppath, sizeof tmppath, "%s.tmp", snap->filename);
+    if (rename(tmppath, snap->filename) == -1) {
+      perror(snap->filename);
+      unlink(tmppath);
+    } else {
+      saved = snap->saved = batch->count;
+    }
+  }
+
+  for (int i = 0; i < batch->count; i++)
+    cache_entry_release(batch->entries[i]);
+  free(batch->entries);
+  free(batch->records);
+  free(batch);
+
+  return saved;
+}
+
+/**
+ * Write the cache out, replacing the snapshot file whole
+ *
+ * All on this thread, which must own the cache. Returns the number of
+ * entries saved, or -1 on failure, leaving any earlier snapshot in place.
+ */
+int snapshot_save(struct snapshot *snap, struct cache *cache) {
+  struct snapshot_batch *batch = snapshot_begin(cache);
+
+  if (batch == NULL) {
+    perror(snap->filename);
+    return -1;
+  }
+
+  return snapshot_finish(snap, batch, snapshot_write(snap, batch));
+}
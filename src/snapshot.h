@@ -0,0 +1,61 @@
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include <stdint.h>
+
+struct cache;
+struct cache_entry;
+struct iopool;
+
+#define SNAPSHOT_MAGIC "WSSNAP01"
+
+// Start of a snapshot file
+struct snapshot_header {
+  char magic[8];
+  uint64_t count; // records that follow
+};
+
+// One cached entry, followed by its path and content type (each with its
+// NUL) and its content, padded to 8 bytes
+struct snapshot_record {
+  uint64_t content_length;
+  uint64_t hits;
+  uint64_t dev, ino; // validator of the file the content was read from
+  int64_t size;
+  int64_t mtime_sec, mtime_nsec;
+  uint32_t path_length, type_length;
+};
+
+// Where the cache is saved between runs
+//
+// Written on shutdown and, with an interval, periodically; read back at
+// startup, keeping only entries whose file hasn't changed since.
+struct snapshot {
+  char *filename;
+  int fd; // timerfd, readable every interval, or -1 if there's none
+  int interval; // seconds between saves, 0 for only on shutdown
+  struct iopool *pool; // periodic saves are written out here, if set
+  int saving;          // ...and one is now
+
+  // Statistics
+  int restored, stale; // entries loaded at startup, and those dropped
+  int saved;           // entries written by the last save
+};
+
+// Entries being saved, each retained so it outlives eviction meanwhile
+struct snapshot_batch {
+  struct cache_entry **entries; // least recently used first
+  struct snapshot_record *records; // theirs, filled in when collected
+  int count;
+};
+
+extern struct snapshot *snapshot_create(char *filename, int interval);
+extern void snapshot_free(struct snapshot *snap);
+extern int snapshot_load(struct snapshot *snap, struct cache *cache);
+extern struct snapshot_batch *snapshot_begin(struct cache *cache);
+extern int snapshot_write(struct snapshot *snap, struct snapshot_batch *batch);
+extern int snapshot_finish(struct snapshot *snap, struct snapshot_batch *batch,
+                           int written);
+extern int snapshot_save(struct snapshot *snap, struct cache *cache);
+
+#endif
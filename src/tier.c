@@ -0,0 +1,341 @@
+/**
+ * Warm cache tier: a slab-structured cache file on local disk, mmap'd
+ *
+ * Entries the RAM cache evicts are copied here rather than dropped, so a
+ * working set bigger than RAM is still served without going back to the
+ * source tree. The kernel pages the file in and out; we only decide which
+ * chunk each entry goes in.
+ */
+
+#include "tier.h"
+#include "hashtable.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/**
+ * Create (or truncate) the cache file and map it
+ *
+ * capacity is rounded down to a whole number of pages, at least one.
+ * Returns NULL with errno set on failure.
+ */
+struct tier *tier_open(char *filename, off_t capacity) {
+  struct tier *tier = calloc(1, sizeof *tier);
+  if (tier == NULL)
+    return NULL;
+
+  capacity -= capacity % TIER_PAGE_SIZE;
+  tier->capacity = capacity > 0 ? capacity : TIER_PAGE_SIZE;
+
+  for (int c = 0; c < TIER_CLASSES; c++)
+    tier->classes[c].chunk_size = (off_t)TIER_MIN_CHUNK << c;
+
+  tier->fd = open(filename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (tier->fd == -1) {
+    free(tier);
+    return NULL;
+  }
+
+  tier->map = MAP_FAILED;
+  if (ftruncate(tier->fd, tier->capacity) == 0)
+    tier->map = mmap(NULL, tier->capacity, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     tier->fd, 0);
+
+  if (tier->map == MAP_FAILED) {
+    int saved_errno = errno;
+
+    close(tier->fd);
+    free(tier);
+    errno = saved_errno;
+    return NULL;
+  }
+
+  // Items are scattered over the file; don't read around them
+  madvise(tier->map, tier->capacity, MADV_RANDOM);
+
+  tier->index = hashtable_create(0, NULL);
+  return tier;
+}
+
+void tier_item_free(struct tier_item *item) {
+  free(item->path);
+  free(item->content_type);
+  free(item);
+}
+
+/**
+ * Unmap and close the cache file, forgetting everything in it
+ */
+void tier_close(struct tier *tier) {
+  if (tier == NULL)
+    return;
+
+  for (int c = 0; c < TIER_CLASSES; c++) {
+    struct tier_class *class = &tier->classes[c];
+
+    for (struct tier_item *item = class->head; item != NULL;) {
+      struct tier_item *next = item->next;
+
+      tier_item_free(item);
+      item = next;
+    }
+    free(class->free);
+  }
+
+  hashtable_destroy(tier->index);
+  munmap(tier->map, tier->capacity);
+  close(tier->fd);
+  free(tier);
+}
+
+/**
+ * The smallest class whose chunks hold length bytes, or -1 if none do
+ */
+int tier_class_for(off_t length) {
+  for (int c = 0; c < TIER_CLASSES; c++)
+    if (length <= (off_t)TIER_MIN_CHUNK << c)
+      return c;
+
+  return -1;
+}
+
+/**
+ * Give a chunk back to its class
+ */
+int tier_free_chunk(struct tier_class *class, off_t offset) {
+  if (class->nfree == class->free_cap) {
+    int cap = class->free_cap > 0 ? class->free_cap * 2 : 64;
+    off_t *free_chunks = realloc(class->free, cap * sizeof *free_chunks);
+
+    if (free_chunks == NULL)
+      return -1;
+    class->free = free_chunks;
+    class->free_cap = cap;
+  }
+
+  class->free[class->nfree++] = offset;
+  return 0;
+}
+
+/**
+ * Find a chunk in class c: a free one, one from a new page, or the one
+ * held by the class's least recently demoted item
+ *
+ * Returns its offset, or -1 if the class has none and can't get any.
+ */
+off_t tier_chunk(struct tier *tier, int c) {
+  struct tier_class *class = &tier->classes[c];
+
+  if (class->nfree == 0 && tier->next_page < tier->capacity) {
+    off_t page = tier->next_page;
+
+    for (off_t off = page + TIER_PAGE_SIZE - class->chunk_size; off >= page;
+         off -= class->chunk_size)
+      if (tier_free_chunk(class, off) == -1)
+        return -1;
+
+    tier->next_page += TIER_PAGE_SIZE;
+    class->pages++;
+  }
+
+  // An item being copied can't give up its chunk yet
+  struct tier_item *victim = class->tail;
+  while (victim != NULL && victim->busy)
+    victim = victim->prev;
+
+  if (class->nfree == 0 && victim != NULL) {
+    tier_remove(tier, victim);
+    tier->evictions++;
+  }
+
+  if (class->nfree == 0)
+    return -1;
+
+  return class->free[--class->nfree];
+}
+
+/**
+ * Demote an entry: copy it into the file, replacing any item for its path
+ *
+ * With tier->copy_in, the copy is only started: the item is busy, holding
+ * a reference to the entry, until it's done. Returns 0, or -1 if it's too
+ * big for any class or there's no room.
+ */
+int tier_put(struct tier *tier, struct cache_entry *entry) {
+  int c = tier_class_for(entry->content_length);
+  if (c == -1)
+    return -1;
+
+  tier_delete(tier, entry->path);
+
+  struct tier_item *item = calloc(1, sizeof *item);
+  if (item == NULL)
+    return -1;
+
+  item->path = strdup(entry->path);
+  item->content_type = strdup(entry->content_type);
+  if (item->path == NULL || item->content_type == NULL) {
+    tier_item_free(item);
+    return -1;
+  }
+
+  item->offset = tier_chunk(tier, c);
+  if (item->offset == -1) {
+    tier_item_free(item);
+    return -1;
+  }
+
+  item->content_length = entry->content_length;
+  item->cls = c;
+  item->version = entry->version;
+  item->validator = entry->validator;
+  item->hits = entry->hits;
+  item->block = entry->block;
+
+  struct tier_class *class = &tier->classes[c];
+  item->next = class->head;
+  if (class->head != NULL)
+    class->head->prev = item;
+  class->head = item;
+  if (class->tail == NULL)
+    class->tail = item;
+
+  hashtable_put(tier->index, item->path, item);
+  tier->count++;
+  tier->blocks += item->block;
+  tier->bytes += item->content_length;
+
+  if (tier->copy_in != NULL) {
+    item->busy = 1;
+    item->source = entry;
+    cache_entry_retain(entry);
+    tier->copy_in(tier, item);
+  } else {
+    memcpy(tier->map + item->offset, entry->content, entry->content_length);
+  }
+
+  return 0;
+}
+
+/**
+ * The item for path, or NULL
+ */
+struct tier_item *tier_get(struct tier *tier, char *path) {
+  if (tier == NULL || tier->count == 0)
+    return NULL;
+
+  return hashtable_get(tier->index, path);
+}
+
+/**
+ * Where an item's content is mapped; good until the item is removed
+ */
+void *tier_content(struct tier *tier, struct tier_item *item) {
+  return tier->map + item->offset;
+}
+
+/**
+ * A busy item's copy, in or out, is done: let it go if it was dropped
+ */
+void tier_copied(struct tier *tier, struct tier_item *item) {
+  cache_entry_release(item->source);
+  item->source = NULL;
+  item->busy = 0;
+
+  if (item->dropped) {
+    tier_free_chunk(&tier->classes[item->cls], item->offset);
+    tier_item_free(item);
+  }
+}
+
+/**
+ * Drop an item, freeing its chunk, or once it's copied if it's busy
+ */
+void tier_remove(struct tier *tier, struct tier_item *item) {
+  struct tier_class *class = &tier->classes[item->cls];
+
+  if (item->prev != NULL)
+    item->prev->next = item->next;
+  else
+    class->head = item->next;
+  if (item->next != NULL)
+    item->next->prev = item->prev;
+  else
+    class->tail = item->prev;
+
+  hashtable_delete(tier->index, item->path);
+
+  tier->count--;
+  tier->blocks -= item->block;
+  tier->bytes -= item->content_length;
+
+  if (item->busy) {
+    item->dropped = 1;
+    return;
+  }
+
+  // There's room on the free list: the chunk came off it
+  tier_free_chunk(class, item->offset);
+  tier_item_free(item);
+}
+
+/**
+ * Drop the item for path; returns 1 if there was one
+ */
+int tier_delete(struct tier *tier, char *path) {
+  struct tier_item *item = tier_get(tier, path);
+
+  if (item == NULL)
+    return 0;
+
+  tier_remove(tier, item);
+  return 1;
+}
+
+/**
+ * Drop every item matching: a block of path, or, with blocks 0, any path
+ * under prefix
+ */
+int tier_delete_matching(struct tier *tier, char *prefix, int blocks) {
+  size_t prefix_len = strlen(prefix);
+  int removed = 0;
+
+  for (int c = 0; c < TIER_CLASSES; c++) {
+    for (struct tier_item *item = tier->classes[c].head; item != NULL;) {
+      struct tier_item *next = item->next;
+
+      if (strncmp(item->path, prefix, prefix_len) == 0 &&
+          (!blocks || (item->block && item->path[prefix_len] == '#'))) {
+        tier_remove(tier, item);
+        removed++;
+      }
+
+      item = next;
+    }
+  }
+
+  return removed;
+}
+
+/**
+ * Drop the blocks demoted for path
+ */
+int tier_delete_blocks(struct tier *tier, char *path) {
+  if (tier == NULL || tier->blocks == 0)
+    return 0;
+
+  return tier_delete_matching(tier, path, 1);
+}
+
+/**
+ * Drop every item whose path begins with prefix
+ */
+int tier_delete_prefix(struct tier *tier, char *prefix) {
+  if (tier == NULL || tier->count == 0)
+    return 0;
+
+  return tier_delete_matching(tier, prefix, 0);
+}
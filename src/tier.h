@@ -0,0 +1,78 @@
+#ifndef _TIER_H_
+#define _TIER_H_
+
+#include "cache.h"
+#include <sys/types.h>
+
+#define TIER_PAGE_SIZE (4 * 1024 * 1024) // slab: what a size class grows by
+#define TIER_MIN_CHUNK 256
+#define TIER_CLASSES 15 // chunks of TIER_MIN_CHUNK doubling to TIER_PAGE_SIZE
+
+// An entry demoted from RAM, in a chunk of the tier file
+struct tier_item {
+  char *path;
+  char *content_type;
+  off_t content_length;
+  off_t offset; // of its chunk in the file
+  int cls;
+  unsigned long version;
+  struct cache_validator validator;
+  unsigned long hits;
+  int block;
+
+  // Being copied on the disk pool, in from source or out to RAM; its chunk
+  // is kept until tier_copied(), even if it's dropped meanwhile
+  int busy;
+  int dropped;                // removed while busy, so freed once it's done
+  struct cache_entry *source; // retained while it's copied in
+
+  struct tier_item *prev, *next; // LRU within its class
+};
+
+// Chunks of one size, carved from the pages given to the class
+struct tier_class {
+  off_t chunk_size;
+  off_t *free; // offsets of chunks holding no item
+  int nfree, free_cap;
+  int pages;
+  struct tier_item *head, *tail; // LRU
+};
+
+// The warm tier: a cache file on local disk, mapped in
+//
+// RAM evictions are demoted here and promoted back on a hit, so an entry is
+// in one tier at a time. The file is split into pages handed out to size
+// classes as they need them; once it's all handed out, a full class makes
+// room by evicting its own least recently demoted item. The index stays in
+// RAM.
+struct tier {
+  int fd;
+  char *map;
+  off_t capacity;  // bytes, a whole number of pages
+  off_t next_page; // first page not yet given to a class
+  struct hashtable *index;
+  struct tier_class classes[TIER_CLASSES];
+
+  int count;  // items
+  int blocks; // ...of which blocks of larger files
+  off_t bytes; // content held, not counting slack in chunks
+  unsigned long evictions; // items pushed out to make room
+
+  // Copies a demoted entry in elsewhere, if set, ending with tier_copied();
+  // otherwise tier_put() copies it there and then
+  void (*copy_in)(struct tier *tier, struct tier_item *item);
+  void *copy_arg; // for copy_in
+};
+
+extern struct tier *tier_open(char *filename, off_t capacity);
+extern void tier_close(struct tier *tier);
+extern int tier_put(struct tier *tier, struct cache_entry *entry);
+extern struct tier_item *tier_get(struct tier *tier, char *path);
+extern void *tier_content(struct tier *tier, struct tier_item *item);
+extern void tier_copied(struct tier *tier, struct tier_item *item);
+extern void tier_remove(struct tier *tier, struct tier_item *item);
+extern int tier_delete(struct tier *tier, char *path);
+extern int tier_delete_blocks(struct tier *tier, char *path);
+extern int tier_delete_prefix(struct tier *tier, char *prefix);
+
+#endif
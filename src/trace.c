@@ -0,0 +1,182 @@
+/**
+ * Request lifecycle tracing into per-thread rings
+ *
+ * Events are Chrome trace async events keyed by connection, so each
+ * connection becomes its own track in chrome://tracing or Perfetto, even
+ * when its work moves between the loop and the disk threads.
+ */
+
+#define _GNU_SOURCE // gettid()
+
+#include "trace.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+int trace_enabled = 0;
+
+__thread struct trace_ring *trace_local = NULL;
+
+struct trace_ring *trace_rings = NULL;
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * This thread's ring, allocated on its first event
+ */
+struct trace_ring *trace_ring(void) {
+  if (trace_local != NULL)
+    return trace_local;
+
+  struct trace_ring *ring = calloc(1, sizeof *ring);
+  if (ring == NULL)
+    return NULL;
+
+  ring->tid = gettid();
+
+  pthread_mutex_lock(&trace_lock);
+  ring->next = trace_rings;
+  trace_rings = ring;
+  pthread_mutex_unlock(&trace_lock);
+
+  return trace_local = ring;
+}
+
+/**
+ * Record an event; use the TRACE_*() macros rather than calling this
+ *
+ * ns: when it happened on the CLOCK_MONOTONIC clock, or 0 for now.
+ */
+void trace_record(char phase, const char *name, uint64_t id, uint64_t ns) {
+  struct trace_ring *ring = trace_ring();
+  if (ring == NULL)
+    return;
+
+  if (ns == 0) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  }
+
+  struct trace_event *ev = &ring->events[ring->head % TRACE_RING_EVENTS];
+  ev->ns = ns;
+  ev->name = name;
+  ev->id = id;
+  ev->phase = phase;
+
+  // Publish the event before the dumper can see the new head
+  __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Switch tracing on or off
+ */
+void trace_set_enabled(int on) {
+  __atomic_store_n(&trace_enabled, on, __ATOMIC_RELAXED);
+}
+
+/**
+ * Copy out a ring's newest events that weren't overwritten meanwhile
+ *
+ * Returns how many were copied into out.
+ */
+long trace_snapshot(struct trace_ring *ring, struct trace_event *out) {
+  uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  uint64_t first = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+
+  for (uint64_t i = first; i < head; i++)
+    out[i - first] = ring->events[i % TRACE_RING_EVENTS];
+
+  // Anything the writer lapped while we copied may be torn, as may the
+  // slot it's filling now: event now, in the slot of now - RING_EVENTS. The
+  // fence keeps the copies from being read after head.
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  uint64_t now = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+  uint64_t valid =
+      now + 1 > TRACE_RING_EVENTS ? now + 1 - TRACE_RING_EVENTS : 0;
+
+  if (valid <= first)
+    return head - first;
+  if (valid >= head)
+    return 0;
+
+  memmove(out, out + (valid - first), (head - valid) * sizeof *out);
+  return head - valid;
+}
+
+/**
+ * Write every thread's events to path as Chrome trace JSON
+ *
+ * Safe while other threads keep recording. Returns the number of events
+ * written, or -1 on error.
+ */
+long trace_dump(const char *path) {
+  struct trace_event *events = malloc(sizeof(struct trace_event) *
+                                      TRACE_RING_EVENTS);
+  if (events == NULL)
+    return -1;
+
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    perror(path);
+    free(events);
+    return -1;
+  }
+
+  long total = 0;
+  int pid = getpid();
+
+  fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+
+  pthread_mutex_lock(&trace_lock);
+
+  for (struct trace_ring *ring = trace_rings; ring != NULL; ring = ring->next) {
+    long n = trace_snapshot(ring, events);
+
+    for (long i = 0; i < n; i++, total++) {
+      struct trace_event *ev = &events[i];
+
+      fprintf(f,
+              "%s\n{\"name\":\"%s\",\"cat\":\"conn\",\"ph\":\"%c\","
+              "\"id\":\"0x%llx\",\"pid\":%d,\"tid\":%d,\"ts\":%llu.%03llu%s}",
+              total > 0 ? "," : "", ev->name, ev->phase,
+              (unsigned long long)ev->id, pid, ring->tid,
+              (unsigned long long)(ev->ns / 1000),
+              (unsigned long long)(ev->ns % 1000),
+              ev->phase == 'n' ? ",\"s\":\"t\"" : "");
+    }
+  }
+
+  pthread_mutex_unlock(&trace_lock);
+
+  fprintf(f, "\n]}\n");
+  free(events);
+
+  if (fclose(f) != 0) {
+    perror(path);
+    return -1;
+  }
+
+  return total;
+}
+
+/**
+ * Free every ring; only once no thread records anything any more
+ */
+void trace_free(void) {
+  pthread_mutex_lock(&trace_lock);
+
+  while (trace_rings != NULL) {
+    struct trace_ring *next = trace_rings->next;
+
+    free(trace_rings);
+    trace_rings = next;
+  }
+
+  pthread_mutex_unlock(&trace_lock);
+
+  trace_local = NULL;
+}
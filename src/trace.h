@@ -0,0 +1,50 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+// Events each thread keeps; older ones are overwritten
+#define TRACE_RING_EVENTS (1 << 16)
+
+// One timestamped event
+struct trace_event {
+  uint64_t ns; // CLOCK_MONOTONIC
+  const char *name;
+  uint64_t id; // which connection
+  char phase;  // Chrome trace phase: 'b' begin, 'e' end, 'n' instant
+};
+
+// A thread's events
+//
+// Only the owning thread writes, so recording is a store and an increment;
+// a dump copies the newest events and throws away any that were overwritten
+// while it copied.
+struct trace_ring {
+  struct trace_event events[TRACE_RING_EVENTS];
+  uint64_t head; // events ever recorded
+  int tid;
+
+  struct trace_ring *next;
+};
+
+extern int trace_enabled;
+
+// Record an event if tracing is on. Costs one branch if it's off.
+#define TRACE_AT(phase, name, id, ns)                                          \
+  do {                                                                         \
+    if (__builtin_expect(__atomic_load_n(&trace_enabled, __ATOMIC_RELAXED),   \
+                         0))                                                   \
+      trace_record((phase), (name), (uintptr_t)(id), (ns));                    \
+  } while (0)
+
+#define TRACE_BEGIN(name, id) TRACE_AT('b', name, id, 0)
+#define TRACE_END(name, id) TRACE_AT('e', name, id, 0)
+#define TRACE_INSTANT(name, id) TRACE_AT('n', name, id, 0)
+
+extern void trace_record(char phase, const char *name, uint64_t id,
+                         uint64_t ns);
+extern void trace_set_enabled(int on);
+extern long trace_dump(const char *path);
+extern void trace_free(void);
+
+#endif
@@ -0,0 +1,915 @@
+/**
+ * uring.c -- io_uring serving loop
+ *
+ * Accepts with a multishot accept, receives and sends through the ring, and
+ * streams file bodies as linked read->send pairs out of registered buffers,
+ * so a busy server makes one io_uring_enter() per batch of completions
+ * rather than several syscalls per request. Cache misses, POST saves and
+ * appends park their connections on the disk pool or the append log, as
+ * under epoll. Talks to the kernel directly; no liburing needed.
+ * Connection deadlines live on a timing wheel, driven by a single timeout
+ * in the ring.
+ */
+
+#include "accesslog.h"
+#include "conn.h"
+#include "iopool.h"
+#include "loop.h"
+#include "metrics.h"
+#include "wheel.h"
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define URING_ENTRIES 256
+#define URING_BUF_COUNT 16
+#define URING_BUF_SIZE (256 * 1024) // file chunk; smaller files go in one read
+#define URING_PAUSED_POLL_MS 100 // recheck limits this often while paused
+
+// What a completion is for, kept in the low bits of user_data. Loop sources
+// are only 8-byte aligned, so there's room for three bits.
+enum uring_op {
+  OP_TICK,   // the wheel's timeout; no pointer, so user_data is 0
+  OP_ACCEPT, // no pointer, or the ring's own for the accept's cancel
+  OP_SOURCE,
+  OP_RECV,
+  OP_SENDMSG, // head, plus whatever body is in memory
+  OP_SEND,    // file chunk, linked behind its read
+  OP_READ,
+  OP_CLOSE,
+};
+
+#define OP_MASK 0x7ULL
+
+struct uring;
+
+// A connection as the ring sees it
+struct uring_conn {
+  struct conn conn; // must be first: conn_resume() hands us a struct conn
+  struct uring *ring;
+  struct uring_conn *prev, *next; // live connections, freed at shutdown
+
+  int inflight; // submitted operations not yet completed
+  int closing;
+  int failed;
+
+  off_t head_sent;
+  off_t body_sent; // memory bodies
+
+  // File bodies go through one buffer, a chunk at a time
+  char *chunk;
+  int buf_index; // registered buffer, or -1 for a heap buffer
+  size_t chunk_length, chunk_sent;
+  off_t file_offset;
+
+  struct iovec iov[2]; // must stay put until the sendmsg completes
+  struct msghdr msg;
+
+  struct wheel_timer timer; // while waiting on the client
+  int stage;                // enum metrics_timeout the timer is armed for
+};
+
+// The ring and its mappings
+struct uring {
+  int fd;
+  struct loop_config *cfg;
+
+  unsigned *sq_khead, *sq_ktail, *sq_mask, *sq_array;
+  unsigned sq_entries, sq_tail;
+  struct io_uring_sqe *sqes;
+
+  unsigned *cq_khead, *cq_ktail, *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  void *sq_map, *cq_map;
+  size_t sq_map_size, cq_map_size, sqes_size;
+
+  int multishot_accept;
+  int accepting;     // an accept is in the ring
+  int accept_paused; // at a limit or out of descriptors: don't re-arm
+  struct wheel_timer paused; // ...and recheck on this while so
+
+  char *bufs; // URING_BUF_COUNT registered buffers, if registration worked
+  int free_bufs[URING_BUF_COUNT];
+  int nfree_bufs;
+
+  struct uring_conn *conns;
+  int nconns;
+  int parked; // waiting on the disk pool or the append log
+  struct loop_source pool_source; // the disk pool's finished jobs
+
+  struct wheel wheel;
+  int ticking;                  // a timeout for the next tick is in the ring
+  struct __kernel_timespec tick; // ...for this long; must stay put
+};
+
+int uring_setup(unsigned entries, struct io_uring_params *p) {
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+int uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                unsigned flags) {
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL,
+                 0);
+}
+
+int uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/**
+ * Does the kernel know every opcode we use?
+ */
+int uring_probe_ok(struct uring *r) {
+  static const int needed[] = {IORING_OP_ACCEPT,  IORING_OP_RECV,
+                               IORING_OP_SEND,    IORING_OP_SENDMSG,
+                               IORING_OP_READ,    IORING_OP_READ_FIXED,
+                               IORING_OP_CLOSE,   IORING_OP_POLL_ADD,
+                               IORING_OP_TIMEOUT, IORING_OP_ASYNC_CANCEL};
+  size_t size = sizeof(struct io_uring_probe) +
+                256 * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe = calloc(1, size);
+  int ok = 1;
+
+  if (probe == NULL || uring_register(r->fd, IORING_REGISTER_PROBE, probe,
+                                      256) == -1) {
+    free(probe);
+    return 0;
+  }
+
+  for (size_t i = 0; i < sizeof needed / sizeof needed[0]; i++) {
+    if (needed[i] > probe->last_op ||
+        !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED))
+      ok = 0;
+  }
+
+  free(probe);
+  return ok;
+}
+
+/**
+ * Tear down the ring
+ *
+ * The ring goes first, so nothing it still has in flight (if draining
+ * failed) completes into the connections and buffers freed after it.
+ */
+void uring_destroy(struct uring *r) {
+  if (r->sqes != NULL && r->sqes != MAP_FAILED)
+    munmap(r->sqes, r->sqes_size);
+  if (r->cq_map != NULL && r->cq_map != MAP_FAILED && r->cq_map != r->sq_map)
+    munmap(r->cq_map, r->cq_map_size);
+  if (r->sq_map != NULL && r->sq_map != MAP_FAILED)
+    munmap(r->sq_map, r->sq_map_size);
+  if (r->fd != -1)
+    close(r->fd);
+
+  while (r->conns != NULL) {
+    struct uring_conn *c = r->conns;
+
+    r->conns = c->next;
+    conn_release(&c->conn);
+    if (c->conn.fd != -1)
+      close(c->conn.fd);
+    if (c->buf_index == -1)
+      free(c->chunk);
+    free(c);
+  }
+
+  free(r->bufs);
+  free(r);
+}
+
+/**
+ * Create the ring, or return NULL if this kernel can't do what we need
+ */
+struct uring *uring_create(struct loop_config *cfg) {
+  struct io_uring_params p;
+  struct uring *r = calloc(1, sizeof *r);
+
+  if (r == NULL)
+    return NULL;
+
+  r->cfg = cfg;
+  memset(&p, 0, sizeof p);
+  r->fd = uring_setup(URING_ENTRIES, &p);
+  if (r->fd == -1) {
+    perror("io_uring_setup");
+    free(r);
+    return NULL;
+  }
+
+  // Map the submission and completion rings, and the SQE array
+  r->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (r->cq_map_size > r->sq_map_size)
+      r->sq_map_size = r->cq_map_size;
+    r->cq_map_size = r->sq_map_size;
+  }
+
+  r->sq_map = mmap(NULL, r->sq_map_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if (r->sq_map == MAP_FAILED) {
+    uring_destroy(r);
+    return NULL;
+  }
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    r->cq_map = r->sq_map;
+  else
+    r->cq_map = mmap(NULL, r->cq_map_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+
+  r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+
+  if (r->cq_map == MAP_FAILED || r->sqes == MAP_FAILED) {
+    uring_destroy(r);
+    return NULL;
+  }
+
+  char *sq = r->sq_map, *cq = r->cq_map;
+  r->sq_khead = (unsigned *)(sq + p.sq_off.head);
+  r->sq_ktail = (unsigned *)(sq + p.sq_off.tail);
+  r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *)(sq + p.sq_off.array);
+  r->sq_entries = p.sq_entries;
+  r->sq_tail = *r->sq_ktail;
+  r->cq_khead = (unsigned *)(cq + p.cq_off.head);
+  r->cq_ktail = (unsigned *)(cq + p.cq_off.tail);
+  r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+  if (!uring_probe_ok(r)) {
+    fprintf(stderr, "io_uring: kernel lacks required operations\n");
+    uring_destroy(r);
+    return NULL;
+  }
+
+  // Register the file chunk buffers so reads skip the page pinning; without
+  // them we fall back to plain reads into heap buffers
+  struct iovec iov[URING_BUF_COUNT];
+  r->bufs = aligned_alloc(4096, (size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+  for (int i = 0; r->bufs != NULL && i < URING_BUF_COUNT; i++) {
+    iov[i].iov_base = r->bufs + (size_t)i * URING_BUF_SIZE;
+    iov[i].iov_len = URING_BUF_SIZE;
+  }
+
+  if (r->bufs != NULL &&
+      uring_register(r->fd, IORING_REGISTER_BUFFERS, iov, URING_BUF_COUNT) ==
+          0) {
+    for (int i = 0; i < URING_BUF_COUNT; i++)
+      r->free_bufs[r->nfree_bufs++] = i;
+  } else {
+    free(r->bufs);
+    r->bufs = NULL;
+  }
+
+  r->multishot_accept = 1;
+  wheel_init(&r->wheel, LOOP_TICK_MS, wheel_now_ms());
+
+  return r;
+}
+
+/**
+ * Hand queued SQEs to the kernel, optionally waiting for completions
+ */
+int uring_submit(struct uring *r, unsigned wait) {
+  unsigned pending =
+      r->sq_tail - __atomic_load_n(r->sq_khead, __ATOMIC_ACQUIRE);
+
+  if (pending == 0 && wait == 0)
+    return 0;
+
+  return uring_enter(r->fd, pending, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+}
+
+/**
+ * Make sure n SQEs can be queued back to back
+ *
+ * Linked chains must not be split across submissions.
+ */
+void uring_reserve(struct uring *r, unsigned n) {
+  unsigned head = __atomic_load_n(r->sq_khead, __ATOMIC_ACQUIRE);
+
+  if (r->sq_entries - (r->sq_tail - head) < n)
+    uring_submit(r, 0);
+}
+
+/**
+ * Queue an SQE for an operation and return it for filling in
+ */
+struct io_uring_sqe *uring_sqe(struct uring *r, int op, void *data) {
+  uring_reserve(r, 1);
+
+  unsigned index = r->sq_tail & *r->sq_mask;
+  struct io_uring_sqe *sqe = &r->sqes[index];
+
+  memset(sqe, 0, sizeof *sqe);
+  sqe->user_data = (uint64_t)(uintptr_t)data | op;
+  r->sq_array[index] = index;
+  r->sq_tail++;
+
+  // The kernel only looks at the ring inside io_uring_enter(), which is
+  // called from this thread, so the tail can be published before the SQE
+  // is filled in
+  __atomic_store_n(r->sq_ktail, r->sq_tail, __ATOMIC_RELEASE);
+
+  return sqe;
+}
+
+void uring_queue_accept(struct uring *r) {
+  struct io_uring_sqe *sqe = uring_sqe(r, OP_ACCEPT, NULL);
+
+  r->accepting = 1;
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = r->cfg->listenfd;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  if (r->multishot_accept)
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+/**
+ * Stop accepting, leaving new connections in the listen queue
+ *
+ * A multishot accept is cancelled; connections it takes before the cancel
+ * lands are still served. Nothing may close here to lift a limit shared
+ * with other loops, or to free a descriptor, so recheck on a timer.
+ */
+void uring_pause_accept(struct uring *r) {
+  if (!r->accept_paused && r->accepting && r->multishot_accept) {
+    struct io_uring_sqe *sqe = uring_sqe(r, OP_ACCEPT, r);
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = OP_ACCEPT; // the accept's user_data
+  }
+
+  r->accept_paused = 1;
+  wheel_add(&r->wheel, &r->paused, wheel_now_ms() + URING_PAUSED_POLL_MS);
+}
+
+/**
+ * Start accepting again if we're back under the limits
+ */
+void uring_maybe_resume(struct uring *r) {
+  if (!r->accept_paused || *r->cfg->stop ||
+      loop_at_limit(r->cfg, r->nconns, 1))
+    return;
+
+  r->accept_paused = 0;
+  wheel_del(&r->wheel, &r->paused);
+
+  // A cancelled multishot accept is re-armed once its last completion is in
+  if (!r->accepting)
+    uring_queue_accept(r);
+}
+
+/**
+ * Wheel callback: time to recheck a paused accept
+ */
+void uring_paused_expired(struct wheel_timer *timer) {
+  struct uring *r = WHEEL_ENTRY(timer, struct uring, paused);
+
+  uring_maybe_resume(r);
+  if (r->accept_paused)
+    wheel_add(&r->wheel, &r->paused, wheel_now_ms() + URING_PAUSED_POLL_MS);
+}
+
+void uring_queue_source(struct uring *r, struct loop_source *src) {
+  struct io_uring_sqe *sqe = uring_sqe(r, OP_SOURCE, src);
+
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = src->fd;
+  sqe->poll32_events = POLLIN;
+  sqe->len = IORING_POLL_ADD_MULTI;
+}
+
+void uring_queue_recv(struct uring *r, struct uring_conn *c) {
+  struct io_uring_sqe *sqe = uring_sqe(r, OP_RECV, c);
+
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = c->conn.fd;
+  sqe->addr = (uintptr_t)(c->conn.request + c->conn.request_length);
+  sqe->len = c->conn.request_size - 1 - c->conn.request_length;
+  c->inflight++;
+}
+
+/**
+ * Wake up for the wheel's next tick, if anything is pending on it
+ */
+void uring_queue_tick(struct uring *r) {
+  int ms = wheel_timeout(&r->wheel, wheel_now_ms());
+
+  if (r->ticking || ms == -1)
+    return;
+
+  r->tick.tv_sec = ms / 1000;
+  r->tick.tv_nsec = (long long)(ms % 1000) * 1000000;
+
+  struct io_uring_sqe *sqe = uring_sqe(r, OP_TICK, NULL);
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->addr = (uintptr_t)&r->tick;
+  sqe->len = 1;
+  r->ticking = 1;
+}
+
+void uring_queue_close(struct uring *r, struct uring_conn *c, int fd) {
+  struct io_uring_sqe *sqe = uring_sqe(r, OP_CLOSE, c);
+
+  sqe->opcode = IORING_OP_CLOSE;
+  sqe->fd = fd;
+  c->inflight++;
+}
+
+/**
+ * Give back a connection's chunk buffer
+ */
+void uring_put_buffer(struct uring *r, struct uring_conn *c) {
+  if (c->chunk == NULL)
+    return;
+
+  if (c->buf_index >= 0)
+    r->free_bufs[r->nfree_bufs++] = c->buf_index;
+  else
+    free(c->chunk);
+
+  c->chunk = NULL;
+}
+
+/**
+ * Free a connection once nothing is in flight for it
+ */
+void uring_conn_free(struct uring *r, struct uring_conn *c) {
+  uring_put_buffer(r, c);
+  conn_release(&c->conn);
+
+  if (c->prev != NULL)
+    c->prev->next = c->next;
+  else
+    r->conns = c->next;
+  if (c->next != NULL)
+    c->next->prev = c->prev;
+
+  free(c);
+
+  r->nconns--;
+  loop_conn_closed(r->cfg);
+  uring_maybe_resume(r);
+}
+
+/**
+ * Start closing: the file (if any) and then the socket
+ */
+void uring_conn_close(struct uring *r, struct uring_conn *c) {
+  c->closing = 1;
+  wheel_del(&r->wheel, &c->timer);
+
+  if (c->conn.body_fd != -1) {
+    uring_queue_close(r, c, c->conn.body_fd);
+    c->conn.body_fd = -1;
+  }
+
+  uring_queue_close(r, c, c->conn.fd);
+  c->conn.fd = -1;
+}
+
+/**
+ * Queue a sendmsg for the rest of the head and whatever body is in memory
+ */
+void uring_queue_sendmsg(struct uring *r, struct uring_conn *c, void *body,
+                         size_t body_length) {
+  c->iov[0].iov_base = c->conn.head + c->head_sent;
+  c->iov[0].iov_len = c->conn.head_length - c->head_sent;
+  c->iov[1].iov_base = body;
+  c->iov[1].iov_len = body_length;
+
+  memset(&c->msg, 0, sizeof c->msg);
+  c->msg.msg_iov = c->iov;
+  c->msg.msg_iovlen = 2;
+
+  struct io_uring_sqe *sqe = uring_sqe(r, OP_SENDMSG, c);
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = c->conn.fd;
+  sqe->addr = (uintptr_t)&c->msg;
+  sqe->len = 1;
+  sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+  c->inflight++;
+
+  c->stage = METRICS_TIMEOUT_WRITE;
+  loop_arm(r->cfg, &r->wheel, &c->timer, c->stage);
+}
+
+/**
+ * Queue the next file chunk: a read into the chunk buffer, linked to a send
+ * of the same bytes
+ */
+void uring_queue_chunk(struct uring *r, struct uring_conn *c) {
+  off_t remaining = c->conn.body_length - c->file_offset;
+  size_t n = remaining < URING_BUF_SIZE ? remaining : URING_BUF_SIZE;
+
+  c->chunk_length = c->chunk_sent = 0;
+  uring_reserve(r, 2);
+
+  struct io_uring_sqe *sqe = uring_sqe(r, OP_READ, c);
+  sqe->opcode = c->buf_index >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ;
+  sqe->fd = c->conn.body_fd;
+  sqe->addr = (uintptr_t)c->chunk;
+  sqe->len = n;
+  sqe->off = c->file_offset;
+  sqe->buf_index = c->buf_index >= 0 ? c->buf_index : 0;
+  sqe->flags = IOSQE_IO_LINK; // a short read cancels the send
+  c->inflight++;
+
+  sqe = uring_sqe(r, OP_SEND, c);
+  sqe->opcode = IORING_OP_SEND;
+  sqe->fd = c->conn.fd;
+  sqe->addr = (uintptr_t)c->chunk;
+  sqe->len = n;
+  sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+  c->inflight++;
+
+  c->stage = METRICS_TIMEOUT_WRITE;
+  loop_arm(r->cfg, &r->wheel, &c->timer, c->stage);
+}
+
+/**
+ * Decide what a connection does next once nothing is in flight for it
+ */
+void uring_conn_advance(struct uring *r, struct uring_conn *c) {
+  struct conn *conn = &c->conn;
+
+  if (c->inflight > 0)
+    return;
+
+  if (c->closing) {
+    uring_conn_free(r, c);
+    return;
+  }
+
+  if (c->failed) {
+    uring_conn_close(r, c);
+    return;
+  }
+
+  if (conn->body_type == CONN_BODY_FILE) {
+    if (c->head_sent < conn->head_length || c->chunk_sent < c->chunk_length) {
+      uring_queue_sendmsg(r, c, c->chunk + c->chunk_sent,
+                          c->chunk_length - c->chunk_sent);
+    } else if (c->file_offset < conn->body_length) {
+      uring_queue_chunk(r, c);
+    } else {
+      uring_conn_close(r, c);
+    }
+    return;
+  }
+
+  off_t body_length = conn->body_type == CONN_BODY_MEMORY ? conn->body_length
+                                                          : 0;
+
+  if (c->head_sent < conn->head_length || c->body_sent < body_length)
+    uring_queue_sendmsg(r, c, (char *)conn->body + c->body_sent,
+                        body_length - c->body_sent);
+  else
+    uring_conn_close(r, c);
+}
+
+/**
+ * The response is queued: start sending it
+ */
+void uring_conn_send(struct uring *r, struct uring_conn *c) {
+  if (c->conn.body_type == CONN_BODY_FILE) {
+    if (r->nfree_bufs > 0) {
+      c->buf_index = r->free_bufs[--r->nfree_bufs];
+      c->chunk = r->bufs + (size_t)c->buf_index * URING_BUF_SIZE;
+    } else {
+      c->buf_index = -1;
+      c->chunk = malloc(URING_BUF_SIZE);
+      if (c->chunk == NULL)
+        c->failed = 1;
+    }
+
+    // Head and first chunk go together: sendmsg -> read -> send
+    if (!c->failed && c->conn.body_length > 0) {
+      uring_reserve(r, 3);
+      uring_queue_sendmsg(r, c, NULL, 0);
+      r->sqes[(r->sq_tail - 1) & *r->sq_mask].flags |= IOSQE_IO_LINK;
+      uring_queue_chunk(r, c);
+      return;
+    }
+  }
+
+  uring_conn_advance(r, c);
+}
+
+/**
+ * Serving loop hook: a parked connection has its response
+ */
+void uring_conn_resume(struct conn *conn) {
+  struct uring_conn *c = (struct uring_conn *)conn;
+
+  c->ring->parked--;
+  uring_conn_send(c->ring, c);
+}
+
+/**
+ * The request is in: run the handler and start sending, or park
+ */
+void uring_conn_respond(struct uring *r, struct uring_conn *c) {
+  wheel_del(&r->wheel, &c->timer);
+  handle_http_request(&c->conn);
+
+  // Misses, saves and appends finish off the ring's thread, then resume
+  if (c->conn.parked) {
+    r->parked++;
+    return;
+  }
+
+  uring_conn_send(r, c);
+}
+
+/**
+ * Account for bytes that went out: head first, then body
+ */
+void uring_conn_sent(struct uring_conn *c, size_t n) {
+  size_t head_left = c->conn.head_length - c->head_sent;
+  size_t step = n < head_left ? n : head_left;
+
+  c->conn.sent += n;
+  c->head_sent += step;
+  n -= step;
+
+  if (c->conn.body_type == CONN_BODY_FILE)
+    c->chunk_sent += n;
+  else
+    c->body_sent += n;
+}
+
+/**
+ * Wheel callback: a connection missed its deadline
+ *
+ * Its operations can't be withdrawn from here, so shut the socket down
+ * under them: they fail, and the connection closes once the last one is
+ * back.
+ */
+void uring_conn_expired(struct wheel_timer *timer) {
+  struct uring_conn *c = WHEEL_ENTRY(timer, struct uring_conn, timer);
+
+  metrics_timeout(c->stage);
+  c->failed = 1;
+  shutdown(c->conn.fd, SHUT_RDWR);
+}
+
+/**
+ * A new connection arrived
+ */
+void uring_accepted(struct uring *r, int fd) {
+  struct uring_conn *c = calloc(1, sizeof *c);
+
+  if (c == NULL || conn_init(&c->conn, fd, r->cfg->cache) == -1) {
+    free(c);
+    close(fd);
+    return;
+  }
+
+  // The multishot accept shares one address buffer, so ask for the peer
+  // separately, and only if it will be logged
+  if (access_log != NULL) {
+    socklen_t length = sizeof c->conn.peer;
+    getpeername(fd, (struct sockaddr *)&c->conn.peer, &length);
+  }
+
+  c->ring = r;
+  c->conn.pool = r->cfg->pool;
+  c->conn.resume = uring_conn_resume;
+  c->buf_index = -1;
+  c->timer.expired = uring_conn_expired;
+  c->stage = METRICS_TIMEOUT_IDLE;
+  loop_arm(r->cfg, &r->wheel, &c->timer, c->stage);
+
+  c->next = r->conns;
+  if (r->conns != NULL)
+    r->conns->prev = c;
+  r->conns = c;
+  r->nconns++;
+  loop_conn_opened(r->cfg);
+
+  uring_queue_recv(r, c);
+}
+
+/**
+ * Dispatch one completion
+ */
+void uring_complete(struct uring *r, struct io_uring_cqe *cqe) {
+  int op = cqe->user_data & OP_MASK;
+  void *data = (void *)(uintptr_t)(cqe->user_data & ~OP_MASK);
+  struct uring_conn *c = data;
+  int res = cqe->res;
+
+  switch (op) {
+  case OP_TICK:
+    r->ticking = 0;
+    return;
+
+  case OP_ACCEPT:
+    if (data != NULL)
+      return; // the cancel, done or too late
+
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+      r->accepting = 0;
+
+    if (res == -EINVAL && r->multishot_accept) {
+      // Pre-5.19 kernel: re-arm a one-shot accept each time instead
+      r->multishot_accept = 0;
+    } else if (res >= 0 && *r->cfg->stop) {
+      close(res); // came in as we stopped
+    } else if (res >= 0) {
+      uring_accepted(r, res);
+    } else if (res == -EMFILE || res == -ENFILE) {
+      // Out of descriptors: wait for a connection to close, or the
+      // recheck, rather than fail the next accept straight away
+      uring_pause_accept(r);
+    } else if (res != -EINTR && res != -ECONNABORTED && res != -ECANCELED) {
+      fprintf(stderr, "io_uring accept: %s\n", strerror(-res));
+    }
+
+    // At a limit, leave new connections in the listen queue
+    if (loop_at_limit(r->cfg, r->nconns, 0))
+      uring_pause_accept(r);
+
+    if (!r->accepting && !r->accept_paused)
+      uring_queue_accept(r);
+    return;
+
+  case OP_SOURCE: {
+    struct loop_source *src = data;
+
+    src->ready(src->arg, r->cfg->cache);
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+      uring_queue_source(r, src);
+    return;
+  }
+
+  case OP_RECV:
+    c->inflight--;
+    if (res <= 0 || c->failed) {
+      c->failed = 1;
+    } else {
+      c->conn.request_length += res;
+      c->conn.request[c->conn.request_length] = '\0';
+
+      if (!conn_request_complete(&c->conn)) {
+        c->stage = loop_arm_read(r->cfg, &r->wheel, &c->timer, c->stage,
+                                 &c->conn);
+        uring_queue_recv(r, c);
+        return;
+      }
+
+      uring_conn_respond(r, c);
+      return;
+    }
+    break;
+
+  case OP_SENDMSG:
+  case OP_SEND:
+    c->inflight--;
+    if (res > 0)
+      uring_conn_sent(c, res);
+    else if (res != -ECANCELED)
+      c->failed = 1;
+    break;
+
+  case OP_READ:
+    c->inflight--;
+    if (res == -ECANCELED)
+      break; // the head in front of it fell short; advance retries
+
+    if (res <= 0) {
+      // The file shrank under us or the read failed; the promised
+      // Content-Length can't be met, so give up on the connection
+      c->failed = 1;
+      break;
+    }
+
+    c->chunk_length = res;
+    c->file_offset += res;
+
+    // Small files arrive in one read: cache them straight from the buffer
+    if (c->file_offset == res && res == c->conn.body_length)
+      conn_file_loaded(&c->conn, c->chunk, res);
+    break;
+
+  case OP_CLOSE:
+    c->inflight--;
+    break;
+  }
+
+  uring_conn_advance(r, c);
+}
+
+/**
+ * Dispatch every completion waiting in the ring
+ */
+void uring_reap(struct uring *r) {
+  unsigned head = *r->cq_khead;
+  unsigned tail = __atomic_load_n(r->cq_ktail, __ATOMIC_ACQUIRE);
+
+  for (; head != tail; head++) {
+    struct io_uring_cqe cqe = r->cqes[head & *r->cq_mask];
+
+    // Free the slot before handling: handlers may submit and wait
+    __atomic_store_n(r->cq_khead, head + 1, __ATOMIC_RELEASE);
+    uring_complete(r, &cqe);
+  }
+}
+
+/**
+ * Loop source callback: disk pool jobs are done
+ */
+void uring_pool_ready(void *pool, struct cache *cache) {
+  (void)cache;
+
+  iopool_complete(pool);
+}
+
+/**
+ * Wait out everything in flight at shutdown
+ *
+ * The kernel may still write into connections' buffers, and pool jobs and
+ * the append log hold parked connections, so none may be freed until
+ * they're back. Shut every socket down under its operations, as a missed
+ * deadline does, and run completions until the last connection is gone.
+ */
+void uring_drain(struct uring *r) {
+  uring_pause_accept(r);
+
+  for (struct uring_conn *c = r->conns; c != NULL; c = c->next) {
+    c->failed = 1;
+    if (c->conn.fd != -1)
+      shutdown(c->conn.fd, SHUT_RDWR);
+  }
+
+  while (r->conns != NULL) {
+    if (uring_submit(r, 1) < 0 && errno != EINTR && errno != EBUSY) {
+      perror("io_uring_enter");
+      return;
+    }
+
+    uring_reap(r);
+  }
+}
+
+/**
+ * io_uring serving loop
+ *
+ * Returns -1 straight away if io_uring can't be used, so the caller can fall
+ * back to another loop; otherwise serves until cfg->stop is set.
+ */
+int serve_uring(struct loop_config *cfg) {
+  struct uring *r = uring_create(cfg);
+
+  if (r == NULL)
+    return -1;
+
+  // A multishot accept is cancelled at a limit, and can overshoot it by
+  // what was in the listen queue; the limit from RLIMIT_NOFILE leaves
+  // descriptors to spare for that. Limits set by hand are kept to exactly:
+  // one-shot accepts stop as soon as we don't re-arm them.
+  if (cfg->exact_limits)
+    r->multishot_accept = 0;
+  r->paused.expired = uring_paused_expired;
+
+  uring_queue_accept(r);
+  for (int i = 0; i < cfg->nsources; i++)
+    uring_queue_source(r, &cfg->sources[i]);
+  if (cfg->pool != NULL) {
+    r->pool_source = (struct loop_source){cfg->pool->fd, uring_pool_ready,
+                                          cfg->pool};
+    uring_queue_source(r, &r->pool_source);
+  }
+
+  while (!*cfg->stop) {
+    if (uring_submit(r, 1) < 0 && errno != EINTR && errno != EBUSY) {
+      perror("io_uring_enter");
+      break;
+    }
+
+    uring_reap(r);
+    wheel_advance(&r->wheel, wheel_now_ms());
+    uring_queue_tick(r);
+  }
+
+  uring_drain(r);
+  uring_destroy(r);
+
+  return 0;
+}
@@ -0,0 +1,348 @@
+#include "warmup.h"
+#include "cache.h"
+#include "file.h"
+#include "hashtable.h"
+#include "mime.h"
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// One file to preload
+struct warmup_job {
+  char *path;           // full file path, as used for cache keys
+  struct cache_validator validator; // as seen by the loader, before reading
+  struct file_data *filedata; // NULL if the load failed
+  struct warmup_job *next_done;
+};
+
+/**
+ * Queue a file for loading unless it is already queued or the budget is spent
+ */
+void warmup_add_job(struct warmup *wu, struct hashtable *seen, char *path,
+                    int budget) {
+  struct stat s;
+
+  if (wu->hot >= budget || hashtable_get(seen, path) != NULL)
+    return;
+
+  if (stat(path, &s) == -1 || !S_ISREG(s.st_mode))
+    return;
+
+  struct warmup_job *job = &wu->jobs[wu->hot++];
+  memset(job, 0, sizeof *job);
+  job->path = strdup(path);
+  hashtable_put(seen, job->path, job);
+}
+
+/**
+ * Queue every regular file under dir, depth first
+ */
+void warmup_walk(struct warmup *wu, struct hashtable *seen, char *dir,
+                 int budget) {
+  DIR *d = opendir(dir);
+  if (d == NULL)
+    return;
+
+  struct dirent *de;
+  while (wu->hot < budget && (de = readdir(d)) != NULL) {
+    char path[PATH_MAX];
+    struct stat s;
+
+    if (de->d_name[0] == '.')
+      continue;
+
+    // A path cut short would name some other file
+    if (snprintf(path, sizeof path, "%s/%s", dir, de->d_name) >=
+            (int)sizeof path ||
+        lstat(path, &s) == -1)
+      continue;
+
+    if (S_ISDIR(s.st_mode))
+      warmup_walk(wu, seen, path, budget);
+    else
+      warmup_add_job(wu, seen, path, budget);
+  }
+
+  closedir(d);
+}
+
+/**
+ * Queue the request paths listed in a popularity file, in file order
+ *
+ * One path per line, relative to the document root; '#' starts a comment.
+ */
+void warmup_read_popularity(struct warmup *wu, struct hashtable *seen,
+                            char *popularity, int budget) {
+  char line[PATH_MAX];
+  FILE *fp = fopen(popularity, "r");
+
+  if (fp == NULL) {
+    if (errno != ENOENT)
+      perror(popularity);
+    return;
+  }
+
+  while (wu->hot < budget && fgets(line, sizeof line, fp) != NULL) {
+    char path[PATH_MAX];
+
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0] == '\0' || line[0] == '#' || strstr(line, "..") != NULL)
+      continue;
+
+    // Skip a line too long to join to the root, rather than warm up
+    // whatever its truncation names
+    if (snprintf(path, sizeof path, "%s%s%s", wu->root,
+                 line[0] == '/' ? "" : "/", line) >= (int)sizeof path)
+      continue;
+    warmup_add_job(wu, seen, path, budget);
+  }
+
+  fclose(fp);
+}
+
+/**
+ * Loader thread: take jobs until there are none left
+ */
+void *warmup_loader(void *arg) {
+  struct warmup *wu = arg;
+  const uint64_t one = 1;
+
+  for (;;) {
+    struct warmup_job *job;
+    struct stat s;
+
+    pthread_mutex_lock(&wu->lock);
+    job = wu->next < wu->hot ? &wu->jobs[wu->next++] : NULL;
+    pthread_mutex_unlock(&wu->lock);
+
+    if (job == NULL)
+      break;
+
+    // Files too big to cache whole are streamed when asked for instead
+    if (stat(job->path, &s) == 0 && s.st_size <= FILE_STREAM_MIN) {
+      cache_validator_set(&job->validator, &s);
+      job->filedata = file_load(job->path);
+    }
+
+    pthread_mutex_lock(&wu->lock);
+    job->next_done = wu->done;
+    wu->done = job;
+    pthread_mutex_unlock(&wu->lock);
+
+    if (write(wu->fd, &one, sizeof one) == -1)
+      perror("warmup: eventfd");
+  }
+
+  return NULL;
+}
+
+/**
+ * Start preloading up to budget files from root
+ *
+ * Files named in the popularity list come first, in list order; the rest of
+ * the budget is filled by walking the tree. Loading happens on nthreads
+ * background threads; completed files are handed to the cache by
+ * warmup_drain() on the server thread. Returns NULL if no loader thread
+ * can be started.
+ */
+struct warmup *warmup_start(char *root, char *popularity, int budget,
+                            int nthreads) {
+  struct warmup *wu = calloc(1, sizeof *wu);
+  if (wu == NULL)
+    return NULL;
+
+  wu->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  wu->root = strdup(root);
+  wu->jobs = calloc(budget > 0 ? budget : 1, sizeof *wu->jobs);
+  pthread_mutex_init(&wu->lock, NULL);
+
+  if (wu->fd == -1 || wu->root == NULL || wu->jobs == NULL) {
+    perror("warmup");
+    warmup_free(wu);
+    return NULL;
+  }
+
+  // Build the hot set, most popular first
+  struct hashtable *seen = hashtable_create(budget, NULL);
+  if (popularity != NULL)
+    warmup_read_popularity(wu, seen, popularity, budget);
+  warmup_walk(wu, seen, root, budget);
+  hashtable_destroy(seen);
+
+  if (nthreads < 1)
+    nthreads = 1;
+  if (nthreads > wu->hot)
+    nthreads = wu->hot;
+
+  wu->threads = calloc(nthreads > 0 ? nthreads : 1, sizeof *wu->threads);
+  for (int i = 0; wu->threads != NULL && i < nthreads; i++) {
+    if (pthread_create(&wu->threads[i], NULL, warmup_loader, wu) != 0)
+      break;
+    wu->nthreads++;
+  }
+
+  // With no loader, nothing would ever be drained: start cold instead
+  if (wu->hot > 0 && wu->nthreads == 0) {
+    fprintf(stderr, "warmup: cannot start a loader thread\n");
+    warmup_free(wu);
+    return NULL;
+  }
+
+  return wu;
+}
+
+/**
+ * Has the file changed since the loader looked at it?
+ *
+ * The inotify watcher can't help here: the entry wasn't cached yet when the
+ * change happened, so there was nothing to invalidate.
+ */
+int warmup_job_stale(struct warmup_job *job) {
+  struct cache_validator *v = &job->validator;
+  struct stat s;
+
+  if (stat(job->path, &s) == -1)
+    return 1;
+
+  return s.st_dev != v->dev || s.st_ino != v->ino || s.st_size != v->size ||
+         s.st_mtim.tv_sec != v->mtime.tv_sec ||
+         s.st_mtim.tv_nsec != v->mtime.tv_nsec;
+}
+
+/**
+ * Move completed loads into the cache
+ *
+ * Must be called from the thread that owns the cache. Never blocks.
+ * Returns the number of warm-up files resident so far.
+ */
+int warmup_drain(struct warmup *wu, struct cache *cache) {
+  uint64_t count;
+  struct warmup_job *job;
+
+  if (read(wu->fd, &count, sizeof count) == -1 && errno != EAGAIN)
+    perror("warmup: eventfd");
+
+  pthread_mutex_lock(&wu->lock);
+  job = wu->done;
+  wu->done = NULL;
+  pthread_mutex_unlock(&wu->lock);
+
+  for (; job != NULL; job = job->next_done) {
+    struct file_data *filedata = job->filedata;
+
+    wu->drained++;
+    if (filedata == NULL)
+      continue;
+
+    if (!warmup_job_stale(job)) {
+      struct cache_entry *entry =
+          cache_put(cache, job->path, mime_type_get(job->path), filedata->data,
+                    filedata->size);
+
+      if (entry != NULL && entry->validator.ino == 0)
+        entry->validator = job->validator;
+      wu->resident++;
+    }
+
+    file_free(filedata);
+    job->filedata = NULL;
+  }
+
+  return wu->resident;
+}
+
+/**
+ * Block until fraction of the hot set is in the cache
+ *
+ * Returns early if the remaining loads can't get there.
+ */
+void warmup_wait(struct warmup *wu, struct cache *cache, double fraction) {
+  int target = (int)ceil(fraction * wu->hot);
+  struct pollfd pfd;
+
+  pfd.fd = wu->fd;
+  pfd.events = POLLIN;
+
+  while (warmup_drain(wu, cache) < target && !warmup_finished(wu)) {
+    if (poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+      perror("poll");
+      break;
+    }
+  }
+}
+
+/**
+ * Have all the loads been handed to the cache?
+ */
+int warmup_finished(struct warmup *wu) { return wu->drained >= wu->hot; }
+
+/**
+ * Stop loading and release the preloader
+ *
+ * Waits for in-progress loads; anything not yet drained is discarded.
+ */
+void warmup_free(struct warmup *wu) {
+  if (wu == NULL)
+    return;
+
+  // Let loader threads run out of work quickly
+  pthread_mutex_lock(&wu->lock);
+  wu->next = wu->hot;
+  pthread_mutex_unlock(&wu->lock);
+
+  for (int i = 0; i < wu->nthreads; i++)
+    pthread_join(wu->threads[i], NULL);
+
+  for (int i = 0; i < wu->hot; i++) {
+    if (wu->jobs[i].filedata != NULL)
+      file_free(wu->jobs[i].filedata);
+    free(wu->jobs[i].path);
+  }
+
+  if (wu->fd != -1)
+    close(wu->fd);
+  pthread_mutex_destroy(&wu->lock);
+  free(wu->threads);
+  free(wu->jobs);
+  free(wu->root);
+  free(wu);
+}
+
+/**
+ * Save the cache's recency order as a popularity list for the next start
+ *
+ * Only paths under root are written, most recently used first.
+ */
+int warmup_save(struct cache *cache, char *root, char *popularity) {
+  char tmppath[PATH_MAX];
+  size_t root_len = strlen(root);
+
+  snprintf(tmppath, sizeof tmppath, "%s.tmp", popularity);
+  FILE *fp = fopen(tmppath, "w");
+  if (fp == NULL) {
+    perror(tmppath);
+    return 0;
+  }
+
+  for (struct cache_entry *ce = cache->head; ce != NULL; ce = ce->next) {
+    if (strncmp(ce->path, root, root_len) == 0 && ce->path[root_len] == '/')
+      fprintf(fp, "%s\n", ce->path + root_len);
+  }
+
+  if (fclose(fp) != 0 || rename(tmppath, popularity) == -1) {
+    perror(popularity);
+    unlink(tmppath);
+    return 0;
+  }
+
+  return 1;
+}
@@ -0,0 +1,35 @@
+#ifndef _WARMUP_H_
+#define _WARMUP_H_
+
+#include <pthread.h>
+
+struct cache;
+struct warmup_job;
+
+// Parallel cache preloader for the document root
+struct warmup {
+  int fd; // eventfd, readable whenever loads have completed
+
+  char *root;
+  struct warmup_job *jobs; // hot set, most popular first
+  int hot;                 // number of jobs
+  int next;                // next job a loader thread will take
+  int resident;            // jobs that made it into the cache
+  int drained;             // jobs handed back to the server thread
+  struct warmup_job *done; // completed loads awaiting cache_put()
+
+  pthread_t *threads;
+  int nthreads;
+  pthread_mutex_t lock;
+};
+
+extern struct warmup *warmup_start(char *root, char *popularity, int budget,
+                                   int nthreads);
+extern int warmup_drain(struct warmup *wu, struct cache *cache);
+extern void warmup_wait(struct warmup *wu, struct cache *cache,
+                        double fraction);
+extern int warmup_finished(struct warmup *wu);
+extern void warmup_free(struct warmup *wu);
+extern int warmup_save(struct cache *cache, char *root, char *popularity);
+
+#endif
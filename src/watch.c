@@ -0,0 +1,177 @@
+#include "watch.h"
+#include "cache.h"
+#include "hashtable.h"
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Anything that can change what a path resolves to
+#define WATCH_MASK                                                             \
+  (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE |           \
+   IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_ONLYDIR)
+
+/**
+ * Watch a directory and, recursively, every directory beneath it
+ */
+void watch_add_tree(struct watcher *w, char *dir) {
+  int wd = inotify_add_watch(w->fd, dir, WATCH_MASK);
+  if (wd == -1) {
+    perror("inotify_add_watch");
+    return;
+  }
+
+  // inotify hands back the same wd if the directory is already watched
+  char *old = hashtable_delete_bin(w->dirs, &wd, sizeof wd);
+  free(old);
+  hashtable_put_bin(w->dirs, &wd, sizeof wd, strdup(dir));
+
+  DIR *d = opendir(dir);
+  if (d == NULL)
+    return;
+
+  struct dirent *de;
+  while ((de = readdir(d)) != NULL) {
+    char path[PATH_MAX];
+    struct stat s;
+
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+      continue;
+
+    snprintf(path, sizeof path, "%s/%s", dir, de->d_name);
+    if (lstat(path, &s) == 0 && S_ISDIR(s.st_mode))
+      watch_add_tree(w, path);
+  }
+
+  closedir(d);
+}
+
+/**
+ * Create a watcher for the tree rooted at root
+ *
+ * Returns NULL if inotify is unavailable.
+ */
+struct watcher *watch_create(char *root) {
+  struct watcher *w = malloc(sizeof *w);
+  if (w == NULL)
+    return NULL;
+
+  w->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (w->fd == -1) {
+    perror("inotify_init1");
+    free(w);
+    return NULL;
+  }
+
+  w->dirs = hashtable_create(0, NULL);
+  watch_add_tree(w, root);
+
+  return w;
+}
+
+/**
+ * Free a directory path stored in the wd table
+ */
+void watch_free_dir(void *data, void *arg) {
+  (void)arg;
+
+  free(data);
+}
+
+/**
+ * Stop watching and release the watcher
+ */
+void watch_free(struct watcher *w) {
+  if (w == NULL)
+    return;
+
+  close(w->fd);
+  hashtable_foreach(w->dirs, watch_free_dir, NULL);
+  hashtable_destroy(w->dirs);
+  free(w);
+}
+
+/**
+ * Apply a single inotify event to the cache
+ */
+int watch_event(struct watcher *w, struct cache *cache,
+                struct inotify_event *ev) {
+  char path[PATH_MAX];
+  char *dir = hashtable_get_bin(w->dirs, &ev->wd, sizeof ev->wd);
+
+  if (ev->mask & IN_IGNORED) {
+    // The directory itself is gone; its entries went with IN_DELETE/MOVED
+    free(hashtable_delete_bin(w->dirs, &ev->wd, sizeof ev->wd));
+    return 0;
+  }
+
+  if (dir == NULL || ev->len == 0)
+    return 0;
+
+  snprintf(path, sizeof path, "%s/%s", dir, ev->name);
+
+  // A copy written through by a POST is already what's on disk; the rename
+  // that put the file there mustn't throw it away again
+  if (!(ev->mask & IN_ISDIR)) {
+    struct stat st;
+    struct cache_validator validator;
+
+    if (stat(path, &st) == -1 || !S_ISREG(st.st_mode))
+      return cache_delete(cache, path);
+
+    cache_validator_set(&validator, &st);
+    return cache_revalidate(cache, path, &validator);
+  }
+
+  // A directory appeared: start watching it, it may already hold files
+  if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+    watch_add_tree(w, path);
+
+  // Anything cached under a directory that moved or vanished is stale
+  strncat(path, "/", sizeof path - strlen(path) - 1);
+  return cache_delete_prefix(cache, path);
+}
+
+/**
+ * Drain pending inotify events and invalidate the affected cache entries
+ *
+ * Never blocks. Returns the number of cache entries invalidated.
+ */
+int watch_process(struct watcher *w, struct cache *cache) {
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  int invalidated = 0;
+
+  if (w == NULL)
+    return 0;
+
+  for (;;) {
+    ssize_t len = read(w->fd, buf, sizeof buf);
+
+    if (len == -1) {
+      if (errno != EAGAIN && errno != EINTR)
+        perror("inotify read");
+      break;
+    }
+
+    for (char *p = buf; p < buf + len;) {
+      struct inotify_event *ev = (struct inotify_event *)p;
+
+      if (ev->mask & IN_Q_OVERFLOW) {
+        // Lost track of what changed, so trust nothing
+        fprintf(stderr, "watch: event queue overflow, flushing cache\n");
+        invalidated += cache_delete_prefix(cache, "");
+      } else {
+        invalidated += watch_event(w, cache, ev);
+      }
+
+      p += sizeof(struct inotify_event) + ev->len;
+    }
+  }
+
+  return invalidated;
+}
@@ -0,0 +1,16 @@
+#ifndef _WATCH_H_
+#define _WATCH_H_
+
+struct cache;
+
+// inotify watcher that keeps the cache coherent with a directory tree
+struct watcher {
+  int fd;                 // inotify descriptor, non-blocking
+  struct hashtable *dirs; // watch descriptor -> directory path
+};
+
+extern struct watcher *watch_create(char *root);
+extern void watch_free(struct watcher *w);
+extern int watch_process(struct watcher *w, struct cache *cache);
+
+#endif
@@ -0,0 +1,176 @@
+/**
+ * Hierarchical timing wheel for connection deadlines
+ *
+ * Each serving loop owns one and drives it from its own clock: there are
+ * no per-timer kernel objects, so a hundred thousand idle connections cost
+ * a list node each, and the loop wakes once a tick only while any timer is
+ * pending.
+ */
+
+#include "wheel.h"
+#include <time.h>
+
+/**
+ * Monotonic milliseconds, from the cheap coarse clock
+ */
+uint64_t wheel_now_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void wheel_list_init(struct wheel_timer *head) {
+  head->prev = head->next = head;
+}
+
+void wheel_list_add(struct wheel_timer *head, struct wheel_timer *t) {
+  t->prev = head->prev;
+  t->next = head;
+  head->prev->next = t;
+  head->prev = t;
+}
+
+void wheel_unlink(struct wheel_timer *t) {
+  t->prev->next = t->next;
+  t->next->prev = t->prev;
+  t->prev = t->next = NULL;
+}
+
+/**
+ * Start a wheel at now_ms
+ */
+void wheel_init(struct wheel *w, unsigned tick_ms, uint64_t now_ms) {
+  w->tick_ms = tick_ms > 0 ? tick_ms : 1;
+  w->now = now_ms / w->tick_ms;
+  w->count = 0;
+
+  for (int l = 0; l < WHEEL_LEVELS; l++)
+    for (int s = 0; s < WHEEL_SLOTS; s++)
+      wheel_list_init(&w->slots[l][s]);
+  wheel_list_init(&w->expiring);
+}
+
+/**
+ * File a timer, due at or after the current tick, in its slot
+ */
+void wheel_insert(struct wheel *w, struct wheel_timer *t) {
+  uint64_t delta = t->expires - w->now;
+  int level = 0;
+
+  if (delta >= 1ULL << (WHEEL_BITS * WHEEL_LEVELS)) {
+    // Beyond the wheel: fire at its far end instead
+    t->expires = w->now + (1ULL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+    delta = t->expires - w->now;
+  }
+
+  while (delta >= 1ULL << (WHEEL_BITS * (level + 1)))
+    level++;
+
+  int slot = (t->expires >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+  wheel_list_add(&w->slots[level][slot], t);
+}
+
+/**
+ * Arm (or re-arm) a timer to call t->expired at expires_ms
+ *
+ * It fires on the first tick at or after then; never on the current tick.
+ */
+void wheel_add(struct wheel *w, struct wheel_timer *t, uint64_t expires_ms) {
+  uint64_t tick = (expires_ms + w->tick_ms - 1) / w->tick_ms;
+
+  wheel_del(w, t);
+
+  t->expires = tick > w->now ? tick : w->now + 1;
+  wheel_insert(w, t);
+  w->count++;
+}
+
+/**
+ * Disarm a timer; harmless if it isn't pending
+ */
+void wheel_del(struct wheel *w, struct wheel_timer *t) {
+  if (t->next == NULL)
+    return;
+
+  wheel_unlink(t);
+  w->count--;
+}
+
+/**
+ * Milliseconds until the next tick, or -1 if nothing is pending
+ *
+ * For a poll timeout: the loop only needs to wake while there are timers.
+ */
+int wheel_timeout(struct wheel *w, uint64_t now_ms) {
+  uint64_t next_ms = (w->now + 1) * w->tick_ms;
+
+  if (w->count == 0)
+    return -1;
+
+  return next_ms > now_ms ? (int)(next_ms - now_ms) : 0;
+}
+
+/**
+ * Move every timer in a slot to where it belongs now
+ */
+void wheel_cascade(struct wheel *w, struct wheel_timer *slot) {
+  while (slot->next != slot) {
+    struct wheel_timer *t = slot->next;
+
+    wheel_unlink(t);
+    wheel_insert(w, t);
+  }
+}
+
+/**
+ * Run the wheel up to now_ms, calling every timer that comes due
+ *
+ * Callbacks may add and delete timers, including other expiring ones.
+ * Returns how many fired.
+ */
+int wheel_advance(struct wheel *w, uint64_t now_ms) {
+  uint64_t target = now_ms / w->tick_ms;
+  int fired = 0;
+
+  while (w->now < target) {
+    if (w->count == 0) {
+      // Nothing to pass over on the way
+      w->now = target;
+      break;
+    }
+
+    w->now++;
+    int index = w->now & (WHEEL_SLOTS - 1);
+
+    // At the start of each turn, spread the next slot of the level above
+    // over this one, and so on up while those turn over too
+    for (int l = 1; l < WHEEL_LEVELS && index == 0; l++) {
+      index = (w->now >> (WHEEL_BITS * l)) & (WHEEL_SLOTS - 1);
+      wheel_cascade(w, &w->slots[l][index]);
+    }
+
+    // Take the slot over whole, so callbacks can't change it under us
+    struct wheel_timer *slot = &w->slots[0][w->now & (WHEEL_SLOTS - 1)];
+    if (slot->next == slot)
+      continue;
+
+    w->expiring.next = slot->next;
+    w->expiring.prev = slot->prev;
+    slot->next->prev = &w->expiring;
+    slot->prev->next = &w->expiring;
+    wheel_list_init(slot);
+
+    while (w->expiring.next != &w->expiring) {
+      struct wheel_timer *t = w->expiring.next;
+
+      wheel_unlink(t);
+      w->count--;
+      fired++;
+      t->expired(t);
+    }
+  }
+
+  return fired;
+}
@@ -0,0 +1,44 @@
+#ifndef _WHEEL_H_
+#define _WHEEL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4 // 64^4 ticks: ~19 days at 100ms
+
+// The struct a timer is embedded in
+#define WHEEL_ENTRY(timer, type, member)                                       \
+  ((type *)((char *)(timer) - offsetof(type, member)))
+
+// A timer, embedded in whatever it times out
+struct wheel_timer {
+  struct wheel_timer *prev, *next; // NULL when not pending
+  uint64_t expires;                // tick
+  void (*expired)(struct wheel_timer *timer);
+};
+
+// Hierarchical timing wheel
+//
+// Level 0 has a slot per tick; each slot of level n covers a whole turn of
+// level n - 1 and is redistributed downwards when that turn begins. Adding
+// and removing a timer are O(1) list operations, and a tick only touches
+// the slots it passes.
+struct wheel {
+  unsigned tick_ms;
+  uint64_t now; // last tick processed
+  int count;    // pending timers
+  struct wheel_timer slots[WHEEL_LEVELS][WHEEL_SLOTS]; // list heads
+  struct wheel_timer expiring;                         // list head
+};
+
+extern uint64_t wheel_now_ms(void);
+extern void wheel_init(struct wheel *w, unsigned tick_ms, uint64_t now_ms);
+extern void wheel_add(struct wheel *w, struct wheel_timer *t,
+                      uint64_t expires_ms);
+extern void wheel_del(struct wheel *w, struct wheel_timer *t);
+extern int wheel_timeout(struct wheel *w, uint64_t now_ms);
+extern int wheel_advance(struct wheel *w, uint64_t now_ms);
+
+#endif